@@ -9,7 +9,9 @@ extensions = [
                 "bigfile/pyxbigfile.pyx",
                 "src/bigfile.c",
                 "src/bigfile-record.c",
+                "src/bigfile-codec.c",
             ],
+            libraries = ["z"],
             depends = [
                 "src/bigfile.h",
                 "src/bigfile-internal.h",
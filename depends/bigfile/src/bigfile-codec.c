@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <zlib.h>
+
+#include "bigfile.h"
+#include "bigfile-internal.h"
+
+/* Compressed blocks: see bigfile.h for the layout. */
+
+#define TABLE_ENTRY_BYTES 16
+
+static void
+_put_int64(unsigned char * p, int64_t v)
+{
+    int b;
+    for(b = 0; b < 8; b ++) {
+        p[b] = (uint64_t) v >> (8 * b);
+    }
+}
+
+static int64_t
+_get_int64(const unsigned char * p)
+{
+    uint64_t v = 0;
+    int b;
+    for(b = 0; b < 8; b ++) {
+        v |= ((uint64_t) p[b]) << (8 * b);
+    }
+    return v;
+}
+
+/* View rows [start, start + n) of array, which may be strided */
+static void
+_array_rows(BigArray * view, const BigArray * array, ptrdiff_t start, ptrdiff_t n)
+{
+    *view = *array;
+    view->data = (char *) array->data + start * array->strides[0];
+    view->dims[0] = n;
+    view->size = array->size / (array->dims[0] ? array->dims[0] : 1) * n;
+}
+
+/* Bytes of each element as stored in the chunk */
+static int
+_stored_elsize(const char * dtype, const BigCodec * codec)
+{
+    if(codec->quantum > 0 && big_file_dtype_kind(dtype) == 'f')
+        return 4;
+    return big_file_dtype_itemsize(dtype);
+}
+
+/* Encode nel elements of the view, of little endian dtype, into the shuffled, quantised byte planes of raw */
+static int
+_chunk_filter(unsigned char * raw, BigArray * view, const char * dtype, size_t nel, const BigCodec * codec, unsigned char * tmp)
+{
+    int elsize = big_file_dtype_itemsize(dtype);
+    int selsize = _stored_elsize(dtype, codec);
+    size_t i;
+    int b;
+
+    BigArray tmparray;
+    BigArrayIter src, dst;
+    size_t dims[1] = {nel};
+    /* Quantisation works on machine doubles; otherwise the bytes are stored little endian */
+    int quantise = selsize != elsize;
+    big_array_init(&tmparray, tmp, quantise ? "=f8" : dtype, 1, dims, NULL);
+    big_array_iter_init(&src, view);
+    big_array_iter_init(&dst, &tmparray);
+    if(0 != _dtype_convert(&dst, &src, nel))
+        return -1;
+
+    if(quantise) {
+        const double * x = (const double *) tmp;
+        for(i = 0; i < nel; i ++) {
+            /* modulo 2^32: periodic coordinates wrap around */
+            uint32_t q = (uint32_t) (int64_t) floor(x[i] / codec->quantum + 0.5);
+            for(b = 0; b < 4; b ++)
+                raw[b * nel + i] = q >> (8 * b);
+        }
+    } else if(codec->shuffle) {
+        for(i = 0; i < nel; i ++)
+            for(b = 0; b < elsize; b ++)
+                raw[b * nel + i] = tmp[i * elsize + b];
+    } else {
+        memcpy(raw, tmp, nel * elsize);
+    }
+    return 0;
+}
+
+/* Inverse of _chunk_filter: decode nel elements of raw into the view */
+static int
+_chunk_unfilter(BigArray * view, const unsigned char * raw, const char * dtype, size_t nel, const BigCodec * codec, unsigned char * tmp)
+{
+    int elsize = big_file_dtype_itemsize(dtype);
+    int quantise = codec->quantum > 0 && big_file_dtype_kind(dtype) == 'f';
+    size_t i;
+    int b;
+
+    if(quantise) {
+        double * x = (double *) tmp;
+        for(i = 0; i < nel; i ++) {
+            uint32_t q = 0;
+            for(b = 0; b < 4; b ++)
+                q |= ((uint32_t) raw[b * nel + i]) << (8 * b);
+            x[i] = q * codec->quantum;
+        }
+    } else if(codec->shuffle) {
+        for(i = 0; i < nel; i ++)
+            for(b = 0; b < elsize; b ++)
+                tmp[i * elsize + b] = raw[b * nel + i];
+    } else {
+        memcpy(tmp, raw, nel * elsize);
+    }
+
+    BigArray tmparray;
+    BigArrayIter src, dst;
+    size_t dims[1] = {nel};
+    big_array_init(&tmparray, tmp, quantise ? "=f8" : dtype, 1, dims, NULL);
+    big_array_iter_init(&src, &tmparray);
+    big_array_iter_init(&dst, view);
+    return _dtype_convert(&dst, &src, nel);
+}
+
+int
+big_chunks_encode(BigChunks * chunks, BigArray * array, const char * dtype, const BigCodec * codec, size_t chunkbytes)
+{
+    memset(chunks, 0, sizeof(chunks[0]));
+    /* Stored little endian, so that the bytes are the same on all machines */
+    _dtype_normalize(chunks->dtype, dtype);
+    chunks->dtype[0] = '<';
+    chunks->nmemb = array->ndim > 1 ? array->dims[1] : 1;
+    chunks->size = array->dims[0];
+
+    const int elsize = big_file_dtype_itemsize(chunks->dtype);
+    const size_t rowbytes = (size_t) elsize * chunks->nmemb;
+    size_t chunkrows = chunkbytes / rowbytes;
+    if(chunkrows == 0) chunkrows = 1;
+    chunks->nchunk = (chunks->size + chunkrows - 1) / chunkrows;
+
+    chunks->table = malloc(sizeof(int64_t) * 2 * (chunks->nchunk + 1));
+    unsigned char ** out = calloc(chunks->nchunk + 1, sizeof(out[0]));
+    RAISEIF(chunks->table == NULL || out == NULL,
+        ex_malloc,
+        "Not enough memory for the table of %td chunks", chunks->nchunk);
+
+    int failed = 0;
+    ptrdiff_t i;
+    /* Chunks are independent, so they may be compressed in parallel */
+    #pragma omp parallel for schedule(dynamic) reduction(+: failed)
+    for(i = 0; i < chunks->nchunk; i ++) {
+        const size_t start = i * chunkrows;
+        const size_t nrows = (start + chunkrows > chunks->size) ? chunks->size - start : chunkrows;
+        const size_t nel = nrows * chunks->nmemb;
+        const size_t rawbytes = nel * _stored_elsize(chunks->dtype, codec);
+        uLongf outbytes = compressBound(rawbytes);
+        unsigned char * raw = malloc(rawbytes);
+        unsigned char * tmp = malloc(nel * (elsize > 8 ? elsize : 8));
+        out[i] = malloc(outbytes);
+        BigArray view;
+        _array_rows(&view, array, start, nrows);
+        if(raw == NULL || tmp == NULL || out[i] == NULL
+        || 0 != _chunk_filter(raw, &view, chunks->dtype, nel, codec, tmp)
+        || Z_OK != compress2(out[i], &outbytes, raw, rawbytes, codec->level)) {
+            failed ++;
+            outbytes = 0;
+        }
+        chunks->table[2 * i] = nrows;
+        chunks->table[2 * i + 1] = outbytes;
+        free(tmp);
+        free(raw);
+    }
+    RAISEIF(failed,
+        ex_compress,
+        "Failed to compress %d chunks", failed);
+
+    for(i = 0; i < chunks->nchunk; i ++) {
+        chunks->bytes += chunks->table[2 * i + 1];
+    }
+    chunks->data = malloc(chunks->bytes + 1);
+    RAISEIF(chunks->data == NULL,
+        ex_compress,
+        "Not enough memory for %td compressed bytes", chunks->bytes);
+    size_t offset = 0;
+    for(i = 0; i < chunks->nchunk; i ++) {
+        memcpy(chunks->data + offset, out[i], chunks->table[2 * i + 1]);
+        offset += chunks->table[2 * i + 1];
+        free(out[i]);
+    }
+    free(out);
+    return 0;
+
+ex_compress:
+    for(i = 0; i < chunks->nchunk; i ++) {
+        free(out[i]);
+    }
+ex_malloc:
+    free(out);
+    big_chunks_free(chunks);
+    return -1;
+}
+
+void
+big_chunks_free(BigChunks * chunks)
+{
+    free(chunks->data);
+    free(chunks->table);
+    chunks->data = NULL;
+    chunks->table = NULL;
+}
+
+void
+big_chunks_pack_table(const BigChunks * chunks, void * buf)
+{
+    unsigned char * p = buf;
+    size_t i;
+    for(i = 0; i < 2 * chunks->nchunk; i ++) {
+        _put_int64(p + 8 * i, chunks->table[i]);
+    }
+}
+
+int
+big_block_set_codec_attrs(BigBlock * bb, const BigChunks * chunks, const BigCodec * codec, size_t size, size_t nchunk)
+{
+    int64_t size64 = size, nchunk64 = nchunk;
+    RAISEIF(
+       (0 != big_block_set_attr(bb, "Compression", "zlib", "S1", 4)) ||
+       (0 != big_block_set_attr(bb, "ItemDtype", chunks->dtype, "S1", strlen(chunks->dtype))) ||
+       (0 != big_block_set_attr(bb, "ItemNmemb", &chunks->nmemb, "i4", 1)) ||
+       (0 != big_block_set_attr(bb, "ItemSize", &size64, "i8", 1)) ||
+       (0 != big_block_set_attr(bb, "NChunk", &nchunk64, "i8", 1)) ||
+       (0 != big_block_set_attr(bb, "Shuffle", &codec->shuffle, "i4", 1)) ||
+       (0 != big_block_set_attr(bb, "Quantum", &codec->quantum, "f8", 1)),
+       ex_attr,
+       NULL);
+    return 0;
+ex_attr:
+    return -1;
+}
+
+int
+big_block_is_compressed(BigBlock * bb)
+{
+    return big_block_lookup_attr(bb, "Compression") != NULL;
+}
+
+int
+big_block_compressed_info(BigBlock * bb, char * dtype, int * nmemb, size_t * size)
+{
+    BigAttr * attr = big_block_lookup_attr(bb, "ItemDtype");
+    int64_t size64;
+    RAISEIF(attr == NULL || attr->nmemb >= 8,
+        ex_attr,
+        "Block `%s' is not a valid compressed block", bb->basename);
+    memset(dtype, 0, 8);
+    memcpy(dtype, attr->data, attr->nmemb);
+    RAISEIF(
+       (0 != big_block_get_attr(bb, "ItemNmemb", nmemb, "i4", 1)) ||
+       (0 != big_block_get_attr(bb, "ItemSize", &size64, "i8", 1)),
+       ex_attr,
+       NULL);
+    *size = size64;
+    return 0;
+ex_attr:
+    return -1;
+}
+
+/* Read bytes [offset, offset + bytes) of a byte block into buf */
+static int
+_read_bytes(BigBlock * bb, ptrdiff_t offset, size_t bytes, void * buf)
+{
+    BigBlockPtr ptr;
+    BigArray array;
+    size_t dims[1] = {bytes};
+    if(bytes == 0) return 0;
+    big_array_init(&array, buf, "u1", 1, dims, NULL);
+    RAISEIF(0 != big_block_seek(bb, &ptr, offset),
+        ex_read, NULL);
+    RAISEIF(0 != big_block_read(bb, &ptr, &array),
+        ex_read, NULL);
+    return 0;
+ex_read:
+    return -1;
+}
+
+int
+big_block_read_compressed(BigBlock * bb, ptrdiff_t start, BigArray * array)
+{
+    char dtype[8];
+    int nmemb;
+    size_t size;
+    int64_t nchunk;
+    BigCodec codec = {0};
+    unsigned char * table = NULL, * comp = NULL, * raw = NULL, * tmp = NULL;
+    char * chunkbuf = NULL;
+    int64_t * rowoffset = NULL, * byteoffset = NULL;
+    const ptrdiff_t nrows = array->dims[0];
+
+    RAISEIF(0 != big_block_compressed_info(bb, dtype, &nmemb, &size),
+        ex_info, NULL);
+    RAISEIF(
+       (0 != big_block_get_attr(bb, "NChunk", &nchunk, "i8", 1)) ||
+       (0 != big_block_get_attr(bb, "Shuffle", &codec.shuffle, "i4", 1)) ||
+       (0 != big_block_get_attr(bb, "Quantum", &codec.quantum, "f8", 1)),
+       ex_info, NULL);
+    RAISEIF(start + nrows > size,
+        ex_info,
+        "Reading beyond the compressed block `%s' at %td", bb->basename, start + nrows);
+    if(nrows == 0) return 0;
+
+    table = malloc(TABLE_ENTRY_BYTES * nchunk);
+    rowoffset = malloc(sizeof(int64_t) * (nchunk + 1));
+    byteoffset = malloc(sizeof(int64_t) * (nchunk + 1));
+    RAISEIF(table == NULL || rowoffset == NULL || byteoffset == NULL,
+        ex_free, "Not enough memory for the table of %td chunks", nchunk);
+    RAISEIF(0 != _read_bytes(bb, 0, TABLE_ENTRY_BYTES * nchunk, table),
+        ex_free, NULL);
+
+    int64_t i;
+    rowoffset[0] = 0;
+    byteoffset[0] = TABLE_ENTRY_BYTES * nchunk;
+    for(i = 0; i < nchunk; i ++) {
+        rowoffset[i + 1] = rowoffset[i] + _get_int64(table + TABLE_ENTRY_BYTES * i);
+        byteoffset[i + 1] = byteoffset[i] + _get_int64(table + TABLE_ENTRY_BYTES * i + 8);
+    }
+
+    /* The chunks holding rows [start, start + nrows) */
+    int64_t first = 0, last;
+    while(rowoffset[first + 1] <= start) first ++;
+    last = first;
+    while(rowoffset[last + 1] < start + nrows) last ++;
+
+    int64_t maxrows = 0;
+    for(i = first; i <= last; i ++) {
+        if(rowoffset[i + 1] - rowoffset[i] > maxrows)
+            maxrows = rowoffset[i + 1] - rowoffset[i];
+    }
+    const int elsize = big_file_dtype_itemsize(dtype);
+    const size_t maxel = maxrows * nmemb;
+    comp = malloc(byteoffset[last + 1] - byteoffset[first] + 1);
+    raw = malloc(maxel * elsize + 1);
+    tmp = malloc(maxel * (elsize > 8 ? elsize : 8) + 1);
+    chunkbuf = malloc(maxel * big_file_dtype_itemsize(array->dtype) + 1);
+    RAISEIF(comp == NULL || raw == NULL || tmp == NULL || chunkbuf == NULL,
+        ex_free, "Not enough memory to decompress %td rows", maxrows);
+    RAISEIF(0 != _read_bytes(bb, byteoffset[first], byteoffset[last + 1] - byteoffset[first], comp),
+        ex_free, NULL);
+
+    for(i = first; i <= last; i ++) {
+        const int64_t rows = rowoffset[i + 1] - rowoffset[i];
+        const size_t nel = rows * nmemb;
+        uLongf rawbytes = nel * _stored_elsize(dtype, &codec);
+        RAISEIF(Z_OK != uncompress(raw, &rawbytes, comp + byteoffset[i] - byteoffset[first], byteoffset[i + 1] - byteoffset[i]),
+            ex_free,
+            "Failed to decompress chunk %td of block `%s'", i, bb->basename);
+
+        /* Decode the chunk, then copy the rows we want */
+        BigArray chunkarray;
+        size_t dims[2] = {rows, nmemb};
+        big_array_init(&chunkarray, chunkbuf, array->dtype, 2, dims, NULL);
+        RAISEIF(0 != _chunk_unfilter(&chunkarray, raw, dtype, nel, &codec, tmp),
+            ex_free, NULL);
+
+        const int64_t lo = rowoffset[i] > start ? rowoffset[i] : start;
+        const int64_t hi = rowoffset[i + 1] < start + nrows ? rowoffset[i + 1] : start + nrows;
+        BigArray src, dst;
+        BigArrayIter srciter, dstiter;
+        _array_rows(&src, &chunkarray, lo - rowoffset[i], hi - lo);
+        _array_rows(&dst, array, lo - start, hi - lo);
+        big_array_iter_init(&srciter, &src);
+        big_array_iter_init(&dstiter, &dst);
+        RAISEIF(0 != _dtype_convert(&dstiter, &srciter, (hi - lo) * nmemb),
+            ex_free, NULL);
+    }
+    free(chunkbuf);
+    free(tmp);
+    free(raw);
+    free(comp);
+    free(byteoffset);
+    free(rowoffset);
+    free(table);
+    return 0;
+
+ex_free:
+    free(chunkbuf);
+    free(tmp);
+    free(raw);
+    free(comp);
+    free(byteoffset);
+    free(rowoffset);
+    free(table);
+ex_info:
+    return -1;
+}
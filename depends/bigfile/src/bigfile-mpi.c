@@ -141,6 +141,70 @@ _big_file_mpi_create_block(BigFile * bf,
     return _big_block_mpi_create(block, basename, dtype, nmemb, Nfile, fsize, comm);
 }
 
+int
+big_file_mpi_create_compressed_block(BigFile * bf,
+        BigBlock * block,
+        const char * blockname,
+        const BigChunks * chunks,
+        const BigCodec * codec,
+        int Nfile,
+        BigBlockPtr * ptr,
+        MPI_Comm comm)
+{
+    if(comm == MPI_COMM_NULL) return 0;
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    /* items, chunks and bytes in total, and chunks before ours */
+    unsigned long long local[3] = {chunks->size, chunks->nchunk, chunks->bytes};
+    unsigned long long total[3];
+    unsigned long long before = 0;
+    MPI_Exscan(&local[1], &before, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    /* MPI_Exscan leaves the result on the first rank undefined */
+    if(rank == 0) {
+        before = 0;
+    }
+    MPI_Allreduce(local, total, 3, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+
+    const size_t tablebytes = 16 * total[1];
+    int rt = big_file_mpi_create_block(bf, block, blockname, "u1", 1, Nfile, tablebytes + total[2], comm);
+    if(rt != 0) return rt;
+
+    rt = big_block_set_codec_attrs(block, chunks, codec, total[0], total[1]);
+    BCAST_AND_RAISEIF(rt, comm);
+
+    /* each rank writes its entries of the table */
+    char * table = malloc(16 * chunks->nchunk + 1);
+    big_chunks_pack_table(chunks, table);
+    BigArray array;
+    size_t dims[1] = {16 * chunks->nchunk};
+    big_array_init(&array, table, "u1", 1, dims, NULL);
+    rt = big_block_seek(block, ptr, 16 * before);
+    if(rt == 0)
+        rt = big_block_write(block, ptr, &array);
+    free(table);
+    BCAST_AND_RAISEIF(rt, comm);
+
+    /* the compressed bytes of all ranks follow the table */
+    rt = big_block_seek(block, ptr, tablebytes);
+    BCAST_AND_RAISEIF(rt, comm);
+    return 0;
+}
+
+int
+big_file_mpi_link_block(BigFile * bf, const char * blockname, BigFile * src, MPI_Comm comm)
+{
+    if(comm == MPI_COMM_NULL) return 0;
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    int rt = 0;
+    if (rank == 0) {
+        rt = big_file_link_block(bf, blockname, src);
+    }
+    return big_file_mpi_broadcast_anyerror(rt, comm);
+}
+
 int big_file_mpi_close(BigFile * bf, MPI_Comm comm) {
     if(comm == MPI_COMM_NULL) return 0;
     int rt = big_file_close(bf);
@@ -488,6 +552,13 @@ _aggregated(
     MPI_Comm_rank(comm, &rank);
     MPI_Comm_size(comm, &nrank);
 
+    /* Nothing to aggregate: act on the array directly, avoiding two copies of it. */
+    if(nrank == 1) {
+        big_block_seek_rel(block, ptr1, offset);
+        e = action(block, ptr1, array);
+        return big_file_mpi_broadcast_anyerror(e, comm);
+    }
+
     BigArray garray[1], larray[1];
     BigArrayIter iarray[1], ilarray[1];
     void * lbuf = malloc(elsize * localsize);
@@ -554,6 +625,30 @@ big_block_mpi_write(BigBlock * block, BigBlockPtr * ptr, BigArray * array, int c
     return rt;
 }
 
+int
+big_block_mpi_write_runs(BigBlock * block, const ptrdiff_t * runs, size_t nruns, BigArray * array, int concurrency, MPI_Comm comm)
+{
+    int ThisTask, NTask;
+
+    MPI_Comm_size(comm, &NTask);
+    MPI_Comm_rank(comm, &ThisTask);
+
+    if(concurrency <= 0 || concurrency > NTask) {
+        concurrency = NTask;
+    }
+    /* Ranks write in turns, at most concurrency at a time, spread over the ranks. */
+    int nturns = (NTask + concurrency - 1) / concurrency;
+    int turn;
+    int rt = 0;
+    for(turn = 0; turn < nturns; turn ++) {
+        if(ThisTask % nturns == turn) {
+            rt = big_block_write_runs(block, runs, nruns, array);
+        }
+        MPI_Barrier(comm);
+    }
+    return big_file_mpi_broadcast_anyerror(rt, comm);
+}
+
 int
 big_block_mpi_read(BigBlock * block, BigBlockPtr * ptr, BigArray * array, int concurrency, MPI_Comm comm)
 {
@@ -561,6 +656,30 @@ big_block_mpi_read(BigBlock * block, BigBlockPtr * ptr, BigArray * array, int co
     return rt;
 }
 
+int
+big_block_mpi_read_runs(BigBlock * block, const ptrdiff_t * runs, size_t nruns, BigArray * array, int concurrency, MPI_Comm comm)
+{
+    int ThisTask, NTask;
+
+    MPI_Comm_size(comm, &NTask);
+    MPI_Comm_rank(comm, &ThisTask);
+
+    if(concurrency <= 0 || concurrency > NTask) {
+        concurrency = NTask;
+    }
+    /* Ranks read in turns, at most concurrency at a time, spread over the ranks. */
+    int nturns = (NTask + concurrency - 1) / concurrency;
+    int turn;
+    int rt = 0;
+    for(turn = 0; turn < nturns; turn ++) {
+        if(ThisTask % nturns == turn) {
+            rt = big_block_read_runs(block, runs, nruns, array);
+        }
+        MPI_Barrier(comm);
+    }
+    return big_file_mpi_broadcast_anyerror(rt, comm);
+}
+
 
 int
 big_file_mpi_create_records(BigFile * bf,
@@ -701,3 +820,216 @@ big_file_mpi_read_records(BigFile * bf,
     }
     return 0;
 }
+
+/* The file holding item offset of a block */
+static int
+_big_block_file_of(BigBlock * block, ptrdiff_t offset)
+{
+    int lo = 0, hi = block->Nfile;
+    while(hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if(block->foffset[mid] <= (size_t) offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int
+big_block_mpi_read_ahead_begin(BigBlock * block, ptrdiff_t start, size_t localsize, BigBlockMPIReadAhead * ra, size_t maxbytes, int concurrency, MPI_Comm comm)
+{
+    int ThisTask, NTask;
+
+    MPI_Comm_size(comm, &NTask);
+    MPI_Comm_rank(comm, &ThisTask);
+
+    if(concurrency <= 0) {
+        concurrency = NTask;
+    }
+
+    memset(ra, 0, sizeof(ra[0]));
+    ra->block = block;
+    ra->localsize = localsize;
+
+    size_t elsize = big_file_dtype_itemsize(block->dtype) * block->nmemb;
+    ra->chunksize = maxbytes / elsize;
+    if(ra->chunksize < 1) ra->chunksize = 1;
+
+    unsigned long long * sizes = malloc(sizeof(sizes[0]) * NTask);
+    sizes[ThisTask] = localsize;
+    MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, sizes, 1, MPI_UNSIGNED_LONG_LONG, comm);
+
+    /* Every rank finds the same groups: a new group starts with the first rank reading from
+     * another group of files. There are at most concurrency groups, so at most concurrency readers. */
+    int i;
+    int color = 0;
+    int mycolor = 0;
+    int lastfgroup = -1;
+    ptrdiff_t offset = start;
+    ptrdiff_t groupoffset = start;
+    for(i = 0; i < NTask; i ++) {
+        if(sizes[i] > 0 && (size_t) offset < block->size) {
+            int fgroup = _big_block_file_of(block, offset);
+            if(block->Nfile > concurrency)
+                fgroup = (long long) fgroup * concurrency / block->Nfile;
+            if(lastfgroup >= 0 && fgroup != lastfgroup) {
+                color ++;
+                groupoffset = offset;
+            }
+            lastfgroup = fgroup;
+        }
+        if(i == ThisTask) {
+            mycolor = color;
+            ra->offset = groupoffset;
+            ra->localoffset = offset - groupoffset;
+        }
+        offset += sizes[i];
+    }
+    free(sizes);
+
+    int rt = 0;
+    if(offset > (ptrdiff_t) block->size) {
+        rt = -1;
+        _big_file_raise("Reading beyond the end of the block: %td > %td", __FILE__, __LINE__, offset, (ptrdiff_t) block->size);
+    }
+
+    MPI_Comm_split(comm, mycolor, ThisTask, &ra->group);
+    int grouprank;
+    MPI_Comm_rank(ra->group, &grouprank);
+    ra->reader = (grouprank == 0);
+    unsigned long long mysize = localsize, size = 0;
+    MPI_Allreduce(&mysize, &size, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, ra->group);
+    ra->size = size;
+
+    rt = big_file_mpi_broadcast_anyerror(rt, comm);
+    if(rt != 0) {
+        MPI_Comm_free(&ra->group);
+    }
+    return rt;
+}
+
+/* Read the chunk of the group starting at item first of the group into the buffer */
+static int
+_big_block_read_ahead_chunk(BigBlockMPIReadAhead * ra, size_t first)
+{
+    BigBlock * block = ra->block;
+    size_t elsize = big_file_dtype_itemsize(block->dtype) * block->nmemb;
+    size_t n = ra->size - first;
+    if(n > ra->chunksize) n = ra->chunksize;
+    BigArray garray[1];
+    BigBlockPtr ptr[1];
+
+    if(ra->buffer == NULL) {
+        ra->buffer = malloc(n * elsize);
+        RAISEIF(ra->buffer == NULL,
+            ex_read,
+            "Failed to allocate %td bytes to read the block", n * elsize);
+    }
+    big_array_init(garray, ra->buffer, block->dtype, 2, (size_t[]){n, block->nmemb}, NULL);
+    RAISEIF(0 != big_block_seek(block, ptr, ra->offset + first),
+        ex_read,
+        NULL);
+    RAISEIF(0 != big_block_read(block, ptr, garray),
+        ex_read,
+        NULL);
+    return 0;
+
+ex_read:
+    ra->error = -1;
+    return -1;
+}
+
+int
+big_block_mpi_read_ahead_fetch(BigBlockMPIReadAhead * ra)
+{
+    if(!ra->reader || ra->size == 0) return 0;
+    return _big_block_read_ahead_chunk(ra, 0);
+}
+
+int
+big_block_mpi_read_ahead_end(BigBlockMPIReadAhead * ra, BigArray * array, MPI_Comm comm)
+{
+    BigBlock * block = ra->block;
+    size_t elsize = big_file_dtype_itemsize(block->dtype) * block->nmemb;
+    int i;
+    int rank;
+    int nrank;
+
+    MPI_Comm_rank(ra->group, &rank);
+    MPI_Comm_size(ra->group, &nrank);
+
+    int rt = 0;
+    if(array->dims[0] != ra->localsize) {
+        rt = -1;
+        _big_file_raise("Array has %td items, not the %td planned", __FILE__, __LINE__, array->dims[0], ra->localsize);
+    }
+    rt = big_file_mpi_broadcast_anyerror(rt, comm);
+    if(rt != 0) goto ex_free;
+
+    MPI_Datatype mpidtype;
+    MPI_Type_contiguous(elsize, MPI_BYTE, &mpidtype);
+    MPI_Type_commit(&mpidtype);
+
+    /* The part of a chunk for this rank, if the group has more than one rank */
+    void * lbuf = NULL;
+    if(nrank > 1) {
+        size_t lsize = ra->localsize < ra->chunksize ? ra->localsize : ra->chunksize;
+        lbuf = malloc(lsize * elsize + 1);
+    }
+    int * recvcounts = malloc(sizeof(int) * (2 * nrank + 1));
+    int * recvdispls = recvcounts + nrank;
+
+    size_t first;
+    for(first = 0; first < ra->size; first += ra->chunksize) {
+        size_t n = ra->size - first;
+        if(n > ra->chunksize) n = ra->chunksize;
+
+        /* The first chunk was read by big_block_mpi_read_ahead_fetch */
+        if(ra->reader && first > 0) {
+            _big_block_read_ahead_chunk(ra, first);
+        }
+        if(0 != (rt = big_file_mpi_broadcast_anyerror(ra->error, ra->group))) {
+            break;
+        }
+
+        /* The items of this rank in the chunk */
+        size_t a = ra->localoffset > first ? ra->localoffset : first;
+        size_t b = ra->localoffset + ra->localsize < first + n ? ra->localoffset + ra->localsize : first + n;
+        if(b < a) b = a;
+
+        void * src = ra->buffer;
+        if(nrank > 1) {
+            recvcounts[rank] = b - a;
+            MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, recvcounts, 1, MPI_INT, ra->group);
+            recvdispls[0] = 0;
+            for(i = 0; i < nrank; i ++) {
+                recvdispls[i + 1] = recvdispls[i] + recvcounts[i];
+            }
+            MPI_Scatterv(ra->buffer, recvcounts, recvdispls, mpidtype,
+                        lbuf, b - a, mpidtype, 0, ra->group);
+            src = lbuf;
+        }
+        if(b == a) continue;
+
+        BigArray larray[1], darray[1];
+        BigArrayIter ilarray[1], idarray[1];
+        big_array_init(larray, src, block->dtype, 2, (size_t[]){b - a, block->nmemb}, NULL);
+        big_array_init(darray, (char *) array->data + (a - ra->localoffset) * array->strides[0],
+            array->dtype, 2, (size_t[]){b - a, array->dims[1]}, array->strides);
+        big_array_iter_init(ilarray, larray);
+        big_array_iter_init(idarray, darray);
+        _dtype_convert(idarray, ilarray, (b - a) * block->nmemb);
+    }
+
+    free(recvcounts);
+    free(lbuf);
+    MPI_Type_free(&mpidtype);
+    rt = big_file_mpi_broadcast_anyerror(rt, comm);
+
+ex_free:
+    free(ra->buffer);
+    ra->buffer = NULL;
+    MPI_Comm_free(&ra->group);
+    return rt;
+}
@@ -68,6 +68,10 @@ _big_file_mpi_create_block(BigFile * bf,
         const size_t fsize[],
         MPI_Comm comm);
 
+/** Hard link the block blockname of src into bf, see big_file_link_block. The links are made by the root rank.
+ * @returns 0 if successful, on all ranks. */
+int big_file_mpi_link_block(BigFile * bf, const char * blockname, BigFile * src, MPI_Comm comm);
+
 /** Close the BigFile, and free memory associated with it. Once closed, it should not be re-used.*/
 int big_file_mpi_close(BigFile * bf, MPI_Comm comm);
 
@@ -100,6 +104,24 @@ size_t big_file_mpi_get_aggregated_threshold();
 
 void big_file_mpi_set_verbose(int verbose);
 
+/** Create a compressed BigBlock holding the items compressed by each rank into chunks, in rank order.
+ * See bigfile.h for the layout. The table of chunks is written; the compressed bytes are not.
+ * Arguments:
+ * @param chunks - the chunks of this rank, from big_chunks_encode.
+ * @param codec - the codec used to encode the chunks.
+ * @param Nfile - Number of files to use for this block on disc.
+ * @param ptr - set to the start of the compressed bytes. The chunks->data of all ranks, as "u1" arrays,
+ *              are written from there in rank order, eg with big_block_mpi_write.
+ * @returns 0 if successful. */
+int big_file_mpi_create_compressed_block(BigFile * bf,
+        BigBlock * block,
+        const char * blockname,
+        const BigChunks * chunks,
+        const BigCodec * codec,
+        int Nfile,
+        BigBlockPtr * ptr,
+        MPI_Comm comm);
+
 /** Write data stored in a BigArray to a BigBlock.
  * You cannot write beyond the end of the size of the block.
  * The value may be a (small) array.
@@ -115,6 +137,18 @@ void big_file_mpi_set_verbose(int verbose);
  * @returns 0 if successful. */
 int big_block_mpi_write(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, int concurrency, MPI_Comm comm);
 
+/** Write a BigArray to runs of a block, which need not be contiguous.
+ *
+ * This is a collective MPI operation. Each rank writes its own runs directly
+ * to their offsets in the files, with big_block_write_runs; there is no communication of the data.
+ *
+ * @param runs - nruns pairs of (offset, number of items) in the block, as in big_block_write_runs.
+ * @param array - BigArray containing the data which should be written, in the order of the runs.
+ * @param concurrency - Max number of MPI ranks that issues write operation at the same time.
+ * @param comm - MPI Communicator
+ * @returns 0 if successful. */
+int big_block_mpi_write_runs(BigBlock * bb, const ptrdiff_t * runs, size_t nruns, BigArray * array, int concurrency, MPI_Comm comm);
+
 /** Read from a block to a BigArray
  *
  * This is a collective MPI operation. The read operation will start from ptr.
@@ -128,6 +162,65 @@ int big_block_mpi_write(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, int
  */
 int big_block_mpi_read(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, int concurrency, MPI_Comm comm);
 
+/** Read runs of a block, which need not be contiguous, to a BigArray.
+ *
+ * This is a collective MPI operation. Each rank reads its own runs directly
+ * from the files, with big_block_read_runs; there is no communication of the data.
+ *
+ * @param runs - nruns pairs of (offset, number of items) in the block, as in big_block_read_runs.
+ * @param array - BigArray to read into, in the order of the runs.
+ * @param concurrency - Max number of MPI ranks that issues read operation at the same time.
+ * @param comm - MPI Communicator
+ * @returns 0 if successful. */
+int big_block_mpi_read_runs(BigBlock * bb, const ptrdiff_t * runs, size_t nruns, BigArray * array, int concurrency, MPI_Comm comm);
+
+/** A read of a block in three phases, so that reading the files can overlap other work.
+ *
+ * Ranks are gathered into at most concurrency groups by the file holding their first item, so that
+ * each file is opened by the one reader of its group rather than by every rank which needs items from it.
+ * The reader reads the items of the group in chunks and scatters each chunk to the group.
+ * Only the first chunk is read ahead; the memory used is at most one chunk on each rank.
+ */
+typedef struct BigBlockMPIReadAhead {
+    BigBlock * block;
+    MPI_Comm group; /* The ranks sharing a reader */
+    int reader; /* Whether this rank reads for its group */
+    ptrdiff_t offset; /* First item of the group in the block */
+    size_t size; /* Number of items of the group */
+    size_t localoffset; /* First item of this rank in the group */
+    size_t localsize; /* Number of items of this rank */
+    size_t chunksize; /* Number of items read at once */
+    void * buffer; /* A chunk of items in the dtype of the block, on the reader */
+    int error;
+} BigBlockMPIReadAhead;
+
+/** Plan a read of localsize items per rank from a block, starting from item start, with ranks in order.
+ *
+ * This is a collective MPI operation.
+ *
+ * @param maxbytes - Max size of a chunk. At least one item is read at once.
+ * @param concurrency - Max number of readers: ranks reading from more files than this share readers.
+ * @returns 0 if successful.
+ */
+int big_block_mpi_read_ahead_begin(BigBlock * bb, ptrdiff_t start, size_t localsize, BigBlockMPIReadAhead * ra, size_t maxbytes, int concurrency, MPI_Comm comm);
+
+/** Read the first chunk of the group of this rank, if it is the reader.
+ *
+ * This is not a collective operation and makes no MPI calls, so it may run in another thread
+ * between big_block_mpi_read_ahead_begin and big_block_mpi_read_ahead_end.
+ *
+ * @returns 0 if successful.
+ */
+int big_block_mpi_read_ahead_fetch(BigBlockMPIReadAhead * ra);
+
+/** Scatter the first chunk to array, which has localsize items, then read and scatter the rest of the group, and free the read.
+ *
+ * This is a collective MPI operation.
+ *
+ * @returns 0 if successful on all ranks.
+ */
+int big_block_mpi_read_ahead_end(BigBlockMPIReadAhead * ra, BigArray * array, MPI_Comm comm);
+
 /** Flush the BigBlock 
  *
  *  Flush will write the attrset from root rank, and gather the checksums from all ranks.
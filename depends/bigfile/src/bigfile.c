@@ -13,6 +13,7 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/mman.h>
 
 #include "bigfile.h"
 #include "bigfile-internal.h"
@@ -33,6 +34,7 @@ static char * volatile ERRORSTR = NULL;
 #endif
 
 static size_t CHUNK_BYTES = 64 * 1024 * 1024;
+static int USE_MMAP = 0;
 
 /* Internal AttrSet API */
 
@@ -74,6 +76,7 @@ dtype_convert_simple(void * dst, const char * dstdtype, const void * src, const
 
 /*Check dtype is valid*/
 static int dtype_isvalid(const char * dtype);
+static char * _big_file_path(const char * basename, int fileid);
 
 /* postfix detection, 1 if postfix is a postfix of str */
 static int
@@ -95,6 +98,13 @@ big_file_set_buffer_size(size_t bytes)
     return 0;
 }
 
+int
+big_file_set_mmap(int enable)
+{
+    USE_MMAP = enable;
+    return 0;
+}
+
 /* Error handling */
 char * big_file_get_error_message() {
     return ERRORSTR;
@@ -298,6 +308,48 @@ ex_subdir:
     return -1;
 }
 
+int
+big_file_link_block(BigFile * bf, const char * blockname, BigFile * src)
+{
+    BigBlock bb;
+    RAISEIF(0 != big_file_open_block(src, &bb, blockname),
+            ex_open,
+            NULL);
+    RAISEIF(0 != _big_file_mksubdir_r(bf->basename, blockname),
+            ex_subdir,
+            NULL);
+    char * srcbase = _path_join(src->basename, blockname);
+    char * dstbase = _path_join(bf->basename, blockname);
+    int i;
+    int rt = 0;
+    for(i = FILEID_ATTR_V2; i < bb.Nfile && rt == 0; i ++) {
+        char * srcname = _big_file_path(srcbase, i);
+        char * dstname = _big_file_path(dstbase, i);
+        unlink(dstname);
+        rt = link(srcname, dstname);
+        /* the attribute files are optional */
+        if(rt != 0 && i < 0 && i != FILEID_HEADER && errno == ENOENT) {
+            rt = 0;
+        }
+        if(rt != 0) {
+            _big_file_raise("Failed to link `%s' to `%s' (%s)", __FILE__, __LINE__, dstname, srcname, strerror(errno));
+        }
+        free(srcname);
+        free(dstname);
+    }
+    free(srcbase);
+    free(dstbase);
+    RAISEIF(rt != 0, ex_link, NULL);
+    big_block_close(&bb);
+    return 0;
+
+ex_link:
+ex_subdir:
+    big_block_close(&bb);
+ex_open:
+    return -1;
+}
+
 int
 big_file_close(BigFile * bf)
 {
@@ -794,9 +846,84 @@ ex_seek:
     return -1;
 }
 
+/* Read by mapping each file: the items are converted from the page cache straight
+ * into array, without a chunk buffer. */
+static int
+_big_block_read_mmap(BigBlock * bb, BigBlockPtr * ptr, BigArray * array)
+{
+    int nmemb = bb->nmemb ? bb->nmemb : 1;
+    int felsize = big_file_dtype_itemsize(bb->dtype) * nmemb;
+    const size_t pagesize = sysconf(_SC_PAGESIZE);
+
+    BigArrayIter array_iter;
+    big_array_iter_init(&array_iter, array);
+
+    ptrdiff_t toread = array->size / nmemb;
+
+    ptrdiff_t abs = bb->foffset[ptr->fileid] + ptr->roffset + toread;
+    RAISEIF(abs > bb->size,
+                ex_eof,
+                "Reading beyond the block `%s` at (%d:%td)",
+                bb->basename, ptr->fileid, ptr->roffset * felsize);
+
+    while(toread > 0 && ! big_block_eof(bb, ptr)) {
+        size_t chunk_size = bb->fsize[ptr->fileid] - ptr->roffset;
+        if(chunk_size > toread) {
+            chunk_size = toread;
+        }
+        RAISEIF(chunk_size == 0,
+            ex_insuf,
+            "Insufficient number of items in file `%s' at (%d:%td)",
+            bb->basename, ptr->fileid, ptr->roffset * felsize);
+
+        FILE * fp = _big_file_open_a_file(bb->basename, ptr->fileid, "r", 1);
+        RAISEIF(fp == NULL,
+                ex_open,
+                NULL);
+        /* mmap offsets must be page aligned */
+        const size_t start = ptr->roffset * felsize;
+        const size_t skip = start % pagesize;
+        const size_t maplen = skip + chunk_size * felsize;
+        char * map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fileno(fp), start - skip);
+        fclose(fp);
+        RAISEIF(map == MAP_FAILED,
+                ex_mmap,
+                "Failed to map block `%s' at (%d:%td) (%s)",
+                bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
+        posix_madvise(map, maplen, POSIX_MADV_SEQUENTIAL);
+
+        BigArray map_array;
+        BigArrayIter map_iter;
+        size_t dims[2] = {chunk_size, bb->nmemb};
+        big_array_init(&map_array, map + skip, bb->dtype, 2, dims, NULL);
+        big_array_iter_init(&map_iter, &map_array);
+        int rt = _dtype_convert(&array_iter, &map_iter, chunk_size * bb->nmemb);
+        munmap(map, maplen);
+        RAISEIF(rt != 0,
+            ex_convert, NULL);
+
+        toread -= chunk_size;
+        RAISEIF(0 != big_block_seek_rel(bb, ptr, chunk_size),
+                ex_blockseek,
+                NULL);
+    }
+    return 0;
+
+ex_mmap:
+ex_insuf:
+ex_convert:
+ex_blockseek:
+ex_open:
+ex_eof:
+    return -1;
+}
+
 int
 big_block_read(BigBlock * bb, BigBlockPtr * ptr, BigArray * array)
 {
+    if(USE_MMAP) {
+        return _big_block_read_mmap(bb, ptr, array);
+    }
     char * chunkbuf = malloc(CHUNK_BYTES);
 
     int nmemb = bb->nmemb ? bb->nmemb : 1;
@@ -887,6 +1014,141 @@ ex_malloc:
     return -1;
 }
 
+int
+big_block_read_runs(BigBlock * bb, const ptrdiff_t * runs, size_t nruns, BigArray * array)
+{
+    if(array->size == 0) return 0;
+    int nmemb = bb->nmemb ? bb->nmemb : 1;
+    int felsize = big_file_dtype_itemsize(bb->dtype) * nmemb;
+    size_t i;
+    ptrdiff_t total = 0;
+    for(i = 0; i < nruns; i ++) {
+        total += runs[2 * i + 1];
+    }
+    /* Compressed blocks do not record nmemb, so count the rows of the array*/
+    RAISEIF(total != array->dims[0],
+            ex_size,
+            "The runs have %td items but the array has %td", total, array->dims[0]);
+
+    if(USE_MMAP || big_block_is_compressed(bb)) {
+        /* Read each run into its rows of the array*/
+        ptrdiff_t done = 0;
+        for(i = 0; i < nruns; i ++) {
+            BigArray rows;
+            BigBlockPtr ptr;
+            size_t dims[32];
+            int d;
+            for(d = 1; d < array->ndim; d ++) {
+                dims[d] = array->dims[d];
+            }
+            dims[0] = runs[2 * i + 1];
+            if(dims[0] == 0) continue;
+            big_array_init(&rows, (char *) array->data + done * array->strides[0], array->dtype, array->ndim, dims, array->strides);
+            if(big_block_is_compressed(bb)) {
+                RAISEIF(0 != big_block_read_compressed(bb, runs[2 * i], &rows),
+                        ex_size, NULL);
+            } else {
+                RAISEIF(0 != big_block_seek(bb, &ptr, runs[2 * i]) ||
+                        0 != _big_block_read_mmap(bb, &ptr, &rows),
+                        ex_size, NULL);
+            }
+            done += runs[2 * i + 1];
+        }
+        return 0;
+    }
+
+    char * chunkbuf = malloc(CHUNK_BYTES);
+    size_t CHUNK_SIZE = CHUNK_BYTES / felsize;
+
+    BigArray chunk_array = {0};
+    size_t dims[2];
+    dims[0] = CHUNK_SIZE;
+    dims[1] = bb->nmemb;
+
+    BigArrayIter chunk_iter;
+    BigArrayIter array_iter;
+    BigBlockPtr ptr;
+    FILE * fp = NULL;
+    /* The file which is open*/
+    int fileid = -1;
+
+    RAISEIF(chunkbuf == NULL,
+            ex_malloc,
+            "not enough memory for chunkbuf of size %d bytes", CHUNK_BYTES);
+
+    big_array_init(&chunk_array, chunkbuf, bb->dtype, 2, dims, NULL);
+    big_array_iter_init(&array_iter, array);
+
+    for(i = 0; i < nruns; i ++) {
+        ptrdiff_t toread = runs[2 * i + 1];
+        if(toread == 0) continue;
+        RAISEIF(runs[2 * i] + toread > bb->size,
+                ex_eof,
+                "Reading beyond the block `%s` at %td",
+                bb->basename, runs[2 * i] + toread);
+        RAISEIF(0 != big_block_seek(bb, &ptr, runs[2 * i]),
+                ex_blockseek, NULL);
+
+        while(toread > 0 && ! big_block_eof(bb, &ptr)) {
+            size_t chunk_size = CHUNK_SIZE;
+            /* remaining items in the file */
+            if(chunk_size > bb->fsize[ptr.fileid] - ptr.roffset) {
+                chunk_size = bb->fsize[ptr.fileid] - ptr.roffset;
+            }
+            /* remaining items to read */
+            if(chunk_size > toread) {
+                chunk_size = toread;
+            }
+            RAISEIF(chunk_size == 0,
+                ex_insuf,
+                "Insufficient number of items in file `%s' at (%d:%td)",
+                bb->basename, ptr.fileid, ptr.roffset * felsize);
+
+            /* Keep the file open for the following runs*/
+            if(ptr.fileid != fileid) {
+                if(fp) fclose(fp);
+                fileid = ptr.fileid;
+                fp = _big_file_open_a_file(bb->basename, fileid, "r", 1);
+                RAISEIF(fp == NULL,
+                        ex_open,
+                        NULL);
+            }
+            RAISEIF(0 > fseek(fp, ptr.roffset * felsize, SEEK_SET),
+                    ex_seek,
+                    "Failed to seek in block `%s' at (%d:%td) (%s)",
+                    bb->basename, ptr.fileid, ptr.roffset * felsize, strerror(errno));
+            RAISEIF(chunk_size != fread(chunkbuf, felsize, chunk_size, fp),
+                    ex_read,
+                    "Failed to read in block `%s' at (%d:%td) (%s)",
+                    bb->basename, ptr.fileid, ptr.roffset * felsize, strerror(errno));
+
+            /* read to the beginning of chunk, then translate the data from chunkbuf to the array */
+            big_array_iter_init(&chunk_iter, &chunk_array);
+            RAISEIF(0 != _dtype_convert(&array_iter, &chunk_iter, chunk_size * bb->nmemb),
+                ex_convert, NULL);
+
+            toread -= chunk_size;
+            RAISEIF(0 != big_block_seek_rel(bb, &ptr, chunk_size),
+                    ex_blockseek, NULL);
+        }
+    }
+    if(fp) fclose(fp);
+    free(chunkbuf);
+    return 0;
+ex_read:
+ex_seek:
+ex_convert:
+ex_blockseek:
+ex_insuf:
+ex_eof:
+    if(fp) fclose(fp);
+ex_open:
+    free(chunkbuf);
+ex_malloc:
+ex_size:
+    return -1;
+}
+
 int
 big_block_write(BigBlock * bb, BigBlockPtr * ptr, BigArray * array)
 {
@@ -974,6 +1236,113 @@ ex_malloc:
     return -1;
 }
 
+int
+big_block_write_runs(BigBlock * bb, const ptrdiff_t * runs, size_t nruns, BigArray * array)
+{
+    if(array->size == 0) return 0;
+    /* the file header is modified */
+    bb->dirty = 1;
+    char * chunkbuf = malloc(CHUNK_BYTES);
+    int nmemb = bb->nmemb ? bb->nmemb : 1;
+    int felsize = big_file_dtype_itemsize(bb->dtype) * nmemb;
+    size_t CHUNK_SIZE = CHUNK_BYTES / felsize;
+
+    BigArray chunk_array = {0};
+    size_t dims[2];
+    dims[0] = CHUNK_SIZE;
+    dims[1] = bb->nmemb;
+
+    BigArrayIter chunk_iter;
+    BigArrayIter array_iter;
+    BigBlockPtr ptr;
+    FILE * fp = NULL;
+    /* The file which is open*/
+    int fileid = -1;
+    ptrdiff_t total = 0;
+    size_t i;
+
+    RAISEIF(chunkbuf == NULL,
+            ex_malloc,
+            "not enough memory for chunkbuf of size %d bytes", CHUNK_BYTES);
+
+    for(i = 0; i < nruns; i ++) {
+        total += runs[2 * i + 1];
+    }
+    RAISEIF(total * nmemb != array->size,
+            ex_size,
+            "The runs have %td items but the array has %td", total, array->size / nmemb);
+
+    big_array_init(&chunk_array, chunkbuf, bb->dtype, 2, dims, NULL);
+    big_array_iter_init(&array_iter, array);
+
+    for(i = 0; i < nruns; i ++) {
+        ptrdiff_t towrite = runs[2 * i + 1];
+        if(towrite == 0) continue;
+        RAISEIF(runs[2 * i] + towrite > bb->size,
+                ex_eof,
+                "Writing beyond the block `%s` at %td",
+                bb->basename, runs[2 * i] + towrite);
+        RAISEIF(0 != big_block_seek(bb, &ptr, runs[2 * i]),
+                ex_blockseek, NULL);
+
+        while(towrite > 0 && ! big_block_eof(bb, &ptr)) {
+            size_t chunk_size = CHUNK_SIZE;
+            /* remaining items in the file */
+            if(chunk_size > bb->fsize[ptr.fileid] - ptr.roffset) {
+                chunk_size = bb->fsize[ptr.fileid] - ptr.roffset;
+            }
+            /* remaining items to write */
+            if(chunk_size > towrite) {
+                chunk_size = towrite;
+            }
+            /* write from the beginning of chunk */
+            big_array_iter_init(&chunk_iter, &chunk_array);
+
+            /* now translate the data to format in the file*/
+            RAISEIF(0 != _dtype_convert(&chunk_iter, &array_iter, chunk_size * bb->nmemb),
+                ex_convert, NULL);
+
+            sysvsum(&bb->fchecksum[ptr.fileid], chunkbuf, chunk_size * felsize);
+
+            /* Keep the file open for the following runs*/
+            if(ptr.fileid != fileid) {
+                if(fp) fclose(fp);
+                fileid = ptr.fileid;
+                fp = _big_file_open_a_file(bb->basename, fileid, "r+", 1);
+                RAISEIF(fp == NULL,
+                        ex_open,
+                        NULL);
+            }
+            RAISEIF(0 > fseek(fp, ptr.roffset * felsize, SEEK_SET),
+                    ex_seek,
+                    "Failed to seek in block `%s' at (%d:%td) (%s)",
+                    bb->basename, ptr.fileid, ptr.roffset * felsize, strerror(errno));
+            RAISEIF(chunk_size != fwrite(chunkbuf, felsize, chunk_size, fp),
+                    ex_write,
+                    "Failed to write in block `%s' at (%d:%td) (%s)",
+                    bb->basename, ptr.fileid, ptr.roffset * felsize, strerror(errno));
+
+            towrite -= chunk_size;
+            RAISEIF(0 != big_block_seek_rel(bb, &ptr, chunk_size),
+                    ex_blockseek, NULL);
+        }
+    }
+    if(fp) fclose(fp);
+    free(chunkbuf);
+    return 0;
+ex_write:
+ex_seek:
+ex_convert:
+ex_blockseek:
+ex_eof:
+    if(fp) fclose(fp);
+ex_open:
+ex_size:
+    free(chunkbuf);
+ex_malloc:
+    return -1;
+}
+
 /**
  * dtype stuff
  * */
@@ -1904,24 +2273,33 @@ _big_block_unpack(BigBlock * block, void * buf)
 
 /* File Path */
 
-FILE *
-_big_file_open_a_file(const char * basename, int fileid, char * mode, int raise)
+static char *
+_big_file_path(const char * basename, int fileid)
 {
-    char * filename;
-    int unbuffered = 0;
     if(fileid == FILEID_HEADER) {
-        filename = _path_join(basename, EXT_HEADER);
+        return _path_join(basename, EXT_HEADER);
     } else
     if(fileid == FILEID_ATTR) {
-        filename = _path_join(basename, EXT_ATTR);
+        return _path_join(basename, EXT_ATTR);
     } else
     if(fileid == FILEID_ATTR_V2) {
-        filename = _path_join(basename, EXT_ATTR_V2);
+        return _path_join(basename, EXT_ATTR_V2);
     } else {
         char d[128];
         sprintf(d, EXT_DATA, fileid);
-        filename = _path_join(basename, d);
-        unbuffered = 1;
+        return _path_join(basename, d);
+    }
+}
+
+FILE *
+_big_file_open_a_file(const char * basename, int fileid, char * mode, int raise)
+{
+    char * filename = _big_file_path(basename, fileid);
+    int unbuffered = fileid >= 0;
+    /* replace rather than truncate, so a file hard linked by another block
+     * (see big_file_link_block) is never changed. */
+    if(mode[0] == 'w') {
+        unlink(filename);
     }
     FILE * fp = fopen(filename, mode);
 
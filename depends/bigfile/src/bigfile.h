@@ -2,6 +2,7 @@
 #define _BIGFILE_H_
 #include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -67,6 +68,9 @@ typedef struct BigArrayIter {
 } BigArrayIter;
 
 int big_file_set_buffer_size(size_t bytes);
+/* If enable is set, big_block_read maps the files with mmap and converts the items straight from the page cache,
+ * instead of reading them through a buffer of big_file_set_buffer_size bytes. */
+int big_file_set_mmap(int enable);
 char * big_file_get_error_message(void);
 void big_file_set_error_message(char * msg);
 
@@ -85,6 +89,11 @@ int big_file_create(BigFile * bf, const char * basename); /* raises */
 int big_file_list(BigFile * bf, char *** blocknames, int * Nblocks);
 int big_file_open_block(BigFile * bf, BigBlock * block, const char * blockname); /* raises*/
 int big_file_create_block(BigFile * bf, BigBlock * block, const char * blockname, const char * dtype, int nmemb, int Nfile, const size_t fsize[]); /* raises */
+/**
+ * Make blockname of bf a hard link of the block of the same name in src, so the block is
+ * shared on disc rather than copied. Fails if the files cannot be linked, eg, across file systems.
+ * Writing a new block over either one replaces its files, so it never changes the other.*/
+int big_file_link_block(BigFile * bf, const char * blockname, BigFile * src); /* raises */
 int big_file_close(BigFile * bf); /* raises */
 
 int big_block_close(BigBlock * block); /* raises */
@@ -117,6 +126,15 @@ int big_block_eof(BigBlock * bb, BigBlockPtr * ptr);
  */
 int big_block_read(BigBlock * bb, BigBlockPtr * ptr, BigArray * array); /* raises */
 
+/** Read runs of a block, which need not be contiguous, to a BigArray.
+ * The items are read in order: the first runs[1] items from offset runs[0], and so on.
+ * Each file is opened once for consecutive runs in the same file, so many small runs are cheap.
+ * @param runs - nruns pairs of (offset, number of items) in the block.
+ * @param nruns - number of runs.
+ * @param array - BigArray to read into. Its size must be the sum of the run lengths.
+ * @returns 0 if successful. */
+int big_block_read_runs(BigBlock * bb, const ptrdiff_t * runs, size_t nruns, BigArray * array); /* raises */
+
 /** Read from a block and create a BigArray 
  *  array->buf shall be freed with the C free() function.
  * 
@@ -142,6 +160,17 @@ int big_block_read_simple(BigBlock * bb, ptrdiff_t start, ptrdiff_t size, BigArr
  * @returns 0 if successful. */
 int big_block_write(BigBlock * bb, BigBlockPtr * ptr, BigArray * array); /* raisees*/
 
+/** Write the items of a BigArray to a list of runs of a BigBlock, which need not be contiguous.
+ * The items of the array are written in order: the first runs[1] items to offset runs[0], and so on.
+ * Each file is opened once for consecutive runs in the same file, so many small runs are cheap.
+ * Arguments:
+ * @param block - pointer to opened BigBlock
+ * @param runs - nruns pairs of (offset, number of items) in the block.
+ * @param nruns - number of runs.
+ * @param array - BigArray containing the data which should be written. Its size must be the sum of the run lengths.
+ * @returns 0 if successful. */
+int big_block_write_runs(BigBlock * bb, const ptrdiff_t * runs, size_t nruns, BigArray * array); /* raises*/
+
 /** Set an attribute on a BigBlock: attributes are plaintext key-value pairs stored in a special file in the Block directory.
  * The value may be a (small) array.
  * Arguments:
@@ -250,6 +279,51 @@ int big_array_init(BigArray * array,
 int big_array_iter_init(BigArrayIter * iter, BigArray * array);
 void big_array_iter_advance(BigArrayIter * iter);
 
+/**
+ * Compressed blocks.
+ *
+ * A compressed block is stored as a block of bytes ("u1"). It starts with a table with an entry
+ * for each chunk, the number of items and of compressed bytes as two little endian int64, followed by the
+ * chunks in order. Each chunk holds a contiguous range of items, compressed with zlib after an optional
+ * quantisation and byte-shuffle. The attributes of the block record the dtype (ItemDtype), nmemb (ItemNmemb)
+ * and number (ItemSize) of the items, the number of chunks (NChunk) and the codec.
+ *
+ * A writer encodes its rows into BigChunks, creates the block with big_file_mpi_create_compressed_block
+ * (or sets the attributes and writes the table itself), then writes chunks->data as bytes.
+ * */
+typedef struct BigCodec {
+    int level;      /* zlib compression level, 1 (fast) - 9 (small) */
+    int shuffle;    /* group the bytes of equal significance of all elements of a chunk before compressing it */
+    double quantum; /* If positive, floating point values are stored (lossily) as unsigned 32 bit multiples of quantum,
+                       modulo 2^32 quantum, which suits periodic coordinates. Quantised values are always shuffled. */
+} BigCodec;
+
+typedef struct BigChunks {
+    /* All members are readonly */
+    char dtype[8];  /* dtype of the items, little endian */
+    int nmemb;      /* num of dtype typed elements per item */
+    size_t size;    /* number of items */
+    size_t nchunk;
+    int64_t * table; /* 2 * nchunk: items and compressed bytes of each chunk */
+    char * data;    /* the compressed chunks */
+    size_t bytes;   /* bytes in data */
+} BigChunks;
+
+/* Compress the items of array, converted to dtype, into chunks of about chunkbytes bytes before compression.
+ * Free with big_chunks_free. */
+int big_chunks_encode(BigChunks * chunks, BigArray * array, const char * dtype, const BigCodec * codec, size_t chunkbytes); /* raises */
+void big_chunks_free(BigChunks * chunks);
+/* Serialize the table of chunks into buf, of 16 * chunks->nchunk bytes */
+void big_chunks_pack_table(const BigChunks * chunks, void * buf);
+/* Set the attributes of a compressed block with size items in nchunk chunks in total, of which chunks is a part */
+int big_block_set_codec_attrs(BigBlock * bb, const BigChunks * chunks, const BigCodec * codec, size_t size, size_t nchunk); /* raises */
+/* Returns 1 if the block is a compressed block */
+int big_block_is_compressed(BigBlock * bb);
+/* The dtype, nmemb and number of items stored in a compressed block */
+int big_block_compressed_info(BigBlock * bb, char * dtype, int * nmemb, size_t * size); /* raises */
+/* Read array->dims[0] items starting at item start from a compressed block, decompressing the chunks which hold them. */
+int big_block_read_compressed(BigBlock * bb, ptrdiff_t start, BigArray * array); /* raises */
+
 /**
  * Record is a composite of fields. Currently each field must be a scalar dtype.
  *
@@ -15,6 +15,7 @@
 
 #include <libgadget/run.h>
 #include <libgadget/checkpoint.h>
+#include <libgadget/petaio.h>
 #include <libgadget/config.h>
 #include <libgadget/forcetree.c>
 
@@ -83,7 +84,8 @@ int main(int argc, char **argv)
 
     int ShowBacktrace;
     double MaxMemSizePerNode;
-    read_parameter_file(argv[1], &ShowBacktrace, &MaxMemSizePerNode);	/* ... read in parameters for this run */
+    int SharedMemoryTree, NUMAFirstTouch;
+    read_parameter_file(argv[1], &ShowBacktrace, &MaxMemSizePerNode, &SharedMemoryTree, &NUMAFirstTouch);	/* ... read in parameters for this run */
 
     int RestartFlag, RestartSnapNum;
 
@@ -107,12 +109,15 @@ int main(int argc, char **argv)
     if(RestartFlag == 3 && RestartSnapNum < 0) {
         endrun(0, "Need to give the snapshot number if FOF is selected for output\n");
     }
+    if(RestartFlag != 3 && RestartFlag != 4 && petaio_reading_subset()) {
+        endrun(0, "SnapshotReadTypes and SnapshotReadRegion can only be used to run FOF or a power spectrum\n");
+    }
 
     /*Set up GSL so it gives a proper MPI termination*/
     gsl_set_error_handler(gsl_handler);
 
     /*Initialize the memory manager*/
-    mymalloc_init(MaxMemSizePerNode);
+    mymalloc_init(MaxMemSizePerNode, SharedMemoryTree, NUMAFirstTouch);
 
     /* Make sure memory has finished initialising on all ranks before doing more.
      * This may improve stability */
@@ -137,6 +142,7 @@ int main(int argc, char **argv)
             run(RestartSnapNum, ti_init, &head);        /* main simulation loop */
             break;
     }
+    mymalloc_free_shared();
     MPI_Finalize();		/* clean up & finalize MPI */
 
     return 0;
@@ -25,6 +25,7 @@
 #include <libgadget/uvbg.h>
 #include <libgadget/stats.h>
 #include <libgadget/plane.h>
+#include <libgadget/lightcone.h>
 
 static int
 BlackHoleFeedbackMethodAction (ParameterSet * ps, const char * name, void * data)
@@ -101,6 +102,8 @@ create_gadget_parameter_set()
     param_declare_int(ps,    "OutputDebugFields", OPTIONAL, 0, "Save a large number of debug fields in snapshots.");
     param_declare_int(ps,    "ShowBacktrace", OPTIONAL, 1, "Print a backtrace on crash. Hangs on stampede.");
     param_declare_double(ps,    "MaxMemSizePerNode", OPTIONAL, 0.6, "Pre-allocate this much memory per computing node/ host, in MB. Passing < 1 allocates a fraction of total available memory per node, defaults to 0.6 available memory.");
+    param_declare_int(ps,    "SharedMemoryTree", OPTIONAL, 0, "Place the memory of the ranks on each node in an MPI-3 shared memory window. The short-range gravity tree walk then reads the trees of the other ranks on the node directly, and only exports particles to ranks on other nodes.");
+    param_declare_int(ps,    "NUMAFirstTouch", OPTIONAL, 0, "Do not clear the memory at startup, so that each page is placed in the NUMA domain of the thread which first uses it. The particle table is then spread over the domains of all threads. Use when running one MPI rank per node or socket with many OpenMP threads. Running out of memory is not detected at startup.");
     param_declare_double(ps, "AutoSnapshotTime", OPTIONAL, 0, "Seconds after which to automatically generate a snapshot if nothing is output.");
 
     param_declare_double(ps, "TimeMax", OPTIONAL, 1.0, "Scale factor to end run.");
@@ -111,6 +114,8 @@ create_gadget_parameter_set()
     param_declare_double(ps, "RandomParticleOffset", OPTIONAL, 8., "Internally shift the particles within a periodic box by a random fraction of a PM grid cell each domain decomposition, ensuring that tree openings are decorrelated between timesteps. This shift is subtracted before particles are saved.");
 
     param_declare_int   (ps, "DomainUseGlobalSorting", OPTIONAL, 1, "Determining the initial refinement of chunks globally. Enabling this produces better domains at costs of slowing down the domain decomposition.");
+    param_declare_double(ps, "DomainRebalanceThreshold", OPTIONAL, 1.1, "On PM steps keep the existing domain if the largest particle load on a rank is below this multiple of the mean. Above it, the domain is rebalanced incrementally by moving the domain boundaries along the Peano curve and splitting expensive domains. 0 always does a full domain decomposition.");
+    param_declare_int   (ps, "DomainUseNodeOrdering", OPTIONAL, 1, "Assign neighbouring domains along the Peano curve to MPI ranks on the same node, found with MPI_Comm_split_type. This keeps most tree walk communication inside a node when ranks are not placed on nodes in blocks.");
     param_declare_double(ps, "ErrTolIntAccuracy", OPTIONAL, 0.02, "Controls the length of the short-range timestep. Smaller values are shorter timesteps.");
     param_declare_double(ps, "ErrTolForceAcc", OPTIONAL, 0.002, "Force accuracy required from tree. Controls tree opening criteria. Lower values are more accurate.");
     param_declare_double(ps, "BHOpeningAngle", OPTIONAL, 0.175, "Barnes-Hut opening angle. Alternative purely geometric tree opening angle. Lower values are more accurate.");
@@ -155,6 +160,16 @@ create_gadget_parameter_set()
 
     param_declare_int(ps, "EnableAggregatedIO", OPTIONAL, 0, "Use the Aggregated IO policy for small data set (Experimental).");
     param_declare_int(ps, "AggregatedIOThreshold", OPTIONAL, 256, "Max size (in MB) on a writer before reverting to throttled IO.");
+    param_declare_int(ps, "AsyncSnapshotMaxMB", OPTIONAL, 0, "Max size (in MB) of the copy of a snapshot on one rank which is written in the background while the simulation continues. Larger snapshots, or 0, are written synchronously.");
+    param_declare_int(ps, "SnapshotCompressionLevel", OPTIONAL, 0, "zlib compression level (1-9) for the particle blocks of snapshots. 0 writes them uncompressed. Compressed blocks are read back transparently.");
+    param_declare_int(ps, "SnapshotQuantisePositions", OPTIONAL, 0, "If compressing snapshots, store positions as 32-bit fractions of the box. This is lossy, with an error of BoxSize / 2^33.");
+    param_declare_int(ps, "SnapshotLinkUnchangedBlocks", OPTIONAL, 0, "Hard link the uncompressed blocks of a snapshot which are unchanged since the previous snapshot, instead of writing them again. A block is unchanged only if every row is the same and in the same place: particles are reordered between snapshots, so in practice this links blocks with the same value for every particle, such as unused fields. When a block might match, its rows are hashed in an extra pass over the particles. Both snapshots must be on the same file system.");
+    param_declare_int(ps, "AdaptiveNumWriters", OPTIONAL, 0, "Time the large block writes and tune the number of writers (and so of files) between MinNumWriters and NumWriters for the best bandwidth. The choice is stored in the snapshot header and used on restart.");
+    param_declare_int(ps, "SnapshotPeanoIndex", OPTIONAL, 0, "Sort the particles of each processor by Peano-Hilbert cell when writing a snapshot, and write an index of the cells, so that parts of the box can be read on their own.");
+    param_declare_int(ps, "SnapshotReadTypes", OPTIONAL, 63, "Bit mask of the particle types to read from the snapshot (bit n for type n). Only for FOF and power spectrum runs.");
+    param_declare_string(ps, "SnapshotReadRegion", OPTIONAL, "", "Read only the particles near the box xmin,ymin,zmin,xmax,ymax,zmax, in internal units. Needs a snapshot written with SnapshotPeanoIndex. Only for FOF and power spectrum runs.");
+    param_declare_int(ps, "SnapshotReadMmap", OPTIONAL, 0, "Read snapshots by mapping the block files into memory, converting the data straight from the page cache into the particle table.");
+    param_declare_int(ps, "SnapshotReadAhead", OPTIONAL, 0, "Read the start of the next block of a snapshot in a background thread while the values of the current block are set on the particles. At most NumWriters ranks read, one for the ranks reading from each group of files, in chunks of at most AggregatedIOThreshold.");
 
     /*Parameters of the cooling module*/
     param_declare_int(ps, "CoolingOn", REQUIRED, 0, "Enables cooling");
@@ -186,7 +201,9 @@ create_gadget_parameter_set()
     param_declare_int(ps, "HydroOn", OPTIONAL, 1, "Enables hydro force");
     param_declare_int(ps, "DensityOn", OPTIONAL, 1, "Enables SPH density computation.");
     param_declare_int(ps, "DensityIndependentSphOn", REQUIRED, 1, "Enables density-independent (pressure-entropy) SPH.");
-    param_declare_int(ps, "LightconeOn", OPTIONAL, 0, "Enables a wildly experimental lightcone algorithm that writes particles crossing a lightcone boundary to a file. May not work!");
+    param_declare_int(ps, "LightconeOn", OPTIONAL, 0, "Enables an experimental lightcone algorithm that writes particles crossing a lightcone boundary to bigfiles in OutputDir/lightcone.");
+    param_declare_double(ps, "LightconeShellWidth", OPTIONAL, 100000, "Comoving thickness, in internal length units, of the shells of the lightcone. The crossings in each shell are written to their own files.");
+    param_declare_double(ps, "LightconeBufferMB", OPTIONAL, 64, "Memory per processor in MB for storing lightcone crossings between writes. The buffer is written when it is full, at a new shell and at each checkpoint.");
     param_declare_int(ps, "TreeGravOn", OPTIONAL, 1, "Enables tree gravity");
     param_declare_int(ps, "RadiationOn", OPTIONAL, 1, "Include radiation density in the background evolution.");
     param_declare_int(ps, "FastParticleType", OPTIONAL, 2, "Particles of this type will not decrease the long-range timestep. Default neutrinos.");
@@ -196,6 +213,8 @@ create_gadget_parameter_set()
     param_declare_int(ps, "GravitySofteningGas", OPTIONAL, 1, "Unused. Previously was for adaptive softening.");
 
     param_declare_int(ps, "ImportBufferBoost", OPTIONAL, 2, "Memory factor to allow for there being more particles imported during treewlk than exported. Increase this if code crashes during treewalk with out of memory.");
+    param_declare_int(ps, "TreeWalkCompressExports", OPTIONAL, 0, "If true, send exported treewalk queries with single precision positions relative to a top-level tree node. Only the position is compressed and results are sent unchanged, so this reduces the communication volume by 5-10%. Lossy: forces and densities change at the level of single precision rounding of the positions.");
+    param_declare_int(ps, "TreeWalkNgbGroupSize", OPTIONAL, 1, "Maximum number of nearby particles which share a single tree walk in the neighbour search of the primary treewalk. 1, the default, disables grouping. Results are the same with grouping.");
     param_declare_double(ps, "PartAllocFactor", OPTIONAL, 1.5, "Over-allocation factor of particles. The load can be imbalanced to allow for the work to be more balanced.");
     param_declare_double(ps, "TopNodeAllocFactor", OPTIONAL, 0.5, "Initial TopNode allocation as a fraction of maximum particle number.");
     param_declare_double(ps, "SlotsIncreaseFactor", OPTIONAL, 0.01, "Percentage factor to increase slot allocation by when requested.");
@@ -393,7 +412,7 @@ create_gadget_parameter_set()
  *  exactly once in the parameterfile, otherwise error messages are
  *  produced that complain about the missing parameters.
  */
-void read_parameter_file(char *fname, int * ShowBacktrace, double * MaxMemSizePerNode)
+void read_parameter_file(char *fname, int * ShowBacktrace, double * MaxMemSizePerNode, int * SharedMemoryTree, int * NUMAFirstTouch)
 {
     ParameterSet * ps = create_gadget_parameter_set();
 
@@ -414,6 +433,8 @@ void read_parameter_file(char *fname, int * ShowBacktrace, double * MaxMemSizePe
 
     *ShowBacktrace = param_get_int(ps, "ShowBacktrace");
     *MaxMemSizePerNode = param_get_double(ps, "MaxMemSizePerNode");
+    *SharedMemoryTree = param_get_int(ps, "SharedMemoryTree");
+    *NUMAFirstTouch = param_get_int(ps, "NUMAFirstTouch");
     if(*MaxMemSizePerNode <= 1) {
         *MaxMemSizePerNode *= get_physmem_bytes() / (1024. * 1024.);
     }
@@ -437,6 +458,7 @@ void read_parameter_file(char *fname, int * ShowBacktrace, double * MaxMemSizePe
     set_uvbg_params(ps);
     set_winds_params(ps);
     set_fof_params(ps);
+    set_lightcone_params(ps);
     set_blackhole_params(ps);
     set_metal_return_params(ps);
     set_stats_params(ps);
@@ -289,8 +289,12 @@ blackhole(const ActiveParticles * act, double atime, Cosmology * CP, ForceTree *
     priv->KEflag = mymalloc("KEflag", SlotsManager->info[5].size * sizeof(int));
 
     /* Need hmax for the symmetric BH merger treewalk*/
-    if(!tree->hmax_computed_flag)
-        force_tree_calc_moments(tree, ddecomp);
+    if(!tree->hmax_computed_flag) {
+        if(tree->hmax_propagated_flag)
+            force_exchange_hmax(tree, ddecomp);
+        else
+            force_tree_calc_moments(tree, ddecomp);
+    }
 
     walltime_measure("/BH/Init");
 
@@ -11,6 +11,7 @@
 #include "checkpoint.h"
 #include "walltime.h"
 #include "fof.h"
+#include "drift.h"
 
 #include "utils.h"
 
@@ -20,35 +21,76 @@
  *  This file delegates the functions to petaio and fof.
  */
 
+/* The snapshot being written in the background, added to Snapshots.txt when it is complete*/
+static struct {
+    int snapnum;
+    double Time;
+    const char * OutputDir;
+} PendingSnapshot;
+
+/* Record a complete snapshot, so that it can be used for a restart*/
+static void
+record_snapshot(int snapnum, double Time, const char * OutputDir)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        char * buf = fastpm_strdup_printf("%s/Snapshots.txt", OutputDir);
+        FILE * fd = fopen(buf, "a");
+        fprintf(fd, "%03d %g\n", snapnum, Time);
+        fclose(fd);
+        myfree(buf);
+    }
+}
+
 void
 write_checkpoint(int snapnum, int WriteGroupID, int MetalReturnOn, double Time, const Cosmology * CP, const char * OutputDir, const int OutputDebugFields)
 {
+    /* Only one snapshot is written at a time*/
+    finish_checkpoint();
+
     /* write snapshot of particles */
     struct IOTable IOTable = {0};
     register_io_blocks(&IOTable, WriteGroupID, MetalReturnOn);
     if(OutputDebugFields)
         register_debug_io_blocks(&IOTable);
+    /* Unchanged blocks may be linked to the last complete snapshot*/
+    int lastsnap = find_last_snapnum(OutputDir);
+    if(lastsnap >= 0 && lastsnap != snapnum)
+        IOTable.LinkSnapshot = petaio_get_snapshot_fname(lastsnap, OutputDir);
     char * fname = petaio_get_snapshot_fname(snapnum, OutputDir);
-    petaio_save_snapshot(fname, &IOTable, 1, Time, CP);
+    int pending = petaio_save_snapshot_async(fname, &IOTable, 1, Time, CP);
     myfree(fname);
+    if(IOTable.LinkSnapshot)
+        myfree(IOTable.LinkSnapshot);
 
     destroy_io_blocks(&IOTable);
     walltime_measure("/WriteSnapshot");
 
-    int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-    if(ThisTask == 0) {
-        char * buf = fastpm_strdup_printf("%s/Snapshots.txt", OutputDir);
-        FILE * fd = fopen(buf, "a");
-        fprintf(fd, "%03d %g\n", snapnum, Time);
-        fclose(fd);
-        myfree(buf);
+    if(pending) {
+        PendingSnapshot.snapnum = snapnum;
+        PendingSnapshot.Time = Time;
+        PendingSnapshot.OutputDir = OutputDir;
+    }
+    else
+        record_snapshot(snapnum, Time, OutputDir);
+}
+
+void
+finish_checkpoint(void)
+{
+    if(petaio_async_wait()) {
+        record_snapshot(PendingSnapshot.snapnum, PendingSnapshot.Time, PendingSnapshot.OutputDir);
+        walltime_measure("/WriteSnapshot");
     }
 }
 
 void
 dump_snapshot(const char * dump, const double Time, const Cosmology * CP, const char * OutputDir)
 {
+    finish_checkpoint();
+    /* Dumps happen in the middle of a step, when a lazy drift may have left inactive particles behind*/
+    drift_lagging_particles(PartManager, SlotsManager);
     struct IOTable IOTable = {0};
     register_io_blocks(&IOTable, 0, 1);
     register_debug_io_blocks(&IOTable);
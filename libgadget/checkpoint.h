@@ -4,6 +4,8 @@
 #include "cosmology.h"
 
 void write_checkpoint(int snapnum, int WriteGroupID, int MetalReturnOn, double Time, const Cosmology * CP, const char * OutputDir, const int OutputDebugFields);
+/* Complete the snapshot started by write_checkpoint, if it is still being written in the background. Collective.*/
+void finish_checkpoint(void);
 void dump_snapshot(const char * dump, const double Time, const Cosmology * CP, const char * OutputDir);
 int find_last_snapnum(const char * OutputDir);
 
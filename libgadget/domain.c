@@ -93,6 +93,8 @@ void set_domain_params(ParameterSet * ps)
             domain_params.DomainOverDecompositionFactor = 4;
         domain_params.TopNodeAllocFactor = param_get_double(ps, "TopNodeAllocFactor");
         domain_params.DomainUseGlobalSorting = param_get_int(ps, "DomainUseGlobalSorting");
+        domain_params.DomainRebalanceThreshold = param_get_double(ps, "DomainRebalanceThreshold");
+        domain_params.DomainUseNodeOrdering = param_get_int(ps, "DomainUseNodeOrdering");
         domain_params.SetAsideFactor = 1.;
     }
     MPI_Bcast(&domain_params, sizeof(DomainParams), MPI_BYTE, 0, MPI_COMM_WORLD);
@@ -136,6 +138,9 @@ domain_layoutfunc(int n, const void * userdata);
 static int
 domain_policies_init(DomainDecompositionPolicy policies[], const int Npolicies);
 
+/* Number of TopLeaves created by the last full domain decomposition*/
+static int FullNTopLeaves;
+
 /*! This is the main routine for the domain decomposition.  It acts as a
  *  driver routine that allocates various temporary buffers, maps the
  *  particles back onto the periodic box if needed, and then does the
@@ -219,6 +224,7 @@ void domain_decompose_full(DomainDecomp * ddecomp)
     if(decompose_failed) {
         endrun(0, "No suitable domain decomposition policy worked for this particle distribution\n");
     }
+    FullNTopLeaves = ddecomp->NTopLeaves;
 
 
     /*Do a garbage collection so that the slots are ordered
@@ -267,8 +273,14 @@ int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift)
     /* Can't update the random shift without re-decomposing domain*/
     const double rel_random_shift[3] = {0};
     double ddrift = 0;
-    if(drift)
+    /* Inactive DM is only needed on this step for the dynamic friction and repositioning tree.
+     * If it is not needed we may skip drifting it, recording the drift so it can be caught up later.*/
+    const int dmneeded = blackhole_dynfric_treemask() & DMMASK;
+    int lazy = 0;
+    if(drift) {
         ddrift = get_exact_drift_factor(drift->CP, drift->ti0, drift->ti1);
+        lazy = drift->lazy && !dmneeded && drift_history_push(drift->ti0, drift->ti1, ddrift);
+    }
 
     /*Garbage particles are counted so we have an accurate memory estimate*/
     int ngarbage = 0;
@@ -283,21 +295,27 @@ int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift)
         int * threx_local = gthread.srcs[tid];
     #pragma omp for schedule(static, gthread.schedsz) reduction(+: ngarbage)
     for(i=0; i < PartManager->NumPart; i++) {
-        if(drift) {
-            real_drift_particle(&PartManager->Base[i], SlotsManager, ddrift, PartManager->BoxSize, rel_random_shift);
-            PartManager->Base[i].Ti_drift = drift->ti1;
+        struct particle_data * pp = &PartManager->Base[i];
+        /* If we aren't using DM for the dynamic friction, we don't need to build a tree with inactive DM particles.
+         * Velocity dispersions are computed on a PM step only.*/
+        const int inactivedm = !dmneeded && pp->Type == 1 && !is_timebin_active(pp->TimeBinGravity, drift ? drift->ti1 : pp->Ti_drift);
+        if(drift && !(lazy && inactivedm && !pp->IsGarbage)) {
+            /* Drift from the last time this particle moved, which may be earlier than ti0 if it was skipped.
+             * If this drift was recorded the history already runs to ti1.*/
+            double pdrift = ddrift;
+            if(pp->Ti_drift != drift->ti0)
+                pdrift = drift_history_factor(pp->Ti_drift) + (lazy ? 0 : ddrift);
+            real_drift_particle(pp, SlotsManager, pdrift, PartManager->BoxSize, rel_random_shift);
+            pp->Ti_drift = drift->ti1;
         }
         /* Garbage is not in the tree*/
-        if(PartManager->Base[i].IsGarbage) {
+        if(pp->IsGarbage) {
             ngarbage++;
             continue;
         }
-        /* If we aren't using DM for the dynamic friction, we don't need to build a tree with inactive DM particles.
-         * Velocity dispersions are computed on a PM step only.
-         * In this case, keep the particles on this processor.*/
-        if(!(blackhole_dynfric_treemask() & DMMASK))
-            if(PartManager->Base[i].Type == 1 && !is_timebin_active(PartManager->Base[i].TimeBinGravity, PartManager->Base[i].Ti_drift))
-                continue;
+        /* Keep inactive DM particles on this processor.*/
+        if(inactivedm)
+            continue;
         if(!inside_topleaf(PartManager->Base[i].TopLeaf, PartManager->Base[i].Pos, &tree)) {
             const int no = domain_get_topleaf(PEANO(PartManager->Base[i].Pos, PartManager->BoxSize), ddecomp);
             /* Set the topleaf for layoutfunc.*/
@@ -312,6 +330,9 @@ int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift)
     gthread.sizes[tid] = nexthr_local;
     }
     force_tree_free(&tree);
+    /* Everything was drifted*/
+    if(drift && !lazy)
+        drift_history_reset(drift->ti1);
     PreExchangeList ExchangeData[1] = {0};
     ExchangeData->ngarbage = ngarbage;
     /*Merge step for the queue.*/
@@ -325,6 +346,222 @@ int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift)
     return errno;
 }
 
+/* State of the recursive copy of the top tree in domain_refine_topleaves*/
+struct refine_data {
+    const DomainDecomp * ddecomp;
+    const int64_t * predicted;
+    int64_t splitlimit;
+    int64_t mergelimit;
+    /* Number of merges still allowed before there are too few TopLeaves*/
+    int maxmerge;
+    struct topnode_data * NewTopNodes;
+    /* Measured cost of each new top node which is a leaf*/
+    int64_t * NewCost;
+    int next;
+    int nsplit;
+    int nmerge;
+};
+
+/* Copy top node oldno to newno, splitting or merging leaves*/
+static void
+domain_refine_copy(struct refine_data * rd, const int oldno, const int newno)
+{
+    const struct topnode_data * old = &rd->ddecomp->TopNodes[oldno];
+    const struct topleaf_data * TopLeaves = rd->ddecomp->TopLeaves;
+    struct topnode_data * nw = &rd->NewTopNodes[newno];
+    nw->StartKey = old->StartKey;
+    nw->Shift = old->Shift;
+    nw->Daughter = -1;
+    nw->Leaf = -1;
+    int j;
+    if(old->Daughter < 0) {
+        if(rd->predicted[old->Leaf] <= rd->splitlimit || old->Shift < 3) {
+            rd->NewCost[newno] = TopLeaves[old->Leaf].Cost;
+            return;
+        }
+        /* Split into 8 new leaves, sharing the measured cost*/
+        nw->Daughter = rd->next;
+        rd->next += 8;
+        for(j = 0; j < 8; j++) {
+            struct topnode_data * sub = &rd->NewTopNodes[nw->Daughter + j];
+            sub->Shift = nw->Shift - 3;
+            sub->StartKey = nw->StartKey + j * (((peano_t) 1) << sub->Shift);
+            sub->Daughter = -1;
+            sub->Leaf = -1;
+            rd->NewCost[nw->Daughter + j] = TopLeaves[old->Leaf].Cost / 8;
+        }
+        rd->nsplit++;
+        return;
+    }
+    /* Merge 8 leaves which together are predicted to be cheap*/
+    int64_t sumpredicted = 0, sumcost = 0;
+    for(j = 0; j < 8; j++) {
+        const struct topnode_data * sub = &rd->ddecomp->TopNodes[old->Daughter + j];
+        if(sub->Daughter >= 0)
+            break;
+        sumpredicted += rd->predicted[sub->Leaf];
+        sumcost += TopLeaves[sub->Leaf].Cost;
+    }
+    if(j == 8 && sumpredicted < rd->mergelimit && rd->nmerge < rd->maxmerge) {
+        rd->NewCost[newno] = sumcost;
+        rd->nmerge++;
+        return;
+    }
+    nw->Daughter = rd->next;
+    rd->next += 8;
+    for(j = 0; j < 8; j++)
+        domain_refine_copy(rd, old->Daughter + j, nw->Daughter + j);
+}
+
+/* Adapt the top tree to the cost predicted for each TopLeaf at the next decomposition.
+ * TopLeaves predicted to cost more than splitlimit are split into 8 new TopLeaves, as in domain_global_refine.
+ * Groups of 8 sibling TopLeaves predicted to cost less than mergelimit in total are merged into their parent,
+ * as long as at least minleaves TopLeaves remain.
+ * TopNodes and TopLeaves are reallocated; the new TopLeaves are in Peano order, with no Task assigned.
+ * Returns the number of TopLeaves which were split or merged. */
+static int
+domain_refine_topleaves(DomainDecomp * ddecomp, const int64_t * predicted, const int64_t splitlimit, const int64_t mergelimit, const int minleaves)
+{
+    int i, maxsplit = 0;
+    for(i = 0; i < ddecomp->NTopLeaves; i++)
+        if(predicted[i] > splitlimit && ddecomp->TopNodes[ddecomp->TopLeaves[i].topnode].Shift >= 3)
+            maxsplit++;
+
+    struct refine_data rd = {0};
+    rd.ddecomp = ddecomp;
+    rd.predicted = predicted;
+    rd.splitlimit = splitlimit;
+    rd.mergelimit = mergelimit;
+    /* Each merge removes 7 TopLeaves. Splits happen in the same pass, so do not count them.*/
+    rd.maxmerge = (ddecomp->NTopLeaves - minleaves) / 7;
+    const int MaxNodes = ddecomp->NTopNodes + 8 * maxsplit;
+    rd.NewTopNodes = (struct topnode_data *) mymalloc("NewTopNodes", sizeof(rd.NewTopNodes[0]) * MaxNodes);
+    rd.NewCost = (int64_t *) mymalloc("NewCost", sizeof(rd.NewCost[0]) * MaxNodes);
+    rd.next = 1;
+    domain_refine_copy(&rd, 0, 0);
+
+    if(rd.nsplit + rd.nmerge == 0) {
+        myfree(rd.NewCost);
+        myfree(rd.NewTopNodes);
+        return 0;
+    }
+
+    /* Replace the TopNodes and TopLeaves, freeing in the reverse order of allocation.*/
+    myfree(ddecomp->TopLeaves);
+    myfree(ddecomp->TopNodes);
+    ddecomp->NTopNodes = rd.next;
+    ddecomp->TopNodes = (struct topnode_data *) mymalloc2("TopNodes", sizeof(ddecomp->TopNodes[0]) * ddecomp->NTopNodes);
+    memcpy(ddecomp->TopNodes, rd.NewTopNodes, ddecomp->NTopNodes * sizeof(ddecomp->TopNodes[0]));
+    /* add 1 extra to mark the end of TopLeaves; see assign */
+    ddecomp->TopLeaves = (struct topleaf_data *) mymalloc2("TopLeaves", sizeof(ddecomp->TopLeaves[0]) * (ddecomp->NTopLeaves + 7 * (rd.nsplit - rd.nmerge) + 1));
+    ddecomp->NTopLeaves = 0;
+    domain_create_topleaves(ddecomp, 0, &ddecomp->NTopLeaves);
+    for(i = 0; i < ddecomp->NTopLeaves; i++)
+        ddecomp->TopLeaves[i].Cost = rd.NewCost[ddecomp->TopLeaves[i].topnode];
+    myfree(rd.NewCost);
+    myfree(rd.NewTopNodes);
+    message(0, "Refined top tree: split %d and merged %d groups of TopLeaves, now %d.\n", rd.nsplit, rd.nmerge, ddecomp->NTopLeaves);
+    return rd.nsplit + rd.nmerge;
+}
+
+/* Largest particle load on a single task, relative to the mean*/
+static double
+domain_load_imbalance(const DomainDecomp * ddecomp, const int64_t * TopLeafCount)
+{
+    int NTask, ta;
+    MPI_Comm_size(ddecomp->DomainComm, &NTask);
+    int64_t maxload = 0, sumload = 0;
+    for(ta = 0; ta < NTask; ta++) {
+        int64_t load = 0;
+        int i;
+        for(i = ddecomp->Tasks[ta].StartLeaf; i < ddecomp->Tasks[ta].EndLeaf; i++)
+            load += TopLeafCount[i];
+        sumload += load;
+        if(load > maxload)
+            maxload = load;
+    }
+    if(sumload == 0)
+        return 1;
+    return maxload / ((double) sumload / NTask);
+}
+
+/* Incremental version of domain_decompose_full, for PM steps. The top tree is kept.
+ * If the particle load is balanced to within DomainRebalanceThreshold, the TopLeaf assignment is also kept,
+ * so only particles which moved out of their domain are exchanged. Otherwise TopLeaves which are too
+ * expensive to balance are split and the domain boundaries are moved along the Peano curve
+ * to balance the load. Since each task owns a contiguous Peano segment, this moves only the particles
+ * in TopLeaves near the boundaries. */
+int domain_decompose_incremental(DomainDecomp * ddecomp)
+{
+    if(domain_params.DomainRebalanceThreshold <= 0 || !ddecomp->domain_allocated_flag)
+        return 1;
+    /* Repeated splits have made the top tree much larger than a fresh one would be.*/
+    if(ddecomp->NTopLeaves > 2 * FullNTopLeaves)
+        return 1;
+
+    int NTask;
+    MPI_Comm_size(ddecomp->DomainComm, &NTask);
+
+    int64_t * TopLeafCount = (int64_t *) mymalloc("TopLeafCount",  ddecomp->NTopLeaves * sizeof(TopLeafCount[0]));
+    /* Also sets P[i].TopLeaf*/
+    domain_compute_costs(ddecomp, NULL, TopLeafCount);
+
+    const double imbalance = domain_load_imbalance(ddecomp, TopLeafCount);
+    if(imbalance > domain_params.DomainRebalanceThreshold) {
+        int64_t totalcount = 0;
+        int i;
+        /* Predict the count at the next decomposition by extrapolating
+         * the growth since the last one. Leaves which are filling up are
+         * split before they become too expensive, and leaves which are emptying are merged.*/
+        int64_t * Predicted = (int64_t *) mymalloc("Predicted",  ddecomp->NTopLeaves * sizeof(Predicted[0]));
+        for(i = 0; i < ddecomp->NTopLeaves; i++) {
+            totalcount += TopLeafCount[i];
+            Predicted[i] = 2 * TopLeafCount[i] - ddecomp->TopLeaves[i].Cost;
+            if(Predicted[i] < 0)
+                Predicted[i] = 0;
+        }
+        /* The same cost limit as a full decomposition with the first policy.*/
+        const int64_t costlimit = totalcount / (domain_params.DomainOverDecompositionFactor * NTask);
+        /* Merge well below the split limit so that leaves do not oscillate.*/
+        const int nchanged = domain_refine_topleaves(ddecomp, Predicted, costlimit, costlimit / 4, domain_params.DomainOverDecompositionFactor * NTask);
+        myfree(Predicted);
+        if(nchanged > 0) {
+            myfree(TopLeafCount);
+            TopLeafCount = (int64_t *) mymalloc("TopLeafCount",  ddecomp->NTopLeaves * sizeof(TopLeafCount[0]));
+            domain_compute_costs(ddecomp, NULL, TopLeafCount);
+        }
+        domain_assign_balanced(ddecomp, TopLeafCount, 1);
+        message(0, "Rebalanced domain with load imbalance %g: %d TopLeaves. New imbalance %g.\n",
+                imbalance, ddecomp->NTopLeaves, domain_load_imbalance(ddecomp, TopLeafCount));
+    }
+    else {
+        message(0, "Keeping domain with load imbalance %g.\n", imbalance);
+        int i;
+        for(i = 0; i < ddecomp->NTopLeaves; i++)
+            ddecomp->TopLeaves[i].Cost = TopLeafCount[i];
+    }
+
+    int failed = domain_check_memory_bound(ddecomp, NULL, TopLeafCount);
+    myfree(TopLeafCount);
+    walltime_measure("/Domain/Decompose");
+    if(failed)
+        return 1;
+
+    if(domain_exchange(domain_layoutfunc, ddecomp, NULL, PartManager, SlotsManager, 10000, ddecomp->DomainComm)) {
+        message(0, "Could not exchange particles\n");
+        return 1;
+    }
+
+    /*Do a garbage collection so that the slots are ordered
+     *the same as the particles, garbage is at the end and all particles are in peano order.*/
+    slots_gc_sorted(PartManager, SlotsManager);
+
+    MPIU_Barrier(ddecomp->DomainComm);
+    message(0, "Incremental domain decomposition done.\n");
+    walltime_measure("/Domain/PeanoSort");
+    return 0;
+}
+
 /* this function generates several domain decomposition policies for attempting
  * creating the domain. */
 static int
@@ -569,14 +806,10 @@ topleaf_ext_order_by_task_and_key(const void * c1, const void * c2)
     return 0;
 }
 
-static int
-topleaf_ext_order_by_key(const void * c1, const void * c2)
+static void
+topleaf_ext_radix_key(const void * c1, void * radix, void * arg)
 {
-    const struct topleaf_extdata * p1 = (const struct topleaf_extdata *) c1;
-    const struct topleaf_extdata * p2 = (const struct topleaf_extdata *) c2;
-    if(p1->Key < p2->Key) return -1;
-    if(p1->Key > p2->Key) return 1;
-    return 0;
+    *(peano_t *) radix = ((const struct topleaf_extdata *) c1)->Key;
 }
 
 
@@ -589,7 +822,11 @@ topleaf_ext_order_by_key(const void * c1, const void * c2)
  * we are able to create Segments of roughly equal cost from the TopLeaves.
  *
  * This creates the index in Tasks[Task].StartLeaf and Tasks[Task].EndLeaf
- * cost is the cost per TopLeaves
+ * cost is the cost per TopLeaves. If the TopLeaves are renumbered, cost is renumbered with them.
+ *
+ * If DomainUseNodeOrdering is set, the consecutive Segments are handed out to ranks in node order
+ * rather than rank order, so that neighbouring Segments are on the same node even if ranks
+ * were placed on nodes round-robin. Most tree walk exports then stay inside the node.
  *
  * */
 static void
@@ -599,6 +836,16 @@ domain_assign_balanced(DomainDecomp * ddecomp, int64_t * cost, const int Nsegmen
     MPI_Comm_size(ddecomp->DomainComm, &NTask);
 
     int Nsegment = NTask * NsegmentPerTask;
+
+    /* The rank which receives the n-th group of Segments along the Peano curve.*/
+    int * TaskOrder = ta_malloc("TaskOrder", int, NTask);
+    if(domain_params.DomainUseNodeOrdering)
+        cluster_get_node_order(ddecomp->DomainComm, TaskOrder);
+    else {
+        int ta;
+        for(ta = 0; ta < NTask; ta++)
+            TaskOrder[ta] = ta;
+    }
     /* we work with TopLeafExt then replace TopLeaves*/
 
     struct topleaf_extdata * TopLeafExt;
@@ -619,7 +866,7 @@ domain_assign_balanced(DomainDecomp * ddecomp, int64_t * cost, const int Nsegmen
     /* make sure TopLeaves are sorted by Key for locality of segments -
      * likely not necessary be cause when this function
      * is called it is already true */
-    qsort_openmp(TopLeafExt, ddecomp->NTopLeaves, sizeof(TopLeafExt[0]), topleaf_ext_order_by_key);
+    radix_sort_openmp(TopLeafExt, ddecomp->NTopLeaves, sizeof(TopLeafExt[0]), topleaf_ext_radix_key, sizeof(peano_t), NULL);
 
     int64_t totalcost = 0;
     #pragma omp parallel for reduction(+ : totalcost)
@@ -673,7 +920,7 @@ domain_assign_balanced(DomainDecomp * ddecomp, int64_t * cost, const int Nsegmen
         if(append) {
             /* assign the leaf to the task */
             curload += TopLeafExt[curleaf].cost;
-            TopLeafExt[curleaf].Task = curtask;
+            TopLeafExt[curleaf].Task = TaskOrder[curtask];
             curleaf ++;
         }
 
@@ -725,13 +972,41 @@ domain_assign_balanced(DomainDecomp * ddecomp, int64_t * cost, const int Nsegmen
 
     /* lets rearrange the TopLeafExt by task, such that we can build the Tasks table */
     qsort_openmp(TopLeafExt, ddecomp->NTopLeaves, sizeof(TopLeafExt[0]), topleaf_ext_order_by_task_and_key);
+
+    /* With node ordering the Task order is not the Peano order, so the TopLeaves may be renumbered.
+     * Update the TopLeaf of each particle, set in domain_compute_costs and used by domain_layoutfunc.*/
+    int * NewLeaf = (int *) mymalloc("NewLeaf", ddecomp->NTopLeaves * sizeof(NewLeaf[0]));
+    int renumbered = 0;
+    for(i = 0; i < ddecomp->NTopLeaves; i ++) {
+        const int oldleaf = ddecomp->TopNodes[TopLeafExt[i].topnode].Leaf;
+        NewLeaf[oldleaf] = i;
+        if(oldleaf != i)
+            renumbered = 1;
+    }
+    if(renumbered) {
+        #pragma omp parallel for
+        for(i = 0; i < PartManager->NumPart; i++) {
+            if(!PartManager->Base[i].IsGarbage)
+                PartManager->Base[i].TopLeaf = NewLeaf[PartManager->Base[i].TopLeaf];
+        }
+        /* The callers check the memory bound and the imbalance with cost*/
+        int64_t * OldCost = (int64_t *) mymalloc("OldCost", ddecomp->NTopLeaves * sizeof(OldCost[0]));
+        memcpy(OldCost, cost, ddecomp->NTopLeaves * sizeof(OldCost[0]));
+        for(i = 0; i < ddecomp->NTopLeaves; i ++)
+            cost[NewLeaf[i]] = OldCost[i];
+        myfree(OldCost);
+    }
+    myfree(NewLeaf);
+
     for(i = 0; i < ddecomp->NTopLeaves; i ++) {
         ddecomp->TopNodes[TopLeafExt[i].topnode].Leaf = i;
         ddecomp->TopLeaves[i].Task = TopLeafExt[i].Task;
         ddecomp->TopLeaves[i].topnode = TopLeafExt[i].topnode;
+        ddecomp->TopLeaves[i].Cost = TopLeafExt[i].cost;
     }
 
     myfree(TopLeafExt);
+    ta_free(TaskOrder);
     /* here we reduce the number of code branches by adding an item to the end. */
     ddecomp->TopLeaves[ddecomp->NTopLeaves].Task = NTask;
     ddecomp->TopLeaves[ddecomp->NTopLeaves].topnode = -1;
@@ -940,20 +1215,6 @@ domain_toptree_truncate(
 }
 
 
-static int
-order_by_key(const void *a, const void *b)
-{
-    const struct local_particle_data * pa  = (const struct local_particle_data *) a;
-    const struct local_particle_data * pb  = (const struct local_particle_data *) b;
-    if(pa->Key < pb->Key)
-        return -1;
-
-    if(pa->Key > pb->Key)
-        return +1;
-
-    return 0;
-}
-
 static void
 mp_order_by_key(const void * data, void * radix, void * arg)
 {
@@ -1022,7 +1283,7 @@ domain_check_for_local_refine_subsample(
         }
 
         /* First sort to ensure spatially 'even' subsamples and remove garbage.*/
-        qsort_openmp(LPfull, PartManager->NumPart, sizeof(struct local_particle_data), order_by_key);
+        radix_sort_openmp(LPfull, PartManager->NumPart, sizeof(struct local_particle_data), mp_order_by_key, 8, NULL);
         Nsample = (PartManager->NumPart - garbage) / policy->SubSampleDistance;
         if(Nsample == 0 && PartManager->NumPart > garbage) Nsample = 1;
 
@@ -1049,7 +1310,7 @@ domain_check_for_local_refine_subsample(
     if(domain_params.DomainUseGlobalSorting) {
         mpsort_mpi(LP, Nsample, sizeof(struct local_particle_data), mp_order_by_key, 8, NULL, DomainComm);
     } else {
-        qsort_openmp(LP, Nsample, sizeof(struct local_particle_data), order_by_key);
+        radix_sort_openmp(LP, Nsample, sizeof(struct local_particle_data), mp_order_by_key, 8, NULL);
     }
 
     walltime_measure("/Domain/DetermineTopTree/Sort");
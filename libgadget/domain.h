@@ -21,6 +21,7 @@ struct topleaf_data {
     int Task;
     int topnode; /* used during domain_decompose for balancing the decomposition */
     int treenode; /* used during life span of the tree for looking up in the tree Nodes */
+    int64_t Cost; /* particle count at the last (full or incremental) decomposition, used to predict the growth of the leaf */
 };
 
 struct task_data {
@@ -55,6 +56,10 @@ typedef struct DomainParams
     double TopNodeAllocFactor;
     /** Fraction of local particle slots to leave free for, eg, star formation*/
     double SetAsideFactor;
+    /** Largest particle load (relative to the mean) at which an incremental decomposition keeps the existing domain. 0 disables incremental decomposition.*/
+    double DomainRebalanceThreshold;
+    /** Assign neighbouring Peano segments to ranks on the same node, rather than to consecutive ranks.*/
+    int DomainUseNodeOrdering;
 } DomainParams;
 
 /*Set the parameters of the domain module*/
@@ -66,6 +71,9 @@ void set_domain_par(DomainParams dp);
 void domain_decompose_full(DomainDecomp * ddecomp);
 /* Exchange particles which have moved into the new domains, not re-doing the split unless we have to*/
 int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift);
+/* Rebalance the existing domain if it has become imbalanced, keeping the top tree, and exchange the particles.
+ * Returns nonzero if a full domain decomposition is needed instead.*/
+int domain_decompose_incremental(DomainDecomp * ddecomp);
 
 /** This function determines the TopLeaves entry for the given key.*/
 static inline int
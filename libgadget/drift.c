@@ -84,6 +84,79 @@ void real_drift_particle(struct particle_data * pp, struct slots_manager_type *
     }
 }
 
+/* Maximum number of steps between synchronisations of all particles which can be recorded.
+ * Steps beyond this drift all particles.*/
+#define DRIFT_HISTORY_MAX 4096
+
+/* Step times since all particles were last synchronised, and the cumulative drift factor
+ * from the first of them. A particle skipped by a lazy drift has a Ti_drift which is one of these times.*/
+static struct {
+    inttime_t Ti[DRIFT_HISTORY_MAX];
+    double Factor[DRIFT_HISTORY_MAX];
+    int N;
+} DriftHistory;
+
+void
+drift_history_reset(inttime_t ti)
+{
+    DriftHistory.Ti[0] = ti;
+    DriftHistory.Factor[0] = 0;
+    DriftHistory.N = 1;
+}
+
+int
+drift_history_push(inttime_t ti0, inttime_t ti1, const double ddrift)
+{
+    /* No particles are behind, so start a new history*/
+    if(DriftHistory.N <= 1)
+        drift_history_reset(ti0);
+    if(DriftHistory.Ti[DriftHistory.N-1] != ti0)
+        endrun(12, "Drift from %ld but last drift was to %ld\n", ti0, DriftHistory.Ti[DriftHistory.N-1]);
+    if(DriftHistory.N >= DRIFT_HISTORY_MAX)
+        return 0;
+    DriftHistory.Ti[DriftHistory.N] = ti1;
+    DriftHistory.Factor[DriftHistory.N] = DriftHistory.Factor[DriftHistory.N-1] + ddrift;
+    DriftHistory.N++;
+    return 1;
+}
+
+double
+drift_history_factor(inttime_t ti0)
+{
+    /* Binary search for ti0: the times are increasing.*/
+    int left = 0, right = DriftHistory.N - 1;
+    while(right > left) {
+        int mid = (left + right) / 2;
+        if(DriftHistory.Ti[mid] < ti0)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+    if(DriftHistory.N == 0 || DriftHistory.Ti[left] != ti0)
+        endrun(10, "Drift time %ld is not a step since the last synchronisation at %ld\n", ti0, DriftHistory.N ? DriftHistory.Ti[0] : -1);
+    return DriftHistory.Factor[DriftHistory.N-1] - DriftHistory.Factor[left];
+}
+
+void
+drift_lagging_particles(struct part_manager_type * pman, struct slots_manager_type * sman)
+{
+    /* No particles can be behind*/
+    if(DriftHistory.N <= 1)
+        return;
+    const inttime_t ti1 = DriftHistory.Ti[DriftHistory.N-1];
+    const double zero_shift[3] = {0};
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < pman->NumPart; i++) {
+        if(pman->Base[i].Ti_drift == ti1)
+            continue;
+        real_drift_particle(&pman->Base[i], sman, drift_history_factor(pman->Base[i].Ti_drift), pman->BoxSize, zero_shift);
+        pman->Base[i].Ti_drift = ti1;
+    }
+    drift_history_reset(ti1);
+    walltime_measure("/Drift");
+}
+
 /* Update all particles to the current time, shifting them by a random vector.*/
 void drift_all_particles(inttime_t ti0, inttime_t ti1, Cosmology * CP, const double random_shift[3])
 {
@@ -92,16 +165,25 @@ void drift_all_particles(inttime_t ti0, inttime_t ti1, Cosmology * CP, const dou
         endrun(12, "Trying to reverse time: ti0=%ld ti1=%ld\n", ti0, ti1);
     }
     const double ddrift = get_exact_drift_factor(CP, ti0, ti1);
+    /* Are there particles left behind by a lazy drift?*/
+    const int lagging = DriftHistory.N > 1;
+    if(lagging && DriftHistory.Ti[DriftHistory.N-1] != ti0)
+        endrun(12, "Drift from %ld but last drift was to %ld\n", ti0, DriftHistory.Ti[DriftHistory.N-1]);
 
 #pragma omp parallel for
     for(i = 0; i < PartManager->NumPart; i++) {
+        double pdrift = ddrift;
+        /* Particles skipped by a lazy drift: add the drift since they were last moved.*/
+        if(lagging && PartManager->Base[i].Ti_drift != ti0)
+            pdrift += drift_history_factor(PartManager->Base[i].Ti_drift);
 #ifdef DEBUG
-        if(PartManager->Base[i].Ti_drift != ti0)
+        else if(PartManager->Base[i].Ti_drift != ti0)
             endrun(10, "Drift time mismatch: (ids = %ld %ld) %ld != %ld\n",PartManager->Base[0].ID, PartManager->Base[i].ID, ti0,  PartManager->Base[i].Ti_drift);
 #endif
-        real_drift_particle(&PartManager->Base[i], SlotsManager, ddrift, PartManager->BoxSize, random_shift);
+        real_drift_particle(&PartManager->Base[i], SlotsManager, pdrift, PartManager->BoxSize, random_shift);
         PartManager->Base[i].Ti_drift = ti1;
     }
+    drift_history_reset(ti1);
 
     walltime_measure("/Drift");
 }
@@ -5,7 +5,8 @@
 #include "partmanager.h"
 #include "slotsmanager.h"
 
-/* Updates all particles to the current drift time*/
+/* Updates all particles to the current drift time. Particles which were skipped by
+ * a lazy drift are brought up from their own Ti_drift.*/
 void drift_all_particles(inttime_t ti0, inttime_t ti1, Cosmology * CP, const double random_shift[3]);
 
 void real_drift_particle(struct particle_data * pp, struct slots_manager_type * sman, const double ddrift, const double BoxSize, const double random_shift[3]);
@@ -15,6 +16,23 @@ struct DriftData
     inttime_t ti0;
     inttime_t ti1;
     Cosmology * CP;
+    /* If true, particles which are not used on this step may be left at their old Ti_drift.*/
+    int lazy;
 };
 
+/* Record a drift of the particles needed on this step from ti0 to ti1,
+ * so that particles left behind can later be drifted exactly.
+ * Returns 0 if there is no space to record it, in which case all particles must be drifted.*/
+int drift_history_push(inttime_t ti0, inttime_t ti1, const double ddrift);
+
+/* Mark all particles as synchronised at ti, clearing the drift history.*/
+void drift_history_reset(inttime_t ti);
+
+/* Drift factor from ti0, a step time since all particles were last synchronised, to the last recorded step.*/
+double drift_history_factor(inttime_t ti0);
+
+/* Drift the particles left behind by a lazy drift to the last recorded step.
+ * Call this before using the positions of inactive particles on a step which does not drift all particles.*/
+void drift_lagging_particles(struct part_manager_type * pman, struct slots_manager_type * sman);
+
 #endif
@@ -19,6 +19,9 @@ typedef struct {
 
 static MPI_Datatype MPI_TYPE_PLAN_ENTRY = 0;
 
+/* Tag for the particle exchange messages*/
+#define EXCHANGE_TAG 101935
+
 /*Small struct to cache the layout function and particle data*/
 typedef struct {
     unsigned int ptype;
@@ -52,28 +55,9 @@ typedef struct {
 static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm);
 static void domain_build_plan(int iter, ExchangeLayoutFunc layoutfunc, const void * layout_userdata, ExchangePlan * plan, struct part_manager_type * pman, MPI_Comm Comm);
 static size_t domain_find_iter_space(ExchangePlan * plan, const struct part_manager_type * pman, const struct slots_manager_type * sman);
+static void domain_reserve_exchange_slots(ExchangePlan * plan, struct slots_manager_type * sman);
 static void domain_build_exchange_list(ExchangeLayoutFunc layoutfunc, const void * layout_userdata, ExchangePlan * plan, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm);
 
-/* This function builds the count/displ arrays from
- * the rows stored in the entry struct of the plan.
- * MPI expects these numbers to be tightly packed in memory,
- * but our struct stores them as different columns.
- *
- * Technically speaking, the operation is therefore a transpose.
- * */
-static void
-_transpose_plan_entries(ExchangePlanEntry * entries, int * count, int ptype, int NTask)
-{
-    int i;
-    for(i = 0; i < NTask; i ++) {
-        if(ptype == -1) {
-            count[i] = entries[i].base;
-        } else {
-            count[i] = entries[i].slots[ptype];
-        }
-    }
-}
-
 static ExchangePlan
 domain_init_exchangeplan(MPI_Comm Comm)
 {
@@ -143,6 +127,16 @@ int domain_exchange(ExchangeLayoutFunc layoutfunc, const void * layout_userdata,
         plan.last = domain_find_iter_space(&plan, pman, sman);
         domain_build_plan(iter, layoutfunc, layout_userdata, &plan, pman, Comm);
 
+        /* Reserving the slots may use some of the memory we planned to use for the send buffer.
+         * If so, redo the plan with fewer particles.*/
+        domain_reserve_exchange_slots(&plan, sman);
+        size_t last = domain_find_iter_space(&plan, pman, sman);
+        if(MPIU_Any(last < plan.last, Comm)) {
+            myfree(plan.layouts);
+            plan.last = last;
+            domain_build_plan(iter, layoutfunc, layout_userdata, &plan, pman, Comm);
+        }
+
         /* Do a GC if this isn't the last iteration.
          * The gc decision is made collective in domain_exchange_once,
          * and a gc will also be done if we have no space for particles.*/
@@ -193,64 +187,306 @@ shall_we_compact_slots(int * compact, ExchangePlan * plan, const struct slots_ma
     MPI_Allreduce(lcompact, compact, 6, MPI_INT, MPI_LOR, Comm);
 }
 
-static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm)
+/* Size in bytes of the particles and slots going to (or coming from) one task in the fused exchange message.*/
+static size_t
+_plan_entry_bytes(const ExchangePlanEntry * entry, const struct slots_manager_type * sman)
 {
-    size_t n;
     int ptype;
-    struct particle_data *partBuf;
-    char * slotBuf[6] = {NULL, NULL, NULL, NULL, NULL, NULL};
+    size_t bytes = entry->base * sizeof(struct particle_data);
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!sman->info[ptype].enabled) continue;
+        bytes += entry->slots[ptype] * sman->info[ptype].elsize;
+    }
+    return bytes;
+}
 
-    /* Check whether the domain exchange will succeed.
-     * Garbage particles will be collected after the particles are exported, so do not need to count.*/
-    int64_t needed = pman->NumPart + plan->toGetSum.base - plan->toGoSum.base  - plan->ngarbage;
-    if(needed > pman->MaxPart)
-        message(1,"Too many particles for exchange: NumPart=%ld count_get = %ld count_togo=%ld garbage = %ld MaxPart=%ld\n",
-                pman->NumPart, plan->toGetSum.base, plan->toGoSum.base, plan->ngarbage, pman->MaxPart);
-    if(MPIU_Any(needed > pman->MaxPart, Comm)) {
-        myfree(plan->layouts);
-        return 1;
+/* Reserve slots for the incoming particles before the exchange, so that the particles
+ * and slots from each task can be received in place in a single message. The slot
+ * counts include particles about to be exported, so this is enough whether or not we gc.*/
+static void
+domain_reserve_exchange_slots(ExchangePlan * plan, struct slots_manager_type * sman)
+{
+    int ptype;
+    int64_t newSlots[6] = {0};
+    for(ptype = 0; ptype < 6; ptype ++) {
+        if(!sman->info[ptype].enabled) continue;
+        newSlots[ptype] = sman->info[ptype].size + plan->toGetSum.slots[ptype];
     }
+    slots_reserve(1, newSlots, sman);
+}
+
+/* Find the position of each exported particle in the message to its target.
+ * Each thread counts its particles to each task, then a prefix sum over threads
+ * gives each thread the position of its first particle in each message.
+ * The returned array, of size NumThreads * NTask, is used by a loop over the
+ * exchange list with the same static schedule, so particles stay in ExchangeList order.*/
+static ExchangePlanEntry *
+domain_exchange_thread_offsets(ExchangePlan * plan)
+{
+    const int NumThreads = omp_get_max_threads();
+    ExchangePlanEntry * threadPtr = (ExchangePlanEntry *) mymalloc2("threadPtr", NumThreads * plan->NTask * sizeof(ExchangePlanEntry));
+    memset(threadPtr, 0, NumThreads * plan->NTask * sizeof(ExchangePlanEntry));
 
+    #pragma omp parallel
+    {
+        size_t n;
+        int tsk;
+        ExchangePlanEntry * toGoPtr = threadPtr + omp_get_thread_num() * plan->NTask;
+        #pragma omp for schedule(static)
+        for(n = 0; n < plan->last; n++) {
+            toGoPtr[plan->layouts[n].target].base++;
+            toGoPtr[plan->layouts[n].target].slots[plan->layouts[n].ptype]++;
+        }
+        #pragma omp for
+        for(tsk = 0; tsk < plan->NTask; tsk++) {
+            ExchangePlanEntry sum = {0};
+            int tid, pt;
+            for(tid = 0; tid < NumThreads; tid++) {
+                ExchangePlanEntry * entry = &threadPtr[tid * plan->NTask + tsk];
+                ExchangePlanEntry count = *entry;
+                *entry = sum;
+                sum.base += count.base;
+                for(pt = 0; pt < 6; pt++)
+                    sum.slots[pt] += count.slots[pt];
+            }
+        }
+    }
+    return threadPtr;
+}
+
+/* The datatype of the message to or from one task: the particles, then the slots of each enabled type,
+ * at the addresses base and slots[ptype]. The counts are in particles and slots rather than bytes,
+ * so that a message may be larger than 2GB.*/
+static MPI_Datatype
+domain_exchange_message_type(const ExchangePlanEntry * entry, char * base, char ** slots, struct slots_manager_type * sman)
+{
+    MPI_Datatype blocktypes[7];
+    int blocklens[7];
+    MPI_Aint displs[7];
+    int nblocks = 0, ptype;
+    MPI_Type_contiguous(sizeof(struct particle_data), MPI_BYTE, &blocktypes[nblocks]);
+    blocklens[nblocks] = entry->base;
+    MPI_Get_address(base, &displs[nblocks++]);
     for(ptype = 0; ptype < 6; ptype++) {
         if(!sman->info[ptype].enabled) continue;
-        slotBuf[ptype] = (char *) mymalloc2("SlotBuf", plan->toGoSum.slots[ptype] * sman->info[ptype].elsize);
+        MPI_Type_contiguous(sman->info[ptype].elsize, MPI_BYTE, &blocktypes[nblocks]);
+        blocklens[nblocks] = entry->slots[ptype];
+        MPI_Get_address(slots[ptype], &displs[nblocks++]);
     }
+    MPI_Datatype type;
+    MPI_Type_create_struct(nblocks, blocklens, displs, blocktypes, &type);
+    MPI_Type_commit(&type);
+    int k;
+    for(k = 0; k < nblocks; k++)
+        MPI_Type_free(&blocktypes[k]);
+    return type;
+}
 
-    partBuf = (struct particle_data *) mymalloc2("partBuf", plan->toGoSum.base * sizeof(struct particle_data));
+/* Copy the exported particles into a send buffer, with the particles and slots for each target together,
+ * and start sending. The particles are marked as garbage, so this is used when we need to gc before receiving.
+ * Returns the send buffer, which must be freed after the sends complete.*/
+static char *
+domain_exchange_send_packed(ExchangePlan * plan, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Request * requests, int * n_requests, MPI_Comm Comm)
+{
+    int ptype, task;
+    /* sendOffset[task] is the start of the message to task, slotOffset[task].slots[ptype]
+     * the start of the slots of each type within it.*/
+    size_t * sendOffset = ta_malloc("sendOffset", size_t, plan->NTask + 1);
+    ExchangePlanEntry * slotOffset = ta_malloc("slotOffset", ExchangePlanEntry, plan->NTask);
+    sendOffset[0] = 0;
+    for(task = 0; task < plan->NTask; task++) {
+        int64_t offset = plan->toGo[task].base * sizeof(struct particle_data);
+        for(ptype = 0; ptype < 6; ptype++) {
+            slotOffset[task].slots[ptype] = offset;
+            if(!sman->info[ptype].enabled) continue;
+            offset += plan->toGo[task].slots[ptype] * sman->info[ptype].elsize;
+        }
+        sendOffset[task + 1] = sendOffset[task] + offset;
+    }
 
-    ExchangePlanEntry * toGoPtr = ta_malloc("toGoPtr", ExchangePlanEntry, plan->NTask);
-    memset(toGoPtr, 0, sizeof(toGoPtr[0]) * plan->NTask);
+    char * sendBuf = (char *) mymalloc2("sendBuf", sendOffset[plan->NTask]);
+    ExchangePlanEntry * threadPtr = domain_exchange_thread_offsets(plan);
 
-    for(n = 0; n < plan->last; n++)
+    #pragma omp parallel
     {
-        const int i = plan->ExchangeList[n];
-        /* preparing for export */
-        const int target = plan->layouts[n].target;
+        size_t n;
+        ExchangePlanEntry * toGoPtr = threadPtr + omp_get_thread_num() * plan->NTask;
+        #pragma omp for schedule(static)
+        for(n = 0; n < plan->last; n++)
+        {
+            const int i = plan->ExchangeList[n];
+            /* preparing for export */
+            const int target = plan->layouts[n].target;
+            const int type = plan->layouts[n].ptype;
+            char * msg = sendBuf + sendOffset[target];
+
+            const size_t elsize = sman->info[type].elsize;
+            if(sman->info[type].enabled)
+                memcpy(msg + slotOffset[target].slots[type] + toGoPtr[target].slots[type] * elsize,
+                    (char*) sman->info[type].ptr + pman->Base[i].PI * elsize, elsize);
+            toGoPtr[target].slots[type]++;
+            /* now copy the base P; after PI has been updated */
+            memcpy(msg + toGoPtr[target].base * sizeof(struct particle_data), pman->Base+i, sizeof(struct particle_data));
+            toGoPtr[target].base++;
+            /* mark the particle for removal. Both secondary and base slots will be marked. */
+            slots_mark_garbage(i, pman, sman);
+        }
+    }
+    myfree(threadPtr);
+
+    for(task = 0; task < plan->NTask; task++) {
+        if(sendOffset[task + 1] == sendOffset[task]) continue;
+        char * msg = sendBuf + sendOffset[task];
+        char * slots[6];
+        for(ptype = 0; ptype < 6; ptype++)
+            slots[ptype] = msg + slotOffset[task].slots[ptype];
+        MPI_Datatype sendtype = domain_exchange_message_type(&plan->toGo[task], msg, slots, sman);
+        MPI_Isend(MPI_BOTTOM, 1, sendtype, task, EXCHANGE_TAG, Comm, &requests[(*n_requests)++]);
+        /* Freeing the type does not affect the pending send*/
+        MPI_Type_free(&sendtype);
+    }
+    myfree(slotOffset);
+    myfree(sendOffset);
+    return sendBuf;
+}
 
-        int type = plan->layouts[n].ptype;
+/* Start sending the exported particles directly from the particle and slot arrays,
+ * using one indexed datatype per target. The message has the same layout as
+ * the packed message. The particles must not be modified until the sends complete.*/
+static void
+domain_exchange_send_inplace(ExchangePlan * plan, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Request * requests, int * n_requests, MPI_Comm Comm)
+{
+    int ptype, task;
+    /* Offsets of the particles and slots from the start of their arrays, in the order they are sent.
+     * Slots are stored by type, then target, offset by typeStart. Offsets, rather than addresses
+     * from MPI_Get_address, since only the master thread may call MPI.*/
+    MPI_Aint * baseDispl = (MPI_Aint *) mymalloc2("baseDispl", plan->toGoSum.base * sizeof(MPI_Aint));
+    MPI_Aint * slotDispl = (MPI_Aint *) mymalloc2("slotDispl", plan->toGoSum.base * sizeof(MPI_Aint));
+    int64_t typeStart[6];
+    typeStart[0] = 0;
+    for(ptype = 1; ptype < 6; ptype++)
+        typeStart[ptype] = typeStart[ptype-1] + plan->toGoSum.slots[ptype-1];
+
+    ExchangePlanEntry * threadPtr = domain_exchange_thread_offsets(plan);
 
-        /* watch out thread unsafe */
-        int bufPI = toGoPtr[target].slots[type];
-        toGoPtr[target].slots[type] ++;
-        size_t elsize = sman->info[type].elsize;
-        if(sman->info[type].enabled)
-            memcpy(slotBuf[type] + (bufPI + plan->toGoOffset[target].slots[type]) * elsize,
-                (char*) sman->info[type].ptr + pman->Base[i].PI * elsize, elsize);
-        /* now copy the base P; after PI has been updated */
-        memcpy(&(partBuf[plan->toGoOffset[target].base + toGoPtr[target].base]), pman->Base+i, sizeof(struct particle_data));
-        toGoPtr[target].base ++;
-        /* mark the particle for removal. Both secondary and base slots will be marked. */
-        slots_mark_garbage(i, pman, sman);
+    #pragma omp parallel
+    {
+        size_t n;
+        ExchangePlanEntry * toGoPtr = threadPtr + omp_get_thread_num() * plan->NTask;
+        #pragma omp for schedule(static)
+        for(n = 0; n < plan->last; n++)
+        {
+            const int i = plan->ExchangeList[n];
+            const int target = plan->layouts[n].target;
+            const int type = plan->layouts[n].ptype;
+            if(sman->info[type].enabled)
+                slotDispl[typeStart[type] + plan->toGoOffset[target].slots[type] + toGoPtr[target].slots[type]] = pman->Base[i].PI * sman->info[type].elsize;
+            toGoPtr[target].slots[type]++;
+            baseDispl[plan->toGoOffset[target].base + toGoPtr[target].base] = i * sizeof(struct particle_data);
+            toGoPtr[target].base++;
+        }
     }
+    myfree(threadPtr);
+
+    /* Start of each array*/
+    MPI_Aint arrayStart[7];
+    MPI_Get_address(pman->Base, &arrayStart[0]);
+    for(ptype = 0; ptype < 6; ptype++)
+        MPI_Get_address(sman->info[ptype].ptr, &arrayStart[ptype + 1]);
+
+    for(task = 0; task < plan->NTask; task++) {
+        if(_plan_entry_bytes(&plan->toGo[task], sman) == 0) continue;
+        MPI_Datatype blocktypes[7];
+        int blocklens[7] = {1, 1, 1, 1, 1, 1, 1};
+        MPI_Aint blockdispls[7];
+        int nblocks = 0;
+        blockdispls[nblocks] = arrayStart[0];
+        MPI_Type_create_hindexed_block(plan->toGo[task].base, sizeof(struct particle_data),
+                baseDispl + plan->toGoOffset[task].base, MPI_BYTE, &blocktypes[nblocks++]);
+        for(ptype = 0; ptype < 6; ptype++) {
+            if(!sman->info[ptype].enabled) continue;
+            blockdispls[nblocks] = arrayStart[ptype + 1];
+            MPI_Type_create_hindexed_block(plan->toGo[task].slots[ptype], sman->info[ptype].elsize,
+                slotDispl + typeStart[ptype] + plan->toGoOffset[task].slots[ptype], MPI_BYTE, &blocktypes[nblocks++]);
+        }
+        MPI_Datatype sendtype;
+        MPI_Type_create_struct(nblocks, blocklens, blockdispls, blocktypes, &sendtype);
+        MPI_Type_commit(&sendtype);
+        MPI_Isend(MPI_BOTTOM, 1, sendtype, task, EXCHANGE_TAG, Comm, &requests[(*n_requests)++]);
+        /* Freeing the types does not affect the pending send*/
+        MPI_Type_free(&sendtype);
+        int k;
+        for(k = 0; k < nblocks; k++)
+            MPI_Type_free(&blocktypes[k]);
+    }
+    myfree(slotDispl);
+    myfree(baseDispl);
+}
 
-    myfree(plan->layouts);
-    ta_free(toGoPtr);
+/* After an in-place exchange, mark the exported particles as garbage and fill the holes
+ * they leave with particles from the end of the particle array (mostly the particles just received).
+ * This moves one particle per hole, instead of compacting the whole array with a gc.
+ * Slots are not moved. */
+static void
+domain_exchange_fill_holes(ExchangePlan * plan, struct part_manager_type * pman, struct slots_manager_type * sman)
+{
+    size_t n;
+    #pragma omp parallel for
+    for(n = 0; n < plan->last; n++)
+        slots_mark_garbage(plan->ExchangeList[n], pman, sman);
+
+    int64_t end = pman->NumPart;
+    for(n = 0; n < plan->last; n++) {
+        const int hole = plan->ExchangeList[n];
+        /* Find the last particle which is not garbage*/
+        while(end > 0 && pman->Base[end-1].IsGarbage)
+            end--;
+        /* Holes after the last particle are trimmed below*/
+        if(hole >= end - 1)
+            continue;
+        memcpy(&pman->Base[hole], &pman->Base[end-1], sizeof(struct particle_data));
+        pman->Base[end-1].IsGarbage = 1;
+        end--;
+    }
+    while(end > 0 && pman->Base[end-1].IsGarbage)
+        end--;
+    pman->NumPart = end;
+}
+
+static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm)
+{
+    int ptype, task;
+
+    /* Check whether the domain exchange will succeed.
+     * Garbage particles will be collected after the particles are exported, so do not need to count.*/
+    int64_t needed = pman->NumPart + plan->toGetSum.base - plan->toGoSum.base  - plan->ngarbage;
+    if(needed > pman->MaxPart)
+        message(1,"Too many particles for exchange: NumPart=%ld count_get = %ld count_togo=%ld garbage = %ld MaxPart=%ld\n",
+                pman->NumPart, plan->toGetSum.base, plan->toGoSum.base, plan->ngarbage, pman->MaxPart);
+    if(MPIU_Any(needed > pman->MaxPart, Comm)) {
+        myfree(plan->layouts);
+        return 1;
+    }
+
+    /* If every task has room at the end of the particle array for the incoming particles,
+     * send directly from the particle arrays. Otherwise copy the exported particles
+     * to a buffer so that we can gc before receiving. Each task receives at the end
+     * of its arrays in both cases, and the messages are the same, but the gc is collective.*/
+    const int inplace = !MPIU_Any(pman->NumPart + plan->toGetSum.base > pman->MaxPart, Comm);
+
+    MPI_Request * requests = (MPI_Request *) mymalloc2("requests", plan->NTask * 2 * sizeof(MPI_Request));
+    int n_requests = 0;
+    char * sendBuf = NULL;
+    /* Start sending now: the messages are in flight while we gc and set up the receives.*/
+    if(inplace)
+        domain_exchange_send_inplace(plan, pman, sman, requests, &n_requests, Comm);
+    else
+        sendBuf = domain_exchange_send_packed(plan, pman, sman, requests, &n_requests, Comm);
     walltime_measure("/Domain/exchange/makebuf");
 
-    /* Do a gc if we were asked to, or if we need one
-     * to have enough space for the incoming material*/
-    int shall_we_gc = do_gc || (pman->NumPart + plan->toGetSum.base > pman->MaxPart);
-    if(MPIU_Any(shall_we_gc, Comm)) {
+    /* Do a gc if we need one to have enough space for the incoming material.
+     * The in-place exchange does not need one, as its holes are filled afterwards.*/
+    if(!inplace) {
         /*Find which slots to gc*/
         int compact[6] = {0};
         shall_we_compact_slots(compact, plan, sman, Comm);
@@ -266,70 +502,53 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
     for(ptype = 0; ptype < 6; ptype ++) {
         if(!sman->info[ptype].enabled) continue;
         newSlots[ptype] = sman->info[ptype].size + plan->toGetSum.slots[ptype];
+        if(newSlots[ptype] > sman->info[ptype].maxsize)
+            endrun(787879, "Slots for type %d: %ld > reserved %ld\n", ptype, newSlots[ptype], sman->info[ptype].maxsize);
     }
 
     if(newNumPart > pman->MaxPart) {
         endrun(787878, "NumPart=%ld MaxPart=%ld\n", newNumPart, pman->MaxPart);
     }
 
-    int * sendcounts = (int*) ta_malloc("sendcounts", int, plan->NTask);
-    int * senddispls = (int*) ta_malloc("senddispls", int, plan->NTask);
-    int * recvcounts = (int*) ta_malloc("recvcounts", int, plan->NTask);
-    int * recvdispls = (int*) ta_malloc("recvdispls", int, plan->NTask);
-
-    _transpose_plan_entries(plan->toGo, sendcounts, -1, plan->NTask);
-    _transpose_plan_entries(plan->toGoOffset, senddispls, -1, plan->NTask);
-    _transpose_plan_entries(plan->toGet, recvcounts, -1, plan->NTask);
-    _transpose_plan_entries(plan->toGetOffset, recvdispls, -1, plan->NTask);
-
 #ifdef DEBUG
     message(0, "Starting particle data exchange\n");
 #endif
-    /* recv at the end */
-    MPI_Alltoallv_sparse(partBuf, sendcounts, senddispls, MPI_TYPE_PARTICLE,
-                 pman->Base + pman->NumPart, recvcounts, recvdispls, MPI_TYPE_PARTICLE,
-                 Comm);
-
-    /* Do not need Particle buffer any more, make space for more slots*/
-    myfree(partBuf);
-
-    slots_reserve(1, newSlots, sman);
-    /* Ensure the reservations are finished on all tasks before we start sending the data*/
-    MPI_Barrier(Comm);
-
-    for(ptype = 0; ptype < 6; ptype ++) {
-        /* skip unused slot types */
-        if(!sman->info[ptype].enabled) continue;
-
-        size_t elsize = sman->info[ptype].elsize;
-        int N_slots = sman->info[ptype].size;
-        char * ptr = sman->info[ptype].ptr;
-        _transpose_plan_entries(plan->toGo, sendcounts, ptype, plan->NTask);
-        _transpose_plan_entries(plan->toGoOffset, senddispls, ptype, plan->NTask);
-        _transpose_plan_entries(plan->toGet, recvcounts, ptype, plan->NTask);
-        _transpose_plan_entries(plan->toGetOffset, recvdispls, ptype, plan->NTask);
+    /* Receive the particles and slots from each task directly into place at the end
+     * of the particle and slot arrays, using an indexed datatype.*/
+    MPI_Datatype * recvtypes = (MPI_Datatype *) mymalloc2("recvtypes", plan->NTask * sizeof(MPI_Datatype));
+    for(task = 0; task < plan->NTask; task++) {
+        recvtypes[task] = MPI_DATATYPE_NULL;
+        if(_plan_entry_bytes(&plan->toGet[task], sman) == 0) continue;
+        char * slots[6];
+        for(ptype = 0; ptype < 6; ptype++)
+            slots[ptype] = sman->info[ptype].ptr + (sman->info[ptype].size + plan->toGetOffset[task].slots[ptype]) * sman->info[ptype].elsize;
+        recvtypes[task] = domain_exchange_message_type(&plan->toGet[task], (char *) (pman->Base + pman->NumPart + plan->toGetOffset[task].base), slots, sman);
+        MPI_Irecv(MPI_BOTTOM, 1, recvtypes[task], task, EXCHANGE_TAG, Comm, &requests[n_requests++]);
+    }
 
-#ifdef DEBUG
-        message(0, "Starting exchange for slot %d\n", ptype);
-#endif
+    MPI_Waitall(n_requests, requests, MPI_STATUSES_IGNORE);
 
-        /* recv at the end */
-        MPI_Alltoallv_sparse(slotBuf[ptype], sendcounts, senddispls, MPI_TYPE_SLOT[ptype],
-                     ptr + N_slots * elsize,
-                     recvcounts, recvdispls, MPI_TYPE_SLOT[ptype],
-                     Comm);
+    for(task = 0; task < plan->NTask; task++) {
+        if(recvtypes[task] != MPI_DATATYPE_NULL)
+            MPI_Type_free(&recvtypes[task]);
     }
+    myfree(recvtypes);
+    if(sendBuf)
+        myfree(sendBuf);
+    myfree(requests);
 
 #ifdef DEBUG
-        message(0, "Done with AlltoAllv\n");
+        message(0, "Done with exchange\n");
 #endif
     int src;
+    #pragma omp parallel for
     for(src = 0; src < plan->NTask; src++) {
         /* unpack each source rank */
         int64_t newPI[6];
         int64_t i;
-        for(ptype = 0; ptype < 6; ptype ++) {
-            newPI[ptype] = sman->info[ptype].size + plan->toGetOffset[src].slots[ptype];
+        int pt;
+        for(pt = 0; pt < 6; pt ++) {
+            newPI[pt] = sman->info[pt].size + plan->toGetOffset[src].slots[pt];
         }
 
         for(i = pman->NumPart + plan->toGetOffset[src].base;
@@ -352,10 +571,10 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
             }
 #endif
         }
-        for(ptype = 0; ptype < 6; ptype ++) {
-            if(newPI[ptype] !=
-                sman->info[ptype].size + plan->toGetOffset[src].slots[ptype]
-              + plan->toGet[src].slots[ptype]) {
+        for(pt = 0; pt < 6; pt ++) {
+            if(newPI[pt] !=
+                sman->info[pt].size + plan->toGetOffset[src].slots[pt]
+              + plan->toGet[src].slots[pt]) {
                 endrun(1, "N_slots mismatched\n");
             }
         }
@@ -363,15 +582,6 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
 
     walltime_measure("/Domain/exchange/alltoall");
 
-    myfree(recvdispls);
-    myfree(recvcounts);
-    myfree(senddispls);
-    myfree(sendcounts);
-    for(ptype = 5; ptype >=0; ptype --) {
-        if(!sman->info[ptype].enabled) continue;
-        myfree(slotBuf[ptype]);
-    }
-
     pman->NumPart = newNumPart;
 
     for(ptype = 0; ptype < 6; ptype++) {
@@ -379,6 +589,20 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
         sman->info[ptype].size = newSlots[ptype];
     }
 
+    if(inplace) {
+        domain_exchange_fill_holes(plan, pman, sman);
+        /* Compact the slots if we were asked to or they are getting full.*/
+        int compact[6] = {0};
+        shall_we_compact_slots(compact, plan, sman, Comm);
+        int any_compact = 0;
+        for(ptype = 0; ptype < 6; ptype++)
+            any_compact |= compact[ptype];
+        if(MPIU_Any(do_gc || any_compact, Comm))
+            slots_gc(compact, pman, sman);
+        walltime_measure("/Domain/exchange/garbage");
+    }
+    myfree(plan->layouts);
+
 #ifdef DEBUG
     domain_test_id_uniqueness(pman);
     slots_check_id_consistency(pman, sman);
@@ -435,14 +659,16 @@ domain_find_iter_space(ExchangePlan * plan, const struct part_manager_type * pma
     int ptype;
     size_t n, nlimit = mymalloc_freebytes();
 
-    if (nlimit <  4096L * 6 + plan->NTask * 2 * sizeof(MPI_Request))
+    /* Requests, receive datatypes and the per-thread pack offsets*/
+    const size_t commsize = plan->NTask * (2 * sizeof(MPI_Request) + sizeof(MPI_Datatype) + omp_get_max_threads() * sizeof(ExchangePlanEntry));
+    if (nlimit <  4096L * 6 + commsize)
         endrun(1, "Not enough memory free to store requests!\n");
 
-    nlimit -= 4096 * 2L + plan->NTask * 2 * sizeof(MPI_Request);
+    nlimit -= 4096 * 2L + commsize;
 
     /* Save some memory for memory headers and wasted space at the end of each allocation.
      * Need max. 2*4096 for each heap-allocated array.*/
-    nlimit -= 4096 * 4L;
+    nlimit -= 4096 * 8L;
 
     size_t maxsize = 0;
     for(ptype = 0; ptype < 6; ptype ++ ) {
@@ -493,7 +719,8 @@ domain_build_plan(int iter, ExchangeLayoutFunc layoutfunc, const void * layout_u
 
     memset(plan->toGo, 0, sizeof(plan->toGo[0]) * plan->NTask);
 
-    plan->layouts = (ExchangePartCache *) mymalloc("layoutcache",sizeof(ExchangePartCache) * plan->last);
+    /* Allocated high, so that the slots can be reserved after the plan is made.*/
+    plan->layouts = (ExchangePartCache *) mymalloc2("layoutcache",sizeof(ExchangePartCache) * plan->last);
 
     #pragma omp parallel for
     for(n = 0; n < plan->last; n++)
@@ -87,7 +87,7 @@ struct fof_particle_list
 };
 
 static void fof_label_secondary(struct fof_particle_list * HaloLabel, ForceTree * tree);
-static int fof_compare_HaloLabel_MinID(const void *a, const void *b);
+static void fof_radix_HaloLabel_MinID(const void * a, void * radix, void * arg);
 static int _fof_compare_Group_MinIDTask_ThisTask;
 static int fof_compare_Group_MinIDTask(const void *a, const void *b);
 static int fof_compare_Group_OriginalIndex(const void *a, const void *b);
@@ -175,7 +175,7 @@ fof_fof(DomainDecomp * ddecomp, const int StoreGrNr, MPI_Comm Comm)
     walltime_measure("/FOF/Secondary");
 
     /* sort HaloLabel according to MinID, because we need that for compiling catalogues */
-    qsort_openmp(HaloLabel, PartManager->NumPart, sizeof(struct fof_particle_list), fof_compare_HaloLabel_MinID);
+    radix_sort_openmp(HaloLabel, PartManager->NumPart, sizeof(struct fof_particle_list), fof_radix_HaloLabel_MinID, sizeof(MyIDType), NULL);
 
     int NgroupsExt = 0;
 
@@ -1138,13 +1138,13 @@ static void fof_assign_grnr(struct BaseGroup * base, const int NgroupsExt, MPI_C
             fof_radix_Group_OriginalTaskMinID, 16, NULL, Comm);
 }
 
-int
+void
 fof_save_groups(FOFGroups * fof, const char * OutputDir, const char * FOFFileBase, int num, Cosmology * CP, double atime, const double * MassTable, int MetalReturnOn, MPI_Comm Comm)
 {
     char * fname = fastpm_strdup_printf("%s/%s_%03d", OutputDir, FOFFileBase, num);
     message(0, "Saving particle groups into %s\n", fname);
 
-    return fof_save_particles(fof, fname, fof_params.FOFSaveParticles, CP, atime, MassTable, MetalReturnOn, Comm);
+    fof_save_particles(fof, fname, fof_params.FOFSaveParticles, CP, atime, MassTable, MetalReturnOn, Comm);
 }
 
 /* FIXME: these shall goto the private member of secondary tree walk */
@@ -1433,15 +1433,9 @@ void fof_seed(FOFGroups * fof, ActiveParticles * act, double atime, const RandTa
     walltime_measure("/FOF/Seeding");
 }
 
-static int fof_compare_HaloLabel_MinID(const void *a, const void *b)
+static void fof_radix_HaloLabel_MinID(const void * a, void * radix, void * arg)
 {
-    if(((struct fof_particle_list *) a)->MinID < ((struct fof_particle_list *) b)->MinID)
-        return -1;
-
-    if(((struct fof_particle_list *) a)->MinID > ((struct fof_particle_list *) b)->MinID)
-        return +1;
-
-    return 0;
+    *(MyIDType *) radix = ((struct fof_particle_list *) a)->MinID;
 }
 
 static int fof_compare_Group_MinID(const void *a, const void *b)
@@ -77,12 +77,11 @@ void fof_finish(FOFGroups * fof);
  * The active particle struct is used only because we may need to reallocate it. Randon number seeds the BH mass.*/
 void fof_seed(FOFGroups * fof, ActiveParticles * act, double atime, const RandTable * const rnd, MPI_Comm Comm);
 
-/* Saves the Group structure to disc.
- Returns 1 if a domain_exchange is needed afterwards.*/
-int fof_save_groups(FOFGroups * fof, const char * OutputDir, const char * FOFFileBase, int num, Cosmology * CP, double atime, const double * MassTable, int MetalReturnOn, MPI_Comm Comm);
+/* Saves the Group structure to disc.*/
+void fof_save_groups(FOFGroups * fof, const char * OutputDir, const char * FOFFileBase, int num, Cosmology * CP, double atime, const double * MassTable, int MetalReturnOn, MPI_Comm Comm);
 
-/* Does the actual saving of the particles
- Returns 1 if a domain_exchange is needed afterwards.*/
-int fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmology * CP, double atime, const double * MassTable, int MetalReturnOn, MPI_Comm Comm);
+/* Does the actual saving of the particles. The particles are written in place,
+ * ordered by group, without being moved between ranks.*/
+void fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmology * CP, double atime, const double * MassTable, int MetalReturnOn, MPI_Comm Comm);
 
 #endif
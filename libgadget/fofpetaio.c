@@ -13,15 +13,14 @@
 #include "partmanager.h"
 #include "slotsmanager.h"
 #include "petaio.h"
-#include "exchange.h"
 #include "fof.h"
 #include "walltime.h"
 
 static void fof_register_io_blocks(int MetalReturnOn, struct IOTable * IOTable);
 static void fof_write_header(BigFile * bf, int64_t TotNgroups, const double atime, const double * MassTable, Cosmology * CP, MPI_Comm Comm);
 static void build_buffer_fof(FOFGroups * fof, BigArray * array, IOTableEntry * ent, struct conversions * conv);
-/* Allocate a new halo structure and move particles there*/
-static int fof_distribute_particles(struct part_manager_type * halo_pman, struct slots_manager_type * halo_sman, int64_t NpigLocal, int64_t * atleast, MPI_Comm Comm);
+/* Find the rows of the grouped particles in the particle blocks*/
+static ptrdiff_t * fof_particle_runs(int * selection, const int64_t * ptype_offset, const int64_t * ptype_count, int64_t * run_offset, int64_t * nruns, const int64_t TotNgroups, MPI_Comm Comm);
 
 static void fof_radix_Group_GrNr(const void * a, void * radix, void * arg) {
     uint64_t * u = (uint64_t *) radix;
@@ -34,7 +33,7 @@ int fof_select_func(int i, const struct particle_data * Parts)
     return Parts[i].GrNr >= 0 && Parts[i].Swallowed == 0;
 }
 
-int fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmology * CP, double atime, const double * MassTable, int MetalReturnOn, MPI_Comm Comm) {
+void fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmology * CP, double atime, const double * MassTable, int MetalReturnOn, MPI_Comm Comm) {
     int i;
     struct IOTable FOFIOTable = {0};
 
@@ -71,56 +70,26 @@ int fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmolo
     destroy_io_blocks(&FOFIOTable);
     walltime_measure("/FOF/IO/WriteFOF");
 
-    /* Store whether we need a new domain_maintain after we return*/
-    int domain_needed = 0;
+    /* The particles are written from where they are, so no domain exchange is needed afterwards*/
     if(SaveParticles) {
         struct IOTable IOTable = {0};
         register_io_blocks(&IOTable, 1, MetalReturnOn);
-        struct part_manager_type * halo_pman = NULL;
-        struct slots_manager_type * halo_sman = NULL;
+
         int64_t NpigLocal = 0;
-        int64_t atleast[6]={0};
-        /* Count how many particles we have: array reductions are an openmp 4.5 feature.*/
-        #pragma omp parallel for reduction(+: NpigLocal, atleast[:6])
+        #pragma omp parallel for reduction(+: NpigLocal)
         for(i = 0; i < PartManager->NumPart; i ++) {
-            if(P[i].GrNr >= 0) {
+            if(fof_select_func(i, P))
                 NpigLocal++;
-                int type = P[i].Type;
-                /* How many of slot type?*/
-                if(type < 6 && type >= 0 && SlotsManager->info[type].enabled)
-                    atleast[type]++;
-            }
-        }
-
-        /* Find the fraction of particles in halos. If it is largeish,
-         * it is easiest to reuse the current particle table*/
-        int64_t NpigGlobal, NumPartGlobal;
-        MPI_Allreduce(&NpigLocal, &NpigGlobal, 1, MPI_INT64, MPI_SUM, Comm);
-        MPI_Allreduce(&PartManager->NumPart, &NumPartGlobal, 1, MPI_INT64, MPI_SUM, Comm);
-
-        struct part_manager_type npartman = {0};
-        struct slots_manager_type nslotman = {0};
-        if(NpigGlobal > 0.25 * NumPartGlobal) {
-            halo_pman = PartManager;
-            halo_sman = SlotsManager;
-            message(0, "Re-using partmanager for FOF: total pig %ld, global %ld\n", NpigGlobal, NumPartGlobal);
-            domain_needed = 1;
         }
-        else {
-            message(0, "Using new partmanager for FOF: total pig %ld, global %ld\n", NpigGlobal, NumPartGlobal);
-            halo_pman = &npartman;
-            halo_sman = &nslotman;
-        }
-        if(fof_distribute_particles(halo_pman, halo_sman, NpigLocal, atleast, Comm)) {
-            destroy_io_blocks(&IOTable);
-            return domain_needed;
-        }
-
-        int * selection = (int *) mymalloc("Selection", sizeof(int) * halo_pman->NumPart);
+        int * selection = (int *) mymalloc("Selection", sizeof(int) * NpigLocal);
 
         int64_t ptype_offset[6]={0};
         int64_t ptype_count[6]={0};
-        petaio_build_selection(selection, ptype_offset, ptype_count, halo_pman->Base, halo_pman->NumPart, fof_select_func);
+        petaio_build_selection(selection, ptype_offset, ptype_count, P, PartManager->NumPart, fof_select_func);
+
+        int64_t run_offset[6] = {0};
+        int64_t nruns[6] = {0};
+        ptrdiff_t * runs = fof_particle_runs(selection, ptype_offset, ptype_count, run_offset, nruns, fof->TotNgroups, Comm);
 
         walltime_measure("/FOF/IO/argind");
 
@@ -131,20 +100,16 @@ int fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmolo
             BigArray array = {0};
             if(ptype < 6 && ptype >= 0) {
                 sprintf(blockname, "%d/%s", ptype, IOTable.ent[i].name);
-                petaio_build_buffer(&array, &IOTable.ent[i], selection + ptype_offset[ptype], ptype_count[ptype], halo_pman->Base, halo_sman, &conv);
+                petaio_build_buffer(&array, &IOTable.ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager, &conv);
 
                 message(0, "Writing Block %s\n", blockname);
 
-                petaio_save_block(&bf, blockname, &array, 1);
+                petaio_save_block_runs(&bf, blockname, &array, runs + 2 * run_offset[ptype], nruns[ptype], 1);
                 petaio_destroy_buffer(&array);
             }
         }
+        myfree(runs);
         myfree(selection);
-        /* If we allocated new particle arrays, just free them*/
-        if(halo_pman != PartManager) {
-            myfree(halo_sman->Base);
-            myfree(halo_pman->Base);
-        }
         walltime_measure("/FOF/IO/WriteParticles");
         destroy_io_blocks(&IOTable);
     }
@@ -154,251 +119,184 @@ int fof_save_particles(FOFGroups * fof, char * fname, int SaveParticles, Cosmolo
     /* Done saving particles*/
     MPIU_Barrier(Comm);
     message(0, "Group catalogues saved.\n");
-    return domain_needed;
 }
 
-struct PartIndex {
-    uint64_t origin;
-    union {
-        int64_t sortKey;
-        int targetTask;
-    };
-};
-
-static int fof_sorted_layout(int i, const void * userdata) {
-    struct part_manager_type * halo_pman = (struct part_manager_type *) userdata;
-    /* Reuse the topleaf info to be a task. We will regenerate it with a domain_maintain afterwards.*/
-    return halo_pman->Base[i].TopLeaf;
+/* Sort key for grouped particles of one type: the group number*/
+static void
+fof_radix_grnr(const void * a, void * radix, void * arg)
+{
+    const struct particle_data * Parts = (const struct particle_data *) arg;
+    uint64_t * u = (uint64_t *) radix;
+    u[0] = Parts[*(const int *) a].GrNr;
 }
 
-static void fof_radix_sortkey(const void * c1, void * out, void * arg) {
-    uint64_t * u = (uint64_t *) out;
-    const struct PartIndex * pi = (const struct PartIndex *) c1;
-    *u = pi->sortKey;
-}
-static void fof_radix_origin(const void * c1, void * out, void * arg) {
-    uint64_t * u = (uint64_t *) out;
-    const struct PartIndex * pi = (const struct PartIndex *) c1;
-    *u = pi->origin;
-}
-#if 0
-/*Unused functions*/
-static int fof_select_particle(int i) {
-    return P[i].GrNr > 0;
-}
-static int fof_cmp_sortkey(const void * c1, const void * c2) {
-    const struct PartIndex * p1 = c1;
-    const struct PartIndex * p2 = c2;
-    return (p1->sortKey > p2->sortKey) - (p1->sortKey < p2->sortKey);
-}
-static int fof_cmp_origin(const void * c1, const void * c2) {
-    const struct PartIndex * p1 = c1;
-    const struct PartIndex * p2 = c2;
-    return (p1->origin > p2->origin) - (p1->origin < p2->origin);
-}
-#endif
+/* The particles of this rank in one group and of one type, sent to the rank owning the group number.
+ * The owner replies with the first row of these particles in the block, in GrNr.*/
+struct FOFRowRequest {
+    int64_t GrNr;
+    int64_t Type;
+    int64_t Count;
+};
 
-static int
-order_by_type_and_grnr(const void *a, const void *b)
+/* Group numbers 1 .. TotNgroups are divided evenly between ranks*/
+static int64_t
+fof_first_owned_grnr(const int task, const int64_t TotNgroups, const int NTask)
 {
-    const struct particle_data * pa  = (const struct particle_data *) a;
-    const struct particle_data * pb  = (const struct particle_data *) b;
-
-    if(pa->Type < pb->Type)
-        return -1;
-    if(pa->Type > pb->Type)
-        return +1;
-    if(pa->GrNr < pb->GrNr)
-        return -1;
-    if(pa->GrNr > pb->GrNr)
-        return +1;
-
-    return 0;
+    return task * TotNgroups / NTask + 1;
 }
 
-/* Build the target task structure by doing a double parallel sort */
-static void
-fof_find_target_task(struct PartIndex * pi, int64_t pi_size, const uint64_t task_origin_offset, MPI_Comm Comm)
+static int
+fof_grnr_owner(const int64_t GrNr, const int64_t TotNgroups, const int NTask)
 {
-    int64_t i;
-    int ThisTask;
-    MPI_Comm_rank(Comm, &ThisTask);
-
-    /* sort pi to decide targetTask */
-    mpsort_mpi(pi, pi_size, sizeof(struct PartIndex),
-            fof_radix_sortkey, 8, NULL, Comm);
-
-    #pragma omp parallel for
-    for(i = 0; i < pi_size; i ++) {
-        /* YU: let's see if we keep the FOF particle load on the processes, IO would be faster
-           (as at high z many ranks has no FOF), communication becomes sparse. */
-        pi[i].targetTask = ThisTask;
-    }
-    /* return pi to the original processors */
-    mpsort_mpi(pi, pi_size, sizeof(struct PartIndex), fof_radix_origin, 8, NULL, Comm);
-    /* Target task is copied into the particle table, unioned with Dthsml.
-     * This is a bit of a hack: probably the elegant thing to do is to unify slot
-     * and main structure, then mpsort the combination directly. */
-#ifdef DEBUG
-    int NTask;
-    MPI_Comm_size(Comm, &NTask);
-    #pragma omp parallel for
-    for(i = 0; i < pi_size; i ++) {
-        if(pi[i].targetTask >= NTask || pi[i].targetTask < 0)
-            endrun(23, "pi %ld is impossible %d of %d tasks\n",i,pi[i].targetTask, NTask);
-    }
-#endif
+    int task = (GrNr - 1) * NTask / TotNgroups;
+    while(task > 0 && fof_first_owned_grnr(task, TotNgroups, NTask) > GrNr)
+        task--;
+    while(task < NTask - 1 && fof_first_owned_grnr(task + 1, TotNgroups, NTask) <= GrNr)
+        task++;
+    return task;
 }
 
-static void
-fof_copy_target_task(struct part_manager_type * halo_pman, struct PartIndex * pi, const int64_t pi_size, const uint64_t task_origin_offset, MPI_Comm Comm)
+/* Find the rows of the particle blocks of the FOF file for the grouped particles on this rank.
+ * Each block stores the particles of one type in order of group number, and the particles of a group
+ * on lower ranks before those on higher ranks. The first row of each (group, type) on each rank is found
+ * by a prefix sum over the counts of particles, done on the rank which owns the group number.
+ * Only these counts are communicated: the particles stay where they are.
+ *
+ * On entry selection holds the particles to write, divided by type as given by ptype_offset and ptype_count.
+ * On return each type in selection is sorted by group number and the returned array holds
+ * nruns[ptype] (row, count) pairs for it, starting at pair run_offset[ptype], which
+ * give the rows for consecutive particles of selection. Free the returned array with myfree.*/
+static ptrdiff_t *
+fof_particle_runs(int * selection, const int64_t * ptype_offset, const int64_t * ptype_count, int64_t * run_offset, int64_t * nruns, const int64_t TotNgroups, MPI_Comm Comm)
 {
-    int64_t i = 0;
-#ifdef DEBUG
-    #pragma omp parallel for
-    for(i = 0; i < halo_pman->NumPart; i ++) {
-        halo_pman->Base[i].TopLeaf = -1;
-    }
-#endif
-    /* Ensure that particles outside groups do not move*/
-    int ThisTask;
+    int NTask, ThisTask;
+    MPI_Comm_size(Comm, &NTask);
     MPI_Comm_rank(Comm, &ThisTask);
-    #pragma omp parallel for
-    for(i = 0; i < halo_pman->NumPart; i ++) {
-        if(halo_pman->Base[i].GrNr < 0)
-            halo_pman->Base[i].TopLeaf = ThisTask;
-    }
-    #pragma omp parallel for
-    for(i = 0; i < pi_size; i ++) {
-        size_t index = pi[i].origin % task_origin_offset;
-        if(index >= (size_t) halo_pman->NumPart)
-            endrun(23, "entry %ld has index %lu (npiglocal %ld)\n", i, index, halo_pman->NumPart);
-        halo_pman->Base[index].TopLeaf = pi[i].targetTask;
-    }
 
-#ifdef DEBUG
-    #pragma omp parallel for
-    for(i = 0; i < halo_pman->NumPart; i ++) {
-        if(halo_pman->Base[i].TopLeaf < 0)
-            endrun(4, "TargetTask %ld not changed %d! neighbours: %d %d\n", i, halo_pman->Base[i].TopLeaf, halo_pman->Base[i-1].TopLeaf, halo_pman->Base[i+1].TopLeaf);
+    int64_t i, totruns = 0;
+    int ptype;
+    /* Sort each type by group and count the (group, type) runs*/
+    for(ptype = 0; ptype < 6; ptype++) {
+        int * sel = selection + ptype_offset[ptype];
+        radix_sort_openmp(sel, ptype_count[ptype], sizeof(int), fof_radix_grnr, sizeof(uint64_t), P);
+        run_offset[ptype] = totruns;
+        nruns[ptype] = 0;
+        for(i = 0; i < ptype_count[ptype]; i++)
+            if(i == 0 || P[sel[i]].GrNr != P[sel[i-1]].GrNr)
+                nruns[ptype]++;
+        totruns += nruns[ptype];
     }
-#endif
-    walltime_measure("/FOF/IO/Distribute");
-}
-
-static int
-fof_distribute_particles(struct part_manager_type * halo_pman, struct slots_manager_type * halo_sman, int64_t NpigLocal, int64_t * atleast, MPI_Comm Comm)
-{
-    int64_t i;
-    int64_t GrNrMaxGlobal = 0, GrNrMax = -1;   /* will mark particles that are not in any group */
-
-    int ThisTask;
-    MPI_Comm_rank(Comm, &ThisTask);
-    const uint64_t task_origin_offset = PartManager->MaxPart + 1Lu;
-
-    struct PartIndex * pi = (struct PartIndex *) mymalloc2("PartIndex", sizeof(struct PartIndex) * NpigLocal);
-    /* Build the index: unfortunately not parallel*/
-    NpigLocal = 0;
-    for(i = 0; i < PartManager->NumPart; i ++) {
-        if(P[i].GrNr >= 0) {
-            pi[NpigLocal].sortKey = PartManager->Base[i].GrNr;
-            /* This should be the index of the current particle in the particle_data struct.
-             * If we are re-using the PartManager, we need it to be the index in P.
-             * If we have a new struct, we will do a copy. */
-            if(halo_pman == PartManager)
-                pi[NpigLocal].origin = task_origin_offset * ((uint64_t) ThisTask) + i;
-            else
-                pi[NpigLocal].origin = task_origin_offset * ((uint64_t) ThisTask) + NpigLocal;
-            NpigLocal++;
-            if(P[i].GrNr > GrNrMax)
-                GrNrMax = P[i].GrNr;
+    ptrdiff_t * runs = (ptrdiff_t *) mymalloc("FOFRuns", sizeof(ptrdiff_t) * (2 * totruns + 1));
+
+    /* Requests for the first row of each run, ordered by the owning rank*/
+    int * Send_count = ta_malloc("Send_count", int, 2 * NTask);
+    int * Recv_count = Send_count + NTask;
+    memset(Send_count, 0, sizeof(int) * NTask);
+    int64_t * dest = (int64_t *) mymalloc2("FOFRowDest", sizeof(int64_t) * (totruns + 1));
+    int64_t r = 0;
+    for(ptype = 0; ptype < 6; ptype++) {
+        const int * sel = selection + ptype_offset[ptype];
+        for(i = 0; i < ptype_count[ptype]; i++) {
+            if(i == 0 || P[sel[i]].GrNr != P[sel[i-1]].GrNr) {
+                runs[2 * r] = P[sel[i]].GrNr;
+                runs[2 * r + 1] = 0;
+                dest[r] = fof_grnr_owner(P[sel[i]].GrNr, TotNgroups, NTask);
+                Send_count[dest[r]]++;
+                r++;
+            }
+            runs[2 * r - 1]++;
         }
     }
-    MPI_Allreduce(&GrNrMax, &GrNrMaxGlobal, 1, MPI_INT64, MPI_MAX, Comm);
-    message(0, "GrNrMax is %ld\n", GrNrMaxGlobal);
-
-    fof_find_target_task(pi, NpigLocal, task_origin_offset, Comm);
-    const double FOFPartAllocFactor = (double) PartManager->MaxPart / PartManager->NumPart;
-
-    /* Initialise the new halo structure*/
-    if(halo_pman != PartManager) {
-        halo_pman->MaxPart = NpigLocal * FOFPartAllocFactor;
-        struct particle_data * halopart = (struct particle_data *) mymalloc("HaloParticle", sizeof(struct particle_data) * halo_pman->MaxPart);
-        halo_pman->Base = halopart;
-        halo_pman->NumPart = NpigLocal;
-        halo_pman->BoxSize = PartManager->BoxSize;
-        memcpy(halo_pman->CurrentParticleOffset, PartManager->CurrentParticleOffset, 3 * sizeof(PartManager->CurrentParticleOffset[0]));
-    }
-
-    /* Now copy the TargetTask we constructed in pi into the new halo_pman*/
-    fof_copy_target_task(halo_pman, pi, NpigLocal, task_origin_offset, Comm);
-    /* Free pi so that we have space for slots*/
-    myfree(pi);
-
-    /* SlotsManager Needs initializing!*/
-    if(halo_sman != SlotsManager) {
-        /* We leave extra space in the hope that we can avoid compacting slots in the fof exchange*/
-        atleast[0] *= 1.05;
-        atleast[4]*= FOFPartAllocFactor;
-        atleast[5]*= FOFPartAllocFactor;
-
-        memcpy(halo_sman, SlotsManager, sizeof(struct slots_manager_type));
-
-        halo_sman->Base = NULL;
-        for(i = 0; i < 6; i ++) {
-            halo_sman->info[i].size = 0;
-            halo_sman->info[i].maxsize = 0;
+    int * Send_offset = ta_malloc("Send_offset", int, NTask);
+    int task;
+    Send_offset[0] = 0;
+    for(task = 1; task < NTask; task++)
+        Send_offset[task] = Send_offset[task - 1] + Send_count[task - 1];
+    struct FOFRowRequest * requests = (struct FOFRowRequest *) mymalloc2("FOFRowRequests", sizeof(struct FOFRowRequest) * (totruns + 1));
+    for(r = 0, ptype = 0; ptype < 6; ptype++) {
+        for(i = 0; i < nruns[ptype]; i++, r++) {
+            /* Store where the request went, so we can find the reply*/
+            int64_t k = Send_offset[dest[r]]++;
+            requests[k].GrNr = runs[2 * r];
+            requests[k].Type = ptype;
+            requests[k].Count = runs[2 * r + 1];
+            dest[r] = k;
         }
-        slots_reserve(0, atleast, halo_sman);
-
-        report_memory_usage("FOF_PetaIO");
-        NpigLocal = 0;
-
-        for(i = 0; i < PartManager->NumPart; i ++) {
-            if(P[i].GrNr < 0)
-                continue;
-            /* Store TargetTask as it will be over-written.
-            * We freed pi above so that we could overlap PI with the slots memory.*/
-            int TargetTask = halo_pman->Base[NpigLocal].TopLeaf;
-            memcpy(&halo_pman->Base[NpigLocal], &P[i], sizeof(P[i]));
-            halo_pman->Base[NpigLocal].TopLeaf = TargetTask;
-            struct slot_info * info = &(halo_sman->info[P[i].Type]);
-            char * oldslotptr = SlotsManager->info[P[i].Type].ptr;
-            if(info->enabled) {
-                memcpy(info->ptr + info->size * info->elsize, oldslotptr+P[i].PI * info->elsize, info->elsize);
-                halo_pman->Base[NpigLocal].PI = info->size;
-                info->size++;
-            }
-            NpigLocal ++;
-        }
-        if(NpigLocal != halo_pman->NumPart)
-            endrun(3, "Error in NpigLocal %ld != %ld!\n", NpigLocal, halo_pman->NumPart);
     }
-    /* Do a domain exchange. No pre-computed list here. Maybe a different particle table.*/
-    if(domain_exchange(fof_sorted_layout, halo_pman, NULL, halo_pman, halo_sman, 10000, Comm)) {
-        message(1930, "Failed to exchange and write particles for the FOF. This is non-fatal, continuing.\n");
-        if(halo_pman != PartManager) {
-            myfree(halo_sman->Base);
-            myfree(halo_pman->Base);
+    ta_free(Send_offset);
+
+    MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, Comm);
+    int64_t nimport = 0;
+    for(task = 0; task < NTask; task++)
+        nimport += Recv_count[task];
+
+    MPI_Datatype MPI_TYPE_REQUEST;
+    MPI_Type_contiguous(sizeof(struct FOFRowRequest), MPI_BYTE, &MPI_TYPE_REQUEST);
+    MPI_Type_commit(&MPI_TYPE_REQUEST);
+    struct FOFRowRequest * imports = (struct FOFRowRequest *) mymalloc2("FOFRowImports", sizeof(struct FOFRowRequest) * (nimport + 1));
+    MPI_Alltoallv_smart(requests, Send_count, NULL, MPI_TYPE_REQUEST,
+                        imports, Recv_count, NULL, MPI_TYPE_REQUEST, Comm);
+
+    /* Count the particles of each type in our groups, then find the first row of each group*/
+    const int64_t firstgrnr = fof_first_owned_grnr(ThisTask, TotNgroups, NTask);
+    const int64_t nowned = fof_first_owned_grnr(ThisTask + 1, TotNgroups, NTask) - firstgrnr;
+    int64_t * grouprow = (int64_t *) mymalloc2("FOFGroupRow", sizeof(int64_t) * (6 * nowned + 1));
+    memset(grouprow, 0, sizeof(int64_t) * 6 * nowned);
+    for(i = 0; i < nimport; i++) {
+        const int64_t g = imports[i].GrNr - firstgrnr;
+        if(g < 0 || g >= nowned)
+            endrun(5, "Request for group %ld, but this rank has groups %ld - %ld\n", imports[i].GrNr, firstgrnr, firstgrnr + nowned - 1);
+        grouprow[6 * g + imports[i].Type] += imports[i].Count;
+    }
+    int64_t localtotal[6] = {0}, rowstart[6] = {0};
+    for(i = 0; i < nowned; i++)
+        for(ptype = 0; ptype < 6; ptype++) {
+            const int64_t count = grouprow[6 * i + ptype];
+            grouprow[6 * i + ptype] = localtotal[ptype];
+            localtotal[ptype] += count;
         }
-        return 1;
+    /* Rows of the groups owned by lower ranks come first*/
+    MPI_Exscan(localtotal, rowstart, 6, MPI_INT64, MPI_SUM, Comm);
+    if(ThisTask == 0)
+        memset(rowstart, 0, sizeof(rowstart));
+    /* The imports are ordered by the sending rank, so lower ranks get the earlier rows of each group*/
+    for(i = 0; i < nimport; i++) {
+        int64_t * row = &grouprow[6 * (imports[i].GrNr - firstgrnr) + imports[i].Type];
+        const int64_t count = imports[i].Count;
+        imports[i].Count = rowstart[imports[i].Type] + *row;
+        *row += count;
     }
-
-    /* Sort locally by group number*/
-    qsort_openmp(halo_pman->Base, halo_pman->NumPart, sizeof(struct particle_data), order_by_type_and_grnr);
-#ifdef DEBUG
-    GrNrMax = -1;
-    int64_t GrNrMaxGlobalAfter = -1;
-    #pragma omp parallel for reduction(max: GrNrMax)
-    for(i = 0; i < halo_pman->NumPart; i ++) {
-        if(halo_pman->Base[i].GrNr > GrNrMax)
-            GrNrMax = halo_pman->Base[i].GrNr;
+    myfree(grouprow);
+
+    /* Send the rows back*/
+    MPI_Alltoallv_smart(imports, Recv_count, NULL, MPI_TYPE_REQUEST,
+                        requests, Send_count, NULL, MPI_TYPE_REQUEST, Comm);
+    MPI_Type_free(&MPI_TYPE_REQUEST);
+    myfree(imports);
+    for(r = 0; r < totruns; r++)
+        runs[2 * r] = requests[dest[r]].Count;
+    myfree(requests);
+    myfree(dest);
+    ta_free(Send_count);
+
+    /* Merge runs which are adjacent in the block*/
+    int64_t nmerged = 0;
+    for(ptype = 0; ptype < 6; ptype++) {
+        const int64_t start = run_offset[ptype], n = nruns[ptype];
+        run_offset[ptype] = nmerged;
+        for(i = 0; i < n; i++) {
+            const ptrdiff_t row = runs[2 * (start + i)], count = runs[2 * (start + i) + 1];
+            if(nmerged > run_offset[ptype] && runs[2 * nmerged - 2] + runs[2 * nmerged - 1] == row)
+                runs[2 * nmerged - 1] += count;
+            else {
+                runs[2 * nmerged] = row;
+                runs[2 * nmerged + 1] = count;
+                nmerged++;
+            }
+        }
+        nruns[ptype] = nmerged - run_offset[ptype];
     }
-    MPI_Allreduce(&GrNrMax, &GrNrMaxGlobalAfter, 1, MPI_INT64, MPI_MAX, Comm);
-    if(GrNrMaxGlobalAfter != GrNrMaxGlobal)
-        endrun(2, "GrNrMax after exchange is %ld, before was %ld\n", GrNrMaxGlobalAfter, GrNrMaxGlobal);
-#endif
-    return 0;
+    return runs;
 }
 
 static void build_buffer_fof(FOFGroups * fof, BigArray * array, IOTableEntry * ent, struct conversions * conv) {
@@ -61,6 +61,9 @@ force_exchange_pseudodata(const ForceTree * const tree, const DomainDecomp * con
 static void
 add_particle_moment_to_node(struct NODE * pnode, const struct particle_data * const part);
 
+static void
+force_tree_propagate_leaf_hmax(ForceTree * tree, const ActiveParticles * act);
+
 #ifdef DEBUG
 /* Walk the constructed tree, validating sibling and nextnode as we go*/
 static void force_validate_nextlist(const ForceTree * tree)
@@ -183,6 +186,7 @@ force_tree_calc_moments(ForceTree * tree, DomainDecomp * ddecomp)
     }
     tree->moments_computed_flag = 1;
     tree->hmax_computed_flag = 1;
+    tree->hmax_propagated_flag = 1;
 }
 
 /*! Constructs the gravitational oct-tree.
@@ -258,6 +262,10 @@ force_tree_build(int mask, DomainDecomp * ddecomp, const ActiveParticles *act, c
         force_tree_calc_moments(&tree, ddecomp);
         walltime_measure("/Tree/Build/Moments");
     }
+    /* If we will need hmax, set up the tree so that only changed smoothing lengths
+     * need to be propagated. */
+    else if(tree.Father && (mask & (GASMASK | BHMASK)))
+        force_tree_propagate_leaf_hmax(&tree, act);
 
     int64_t allact = tree.NumParticles;
     int maxnumnodes = tree.numnodes;
@@ -311,6 +319,7 @@ static void init_internal_node(struct NODE *nfreep, struct NODE *parent, int sub
     nfreep->f.InternalTopLevel = 0;
     nfreep->f.DependsOnLocalMass = 0;
     nfreep->f.ChildType = PARTICLE_NODE_TYPE;
+    nfreep->f.HmaxDirty = 0;
     nfreep->f.unused = 0;
 
     for(j = 0; j < 3; j++) {
@@ -672,6 +681,7 @@ force_tree_create_topnodes(ForceTree * tree, DomainDecomp * ddecomp)
     nfreep->f.InternalTopLevel = 0;
     nfreep->f.DependsOnLocalMass = 0;
     nfreep->f.ChildType = PARTICLE_NODE_TYPE;
+    nfreep->f.HmaxDirty = 0;
     nfreep->f.unused = 0;
     memset(&(nfreep->mom.cofm),0,3*sizeof(MyFloat));
     nfreep->mom.mass = 0;
@@ -727,6 +737,8 @@ void
 force_tree_create_nodes(ForceTree * tree, const ActiveParticles * act, int mask, DomainDecomp * ddecomp)
 {
     int nnext = force_tree_create_topnodes(tree, ddecomp);
+    /* Only the hmax of the particle-containing nodes is set as particles are added*/
+    tree->hmax_propagated_flag = 0;
 
     /* Set up thread-local copies of the topnodes to anchor the subtrees. */
     int ThisTask, j, t;
@@ -1279,6 +1291,62 @@ force_treeupdate_pseudos(const int no, const int level, const ForceTree * const
     }
 }
 
+/* Raise the hmax of a node to at least newhmax, thread-safely. Returns 1 if the hmax changed.*/
+static int
+force_raise_hmax(struct NODE * node, MyFloat newhmax)
+{
+    MyFloat readhmax;
+    #pragma omp atomic read
+    readhmax = node->mom.hmax;
+
+    do {
+        if (newhmax <= readhmax)
+            return 0;
+        /* Swap in the new hmax only if the old one hasn't changed. */
+    } while(!__atomic_compare_exchange(&(node->mom.hmax), &readhmax, &newhmax, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/* Node no has just had its hmax raised to hmax: raise the hmax of its parents to match.
+ * Every node has an hmax at least as large as its children, so we can stop at the first parent
+ * which is already large enough. The top-level tree is shared between ranks, so we stop at
+ * the local top-level leaf and flag it for force_exchange_hmax. */
+static void
+force_propagate_hmax(const ForceTree * const tree, int no, const MyFloat hmax)
+{
+    while(!tree->Nodes[no].f.TopLevel) {
+        no = tree->Nodes[no].father;
+        if(!force_raise_hmax(&tree->Nodes[no], hmax))
+            return;
+    }
+    tree->Nodes[no].f.HmaxDirty = 1;
+}
+
+/* Propagate the hmax of each local particle-containing node to its parents.
+ * After the build this is set only from the inactive particles directly in the node, and all other nodes have zero hmax.
+ * Afterwards changed smoothing lengths can be propagated incrementally by update_tree_hmax_father.
+ * The particles in act should be those used to build the tree.*/
+static void
+force_tree_propagate_leaf_hmax(ForceTree * tree, const ActiveParticles * act)
+{
+    int64_t j;
+    #pragma omp parallel for
+    for(j = 0; j < act->NumActiveParticle; j++) {
+        const int i = act->ActiveParticle ? act->ActiveParticle[j] : j;
+        /* Same selection as in force_tree_create_nodes*/
+        if(!((1<<P[i].Type) & tree->mask) || P[i].IsGarbage || (P[i].Swallowed && P[i].Type==5))
+            continue;
+        const int no = tree->Father[i];
+        /* Propagate each node once, from its first particle*/
+        if(tree->Nodes[no].s.suns[0] != i)
+            continue;
+        const MyFloat hmax = tree->Nodes[no].mom.hmax;
+        if(hmax > 0)
+            force_propagate_hmax(tree, no, hmax);
+    }
+    tree->hmax_propagated_flag = 1;
+}
+
 /* Update the hmax in the parent node of the particle p_i*/
 void
 update_tree_hmax_father(const ForceTree * const tree, const int p_i, const double Pos[3], const double Hsml)
@@ -1299,20 +1367,78 @@ update_tree_hmax_father(const ForceTree * const tree, const int p_i, const doubl
     for(j = 0; j < 3; j++)
         newhmax = DMAX(newhmax, fabs(Pos[j] - node->center[j]) + Hsml - node->len/2.);
 
-    MyFloat readhmax;
-    #pragma omp atomic read
-    readhmax = node->mom.hmax;
+    /* The particle pokes out of its parents by less than it pokes out of its node,
+     * so raising them to the same hmax is conservative.*/
+    if(force_raise_hmax(node, newhmax) && tree->hmax_propagated_flag)
+        force_propagate_hmax(tree, no, newhmax);
+}
 
-    do {
-        if (newhmax <= readhmax)
-            break;
-        /* Swap in the new hmax only if the old one hasn't changed. */
-    } while(!__atomic_compare_exchange(&(node->mom.hmax), &readhmax, &newhmax, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+struct topleaf_hmaxdata
+{
+    int topleaf;
+    MyFloat hmax;
+};
+
+void
+force_exchange_hmax(ForceTree * tree, const DomainDecomp * ddecomp)
+{
+    if(!tree->hmax_propagated_flag)
+        endrun(5, "Incremental hmax exchange on a tree without propagated hmax\n");
+
+    int NTask, i;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    const int StartLeaf = ddecomp->Tasks[tree->ThisTask].StartLeaf;
+    const int EndLeaf = ddecomp->Tasks[tree->ThisTask].EndLeaf;
+
+    /* Collect the local top-level leaves which changed*/
+    struct topleaf_hmaxdata * dirty = (struct topleaf_hmaxdata *) mymalloc("DirtyTopLeaves", (EndLeaf - StartLeaf + 1) * sizeof(dirty[0]));
+    int ndirty = 0;
+    for(i = StartLeaf; i < EndLeaf; i++) {
+        struct NODE * node = &tree->Nodes[ddecomp->TopLeaves[i].treenode];
+        if(!node->f.HmaxDirty)
+            continue;
+        node->f.HmaxDirty = 0;
+        dirty[ndirty].topleaf = i;
+        dirty[ndirty].hmax = node->mom.hmax;
+        ndirty++;
+    }
+
+    int * recvcounts = (int *) mymalloc("recvcounts", sizeof(int) * NTask);
+    int * recvoffset = (int *) mymalloc("recvoffset", sizeof(int) * NTask);
+    MPI_Allgather(&ndirty, 1, MPI_INT, recvcounts, 1, MPI_INT, MPI_COMM_WORLD);
+    int64_t ntotal = 0;
+    for(i = 0; i < NTask; i++) {
+        recvoffset[i] = ntotal * sizeof(dirty[0]);
+        ntotal += recvcounts[i];
+        recvcounts[i] *= sizeof(dirty[0]);
+    }
+
+    struct topleaf_hmaxdata * alldirty = (struct topleaf_hmaxdata *) mymalloc("AllDirtyTopLeaves", (ntotal + 1) * sizeof(dirty[0]));
+    MPI_Allgatherv(dirty, ndirty * sizeof(dirty[0]), MPI_BYTE, alldirty, recvcounts, recvoffset, MPI_BYTE, MPI_COMM_WORLD);
+
+    /* Update the pseudo-particles and the top-level tree above them. All ranks do the same updates
+     * in the same order, so the top-level tree stays identical.*/
+    for(i = 0; i < ntotal; i++) {
+        int no = ddecomp->TopLeaves[alldirty[i].topleaf].treenode;
+        const MyFloat hmax = alldirty[i].hmax;
+        if(tree->Nodes[no].mom.hmax < hmax)
+            tree->Nodes[no].mom.hmax = hmax;
+        for(no = tree->Nodes[no].father; no >= 0; no = tree->Nodes[no].father) {
+            if(tree->Nodes[no].mom.hmax >= hmax)
+                break;
+            tree->Nodes[no].mom.hmax = hmax;
+        }
+    }
+    myfree(alldirty);
+    myfree(recvoffset);
+    myfree(recvcounts);
+    myfree(dirty);
+    tree->hmax_computed_flag = 1;
 }
 
 /*! This function updates the hmax-values in tree nodes that hold SPH
- *  particles. This is no longer called. The density() code updates hmax for the parent node
- *  of each active particle.
+ *  particles. The density() code updates hmax for each active particle as it goes, so
+ *  in the main loop only force_exchange_hmax is needed.
  *
  *  The purpose of the hmax node is for a symmetric treewalk (currently only the hydro).
  *  Particles where P[i].Pos + Hsml pokes beyond the exterior of the tree node may mean
@@ -1333,7 +1459,13 @@ void force_update_hmax(ActiveParticles * act, ForceTree * tree, DomainDecomp * d
     if(tree->mask & BHMASK)
         tree_has_bh = 1;
 
-    /* Adjust the base particle containing nodes*/
+    if(!tree->hmax_propagated_flag) {
+        /* All particles, which were used to build the tree*/
+        ActiveParticles all = init_empty_active_particles(PartManager);
+        force_tree_propagate_leaf_hmax(tree, &all);
+    }
+
+    /* Adjust the base particle containing nodes and their parents*/
     #pragma omp parallel for
     for(i = 0; i < act->NumActiveParticle; i++)
     {
@@ -1349,8 +1481,8 @@ void force_update_hmax(ActiveParticles * act, ForceTree * tree, DomainDecomp * d
         update_tree_hmax_father(tree, p_i, pp->Pos, pp->Hsml);
     }
 
-    /* Calculate moments to propagate everything upwards. */
-    force_tree_calc_moments(tree, ddecomp);
+    /* Propagate the changes through the top-level tree. */
+    force_exchange_hmax(tree, ddecomp);
 
     walltime_measure("/SPH/HmaxUpdate");
     int64_t totnumparticles;
@@ -1407,3 +1539,52 @@ void force_tree_free(ForceTree * tree)
     memset(tree, 0, sizeof(ForceTree));
     tree->tree_allocated_flag = 0;
 }
+
+/* Offsets of a tree and the particle table in the shared MAIN memory of a rank*/
+struct node_tree_data {
+    ptrdiff_t Nodes_base;
+    ptrdiff_t Part;
+    int firstnode;
+    int Task;
+};
+
+ForceTreeNodeView *
+force_tree_map_node_trees(const ForceTree * tree)
+{
+    MPI_Comm comm = mymalloc_node_comm();
+    if(comm == MPI_COMM_NULL)
+        return NULL;
+
+    int NTask, NodeSize, NodeRank, i;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_size(comm, &NodeSize);
+    MPI_Comm_rank(comm, &NodeRank);
+
+    struct node_tree_data mine = {mymalloc_node_offset(tree->Nodes_base), mymalloc_node_offset(PartManager->Base), tree->firstnode, tree->ThisTask};
+    struct node_tree_data * all = ta_malloc("NodeTreeData", struct node_tree_data, NodeSize);
+    MPI_Allgather(&mine, sizeof(mine), MPI_BYTE, all, sizeof(mine), MPI_BYTE, comm);
+
+    ForceTreeNodeView * views = (ForceTreeNodeView *) mymalloc("NodeTreeViews", NTask * sizeof(views[0]));
+    memset(views, 0, NTask * sizeof(views[0]));
+    for(i = 0; i < NodeSize; i++) {
+        if(i == NodeRank)
+            continue;
+        const struct NODE * Nodes_base = (const struct NODE *) mymalloc_node_address(i, all[i].Nodes_base);
+        views[all[i].Task].Nodes = Nodes_base - all[i].firstnode;
+        views[all[i].Task].Part = (const struct particle_data *) mymalloc_node_address(i, all[i].Part);
+    }
+    ta_free(all);
+    /* Make sure the other trees are complete before they are read*/
+    mymalloc_node_sync();
+    return views;
+}
+
+void
+force_tree_unmap_node_trees(ForceTreeNodeView * views)
+{
+    if(!views)
+        return;
+    /* No rank may change its tree while the others may still be reading it*/
+    mymalloc_node_sync();
+    myfree(views);
+}
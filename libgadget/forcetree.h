@@ -61,7 +61,8 @@ struct NODE
         unsigned int DependsOnLocalMass :1;  /* Intersects with local mass */
         unsigned int ChildType :2; /* Specify the type of children this node has: particles, other nodes, or pseudo-particles.
                                     * (should be an enum, but not standard in C).*/
-        unsigned int unused : 3; /* Spare bits*/
+        unsigned int HmaxDirty :1; /* Local top-level leaf whose hmax has changed since it was last exchanged */
+        unsigned int unused : 2; /* Spare bits*/
     } f;
 };
 
@@ -77,6 +78,9 @@ typedef struct ForceTree {
     int tree_allocated_flag;
     /* Flags that hmax has been computed for this tree*/
     int hmax_computed_flag;
+    /* Flags that the hmax of every local node is at least that of its children,
+     * so that changed smoothing lengths can be propagated up the tree incrementally.*/
+    int hmax_propagated_flag;
     /* Flags that the tree has fully computed and exchanged mass moments*/
     int moments_computed_flag;
     /* Flags that the tree contains all active particles*/
@@ -119,9 +123,14 @@ int force_tree_allocated(const ForceTree * tt);
 /* This function propagates changed SPH smoothing lengths up the tree*/
 void force_update_hmax(ActiveParticles * act, ForceTree * tt, DomainDecomp * ddecomp);
 
-/* Update the hmax in the parent node of a single particle at p_i*/
+/* Update the hmax in the parent node of a single particle at p_i.
+ * If the tree has hmax_propagated_flag set, the change is also propagated up to the local top-level node.*/
 void update_tree_hmax_father(const ForceTree * const tree, const int p_i, const double Pos[3], const double Hsml);
 
+/* Exchange the hmax of the local top-level leaves which changed since the last exchange,
+ * and update the top-level tree. Completes an incremental hmax update.*/
+void force_exchange_hmax(ForceTree * tree, const DomainDecomp * ddecomp);
+
 /* Build a tree structure using all particles, compute moments and allocate a father array.
  * This is the fattest tree constructor, allows moments and walking up and down.*/
 void force_tree_full(ForceTree * tree, DomainDecomp * ddecomp, const int HybridNuTracer, const char * EmergencyOutputDir);
@@ -168,6 +177,20 @@ node_is_node(int no, const ForceTree * tree)
 int
 force_get_father(int no, const ForceTree * tt);
 
+/* The force tree of another rank on this node, read directly from its shared memory.
+ * Nodes is shifted as ForceTree.Nodes and Part is the particle table of that rank.*/
+typedef struct ForceTreeNodeView {
+    const struct NODE * Nodes;
+    const struct particle_data * Part;
+} ForceTreeNodeView;
+
+/* Map the trees of the other ranks on this node, if their memory is shared (see mymalloc_init).
+ * Returns an array indexed by task, with Nodes NULL for this rank and for ranks on other nodes,
+ * or NULL if memory is not shared. Collective: no rank may change its tree or particle table
+ * until force_tree_unmap_node_trees is called.*/
+ForceTreeNodeView * force_tree_map_node_trees(const ForceTree * tree);
+void force_tree_unmap_node_trees(ForceTreeNodeView * views);
+
 /*Internal API, exposed for tests*/
 void
 force_tree_create_nodes(ForceTree * tree, const ActiveParticles * act, int mask, DomainDecomp * ddecomp);
@@ -125,8 +125,14 @@ grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, MyFl
     tw->tree = tree;
     tw->priv = &priv;
 
+    /* With shared memory, walk the trees of the other ranks on this node instead of exporting to them*/
+    ForceTreeNodeView * NodeTrees = force_tree_map_node_trees(tree);
+    priv.NodeTrees = NodeTrees;
+
     treewalk_run(tw, act->ActiveParticle, act->NumActiveParticle);
 
+    force_tree_unmap_node_trees(NodeTrees);
+
     /* Now the force computation is finished */
     /*  gather some diagnostic information */
 
@@ -239,6 +245,59 @@ shall_we_open_node(const double len, const double mass, const double r2, const d
     return 0;
 }
 
+/* Walk the tree of another rank on this node below its top-level leaf startno, reading the nodes and particles
+ * directly from its shared memory. This adds the same contribution as exporting the particle to that rank.
+ * Returns the number of particle interactions.*/
+static int
+force_treeev_shortrange_shared(const ForceTreeNodeView * view, const int startno, const double * inpos, TreeWalkResultGravShort * output,
+        const double BoxSize, const double cellsize, const double rcut, const double aold, const int TreeUseBH, const double BHOpeningAngle2)
+{
+    int ninteractions = 0;
+    int no = startno;
+    while(no >= 0)
+    {
+        const struct NODE *nop = &view->Nodes[no];
+        /* Back in the top-level tree: the branch is done*/
+        if(nop->f.TopLevel && no != startno)
+            break;
+
+        int i;
+        double dx[3];
+        for(i = 0; i < 3; i++)
+            dx[i] = NEAREST(nop->mom.cofm[i] - inpos[i], BoxSize);
+        const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
+
+        if(shall_we_discard_node(nop->len, r2, nop->center, inpos, BoxSize, rcut, rcut * rcut)) {
+            no = nop->sibling;
+            continue;
+        }
+
+        if(!shall_we_open_node(nop->len, nop->mom.mass, r2, nop->center, inpos, BoxSize, aold, TreeUseBH, BHOpeningAngle2)) {
+            apply_accn_to_output(output, dx, r2, nop->mom.mass, cellsize);
+            no = nop->sibling;
+            continue;
+        }
+
+        /* There are no pseudo particles below a top-level leaf*/
+        if(nop->f.ChildType == PARTICLE_NODE_TYPE) {
+            for(i = 0; i < nop->s.noccupied; i++) {
+                const struct particle_data * pp = &view->Part[nop->s.suns[i]];
+                double pdx[3];
+                int j;
+                for(j = 0; j < 3; j++)
+                    pdx[j] = NEAREST(pp->Pos[j] - inpos[j], BoxSize);
+                const double pr2 = pdx[0] * pdx[0] + pdx[1] * pdx[1] + pdx[2] * pdx[2];
+                apply_accn_to_output(output, pdx, pr2, pp->Mass, cellsize);
+            }
+            ninteractions += nop->s.noccupied;
+            no = nop->sibling;
+        }
+        else
+            no = nop->s.suns[0];
+    }
+    return ninteractions;
+}
+
 /*! In the TreePM algorithm, the tree is walked only locally around the
  *  target coordinate.  Tree nodes that fall outside a box of half
  *  side-length Rcut= RCUT*ASMTH*MeshSize can be discarded. The short-range
@@ -255,6 +314,7 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
 {
     const ForceTree * tree = lv->tw->tree;
     const double BoxSize = tree->BoxSize;
+    const ForceTreeNodeView * NodeTrees = GRAV_GET_PRIV(lv->tw)->NodeTrees;
 
     /*Tree-opening constants*/
     const double cellsize = GRAV_GET_PRIV(lv->tw)->cellsize;
@@ -272,7 +332,7 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
     const double * inpos = input->base.Pos;
 
     /*Start the tree walk*/
-    int listindex, ninteractions=0;
+    int listindex, ninteractions=0, nshared = 0;
 
     /* Primary treewalk only ever has one nodelist entry*/
     for(listindex = 0; listindex < NODELISTLENGTH; listindex++)
@@ -323,6 +383,11 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
 
             if(lv->mode == TREEWALK_TOPTREE) {
                 if(nop->f.ChildType == PSEUDO_NODE_TYPE) {
+                    /* Trees on this node are walked directly in the primary walk*/
+                    if(NodeTrees && NodeTrees[tree->TopLeaves[nop->s.suns[0] - tree->lastnode].Task].Nodes) {
+                        no = nop->sibling;
+                        continue;
+                    }
                     /* Export the pseudo particle*/
                     if(-1 == treewalk_export_particle(lv, nop->s.suns[0]))
                         return -1;
@@ -351,6 +416,11 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
                 }
                 else if (nop->f.ChildType == PSEUDO_NODE_TYPE)
                 {
+                    /* If the pseudo particle is on this node, walk its tree directly*/
+                    const struct topleaf_data * leaf = &tree->TopLeaves[nop->s.suns[0] - tree->lastnode];
+                    if(NodeTrees && NodeTrees[leaf->Task].Nodes)
+                        nshared += force_treeev_shortrange_shared(&NodeTrees[leaf->Task], leaf->treenode, inpos, output,
+                                BoxSize, cellsize, rcut, aold, TreeUseBH, BHOpeningAngle2);
                     /* Move to the sibling (likely also a pseudo node)*/
                     no = nop->sibling;
                 }
@@ -373,6 +443,6 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
         }
         ninteractions = numcand;
     }
-    treewalk_add_counters(lv, ninteractions);
+    treewalk_add_counters(lv, ninteractions + nshared);
     return 1;
 }
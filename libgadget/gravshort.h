@@ -39,6 +39,8 @@ struct GravShortPriv {
     double cbrtrho0;
     /* Pointer to the place to store accelerations*/
     MyFloat (*Accel)[3];
+    /* Trees of the other ranks on this node, indexed by task, if memory is shared. May be NULL.*/
+    const ForceTreeNodeView * NodeTrees;
 };
 
 #define GRAV_GET_PRIV(tw) ((struct GravShortPriv *) ((tw)->priv))
@@ -85,7 +85,7 @@ static void get_mean_separation(double * MeanSeparation, const double BoxSize, c
 static void check_omega(struct part_manager_type * PartManager, Cosmology * CP, int generations, double * MassTable);
 static void check_positions(struct part_manager_type * PartManager);
 static void check_smoothing_length(struct part_manager_type * PartManager, double * MeanSpacing);
-static void init_alloc_particle_slot_memory(struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager, const double PartAllocFactor, struct header_data * header, MPI_Comm Comm);
+static void init_alloc_particle_slot_memory(struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager, const double PartAllocFactor, struct header_data * header, int RestartSnapNum, const char * OutputDir, MPI_Comm Comm);
 
 /*! This function reads the initial conditions, allocates storage for the
  *  particle data, validates and initialises the particle data.
@@ -94,14 +94,16 @@ inttime_t init(int RestartSnapNum, const char * OutputDir, struct header_data *
 {
     int i;
 
-    init_alloc_particle_slot_memory(PartManager, SlotsManager, InitParams.PartAllocFactor, header, MPI_COMM_WORLD);
+    init_alloc_particle_slot_memory(PartManager, SlotsManager, InitParams.PartAllocFactor, header, RestartSnapNum, OutputDir, MPI_COMM_WORLD);
 
     /*Read the snapshot*/
     petaio_read_snapshot(RestartSnapNum, OutputDir, CP, header, PartManager, SlotsManager, MPI_COMM_WORLD);
 
     domain_test_id_uniqueness(PartManager);
 
-    check_omega(PartManager, CP, get_generations(), header->MassTable);
+    /* A subset of the particles does not have the mass of the box*/
+    if(!petaio_reading_subset())
+        check_omega(PartManager, CP, get_generations(), header->MassTable);
 
     check_positions(PartManager);
 
@@ -235,7 +237,7 @@ void check_omega(struct part_manager_type * PartManager, Cosmology * CP, int gen
 
 /* Allocate the memory for particles and slots. First the total amount of particles are counted, then allocations are made*/
 static void
-init_alloc_particle_slot_memory(struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager, const double PartAllocFactor, struct header_data * header, MPI_Comm Comm)
+init_alloc_particle_slot_memory(struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager, const double PartAllocFactor, struct header_data * header, int RestartSnapNum, const char * OutputDir, MPI_Comm Comm)
 {
     int NTask, ThisTask;
     MPI_Comm_size(Comm, &NTask);
@@ -263,15 +265,30 @@ init_alloc_particle_slot_memory(struct part_manager_type * PartManager, struct s
     /* sets the maximum number of particles that may reside on a processor */
     int MaxPart = (int) (PartAllocFactor * TotNumPartInit / NTask);
 
-    /*Allocate the particle memory*/
-    particle_alloc_memory(PartManager, header->BoxSize, MaxPart);
-
-    for(ptype = 0; ptype < 6; ptype ++) {
-        int64_t start = ThisTask * header->NTotal[ptype] / NTask;
-        int64_t end = (ThisTask + 1) * header->NTotal[ptype] / NTask;
-        header->NLocal[ptype] = end - start;
-        PartManager->NumPart += header->NLocal[ptype];
+    /* Analysis runs may read only part of the snapshot: allocate for the largest part read on a processor*/
+    if(petaio_read_subset_counts(RestartSnapNum, OutputDir, header, Comm)) {
+        int64_t NumPart = 0, MaxNumPart;
+        for(ptype = 0; ptype < 6; ptype ++)
+            NumPart += header->NLocal[ptype];
+        MPI_Allreduce(&NumPart, &MaxNumPart, 1, MPI_INT64, MPI_MAX, Comm);
+        MaxPart = PartAllocFactor * MaxNumPart + 1;
+        message(0, "Reading a subset of the snapshot, at most %ld particles per processor.\n", MaxNumPart);
     }
+    else {
+        for(ptype = 0; ptype < 6; ptype ++) {
+            int64_t start = ThisTask * header->NTotal[ptype] / NTask;
+            int64_t end = (ThisTask + 1) * header->NTotal[ptype] / NTask;
+            header->NLocal[ptype] = end - start;
+        }
+    }
+
+    int64_t NumPart = 0;
+    for(ptype = 0; ptype < 6; ptype ++)
+        NumPart += header->NLocal[ptype];
+
+    /*Allocate the particle memory*/
+    particle_alloc_memory(PartManager, header->BoxSize, MaxPart, NumPart);
+    PartManager->NumPart = NumPart;
 
     /* Allocate enough memory for stars and black holes.
      * This will be dynamically increased as needed.*/
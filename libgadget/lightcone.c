@@ -1,6 +1,7 @@
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <math.h>
 #include <gsl/gsl_math.h>
@@ -8,6 +9,8 @@
 /*For mkdir*/
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <omp.h>
+#include <bigfile-mpi.h>
 
 #include "utils.h"
 
@@ -15,6 +18,8 @@
 #include "partmanager.h"
 #include "cosmology.h"
 #include "physconst.h"
+#include "petaio.h"
+#include "lightcone.h"
 
 #define NENTRY 4096
 static double tab_loga[NENTRY];
@@ -43,11 +48,52 @@ static double zmin = 0.1;
 static double zmax = 80.0;
 static double ReferenceRedshift = 2.0; /* write all particles below this redshift; write a fraction above this. */
 static double SampleFraction; /* current fraction of particle gets written */
-static FILE * fd_lightcone;
+static double Atime; /* Scale factor of the current step, for the velocity conversion*/
+
+static struct lightcone_params
+{
+    double ShellWidth; /* Comoving thickness of the shell of the lightcone stored in each file*/
+    double BufferMB; /* Memory for the crossings stored between writes*/
+} LightconeParams;
+
+/* A particle crossing the lightcone*/
+struct LightconeParticle
+{
+    double Pos[3];
+    float Vel[3];
+    float Redshift;
+    float SampleFraction;
+    MyIDType ID;
+    unsigned char Type;
+};
+
+/* Crossings stored until they are written. The files are
+ * rotated by shell of comoving distance from the origin.*/
+static struct LightconeBuffer
+{
+    struct LightconeParticle * Parts;
+    int64_t Size;
+    int64_t MaxSize;
+    /* Shell of the crossings in the buffer*/
+    int Shell;
+    double BoxSize;
+    char OutputDir[1024];
+} Buffer;
 
 static double lightcone_get_horizon(double a);
-static void lightcone_cross(int p, double ddrift, const RandTable * const rnd);
+static int lightcone_cross(int p, double ddrift, const RandTable * const rnd, struct LightconeParticle * out);
 static void lightcone_set_time(double a, const double BoxSize);
+
+void set_lightcone_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        LightconeParams.ShellWidth = param_get_double(ps, "LightconeShellWidth");
+        LightconeParams.BufferMB = param_get_double(ps, "LightconeBufferMB");
+    }
+    MPI_Bcast(&LightconeParams, sizeof(struct lightcone_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+}
 /*
 M, L = self.M, self.L
   logx = numpy.linspace(log10amin, 0, Np)
@@ -95,24 +141,22 @@ void lightcone_init(Cosmology * CP, double timeBegin, const double UnitLength_in
     for(i = 0; i < NENTRY; i ++) {
         lightcone_init_entry(CP, i, UnitLength_in_cm);
     };
-    char buf[1024];
-    int chunk = 100;
-    int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-
-    sprintf(buf, "%s/lightcone/", OutputDir);
+    char * buf = fastpm_strdup_printf("%s/lightcone/", OutputDir);
     mkdir(buf, 02755);
-    sprintf(buf, "%s/lightcone/%03d/", OutputDir, (int)(ThisTask / chunk));
-    mkdir(buf, 02755);
-    sprintf(buf, "%s/lightcone/%03d/lightcone-%05d.raw", OutputDir, (int)(ThisTask / chunk), ThisTask);
+    myfree(buf);
+
+    if(LightconeParams.ShellWidth <= 0)
+        endrun(0, "LightconeShellWidth = %g should be positive\n", LightconeParams.ShellWidth);
+    /* Allocated before the particles and kept for the whole run*/
+    Buffer.MaxSize = LightconeParams.BufferMB * 1024 * 1024 / sizeof(struct LightconeParticle);
+    Buffer.Parts = (struct LightconeParticle *) mymalloc("LightconeBuffer", Buffer.MaxSize * sizeof(struct LightconeParticle));
+    Buffer.Size = 0;
+    Buffer.Shell = -1;
+    strncpy(Buffer.OutputDir, OutputDir, sizeof(Buffer.OutputDir) - 1);
 
-    fd_lightcone = fopen(buf, "a+");
-    if(fd_lightcone == NULL) {
-        endrun(1, "failed to open %s\n", buf);
-    }
     HorizonDistanceRef = lightcone_get_horizon(1 / (1 + ReferenceRedshift));
-    printf("lightcone reference redshift = %g distance = %g\n",
-            ReferenceRedshift, HorizonDistanceRef);
+    message(0, "lightcone reference redshift = %g distance = %g, buffer holds %ld particles\n",
+            ReferenceRedshift, HorizonDistanceRef, Buffer.MaxSize);
 }
 
 /* returns the horizon distance */
@@ -171,19 +215,159 @@ static void update_replicas(double a, double BoxSize) {
     }
 }
 
+/* returns the redshift at which the horizon is at comoving distance dist*/
+static double lightcone_get_redshift(double dist) {
+    /* tab_Dc decreases with the scale factor*/
+    int lo = 0, hi = NENTRY - 1;
+    if(dist >= tab_Dc[0])
+        return exp(-tab_loga[0]) - 1;
+    if(dist <= tab_Dc[NENTRY - 1])
+        return exp(-tab_loga[NENTRY - 1]) - 1;
+    while(hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if(tab_Dc[mid] > dist)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    double u = (tab_Dc[lo] - dist) / (tab_Dc[lo] - tab_Dc[hi]);
+    double loga = tab_loga[lo] * (1 - u) + tab_loga[hi] * u;
+    return exp(-loga) - 1;
+}
+
+/* Write the buffered crossings of this shell to a new bigfile in OutputDir/lightcone.
+ * Files are named by the shell and a part number, which is incremented if the buffer fills
+ * during a shell, or if the file exists from an earlier run.*/
+void lightcone_flush(void)
+{
+    int64_t TotSize;
+    MPI_Allreduce(&Buffer.Size, &TotSize, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    if(TotSize == 0)
+        return;
+
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    int part = 0;
+    if(ThisTask == 0) {
+        struct stat st;
+        while(1) {
+            char * fname = fastpm_strdup_printf("%s/lightcone/SHELL_%03d_%02d", Buffer.OutputDir, Buffer.Shell, part);
+            int exists = stat(fname, &st) == 0;
+            myfree(fname);
+            if(!exists)
+                break;
+            part++;
+        }
+    }
+    MPI_Bcast(&part, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    char * fname = fastpm_strdup_printf("%s/lightcone/SHELL_%03d_%02d", Buffer.OutputDir, Buffer.Shell, part);
+    message(0, "Writing %ld lightcone particles to %s\n", TotSize, fname);
+
+    BigFile bf;
+    if(0 != big_file_mpi_create(&bf, fname, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create lightcone file at %s:%s\n", fname,
+                big_file_get_error_message());
+    }
+    BigBlock bh;
+    if(0 != big_file_mpi_create_block(&bf, &bh, "Header", NULL, 0, 0, 0, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create block at %s:%s\n", "Header",
+                big_file_get_error_message());
+    }
+    int UsePeculiarVelocity = GetUsePeculiarVelocity();
+    double ShellMin = Buffer.Shell * LightconeParams.ShellWidth;
+    double ShellMax = ShellMin + LightconeParams.ShellWidth;
+    if(
+    (0 != big_block_set_attr(&bh, "TotNumPart", &TotSize, "i8", 1)) ||
+    (0 != big_block_set_attr(&bh, "Shell", &Buffer.Shell, "i4", 1)) ||
+    (0 != big_block_set_attr(&bh, "ShellMinDistance", &ShellMin, "f8", 1)) ||
+    (0 != big_block_set_attr(&bh, "ShellMaxDistance", &ShellMax, "f8", 1)) ||
+    (0 != big_block_set_attr(&bh, "BoxSize", &Buffer.BoxSize, "f8", 1)) ||
+    (0 != big_block_set_attr(&bh, "ReferenceRedshift", &ReferenceRedshift, "f8", 1)) ||
+    (0 != big_block_set_attr(&bh, "UsePeculiarVelocity", &UsePeculiarVelocity, "i4", 1)) ) {
+        endrun(0, "Failed to write attributes %s\n",
+                    big_file_get_error_message());
+    }
+    if(0 != big_block_mpi_close(&bh, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close block %s\n",
+                    big_file_get_error_message());
+    }
+
+    /* Each block is a strided view of the buffer*/
+    struct {
+        const char * name;
+        const char * dtype;
+        int nmemb;
+        size_t offset;
+    } blocks[] = {
+        {"Position", "f8", 3, offsetof(struct LightconeParticle, Pos)},
+        {"Velocity", "f4", 3, offsetof(struct LightconeParticle, Vel)},
+        {"ID", "u8", 1, offsetof(struct LightconeParticle, ID)},
+        {"Type", "u1", 1, offsetof(struct LightconeParticle, Type)},
+        {"Redshift", "f4", 1, offsetof(struct LightconeParticle, Redshift)},
+        {"SampleFraction", "f4", 1, offsetof(struct LightconeParticle, SampleFraction)},
+    };
+    int i;
+    for(i = 0; i < (int) (sizeof(blocks) / sizeof(blocks[0])); i++) {
+        BigArray array;
+        size_t dims[2] = {Buffer.Size, blocks[i].nmemb};
+        ptrdiff_t strides[2] = {sizeof(struct LightconeParticle), big_file_dtype_itemsize(blocks[i].dtype)};
+        big_array_init(&array, (char *) Buffer.Parts + blocks[i].offset, blocks[i].dtype, 2, dims, strides);
+        petaio_save_block(&bf, blocks[i].name, &array, 0);
+    }
+    if(0 != big_file_mpi_close(&bf, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close lightcone file at %s:%s\n", fname,
+                big_file_get_error_message());
+    }
+    myfree(fname);
+    Buffer.Size = 0;
+}
+
 /* Compute a list of particles which crossed
  * the lightcone boundaries on this timestep and
- * write them to the lightcone file*/
+ * store them in the lightcone buffer. Each chunk of the particle table
+ * first counts its crossings, then stores them in its own range of the buffer,
+ * so the threads do not need to share anything.*/
 void lightcone_compute(double a, double BoxSize, Cosmology * CP, inttime_t ti_curr, inttime_t ti_next, const RandTable * const rnd)
 {
     int i;
     lightcone_set_time(a, BoxSize);
+    if(SampleFraction <= 0.0)
+        return;
     const double ddrift = get_exact_drift_factor(CP, ti_curr, ti_next);
+    const int64_t NumPart = PartManager->NumPart;
+    const int nchunk = omp_get_max_threads();
+    int64_t * NCross = ta_malloc("NCross", int64_t, nchunk + 1);
     #pragma omp parallel for
-    for(i = 0; i < PartManager->NumPart; i++)
-    {
-        lightcone_cross(i, ddrift, rnd);
+    for(i = 0; i < nchunk; i++) {
+        int64_t j, n = 0;
+        for(j = NumPart * i / nchunk; j < NumPart * (i + 1) / nchunk; j++)
+            n += lightcone_cross(j, ddrift, rnd, NULL);
+        NCross[i + 1] = n;
     }
+    NCross[0] = 0;
+    for(i = 0; i < nchunk; i++)
+        NCross[i + 1] += NCross[i];
+    const int64_t ncross = NCross[nchunk];
+
+    /* Make room: every rank writes together*/
+    if(MPIU_Any(Buffer.Size + ncross > Buffer.MaxSize, MPI_COMM_WORLD))
+        lightcone_flush();
+    if(ncross > Buffer.MaxSize)
+        endrun(5, "%ld particles crossed the lightcone on this step, but the buffer holds only %ld. Increase LightconeBufferMB.\n", ncross, Buffer.MaxSize);
+
+    struct LightconeParticle * out = Buffer.Parts + Buffer.Size;
+    #pragma omp parallel for
+    for(i = 0; i < nchunk; i++) {
+        int64_t j, n = NCross[i];
+        for(j = NumPart * i / nchunk; j < NumPart * (i + 1) / nchunk; j++)
+            n += lightcone_cross(j, ddrift, rnd, out + n);
+    }
+    Buffer.Size += ncross;
+    ta_free(NCross);
+
+    int64_t TotCross;
+    MPI_Reduce(&ncross, &TotCross, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+    message(0, "%ld particles crossed the lightcone in shell %d\n", TotCross, Buffer.Shell);
 }
 
 void lightcone_set_time(double a, const double BoxSize) {
@@ -193,8 +377,15 @@ void lightcone_set_time(double a, const double BoxSize) {
         HorizonDistance2Prev = HorizonDistance2;
         HorizonDistance = lightcone_get_horizon(a);
         HorizonDistance2 = HorizonDistance * HorizonDistance;
+        Atime = a;
+        Buffer.BoxSize = BoxSize;
         update_replicas(a, BoxSize);
-        fflush(fd_lightcone);
+        /* Start a new file when the horizon reaches the next shell*/
+        int shell = HorizonDistance / LightconeParams.ShellWidth;
+        if(shell != Buffer.Shell) {
+            lightcone_flush();
+            Buffer.Shell = shell;
+        }
         if (z < ReferenceRedshift) {
             SampleFraction = 1.0;
         } else {
@@ -218,13 +409,14 @@ void lightcone_set_time(double a, const double BoxSize) {
     }
 }
 
-/* check crossing of the horizon, write the particle */
-static void lightcone_cross(int p, double ddrift, const RandTable * const rnd) {
-    if(SampleFraction <= 0.0) return;
+/* check crossing of the horizon in each replica. Returns the number of crossings,
+ * and stores them in out if it is not NULL. */
+static int lightcone_cross(int p, double ddrift, const RandTable * const rnd, struct LightconeParticle * out) {
+    if(SampleFraction <= 0.0) return 0;
+    if(P[p].IsGarbage || P[p].Swallowed) return 0;
     int i;
     int k;
-    /* DM only */
-    if(P[p].Type != 1) return;
+    int ncross = 0;
 
     for(i = 0; i < Nreplica; i++) {
         double r = get_random_number(P[p].ID + i, rnd);
@@ -232,38 +424,46 @@ static void lightcone_cross(int p, double ddrift, const RandTable * const rnd) {
 
         double pnew[3];
         double pold[3];
-        double p3[4];
         double dnew = 0, dold = 0;
         for(k = 0; k < 3; k ++) {
             pold[k] = P[p].Pos[k] + Reps[i][k] - PartManager->CurrentParticleOffset[k];
-            pnew[k] = P[p].Pos[k] + P[i].Vel[k] * ddrift - PartManager->CurrentParticleOffset[k];
+            pnew[k] = P[p].Pos[k] + P[p].Vel[k] * ddrift + Reps[i][k] - PartManager->CurrentParticleOffset[k];
             dnew += pnew[k] * pnew[k];
             dold += pold[k] * pold[k];
         }
         if(
             (dold <= HorizonDistance2Prev && dnew >= HorizonDistance2)
          ) {
-            double u1, u2;
-            if(dold != dnew) {
-                double cnew, cold;
-                dnew = sqrt(dnew);
-                dold = sqrt(dold);
-                cnew = dnew - HorizonDistance;
-                cold = dold - HorizonDistancePrev;
-                u1 = -cold / (cnew - cold);
-                u2 = cnew / (cnew - cold);
-            } else {
-                /* really should write all particles along the line:
-                 * this partilce is moving along the horizon! */
-                u1 = u2 = 0.5;
-            }
-
-            /* write particle position */
-            for(k = 0; k < 3; k ++) {
-                p3[k] = pold[k] * u2 + pnew[k] * u1;
+            if(out) {
+                double u1, u2;
+                if(dold != dnew) {
+                    double cnew, cold;
+                    dnew = sqrt(dnew);
+                    dold = sqrt(dold);
+                    cnew = dnew - HorizonDistance;
+                    cold = dold - HorizonDistancePrev;
+                    u1 = -cold / (cnew - cold);
+                    u2 = cnew / (cnew - cold);
+                } else {
+                    /* really should write all particles along the line:
+                     * this partilce is moving along the horizon! */
+                    u1 = u2 = 0.5;
+                }
+                const double velfac = GetUsePeculiarVelocity() ? 1 / Atime : 1;
+                double dist = 0;
+                /* particle position at the crossing */
+                for(k = 0; k < 3; k ++) {
+                    out[ncross].Pos[k] = pold[k] * u2 + pnew[k] * u1;
+                    out[ncross].Vel[k] = P[p].Vel[k] * velfac;
+                    dist += out[ncross].Pos[k] * out[ncross].Pos[k];
+                }
+                out[ncross].Redshift = lightcone_get_redshift(sqrt(dist));
+                out[ncross].SampleFraction = SampleFraction;
+                out[ncross].ID = P[p].ID;
+                out[ncross].Type = P[p].Type;
             }
-            p3[3] = SampleFraction;
-            fwrite(p3, sizeof(double), 4, fd_lightcone);
+            ncross++;
         }
     }
+    return ncross;
 }
@@ -1,7 +1,17 @@
 #ifndef LIGHTCONE_H
 #define LIGHTCONE_H
 
+#include "cosmology.h"
+#include "utils/paramset.h"
+#include "utils/system.h"
+#include "types.h"
+
+/* Set the lightcone parameters*/
+void set_lightcone_params(ParameterSet * ps);
 /* Initialise the lightcone code module. */
 void lightcone_init(Cosmology * CP, double timeBegin, const double UnitLength_in_cm, const char * OutputDir);
+/* Store the particles which cross the lightcone on this step, writing them to disc if the buffer is full or a new shell is started.*/
 void lightcone_compute(double a, double BoxSize, Cosmology * CP, inttime_t ti_curr, inttime_t ti_next, const RandTable * const rnd);
+/* Write the stored lightcone particles to disc. Collective.*/
+void lightcone_flush(void);
 #endif
@@ -11,7 +11,7 @@
 struct part_manager_type PartManager[1] = {{0}};
 
 void
-particle_alloc_memory(struct part_manager_type * PartManager, double BoxSize, int64_t MaxPart)
+particle_alloc_memory(struct part_manager_type * PartManager, double BoxSize, int64_t MaxPart, int64_t NumPart)
 {
     size_t bytes;
     PartManager->Base = (struct particle_data *) mymalloc("P", bytes = MaxPart * sizeof(struct particle_data));
@@ -29,8 +29,20 @@ particle_alloc_memory(struct part_manager_type * PartManager, double BoxSize, in
      * seems to be to do with how the struct is padded and
      * the missing holes being accessed by __kmp_atomic functions.
      * (memory lock etc?)
+     *
+     * This is done in parallel with the static schedule of the particle loops, which run over NumPart,
+     * so that with a first touch allocator each thread's particles are in its NUMA domain.
+     * The free space after NumPart is only used as particles arrive, so it is simply spread over the threads.
      * */
-    memset(PartManager->Base, 0, sizeof(struct particle_data) * MaxPart);
+    if(NumPart > MaxPart || NumPart < 0)
+        NumPart = MaxPart;
+    int64_t i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < NumPart; i++)
+        memset(&PartManager->Base[i], 0, sizeof(struct particle_data));
+    #pragma omp parallel for schedule(static)
+    for(i = NumPart; i < MaxPart; i++)
+        memset(&PartManager->Base[i], 0, sizeof(struct particle_data));
     message(0, "Allocated %g MByte for storing %ld particles.\n", bytes / (1024.0 * 1024.0), MaxPart);
 }
 
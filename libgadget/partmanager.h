@@ -89,8 +89,9 @@ extern struct part_manager_type {
 /*Compatibility define*/
 #define P PartManager->Base
 
-/*Allocate memory for the particles*/
-void particle_alloc_memory(struct part_manager_type * PartManager, double BoxSize, int64_t MaxPart);
+/*Allocate memory for MaxPart particles. NumPart is the number of particles expected at first:
+ * the memory for them is first touched with the schedule of the particle loops.*/
+void particle_alloc_memory(struct part_manager_type * PartManager, double BoxSize, int64_t MaxPart, int64_t NumPart);
 
 /* Updates the global storing the current random offset of the particles,
  * and stores the relative offset from the last random offset in rel_random_shift.
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <omp.h>
+#include <pthread.h>
 
 #include <bigfile-mpi.h>
 
@@ -48,12 +49,48 @@ static struct petaio_params {
     char InitCondFile[100]; /* Path to read ICs from is InitCondFile */
 
     int ExcursionSetReionOn;
+    int CompressionLevel; /* zlib level for compressing the particle blocks of snapshots. 0 writes them uncompressed.*/
+    int QuantisePositions; /* Store compressed positions as 32 bit fractions of the box (lossy)*/
+    int LinkUnchangedBlocks; /* Hard link blocks which are unchanged since IOTable->LinkSnapshot, instead of writing them*/
+    int ReadMmap; /* Read snapshot blocks by mapping the files, rather than through a buffer*/
+    int ReadAhead; /* Read the next snapshot block in a background thread while the values of the current block are set*/
+    int AdaptiveNumWriters; /* Tune the number of writers between MinNumWriters and NumWriters by measuring the bandwidth*/
+    int PeanoIndex; /* Sort the particles of each rank by Peano-Hilbert cell and write an index of the cells with snapshots*/
+    int ReadTypes; /* Bit mask of the particle types to read from a snapshot*/
+    int ReadRegionOn; /* Only read the cells of the Peano index which overlap ReadRegion*/
+    double ReadRegion[6]; /* Box to read: the lower corner, then the upper corner*/
+    /* Max size (in bytes) of the staging copy of a snapshot on one rank which is written in the background. 0 disables background writing.*/
+    size_t AsyncSnapshotMaxBytes;
 
 } IO;
 
 /* Struct to store constant information written to each snapshot header*/
 static struct header_data Header;
 
+/* Uncompressed size of a chunk of a compressed block: large enough that the zlib window is full,
+ * small enough to decompress a few rows cheaply.*/
+#define IO_CHUNK_BYTES (4*1024*1024)
+/* Memory for the chunk buffers of the blocks of one particle type when streaming a snapshot to disk*/
+#define IO_STREAM_BYTES (64*1024*1024)
+/* Writes smaller than this are too quick to time reliably, and do not tune the number of writers*/
+#define IO_TUNE_MIN_BYTES (64*1024*1024)
+/* Number of large writes with the best number of writers between trials of another number*/
+#define IO_TUNE_PATIENCE 8
+/* Number of bits per dimension of the Peano-Hilbert cells of the snapshot index*/
+#define IO_INDEX_BITS 6
+
+/* State of the adaptive number of writers, if AdaptiveNumWriters is set.
+ * Large writes use the number of writers with the best bandwidth so far. Every so often
+ * one tries twice or half as many writers, which become the best if they are faster.
+ * The number of files of a block follows the number of writers.*/
+static struct {
+    int Best;          /* Number of writers with the best bandwidth. 0 before the first write.*/
+    double Bandwidth;  /* Running mean of the bandwidth achieved with Best, in bytes per second*/
+    int Trial;         /* Number of writers to try, 0 if there is nothing left to try*/
+    int Direction;     /* 1 if the trial doubles the number of writers, -1 if it halves it*/
+    int Wait;          /* Number of large writes with Best before the trial*/
+} IOTune;
+
 /*Set the IO parameters*/
 void
 set_petaio_params(ParameterSet * ps)
@@ -76,6 +113,22 @@ set_petaio_params(ParameterSet * ps)
         param_get_string2(ps, "SnapshotFileBase", IO.SnapshotFileBase, sizeof(IO.SnapshotFileBase));
         param_get_string2(ps, "InitCondFile", IO.InitCondFile, sizeof(IO.InitCondFile));
         IO.ExcursionSetReionOn = param_get_int(ps,"ExcursionSetReionOn");
+        IO.CompressionLevel = param_get_int(ps, "SnapshotCompressionLevel");
+        IO.QuantisePositions = param_get_int(ps, "SnapshotQuantisePositions");
+        IO.LinkUnchangedBlocks = param_get_int(ps, "SnapshotLinkUnchangedBlocks");
+        IO.ReadMmap = param_get_int(ps, "SnapshotReadMmap");
+        IO.ReadAhead = param_get_int(ps, "SnapshotReadAhead");
+        IO.AdaptiveNumWriters = param_get_int(ps, "AdaptiveNumWriters");
+        IO.PeanoIndex = param_get_int(ps, "SnapshotPeanoIndex");
+        IO.ReadTypes = param_get_int(ps, "SnapshotReadTypes");
+        char * region = param_get_string(ps, "SnapshotReadRegion");
+        IO.ReadRegionOn = region && strlen(region) > 0;
+        if(IO.ReadRegionOn && 6 != sscanf(region, "%lg,%lg,%lg,%lg,%lg,%lg", &IO.ReadRegion[0], &IO.ReadRegion[1], &IO.ReadRegion[2],
+                    &IO.ReadRegion[3], &IO.ReadRegion[4], &IO.ReadRegion[5]))
+            endrun(0, "SnapshotReadRegion should be xmin,ymin,zmin,xmax,ymax,zmax, not %s\n", region);
+        IO.AsyncSnapshotMaxBytes = param_get_int(ps, "AsyncSnapshotMaxMB");
+        /* Convert from MB to bytes*/
+        IO.AsyncSnapshotMaxBytes *= 1024L * 1024L;
     }
     MPI_Bcast(&IO, sizeof(struct petaio_params), MPI_BYTE, 0, MPI_COMM_WORLD);
 }
@@ -87,6 +140,30 @@ int GetUsePeculiarVelocity(void)
 
 static void petaio_write_header(BigFile * bf, const double atime, const int64_t * NTotal, const Cosmology * CP, const struct header_data * data);
 static void petaio_read_header_internal(BigFile * bf, Cosmology * CP, struct header_data * data);
+static void petaio_save_io_tuning(BigFile * bf);
+static void petaio_save_peano_index(BigFile * bf, int * selection, const int64_t * ptype_offset, const int64_t * ptype_count, const int64_t * NTotal);
+/* The rows of each particle type this rank reads in a subset read*/
+struct SubsetPlan {
+    /* Pairs of (first row, number of rows) for each type*/
+    int64_t * seg[6];
+    int nseg[6];
+    int64_t NLocal[6];
+};
+static void petaio_subset_plan(BigFile * bf, const int64_t * NTotal, const double BoxSize, struct SubsetPlan * plan, MPI_Comm Comm);
+static void petaio_subset_free(struct SubsetPlan * plan);
+static int petaio_read_rows(BigFile * bf, const char * blockname, BigArray * array, const int64_t * seg, const int nseg, int required);
+/* A snapshot block read in the background by a thread, while the previous block is set on the particles*/
+struct ReadAheadBlock {
+    BigBlock bb;
+    int compressed;
+    BigBlockMPIReadAhead ra;
+    int threaded;
+    pthread_t thread;
+};
+static int petaio_read_ahead_begin(BigFile * bf, const char * blockname, struct ReadAheadBlock * rab, const int64_t localsize, int required, MPI_Comm Comm);
+static void petaio_read_ahead_end(struct ReadAheadBlock * rab, const char * blockname, BigArray * array, MPI_Comm Comm);
+static void GTPosition(int i, double * out, void * baseptr, void * smanptr, const struct conversions * params);
+static void petaio_save_stream(BigFile * bf, BigFile * linkbf, IOTableEntry ** ents, const int nblocks, const int * selection, const int64_t NumSelection, struct conversions * conv, int verbose);
 
 /* these are only used in reading in */
 void petaio_init(void) {
@@ -98,6 +175,7 @@ void petaio_init(void) {
         message(0, "Aggregated IO is disabled.\n");
         big_file_mpi_set_aggregated_threshold(0);
     }
+    big_file_set_mmap(IO.ReadMmap);
     if(IO.NumWriters == 0)
         MPI_Comm_size(MPI_COMM_WORLD, &IO.NumWriters);
 }
@@ -152,6 +230,20 @@ petaio_build_selection(int * selection,
     }
 }
 
+/* Open the snapshot which unchanged blocks are hard linked to, if there is one. Returns NULL otherwise.*/
+static BigFile *
+petaio_open_link_snapshot(BigFile * linkbf, const struct IOTable * IOTable)
+{
+    if(!IO.LinkUnchangedBlocks || IOTable->LinkSnapshot == NULL)
+        return NULL;
+    if(0 != big_file_mpi_open(linkbf, IOTable->LinkSnapshot, MPI_COMM_WORLD)) {
+        message(0, "Not linking unchanged blocks: could not open %s: %s\n", IOTable->LinkSnapshot, big_file_get_error_message());
+        return NULL;
+    }
+    message(0, "Linking unchanged blocks to %s\n", IOTable->LinkSnapshot);
+    return linkbf;
+}
+
 void
 petaio_save_snapshot(const char * fname, struct IOTable * IOTable, int verbose, const double atime, const Cosmology * CP)
 {
@@ -177,24 +269,47 @@ petaio_save_snapshot(const char * fname, struct IOTable * IOTable, int verbose,
     conv.hubble = hubble_function(CP, atime);
 
     petaio_write_header(&bf, atime, NTotal, CP, &Header);
+    if(IO.PeanoIndex)
+        petaio_save_peano_index(&bf, selection, ptype_offset, ptype_count, NTotal);
+
+    BigFile linkbfs = {0};
+    BigFile * linkbf = petaio_open_link_snapshot(&linkbfs, IOTable);
+
+    int i, ptype;
+    /* Uncompressed blocks are streamed to disk, all the blocks of a type at once*/
+    IOTableEntry ** ents = ta_malloc("StreamEnts", IOTableEntry *, IOTable->used);
+    for(ptype = 0; ptype < 6; ptype++) {
+        /* No need to write empty folders for particle types we don't have.
+         * But do still write them for stars and BHs as someone might expect them.*/
+        if(NTotal[ptype] == 0 && ptype < 4)
+            continue;
+        int nents = 0;
+        for(i = 0; i < IOTable->used; i ++)
+            if(IOTable->ent[i].ptype == ptype && IOTable->ent[i].codec.level == 0)
+                ents[nents++] = &IOTable->ent[i];
+        if(nents > 0)
+            petaio_save_stream(&bf, linkbf, ents, nents, selection + ptype_offset[ptype], ptype_count[ptype], &conv, verbose);
+    }
+    ta_free(ents);
+    if(linkbf)
+        big_file_mpi_close(linkbf, MPI_COMM_WORLD);
 
-    int i;
     for(i = 0; i < IOTable->used; i ++) {
         /* only process the particle blocks */
         char blockname[128];
-        int ptype = IOTable->ent[i].ptype;
+        ptype = IOTable->ent[i].ptype;
         BigArray array = {0};
         /*This exclude FOF blocks*/
         if(!(ptype < 6 && ptype >= 0)) {
             continue;
         }
-        /* No need to write empty folders for particle types we don't have.
-         * But do still write them for stars and BHs as someone might expect them.*/
-        if(ptype_count[ptype] == 0 && ptype < 4)
+        if(IOTable->ent[i].codec.level == 0)
+            continue;
+        if(NTotal[ptype] == 0 && ptype < 4)
             continue;
         sprintf(blockname, "%d/%s", ptype, IOTable->ent[i].name);
         petaio_build_buffer(&array, &IOTable->ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager, &conv);
-        petaio_save_block(&bf, blockname, &array, verbose);
+        petaio_save_compressed_block(&bf, blockname, &array, &IOTable->ent[i].codec, verbose);
         petaio_destroy_buffer(&array);
     }
 
@@ -203,6 +318,7 @@ petaio_save_snapshot(const char * fname, struct IOTable * IOTable, int verbose,
         MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
         petaio_save_neutrinos(&bf, ThisTask);
     }
+    petaio_save_io_tuning(&bf);
     if(0 != big_file_mpi_close(&bf, MPI_COMM_WORLD)){
         endrun(0, "Failed to close snapshot at %s:%s\n", fname,
                     big_file_get_error_message());
@@ -261,6 +377,37 @@ struct header_data
     return head;
 }
 
+/* Build a strided view of the field of a directly readable block in the particle table or slots.
+ * Particles are stored contiguously by type, as set up by slots_setup_topology, so the slot of
+ * the i-th particle of a type is i. Returns 0 if the block must be read through its setter.*/
+static int
+petaio_direct_array(BigArray * array, IOTableEntry * ent, const int64_t * NLocal, struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager)
+{
+    size_t dims[2];
+    ptrdiff_t strides[2];
+    char * base;
+    const int ptype = ent->ptype;
+    if(ent->direct == 1) {
+        int64_t offset = 0;
+        int t;
+        for(t = 0; t < ptype; t++)
+            offset += NLocal[t];
+        base = (char *) (PartManager->Base + offset);
+        strides[0] = sizeof(struct particle_data);
+    }
+    else if(ent->direct == 2 && SlotsManager->info[ptype].enabled) {
+        base = SlotsManager->info[ptype].ptr;
+        strides[0] = SlotsManager->info[ptype].elsize;
+    }
+    else
+        return 0;
+    dims[0] = NLocal[ptype];
+    dims[1] = ent->items;
+    strides[1] = dtype_itemsize(ent->direct_dtype);
+    big_array_init(array, base + ent->direct_offset, ent->direct_dtype, 2, dims, strides);
+    return 1;
+}
+
 void
 petaio_read_snapshot(int num, const char * OutputDir, Cosmology * CP, struct header_data * header, struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager, MPI_Comm Comm)
 {
@@ -290,12 +437,22 @@ petaio_read_snapshot(int num, const char * OutputDir, Cosmology * CP, struct hea
     conv.atime = header->TimeSnapshot;
     conv.hubble = hubble_function(CP, header->TimeSnapshot);
 
+    /* Analysis runs may read only some of the particles*/
+    const int subset = petaio_reading_subset();
+    struct SubsetPlan plan;
+    if(subset)
+        petaio_subset_plan(&bf, header->NTotal, header->BoxSize, &plan, Comm);
+
     struct IOTable IOTable[1] = {0};
     /* Always try to read the metal tables.
      * This lets us turn it off for a short period and then re-enable it.
      * Note the metal fields are non-fatal so this does not break resuming without metals.*/
     register_io_blocks(IOTable, 0, 1);
 
+    /* With read ahead, the block whose values are still to be set on the particles*/
+    BigArray pending = {0};
+    IOTableEntry * pendingent = NULL;
+
     for(i = 0; i < IOTable->used; i ++) {
         /* only process the particle blocks */
         char blockname[128];
@@ -305,6 +462,7 @@ petaio_read_snapshot(int num, const char * OutputDir, Cosmology * CP, struct hea
             continue;
         }
         if(header->NTotal[ptype] == 0) continue;
+        if(subset && !(IO.ReadTypes & (1 << ptype))) continue;
         if(ic) {
             /* for IC read in only three blocks */
             int keep = 0;
@@ -324,12 +482,52 @@ petaio_read_snapshot(int num, const char * OutputDir, Cosmology * CP, struct hea
             continue;
         }
         sprintf(blockname, "%d/%s", ptype, IOTable->ent[i].name);
+        /* Plain fields are read straight into the particle table*/
+        const int direct = petaio_direct_array(&array, &IOTable->ent[i], header->NLocal, PartManager, SlotsManager);
+        if(!subset && IO.ReadAhead) {
+            /* Start reading this block, and set the values of the previous block while it is read*/
+            struct ReadAheadBlock rab;
+            const int missing = petaio_read_ahead_begin(&bf, blockname, &rab, header->NLocal[ptype], IOTable->ent[i].required, Comm);
+            if(pendingent) {
+                petaio_readout_buffer(&pending, pendingent, &conv, PartManager, SlotsManager);
+                petaio_destroy_buffer(&pending);
+                pendingent = NULL;
+            }
+            if(missing)
+                continue;
+            if(!direct)
+                petaio_alloc_buffer(&array, &IOTable->ent[i], header->NLocal[ptype]);
+            petaio_read_ahead_end(&rab, blockname, &array, Comm);
+            if(!direct) {
+                pending = array;
+                pendingent = &IOTable->ent[i];
+            }
+            continue;
+        }
+        if(direct) {
+            if(subset)
+                petaio_read_rows(&bf, blockname, &array, plan.seg[ptype], plan.nseg[ptype], IOTable->ent[i].required);
+            else
+                petaio_read_block(&bf, blockname, &array, IOTable->ent[i].required);
+            continue;
+        }
         petaio_alloc_buffer(&array, &IOTable->ent[i], header->NLocal[ptype]);
-        if(0 == petaio_read_block(&bf, blockname, &array, IOTable->ent[i].required))
+        int missing;
+        if(subset)
+            missing = petaio_read_rows(&bf, blockname, &array, plan.seg[ptype], plan.nseg[ptype], IOTable->ent[i].required);
+        else
+            missing = petaio_read_block(&bf, blockname, &array, IOTable->ent[i].required);
+        if(!missing)
             petaio_readout_buffer(&array, &IOTable->ent[i], &conv, PartManager, SlotsManager);
         petaio_destroy_buffer(&array);
     }
+    if(pendingent) {
+        petaio_readout_buffer(&pending, pendingent, &conv, PartManager, SlotsManager);
+        petaio_destroy_buffer(&pending);
+    }
     destroy_io_blocks(IOTable);
+    if(subset)
+        petaio_subset_free(&plan);
 
     if(0 != big_file_mpi_close(&bf, Comm)) {
         endrun(0, "Failed to close snapshot at %s:%s\n", fname,
@@ -437,6 +635,29 @@ _get_attr_int(BigBlock * bh, const char * name, const int def)
     return foo;
 }
 
+/* Store the tuned number of writers in the header, so a restart carries on from it*/
+static void
+petaio_save_io_tuning(BigFile * bf)
+{
+    if(!IO.AdaptiveNumWriters || IOTune.Best == 0)
+        return;
+    message(0, "IO tuning: writing with %d writers at %g MB/s\n", IOTune.Best, IOTune.Bandwidth / (1024. * 1024.));
+    BigBlock bh;
+    if(0 != big_file_mpi_open_block(bf, &bh, "Header", MPI_COMM_WORLD)) {
+        endrun(0, "Failed to open block at %s:%s\n", "Header",
+                big_file_get_error_message());
+    }
+    if((0 != big_block_set_attr(&bh, "IOTuneNumWriters", &IOTune.Best, "i4", 1)) ||
+       (0 != big_block_set_attr(&bh, "IOTuneBandwidth", &IOTune.Bandwidth, "f8", 1))) {
+        endrun(0, "Failed to write attributes %s\n",
+                    big_file_get_error_message());
+    }
+    if(0 != big_block_mpi_close(&bh, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close block %s\n",
+                    big_file_get_error_message());
+    }
+}
+
 static void
 petaio_read_header_internal(BigFile * bf, Cosmology * CP, struct header_data * Header) {
     BigBlock bh;
@@ -503,6 +724,9 @@ petaio_read_header_internal(BigFile * bf, Cosmology * CP, struct header_data * H
      * and v / sqrt(a) = sqrt(a) dx/dt in the ICs. Note that snapshots never match Gadget-2, which
      * saves physical peculiar velocity / sqrt(a) in both ICs and snapshots. */
     IO.UsePeculiarVelocity = _get_attr_int(&bh, "UsePeculiarVelocity", 0);
+    /* Resume tuning the number of writers from the snapshot*/
+    IOTune.Best = _get_attr_int(&bh, "IOTuneNumWriters", 0);
+    IOTune.Bandwidth = _get_attr_double(&bh, "IOTuneBandwidth", 0);
 
     if(0 != big_block_get_attr(&bh, "TotNumPartInit", Header->NTotalInit, "u8", 6)) {
         int ptype;
@@ -542,20 +766,10 @@ void petaio_readout_buffer(BigArray * array, IOTableEntry * ent, struct conversi
         p += array->strides[0];
     }
 }
-/* build an IO buffer for block, based on selection
- * only check P[ selection[i]]. If selection is NULL, just use P[i].
- * NOTE: selected range should contain only one particle type!
-*/
-void
-petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv)
+/* fill an allocated IO buffer for block, based on selection */
+static void
+petaio_fill_buffer(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv)
 {
-    if(selection == NULL) {
-        endrun(-1, "NULL selection is not supported\n");
-    }
-
-    /* don't forget to free buffer after its done*/
-    petaio_alloc_buffer(array, ent, NumSelection);
-
     /* Fast code path if there are no such particles */
     if(NumSelection == 0) {
         return;
@@ -582,11 +796,98 @@ petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection,
     }
 }
 
+/* build an IO buffer for block, based on selection
+ * only check P[ selection[i]]. If selection is NULL, just use P[i].
+ * NOTE: selected range should contain only one particle type!
+*/
+void
+petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv)
+{
+    if(selection == NULL) {
+        endrun(-1, "NULL selection is not supported\n");
+    }
+
+    /* don't forget to free buffer after its done*/
+    petaio_alloc_buffer(array, ent, NumSelection);
+
+    petaio_fill_buffer(array, ent, selection, NumSelection, Parts, SlotsManager, conv);
+}
+
 /* destroy a buffer, freeing its memory */
 void petaio_destroy_buffer(BigArray * array) {
     myfree(array->data);
 }
 
+/* Each rank decompresses the chunks holding its rows of a compressed block*/
+static void
+petaio_read_compressed(BigBlock * bb, const char * blockname, BigArray * array, MPI_Comm Comm)
+{
+    int64_t start = 0, localsize = array->dims[0];
+    MPI_Exscan(&localsize, &start, 1, MPI_INT64, MPI_SUM, Comm);
+    int ThisTask;
+    MPI_Comm_rank(Comm, &ThisTask);
+    if(ThisTask == 0)
+        start = 0;
+    if(MPIU_Any(0 != big_block_read_compressed(bb, start, array), Comm)) {
+        endrun(1, "Failed to read from compressed block %s: %s\n", blockname, big_file_get_error_message());
+    }
+}
+
+static void *
+petaio_read_ahead_thread(void * rab)
+{
+    /* Errors are recorded in the read and reported by big_block_mpi_read_ahead_end*/
+    big_block_mpi_read_ahead_fetch(&((struct ReadAheadBlock *) rab)->ra);
+    return NULL;
+}
+
+/* Open a block and start reading the rows of this rank in a background thread. Collective.
+ * The ranks are grouped by the files of the block, with at most NumWriters groups, and one rank of each
+ * group reads for it in chunks of at most AggregatedIOThreshold bytes.
+ * Returns 1 if the block is missing and not required.*/
+static int
+petaio_read_ahead_begin(BigFile * bf, const char * blockname, struct ReadAheadBlock * rab, const int64_t localsize, int required, MPI_Comm Comm)
+{
+    if(0 != big_file_mpi_open_block(bf, &rab->bb, blockname, Comm)) {
+        if(required)
+            endrun(0, "Failed to open block at %s:%s\n", blockname, big_file_get_error_message());
+        else
+            return 1;
+    }
+    rab->threaded = 0;
+    /* Compressed blocks are read by every rank from its chunks when the block is finished*/
+    rab->compressed = big_block_is_compressed(&rab->bb);
+    if(rab->compressed)
+        return 0;
+    if(0 != big_block_mpi_read_ahead_begin(&rab->bb, 0, localsize, &rab->ra, IO.AggregatedIOThreshold, IO.NumWriters, Comm)) {
+        endrun(1, "Failed to read from block %s: %s\n", blockname, big_file_get_error_message());
+    }
+    if(0 == pthread_create(&rab->thread, NULL, petaio_read_ahead_thread, rab))
+        rab->threaded = 1;
+    else
+        big_block_mpi_read_ahead_fetch(&rab->ra);
+    return 0;
+}
+
+/* Wait for the read of a block started by petaio_read_ahead_begin, put the rows of this rank into array and close the block. Collective.*/
+static void
+petaio_read_ahead_end(struct ReadAheadBlock * rab, const char * blockname, BigArray * array, MPI_Comm Comm)
+{
+    if(rab->compressed)
+        petaio_read_compressed(&rab->bb, blockname, array, Comm);
+    else {
+        if(rab->threaded)
+            pthread_join(rab->thread, NULL);
+        if(0 != big_block_mpi_read_ahead_end(&rab->ra, array, Comm)) {
+            endrun(1, "Failed to read from block %s: %s\n", blockname, big_file_get_error_message());
+        }
+    }
+    if(0 != big_block_mpi_close(&rab->bb, Comm)) {
+        endrun(0, "Failed to close block at %s:%s\n", blockname,
+                    big_file_get_error_message());
+    }
+}
+
 /* read a block from disk, spread the values to memory with setters  */
 int petaio_read_block(BigFile * bf, const char * blockname, BigArray * array, int required) {
     BigBlock bb;
@@ -599,11 +900,16 @@ int petaio_read_block(BigFile * bf, const char * blockname, BigArray * array, in
         else
             return 1;
     }
-    if(0 != big_block_seek(&bb, &ptr, 0)) {
-            endrun(1, "Failed to seek block %s: %s\n", blockname, big_file_get_error_message());
+    if(big_block_is_compressed(&bb)) {
+        petaio_read_compressed(&bb, blockname, array, MPI_COMM_WORLD);
     }
-    if(0 != big_block_mpi_read(&bb, &ptr, array, IO.NumWriters, MPI_COMM_WORLD)) {
-        endrun(1, "Failed to read from block %s: %s\n", blockname, big_file_get_error_message());
+    else {
+        if(0 != big_block_seek(&bb, &ptr, 0)) {
+                endrun(1, "Failed to seek block %s: %s\n", blockname, big_file_get_error_message());
+        }
+        if(0 != big_block_mpi_read(&bb, &ptr, array, IO.NumWriters, MPI_COMM_WORLD)) {
+            endrun(1, "Failed to read from block %s: %s\n", blockname, big_file_get_error_message());
+        }
     }
     if(0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
         endrun(0, "Failed to close block at %s:%s\n", blockname,
@@ -612,37 +918,113 @@ int petaio_read_block(BigFile * bf, const char * blockname, BigArray * array, in
     return 0;
 }
 
-/* save a block to disk */
-void petaio_save_block(BigFile * bf, const char * blockname, BigArray * array, int verbose)
+static int
+petaio_tune_clamp(int NumWriters)
 {
+    if(NumWriters > IO.NumWriters)
+        NumWriters = IO.NumWriters;
+    if(NumWriters < IO.MinNumWriters)
+        NumWriters = IO.MinNumWriters;
+    if(NumWriters < 1)
+        NumWriters = 1;
+    return NumWriters;
+}
 
-    BigBlock bb;
-    BigBlockPtr ptr;
-
-    int elsize = big_file_dtype_itemsize(array->dtype);
+/* Number of writers for the next block, before it is throttled for its size*/
+static int
+petaio_tune_writers(void)
+{
+    if(!IO.AdaptiveNumWriters)
+        return IO.NumWriters;
+    if(IOTune.Best == 0)
+        IOTune.Best = IO.NumWriters;
+    if(IOTune.Direction == 0)
+        IOTune.Direction = -1;
+    /* The range may have changed since the snapshot we resumed from*/
+    IOTune.Best = petaio_tune_clamp(IOTune.Best);
+    if(IOTune.Trial > 0 && IOTune.Wait == 0)
+        return IOTune.Trial;
+    return IOTune.Best;
+}
 
-    int NumWriters = IO.NumWriters;
+/* Record that bytes were written by NumWriters writers, taking elapsed seconds on this rank,
+ * and choose the number of writers for the next block. Collective.*/
+static void
+petaio_tune_update(const int NumWriters, const int64_t bytes, double elapsed)
+{
+    if(!IO.AdaptiveNumWriters)
+        return;
+    MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    /* Blocks throttled for their size tell us nothing about the number of writers*/
+    if(bytes < IO_TUNE_MIN_BYTES || elapsed <= 0 || NumWriters != petaio_tune_writers())
+        return;
+    const double bandwidth = bytes / elapsed;
+    if(NumWriters == IOTune.Best) {
+        IOTune.Bandwidth = IOTune.Bandwidth > 0 ? 0.5 * (IOTune.Bandwidth + bandwidth) : bandwidth;
+        if(IOTune.Wait > 0)
+            IOTune.Wait--;
+    }
+    /* A trial: keep it if it is clearly faster, otherwise try the other way after a while*/
+    else if(bandwidth > 1.05 * IOTune.Bandwidth) {
+        message(0, "IO tuning: %d writers achieved %g MB/s, better than %g MB/s with %d writers.\n",
+                NumWriters, bandwidth / (1024. * 1024.), IOTune.Bandwidth / (1024. * 1024.), IOTune.Best);
+        IOTune.Best = NumWriters;
+        IOTune.Bandwidth = bandwidth;
+    }
+    else {
+        IOTune.Direction = -IOTune.Direction;
+        IOTune.Wait = IO_TUNE_PATIENCE;
+    }
+    IOTune.Trial = petaio_tune_clamp(IOTune.Direction > 0 ? 2 * IOTune.Best : IOTune.Best / 2);
+    /* At the edge of the range: try the other way*/
+    if(IOTune.Trial == IOTune.Best) {
+        IOTune.Direction = -IOTune.Direction;
+        IOTune.Trial = petaio_tune_clamp(IOTune.Direction > 0 ? 2 * IOTune.Best : IOTune.Best / 2);
+    }
+    if(IOTune.Trial == IOTune.Best)
+        IOTune.Trial = 0;
+}
 
-    size_t size = count_sum(array->dims[0]);
+/* Number of files and writers to use for a block of size items, each of elsize bytes*/
+static int
+petaio_block_files(const size_t size, const int elsize, int * NumWriters)
+{
     int NumFiles;
+    *NumWriters = petaio_tune_writers();
 
     if(IO.EnableAggregatedIO) {
         NumFiles = (size * elsize + IO.BytesPerFile - 1) / IO.BytesPerFile;
-        if(NumWriters > NumFiles * IO.WritersPerFile) {
-            NumWriters = NumFiles * IO.WritersPerFile;
+        if(*NumWriters > NumFiles * IO.WritersPerFile) {
+            *NumWriters = NumFiles * IO.WritersPerFile;
         }
-        if(NumWriters < IO.MinNumWriters) {
-            message(0, "Throttling to %d NumWriters but could throttle to %d.\n", IO.MinNumWriters, NumWriters);
-            NumWriters = IO.MinNumWriters;
-            NumFiles = (NumWriters + IO.WritersPerFile - 1) / IO.WritersPerFile ;
+        if(*NumWriters < IO.MinNumWriters) {
+            message(0, "Throttling to %d NumWriters but could throttle to %d.\n", IO.MinNumWriters, *NumWriters);
+            *NumWriters = IO.MinNumWriters;
+            NumFiles = (*NumWriters + IO.WritersPerFile - 1) / IO.WritersPerFile ;
         }
     } else {
-        NumFiles = NumWriters;
+        NumFiles = *NumWriters;
     }
     /*Do not write empty files*/
     if(size == 0) {
         NumFiles = 0;
     }
+    return NumFiles;
+}
+
+/* save a block to disk */
+void petaio_save_block(BigFile * bf, const char * blockname, BigArray * array, int verbose)
+{
+
+    BigBlock bb;
+    BigBlockPtr ptr;
+
+    int elsize = big_file_dtype_itemsize(array->dtype);
+
+    int NumWriters;
+
+    size_t size = count_sum(array->dims[0]);
+    int NumFiles = petaio_block_files(size, elsize, &NumWriters);
 
     if(verbose && size > 0) {
         message(0, "Will write %td particles to %d Files with %d writers for %s. \n", size, NumFiles, NumWriters, blockname);
@@ -656,9 +1038,11 @@ void petaio_save_block(BigFile * bf, const char * blockname, BigArray * array, i
     if(0 != big_block_seek(&bb, &ptr, 0)) {
         endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
     }
+    double tstart = MPI_Wtime();
     if(0 != big_block_mpi_write(&bb, &ptr, array, NumWriters, MPI_COMM_WORLD)) {
         endrun(0, "Failed to write :%s\n", big_file_get_error_message());
     }
+    petaio_tune_update(NumWriters, size * elsize * array->dims[1], MPI_Wtime() - tstart);
 
     if(verbose && size > 0)
         message(0, "Done writing %td particles to %d Files\n", size, NumFiles);
@@ -669,6 +1053,1005 @@ void petaio_save_block(BigFile * bf, const char * blockname, BigArray * array, i
     }
 }
 
+/* Save a block whose rows on this rank are not contiguous in the file:
+ * the rows of array go to the nruns (offset, count) runs, which are disjoint between ranks.
+ * Each rank writes its runs directly, with no communication of the data.*/
+void petaio_save_block_runs(BigFile * bf, const char * blockname, BigArray * array, const ptrdiff_t * runs, const int64_t nruns, int verbose)
+{
+    BigBlock bb;
+
+    int elsize = big_file_dtype_itemsize(array->dtype);
+
+    int NumWriters;
+
+    size_t size = count_sum(array->dims[0]);
+    int NumFiles = petaio_block_files(size, elsize, &NumWriters);
+
+    if(verbose && size > 0) {
+        message(0, "Will write %td particles to %d Files with %d writers for %s. \n", size, NumFiles, NumWriters, blockname);
+    }
+    if(0 != big_file_mpi_create_block(bf, &bb, blockname, array->dtype, array->dims[1], NumFiles, size, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create block at %s:%s\n", blockname,
+                    big_file_get_error_message());
+    }
+    if(0 != big_block_mpi_write_runs(&bb, runs, nruns, array, NumWriters, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to write :%s\n", big_file_get_error_message());
+    }
+    if(0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close block at %s:%s\n", blockname,
+                big_file_get_error_message());
+    }
+}
+
+/* Compress a block with codec and save it to disk*/
+void petaio_save_compressed_block(BigFile * bf, const char * blockname, BigArray * array, const BigCodec * codec, int verbose)
+{
+    BigBlock bb;
+    BigBlockPtr ptr;
+    BigChunks chunks;
+
+    if(MPIU_Any(0 != big_chunks_encode(&chunks, array, array->dtype, codec, IO_CHUNK_BYTES), MPI_COMM_WORLD)) {
+        endrun(0, "Failed to compress block %s:%s\n", blockname,
+                big_file_get_error_message());
+    }
+    int64_t bytes = chunks.bytes, totbytes;
+    MPI_Allreduce(&bytes, &totbytes, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    size_t size = count_sum(array->dims[0]);
+    int NumWriters;
+    int NumFiles = petaio_block_files(totbytes, 1, &NumWriters);
+
+    if(verbose && size > 0) {
+        message(0, "Will write %td particles as %ld compressed bytes (ratio %g) to %d Files with %d writers for %s. \n",
+                size, totbytes, (double) size * array->dims[1] * dtype_itemsize(array->dtype) / totbytes, NumFiles, NumWriters, blockname);
+    }
+    if(0 != big_file_mpi_create_compressed_block(bf, &bb, blockname, &chunks, codec, NumFiles, &ptr, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create block at %s:%s\n", blockname,
+                    big_file_get_error_message());
+    }
+    BigArray bytearray;
+    size_t dims[1] = {chunks.bytes};
+    big_array_init(&bytearray, chunks.data, "u1", 1, dims, NULL);
+    double tstart = MPI_Wtime();
+    if(0 != big_block_mpi_write(&bb, &ptr, &bytearray, NumWriters, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to write :%s\n", big_file_get_error_message());
+    }
+    petaio_tune_update(NumWriters, totbytes, MPI_Wtime() - tstart);
+    big_chunks_free(&chunks);
+
+    if(0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close block at %s:%s\n", blockname,
+                big_file_get_error_message());
+    }
+}
+
+/* Mix the bits of a 64-bit integer (the splitmix64 finaliser)*/
+static inline uint64_t
+petaio_mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* Number of 64-bit words of the hash of a block*/
+#define IO_HASH_WORDS 2
+
+/* Add the hash of one row of a block, at index row in the block, to hash. The hash of a block is the sum over its rows,
+ * so it does not depend on how the rows are divided between ranks. The two words hash the row
+ * independently, each mixing every 8 bytes of the row with the row index, so an accidental match
+ * of a changed block has a probability of about 2^-128.*/
+static inline void
+petaio_hash_row(const unsigned char * data, const size_t rowbytes, const int64_t row, uint64_t * hash)
+{
+    uint64_t h0 = petaio_mix64(row), h1 = petaio_mix64(row ^ 0x9e3779b97f4a7c15ULL);
+    size_t k;
+    for(k = 0; k < rowbytes; k += 8) {
+        uint64_t word = 0;
+        memcpy(&word, data + k, rowbytes - k < 8 ? rowbytes - k : 8);
+        h0 = petaio_mix64(h0 ^ word);
+        h1 = petaio_mix64(h1 + word) * 0xff51afd7ed558ccdULL;
+    }
+    hash[0] += petaio_mix64(h0 + rowbytes);
+    hash[1] += petaio_mix64(h1 ^ rowbytes);
+}
+
+/* Whether the block of the same name in linkbf has the shape of a block we write, and a ContentHash.
+ * If so, its hash is stored in oldhash. Collective.*/
+static int
+petaio_link_candidate(BigFile * linkbf, const char * blockname, const IOTableEntry * ent, const size_t size, const int NumFiles, uint64_t * oldhash)
+{
+    BigBlock bb;
+    BigArray norm;
+    if(linkbf == NULL)
+        return 0;
+    if(0 != big_file_mpi_open_block(linkbf, &bb, blockname, MPI_COMM_WORLD))
+        return 0;
+    /* Normalises the dtype for comparison*/
+    big_array_init(&norm, NULL, ent->dtype, 1, (size_t[]){0}, NULL);
+    /* The number of files changes as the writers are tuned, but does not change the content*/
+    int same = bb.size == size && (bb.Nfile == NumFiles || IO.AdaptiveNumWriters) && bb.nmemb == ent->items && !strcmp(bb.dtype, norm.dtype) &&
+        0 == big_block_get_attr(&bb, "ContentHash", oldhash, "u8", IO_HASH_WORDS);
+    if(0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close block at %s:%s\n", blockname,
+                big_file_get_error_message());
+    }
+    return same;
+}
+
+/* If a block is identical to the block of the same name in linkbf, hard link it there rather than writing it.
+ * The blocks are compared by the ContentHash attribute, which is stored in each uncompressed block written.
+ * The hash depends on the order of the rows, so a block is only linked if every row is unchanged and in the same place.
+ * Collective. Returns 1 if the block was linked.*/
+static int
+petaio_link_block(BigFile * bf, BigFile * linkbf, const char * blockname, const IOTableEntry * ent, const size_t size, const int NumFiles, const uint64_t * hash)
+{
+    uint64_t oldhash[IO_HASH_WORDS];
+    if(!petaio_link_candidate(linkbf, blockname, ent, size, NumFiles, oldhash))
+        return 0;
+    if(memcmp(oldhash, hash, sizeof(oldhash)))
+        return 0;
+    if(0 != big_file_mpi_link_block(bf, blockname, linkbf, MPI_COMM_WORLD)) {
+        message(0, "Could not link unchanged block %s, writing it: %s\n", blockname, big_file_get_error_message());
+        return 0;
+    }
+    return 1;
+}
+
+/* Peano-Hilbert cell of the index containing a position in the box*/
+static peano_t
+petaio_index_key(const double * pos, const double BoxSize)
+{
+    const int ncell = 1 << IO_INDEX_BITS;
+    int x[3], d;
+    for(d = 0; d < 3; d++) {
+        x[d] = pos[d] / BoxSize * ncell;
+        if(x[d] < 0)
+            x[d] = 0;
+        if(x[d] >= ncell)
+            x[d] = ncell - 1;
+    }
+    return peano_hilbert_key(x[0], x[1], x[2], IO_INDEX_BITS);
+}
+
+/* A particle of the selection and the index cell it is in*/
+struct IndexItem {
+    uint32_t key;
+    int index;
+};
+
+static void
+petaio_index_radix(const void * a, void * radix, void * arg)
+{
+    *(uint32_t *) radix = ((const struct IndexItem *) a)->key;
+}
+
+/* Sort the particles of each type in the selection by index cell, then write for each type
+ * the block PeanoIndex, listing the cells of the rows of the particle blocks in order.
+ * Each row of PeanoIndex is a cell and the number of consecutive rows in that cell.
+ * The sort is stable, so a snapshot of the same particles is written in the same order.*/
+static void
+petaio_save_peano_index(BigFile * bf, int * selection, const int64_t * ptype_offset, const int64_t * ptype_count, const int64_t * NTotal)
+{
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(NTotal[ptype] == 0)
+            continue;
+        int * sel = selection + ptype_offset[ptype];
+        const int64_t n = ptype_count[ptype];
+        struct IndexItem * items = (struct IndexItem *) mymalloc("IndexItems", (n + 1) * sizeof(struct IndexItem));
+        int64_t i, nruns = 0;
+        #pragma omp parallel for
+        for(i = 0; i < n; i++) {
+            double pos[3];
+            GTPosition(sel[i], pos, P, SlotsManager, NULL);
+            items[i].key = petaio_index_key(pos, PartManager->BoxSize);
+            items[i].index = sel[i];
+        }
+        radix_sort_openmp(items, n, sizeof(struct IndexItem), petaio_index_radix, sizeof(uint32_t), NULL);
+        for(i = 0; i < n; i++) {
+            sel[i] = items[i].index;
+            if(i == 0 || items[i].key != items[i-1].key)
+                nruns++;
+        }
+        int64_t * runs = (int64_t *) mymalloc("IndexRuns", (2 * nruns + 1) * sizeof(int64_t));
+        int64_t r = -1;
+        for(i = 0; i < n; i++) {
+            if(i == 0 || items[i].key != items[i-1].key) {
+                r++;
+                runs[2 * r] = items[i].key;
+                runs[2 * r + 1] = 0;
+            }
+            runs[2 * r + 1]++;
+        }
+        char blockname[128];
+        sprintf(blockname, "%d/PeanoIndex", ptype);
+        BigArray array;
+        size_t dims[2] = {nruns, 2};
+        big_array_init(&array, runs, "i8", 2, dims, NULL);
+        petaio_save_block(bf, blockname, &array, 0);
+        BigBlock bb;
+        int bits = IO_INDEX_BITS;
+        if(0 != big_file_mpi_open_block(bf, &bb, blockname, MPI_COMM_WORLD) ||
+           0 != big_block_set_attr(&bb, "Bits", &bits, "i4", 1) ||
+           0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to write attributes of %s: %s\n", blockname, big_file_get_error_message());
+        }
+        myfree(runs);
+        myfree(items);
+    }
+}
+
+int
+petaio_reading_subset(void)
+{
+    return IO.ReadRegionOn || (IO.ReadTypes & 63) != 63;
+}
+
+/* Plan a subset read, which reads only the types in SnapshotReadTypes and the index cells overlapping SnapshotReadRegion.
+ * The selected cells are divided between the ranks as contiguous ranges of Peano-Hilbert keys,
+ * with about the same number of particles, so that each rank holds a compact part of the box.
+ * Types without an index are divided evenly, and then the region cannot be selected.
+ * Free the plan with petaio_subset_free.*/
+static void
+petaio_subset_plan(BigFile * bf, const int64_t * NTotal, const double BoxSize, struct SubsetPlan * plan, MPI_Comm Comm)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(Comm, &NTask);
+    MPI_Comm_rank(Comm, &ThisTask);
+
+    BigBlock bb[6];
+    int indexed[6] = {0};
+    int64_t nruns[6] = {0}, totruns = 0;
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!(IO.ReadTypes & (1 << ptype)) || NTotal[ptype] == 0)
+            continue;
+        char blockname[128];
+        sprintf(blockname, "%d/PeanoIndex", ptype);
+        if(0 != big_file_mpi_open_block(bf, &bb[ptype], blockname, Comm)) {
+            if(IO.ReadRegionOn)
+                endrun(0, "Snapshot has no Peano index for type %d, so SnapshotReadRegion cannot be used: %s\n", ptype, big_file_get_error_message());
+            continue;
+        }
+        int bits = 0;
+        if(0 != big_block_get_attr(&bb[ptype], "Bits", &bits, "i4", 1) || bits != IO_INDEX_BITS)
+            endrun(0, "Peano index of type %d has %d bits, not %d\n", ptype, bits, IO_INDEX_BITS);
+        indexed[ptype] = 1;
+        nruns[ptype] = bb[ptype].size;
+        totruns += nruns[ptype];
+    }
+
+    int64_t * seg = (int64_t *) mymalloc2("SubsetSegments", (2 * totruns + 12) * sizeof(int64_t));
+    int64_t * runs = (int64_t *) mymalloc2("IndexRuns", (2 * totruns + 1) * sizeof(int64_t));
+    int64_t * runstart[6];
+    totruns = 0;
+    for(ptype = 0; ptype < 6; ptype++) {
+        runstart[ptype] = runs + 2 * totruns;
+        if(!indexed[ptype])
+            continue;
+        /* The index is small: read it on one rank and share it*/
+        int err = 0;
+        if(ThisTask == 0) {
+            BigBlockPtr ptr;
+            BigArray array;
+            size_t dims[2] = {nruns[ptype], 2};
+            big_array_init(&array, runstart[ptype], "i8", 2, dims, NULL);
+            err = 0 != big_block_seek(&bb[ptype], &ptr, 0) || 0 != big_block_read(&bb[ptype], &ptr, &array);
+        }
+        if(MPIU_Any(err, Comm))
+            endrun(1, "Failed to read the Peano index of type %d: %s\n", ptype, big_file_get_error_message());
+        MPI_Bcast(runstart[ptype], 2 * nruns[ptype], MPI_INT64, 0, Comm);
+        big_block_mpi_close(&bb[ptype], Comm);
+        totruns += nruns[ptype];
+    }
+
+    /* Cells to read, and the number of particles in each*/
+    const int ncell = 1 << IO_INDEX_BITS;
+    const int64_t nkeys = ((int64_t) 1) << (3 * IO_INDEX_BITS);
+    int64_t * count = (int64_t *) mymalloc2("IndexCount", nkeys * sizeof(int64_t));
+    unsigned char * wanted = (unsigned char *) mymalloc2("IndexWanted", nkeys);
+    memset(wanted, !IO.ReadRegionOn, nkeys);
+    memset(count, 0, nkeys * sizeof(int64_t));
+    if(IO.ReadRegionOn) {
+        const double cell = BoxSize / ncell;
+        int x, y, z;
+        #pragma omp parallel for private(y, z)
+        for(x = 0; x < ncell; x++)
+            for(y = 0; y < ncell; y++)
+                for(z = 0; z < ncell; z++) {
+                    const int xyz[3] = {x, y, z};
+                    int d, overlap = 1;
+                    for(d = 0; d < 3; d++)
+                        overlap &= (xyz[d] + 1) * cell > IO.ReadRegion[d] && xyz[d] * cell < IO.ReadRegion[d + 3];
+                    if(overlap)
+                        wanted[peano_hilbert_key(x, y, z, IO_INDEX_BITS)] = 1;
+                }
+    }
+    int64_t i, total = 0;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!indexed[ptype])
+            continue;
+        for(i = 0; i < nruns[ptype]; i++) {
+            const int64_t key = runstart[ptype][2 * i];
+            if(key < 0 || key >= nkeys)
+                endrun(1, "Bad key %ld in the Peano index of type %d\n", key, ptype);
+            if(wanted[key]) {
+                count[key] += runstart[ptype][2 * i + 1];
+                total += runstart[ptype][2 * i + 1];
+            }
+        }
+    }
+    /* Our range of keys: a cell goes to the rank holding the particle before it*/
+    int64_t key, before = 0, firstkey = nkeys, lastkey = nkeys;
+    for(key = 0; key < nkeys; key++) {
+        if(before * NTask >= (int64_t) ThisTask * total && firstkey == nkeys)
+            firstkey = key;
+        if(before * NTask >= (int64_t) (ThisTask + 1) * total) {
+            lastkey = key;
+            break;
+        }
+        before += count[key];
+    }
+    if(total == 0)
+        firstkey = lastkey = 0;
+
+    int64_t nseg = 0;
+    for(ptype = 0; ptype < 6; ptype++) {
+        plan->seg[ptype] = seg + 2 * nseg;
+        plan->nseg[ptype] = 0;
+        plan->NLocal[ptype] = 0;
+        if(!(IO.ReadTypes & (1 << ptype)) || NTotal[ptype] == 0)
+            continue;
+        if(!indexed[ptype]) {
+            const int64_t start = ThisTask * NTotal[ptype] / NTask;
+            const int64_t end = (ThisTask + 1) * NTotal[ptype] / NTask;
+            seg[2 * nseg] = start;
+            seg[2 * nseg + 1] = end - start;
+            nseg++;
+            plan->nseg[ptype] = 1;
+            plan->NLocal[ptype] = end - start;
+            continue;
+        }
+        int64_t row = 0;
+        for(i = 0; i < nruns[ptype]; i++) {
+            const int64_t key = runstart[ptype][2 * i], len = runstart[ptype][2 * i + 1];
+            if(wanted[key] && key >= firstkey && key < lastkey) {
+                /* Merge with the previous segment if it ends here*/
+                if(plan->nseg[ptype] > 0 && seg[2 * nseg - 2] + seg[2 * nseg - 1] == row)
+                    seg[2 * nseg - 1] += len;
+                else {
+                    seg[2 * nseg] = row;
+                    seg[2 * nseg + 1] = len;
+                    nseg++;
+                    plan->nseg[ptype]++;
+                }
+                plan->NLocal[ptype] += len;
+            }
+            row += len;
+        }
+        if(row != NTotal[ptype])
+            endrun(1, "Peano index of type %d has %ld rows, but there are %ld particles\n", ptype, row, NTotal[ptype]);
+    }
+    myfree(wanted);
+    myfree(count);
+    myfree(runs);
+}
+
+static void
+petaio_subset_free(struct SubsetPlan * plan)
+{
+    myfree(plan->seg[0]);
+}
+
+/* Read the rows of a block listed in seg (as in struct SubsetPlan) into consecutive rows of array.
+ * Each rank reads its own rows independently. Returns 1 if the block is missing and not required.*/
+static int
+petaio_read_rows(BigFile * bf, const char * blockname, BigArray * array, const int64_t * seg, const int nseg, int required)
+{
+    BigBlock bb;
+    if(0 != big_file_mpi_open_block(bf, &bb, blockname, MPI_COMM_WORLD)) {
+        if(required)
+            endrun(0, "Failed to open block at %s:%s\n", blockname, big_file_get_error_message());
+        else
+            return 1;
+    }
+    /* Each rank reads its own rows, keeping the files open across consecutive segments, NumWriters ranks at a time*/
+    if(0 != big_block_mpi_read_runs(&bb, (const ptrdiff_t *) seg, nseg, array, IO.NumWriters, MPI_COMM_WORLD))
+        endrun(1, "Failed to read from block %s: %s\n", blockname, big_file_get_error_message());
+    if(0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close block at %s:%s\n", blockname,
+                    big_file_get_error_message());
+    }
+    return 0;
+}
+
+int
+petaio_read_subset_counts(int num, const char * OutputDir, struct header_data * header, MPI_Comm Comm)
+{
+    if(!petaio_reading_subset())
+        return 0;
+    char * fname = petaio_get_snapshot_fname(num, OutputDir);
+    BigFile bf = {0};
+    if(0 != big_file_mpi_open(&bf, fname, Comm)) {
+        endrun(0, "Failed to open snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+    struct SubsetPlan plan;
+    petaio_subset_plan(&bf, header->NTotal, header->BoxSize, &plan, Comm);
+    memcpy(header->NLocal, plan.NLocal, sizeof(plan.NLocal));
+    petaio_subset_free(&plan);
+    big_file_mpi_close(&bf, Comm);
+    myfree(fname);
+    return 1;
+}
+
+/* A block of one particle type which is filled in a single pass over the particles,
+ * together with the other blocks of that type, and streamed to disk in chunks.*/
+struct StreamBlock {
+    IOTableEntry * ent;
+    BigBlock bb;
+    BigBlockPtr ptr;
+    size_t rowbytes;
+    int NumFiles;
+    /* Set if the block was hard linked to the previous snapshot, and so is not written*/
+    int linked;
+    /* Two chunk buffers: one is filled while the other is written*/
+    char * buffer[2];
+};
+
+struct StreamWrite {
+    struct StreamBlock * blocks;
+    int nblocks;
+    /* Buffer and number of rows to write*/
+    int buf;
+    int64_t nrows;
+    int error;
+};
+
+/* Write one chunk of every block in the group. Runs in a helper thread, so must not call MPI.*/
+static void *
+petaio_stream_writer(void * data)
+{
+    struct StreamWrite * sw = (struct StreamWrite *) data;
+    int b;
+    for(b = 0; b < sw->nblocks; b++) {
+        struct StreamBlock * blk = &sw->blocks[b];
+        if(blk->linked)
+            continue;
+        BigArray array;
+        size_t dims[2] = {sw->nrows, blk->ent->items};
+        big_array_init(&array, blk->buffer[sw->buf], blk->ent->dtype, 2, dims, NULL);
+        if(0 != big_block_write(&blk->bb, &blk->ptr, &array)) {
+            sw->error = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Fill one chunk of every block in the group with a single sweep over the selected particles,
+ * adding the rows to the hash of each block. firstrow is the index of the first row in the blocks.*/
+static void
+petaio_stream_fill(struct StreamBlock * blocks, const int nblocks, const int buf, const int * selection, const int64_t nrows, const int64_t firstrow,
+        uint64_t * hashes, struct particle_data * Parts, struct slots_manager_type * SlotsManager, struct conversions * conv)
+{
+    int64_t i;
+    #pragma omp parallel for reduction(+: hashes[:IO_HASH_WORDS * nblocks])
+    for(i = 0; i < nrows; i++) {
+        const int j = selection[i];
+        int b;
+        if(Parts[j].Type != blocks[0].ent->ptype) {
+            endrun(2, "Selection %d has type = %d != %d\n", j, Parts[j].Type, blocks[0].ent->ptype);
+        }
+        for(b = 0; b < nblocks; b++) {
+            if(blocks[b].linked)
+                continue;
+            unsigned char * row = (unsigned char *) blocks[b].buffer[buf] + i * blocks[b].rowbytes;
+            blocks[b].ent->getter(j, row, Parts, SlotsManager, conv);
+            petaio_hash_row(row, blocks[b].rowbytes, firstrow + i, hashes + IO_HASH_WORDS * b);
+        }
+    }
+}
+
+/* Save several uncompressed blocks of the same particle type. Rather than building a full buffer for each block,
+ * the particles are converted in chunks, one pass over the particles filling every block, and each chunk is
+ * written while the next is filled. Each rank writes its own rows, NumWriters ranks at a time.
+ * If linkbf is not NULL, blocks identical to those in linkbf are hard linked instead of written.
+ * If any block of linkbf could match, this costs an extra pass over the particles to hash the blocks.*/
+static void
+petaio_save_stream(BigFile * bf, BigFile * linkbf, IOTableEntry ** ents, const int nblocks, const int * selection, const int64_t NumSelection, struct conversions * conv, int verbose)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    struct StreamBlock * blocks = (struct StreamBlock *) mymalloc("StreamBlocks", nblocks * sizeof(struct StreamBlock));
+    uint64_t * hashes = (uint64_t *) mymalloc("StreamHashes", IO_HASH_WORDS * nblocks * sizeof(uint64_t));
+    int64_t start = 0;
+    MPI_Exscan(&NumSelection, &start, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    /* MPI_Exscan leaves the result on the first rank undefined*/
+    if(ThisTask == 0)
+        start = 0;
+    const size_t size = count_sum(NumSelection);
+
+    /* Throttle to the fewest writers any block asks for.*/
+    int b, NumWriters = NTask;
+    size_t rowbytes = 0, writebytes = 0;
+    for(b = 0; b < nblocks; b++) {
+        struct StreamBlock * blk = &blocks[b];
+        int BlockWriters;
+        blk->ent = ents[b];
+        blk->linked = 0;
+        blk->rowbytes = dtype_itemsize(blk->ent->dtype) * blk->ent->items;
+        rowbytes += blk->rowbytes;
+        blk->NumFiles = petaio_block_files(size, dtype_itemsize(blk->ent->dtype), &BlockWriters);
+        if(BlockWriters > 0 && BlockWriters < NumWriters)
+            NumWriters = BlockWriters;
+    }
+
+    /* Chunk size such that both buffers of all the blocks fit into IO_STREAM_BYTES*/
+    int64_t chunkrows = IO_STREAM_BYTES / (2 * rowbytes);
+    if(chunkrows < 1)
+        chunkrows = 1;
+    if(chunkrows > NumSelection)
+        chunkrows = NumSelection;
+    for(b = 0; b < nblocks; b++) {
+        blocks[b].buffer[0] = (char *) mymalloc("StreamBuffer", chunkrows * blocks[b].rowbytes + 1);
+        blocks[b].buffer[1] = (char *) mymalloc("StreamBuffer", chunkrows * blocks[b].rowbytes + 1);
+    }
+
+    int64_t done, nrows;
+    /* Only hash the blocks if one of them might be unchanged*/
+    int candidates = 0;
+    for(b = 0; b < nblocks && linkbf; b++) {
+        char blockname[128];
+        uint64_t oldhash[IO_HASH_WORDS];
+        sprintf(blockname, "%d/%s", blocks[b].ent->ptype, blocks[b].ent->name);
+        candidates += petaio_link_candidate(linkbf, blockname, blocks[b].ent, size, blocks[b].NumFiles, oldhash);
+    }
+    if(candidates > 0) {
+        /* Hash the blocks, to find those which have not changed*/
+        memset(hashes, 0, IO_HASH_WORDS * nblocks * sizeof(uint64_t));
+        for(done = 0; done < NumSelection; done += nrows) {
+            nrows = chunkrows;
+            if(nrows > NumSelection - done)
+                nrows = NumSelection - done;
+            petaio_stream_fill(blocks, nblocks, 0, selection + done, nrows, start + done, hashes, P, SlotsManager, conv);
+        }
+        MPI_Allreduce(MPI_IN_PLACE, hashes, IO_HASH_WORDS * nblocks, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+        for(b = 0; b < nblocks; b++) {
+            char blockname[128];
+            sprintf(blockname, "%d/%s", blocks[b].ent->ptype, blocks[b].ent->name);
+            blocks[b].linked = petaio_link_block(bf, linkbf, blockname, blocks[b].ent, size, blocks[b].NumFiles, hashes + IO_HASH_WORDS * b);
+            if(verbose && blocks[b].linked)
+                message(0, "Block %s is unchanged: linked to the previous snapshot.\n", blockname);
+        }
+    }
+
+    /* Create all the blocks first, as this is collective.*/
+    int nwrite = 0;
+    for(b = 0; b < nblocks; b++) {
+        struct StreamBlock * blk = &blocks[b];
+        char blockname[128];
+        if(blk->linked)
+            continue;
+        nwrite++;
+        writebytes += size * blk->rowbytes;
+        sprintf(blockname, "%d/%s", blk->ent->ptype, blk->ent->name);
+        if(verbose && size > 0)
+            message(0, "Will write %td particles to %d Files for %s. \n", size, blk->NumFiles, blockname);
+        if(0 != big_file_mpi_create_block(bf, &blk->bb, blockname, blk->ent->dtype, blk->ent->items, blk->NumFiles, size, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to create block at %s:%s\n", blockname,
+                    big_file_get_error_message());
+        }
+        if(0 != big_block_seek(&blk->bb, &blk->ptr, start)) {
+            endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
+        }
+    }
+
+    /* Ranks write in turn within each of NumWriters contiguous groups of ranks.
+     * The first chunk is filled before waiting for our turn, so only its getters overlap the wait:
+     * the later chunks are filled while the previous chunk is written, inside our turn.*/
+    const int group = (int64_t) ThisTask * NumWriters / NTask;
+    const int prevgroup = ThisTask > 0 ? (int64_t) (ThisTask - 1) * NumWriters / NTask : -1;
+    const int nextgroup = ThisTask < NTask - 1 ? (int64_t) (ThisTask + 1) * NumWriters / NTask : -1;
+
+    memset(hashes, 0, IO_HASH_WORDS * nblocks * sizeof(uint64_t));
+    nrows = nwrite > 0 ? chunkrows : 0;
+    /* The timing includes filling the buffers, as that overlaps the writes*/
+    double tstart = MPI_Wtime();
+    petaio_stream_fill(blocks, nblocks, 0, selection, nrows, start, hashes, P, SlotsManager, conv);
+
+    if(prevgroup == group)
+        MPI_Recv(NULL, 0, MPI_BYTE, ThisTask - 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+    struct StreamWrite sw = {0};
+    sw.blocks = blocks;
+    sw.nblocks = nblocks;
+    done = 0;
+    while(nrows > 0) {
+        pthread_t writer;
+        sw.nrows = nrows;
+        if(0 != pthread_create(&writer, NULL, petaio_stream_writer, &sw))
+            endrun(1, "Could not start IO writer thread\n");
+        /* Fill the next chunk while this one is written*/
+        done += nrows;
+        nrows = chunkrows;
+        if(nrows > NumSelection - done)
+            nrows = NumSelection - done;
+        petaio_stream_fill(blocks, nblocks, 1 - sw.buf, selection + done, nrows, start + done, hashes, P, SlotsManager, conv);
+        pthread_join(writer, NULL);
+        if(sw.error)
+            endrun(1, "Failed to write :%s\n", big_file_get_error_message());
+        sw.buf = 1 - sw.buf;
+    }
+
+    if(nextgroup == group)
+        MPI_Send(NULL, 0, MPI_BYTE, ThisTask + 1, 0, MPI_COMM_WORLD);
+    petaio_tune_update(NumWriters, writebytes, MPI_Wtime() - tstart);
+
+    for(b = nblocks - 1; b >= 0; b--) {
+        myfree(blocks[b].buffer[1]);
+        myfree(blocks[b].buffer[0]);
+    }
+    /* Store the hash, so the next snapshot can find whether the block has changed*/
+    MPI_Allreduce(MPI_IN_PLACE, hashes, IO_HASH_WORDS * nblocks, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+    for(b = 0; b < nblocks; b++) {
+        if(blocks[b].linked)
+            continue;
+        if(0 != big_block_set_attr(&blocks[b].bb, "ContentHash", hashes + IO_HASH_WORDS * b, "u8", IO_HASH_WORDS)) {
+            endrun(0, "Failed to set attribute at %d/%s:%s\n", blocks[b].ent->ptype, blocks[b].ent->name,
+                    big_file_get_error_message());
+        }
+        if(0 != big_block_mpi_close(&blocks[b].bb, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to close block at %d/%s:%s\n", blocks[b].ent->ptype, blocks[b].ent->name,
+                    big_file_get_error_message());
+        }
+    }
+    if(verbose && size > 0 && nwrite > 0)
+        message(0, "Done writing %td particles of type %d in %d blocks\n", size, ents[0]->ptype, nwrite);
+    myfree(hashes);
+    myfree(blocks);
+}
+
+/* A block of a snapshot which is written in the background*/
+struct AsyncBlock {
+    BigBlock bb;
+    BigBlockPtr ptr;
+    BigArray array;
+    /* Compressed blocks are staged as their compressed chunks*/
+    int compressed;
+    BigChunks chunks;
+};
+
+/* The snapshot being written in the background by petaio_save_snapshot_async*/
+static struct {
+    int pending;
+    /* Set by the writer thread if a write failed*/
+    int error;
+    char fname[1024];
+    BigFile bf;
+    /* The staging copy of the blocks. It lives outside the MAIN allocator,
+     * which the timesteps running during the write use as a stack.*/
+    Allocator alloc[1];
+    struct AsyncBlock * blocks;
+    int nblocks;
+    pthread_t thread;
+    /* Ranks write in turn within each of NumWriters groups, passing a token along the group.
+     * The writer thread makes no MPI calls, so the token is passed by the main thread.*/
+    MPI_Comm comm;
+    int prevrank, nextrank;
+    MPI_Request recvtoken, sendtoken;
+    /* Set while the writer thread is running*/
+    int writing;
+    /* Set by the writer thread when it is done*/
+    int written;
+} AsyncSnap;
+
+/* Writes the staged blocks. Each rank writes its own part of each block,
+ * at an offset computed beforehand, so this thread makes no MPI calls.*/
+static void *
+petaio_async_writer(void * unused)
+{
+    int i;
+    for(i = 0; i < AsyncSnap.nblocks; i++) {
+        struct AsyncBlock * blk = &AsyncSnap.blocks[i];
+        if(blk->array.dims[0] == 0)
+            continue;
+        if(0 != big_block_write(&blk->bb, &blk->ptr, &blk->array)) {
+            AsyncSnap.error = 1;
+            break;
+        }
+    }
+    __atomic_store_n(&AsyncSnap.written, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* We hold the token: start writing*/
+static void
+petaio_async_start_writer(void)
+{
+    AsyncSnap.written = 0;
+    if(pthread_create(&AsyncSnap.thread, NULL, petaio_async_writer, NULL))
+        endrun(1, "Could not start the snapshot writer thread\n");
+    AsyncSnap.writing = 1;
+}
+
+/* Wait for our write to finish and pass the token to the next rank of the group*/
+static void
+petaio_async_pass_token(void)
+{
+    pthread_join(AsyncSnap.thread, NULL);
+    AsyncSnap.writing = 0;
+    if(AsyncSnap.nextrank >= 0)
+        MPI_Isend(NULL, 0, MPI_BYTE, AsyncSnap.nextrank, 0, AsyncSnap.comm, &AsyncSnap.sendtoken);
+}
+
+void
+petaio_async_progress(void)
+{
+    if(!AsyncSnap.pending)
+        return;
+    if(AsyncSnap.recvtoken != MPI_REQUEST_NULL) {
+        int flag;
+        MPI_Test(&AsyncSnap.recvtoken, &flag, MPI_STATUS_IGNORE);
+        if(flag)
+            petaio_async_start_writer();
+    }
+    if(AsyncSnap.writing && __atomic_load_n(&AsyncSnap.written, __ATOMIC_ACQUIRE))
+        petaio_async_pass_token();
+}
+
+/* Save a snapshot, writing it in the background if there is enough memory
+ * for a staging copy of it. The particle data is copied before returning, so the particles
+ * may change while it is written. As in petaio_save_snapshot, NumWriters ranks write at a time.
+ * Only one snapshot is written at a time: this waits for the previous one. Returns 1 if the snapshot is still being written,
+ * and petaio_async_wait must be called to complete it, or 0 if it was written synchronously.*/
+int
+petaio_save_snapshot_async(const char * fname, struct IOTable * IOTable, int verbose, const double atime, const Cosmology * CP)
+{
+    petaio_async_wait();
+
+    int64_t ptype_offset[6]={0};
+    int64_t ptype_count[6]={0};
+    int64_t NTotal[6]={0};
+
+    int * selection = (int *) mymalloc("Selection", sizeof(int) * PartManager->NumPart);
+
+    petaio_build_selection(selection, ptype_offset, ptype_count, P, PartManager->NumPart, NULL);
+
+    MPI_Allreduce(ptype_count, NTotal, 6, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+
+    /* Size the staging copy: the blocks, the block table and an allocator header and alignment for each.
+     * Compressed blocks are staged outside the allocator, and are counted at their uncompressed size.*/
+    int i, nblocks = 0;
+    size_t stagebytes = 0, allocbytes = 0;
+    for(i = 0; i < IOTable->used; i ++) {
+        int ptype = IOTable->ent[i].ptype;
+        if(!(ptype < 6 && ptype >= 0))
+            continue;
+        if(NTotal[ptype] == 0 && ptype < 4)
+            continue;
+        const size_t bytes = ptype_count[ptype] * dtype_itemsize(IOTable->ent[i].dtype) * IOTable->ent[i].items + 2 * 4096;
+        stagebytes += bytes;
+        if(IOTable->ent[i].codec.level == 0)
+            allocbytes += bytes;
+        nblocks++;
+    }
+    allocbytes += nblocks * sizeof(struct AsyncBlock) + 2 * 4096;
+    stagebytes += nblocks * sizeof(struct AsyncBlock) + 2 * 4096;
+
+    int nomemory = 1;
+    if(IO.AsyncSnapshotMaxBytes > 0 && stagebytes <= IO.AsyncSnapshotMaxBytes)
+        nomemory = allocator_init(AsyncSnap.alloc, "ASYNCIO", allocbytes, 0, NULL) != 0;
+    if(MPIU_Any(nomemory, MPI_COMM_WORLD)) {
+        if(!nomemory)
+            allocator_destroy(AsyncSnap.alloc);
+        myfree(selection);
+        if(IO.AsyncSnapshotMaxBytes > 0)
+            message(0, "Not enough memory to stage the snapshot, writing it synchronously.\n");
+        petaio_save_snapshot(fname, IOTable, verbose, atime, CP);
+        return 0;
+    }
+
+    message(0, "saving snapshot into %s in the background, staging %g MB\n", fname, stagebytes / (1024. * 1024.));
+    strncpy(AsyncSnap.fname, fname, sizeof(AsyncSnap.fname) - 1);
+    AsyncSnap.error = 0;
+
+    if(0 != big_file_mpi_create(&AsyncSnap.bf, fname, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+
+    struct conversions conv = {0};
+    conv.atime = atime;
+    conv.hubble = hubble_function(CP, atime);
+
+    petaio_write_header(&AsyncSnap.bf, atime, NTotal, CP, &Header);
+    if(IO.PeanoIndex)
+        petaio_save_peano_index(&AsyncSnap.bf, selection, ptype_offset, ptype_count, NTotal);
+
+    BigFile linkbfs = {0};
+    BigFile * linkbf = petaio_open_link_snapshot(&linkbfs, IOTable);
+
+    AsyncSnap.blocks = (struct AsyncBlock *) allocator_alloc_bot(AsyncSnap.alloc, "AsyncBlocks", nblocks * sizeof(struct AsyncBlock));
+    AsyncSnap.nblocks = 0;
+    int ThisTask, NTask, NumWriters;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    NumWriters = NTask;
+    for(i = 0; i < IOTable->used; i ++) {
+        char blockname[128];
+        IOTableEntry * ent = &IOTable->ent[i];
+        int ptype = ent->ptype;
+        if(!(ptype < 6 && ptype >= 0))
+            continue;
+        if(NTotal[ptype] == 0 && ptype < 4)
+            continue;
+        sprintf(blockname, "%d/%s", ptype, ent->name);
+        struct AsyncBlock * blk = &AsyncSnap.blocks[AsyncSnap.nblocks++];
+        int BlockWriters;
+        int64_t offset = 0, localsize;
+        blk->compressed = ent->codec.level > 0;
+
+        if(blk->compressed) {
+            /* Stage the compressed chunks*/
+            BigArray array = {0};
+            petaio_build_buffer(&array, ent, selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager, &conv);
+            if(MPIU_Any(0 != big_chunks_encode(&blk->chunks, &array, array.dtype, &ent->codec, IO_CHUNK_BYTES), MPI_COMM_WORLD)) {
+                endrun(0, "Failed to compress block %s:%s\n", blockname,
+                        big_file_get_error_message());
+            }
+            petaio_destroy_buffer(&array);
+            int64_t totbytes;
+            localsize = blk->chunks.bytes;
+            MPI_Allreduce(&localsize, &totbytes, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+            int NumFiles = petaio_block_files(totbytes, 1, &BlockWriters);
+            if(verbose && totbytes > 0)
+                message(0, "Will write %ld compressed bytes to %d Files for %s in the background.\n", totbytes, NumFiles, blockname);
+            if(0 != big_file_mpi_create_compressed_block(&AsyncSnap.bf, &blk->bb, blockname, &blk->chunks, &ent->codec, NumFiles, &blk->ptr, MPI_COMM_WORLD)) {
+                endrun(0, "Failed to create block at %s:%s\n", blockname,
+                        big_file_get_error_message());
+            }
+            size_t dims[1] = {blk->chunks.bytes};
+            big_array_init(&blk->array, blk->chunks.data, "u1", 1, dims, NULL);
+        }
+        else {
+            /* Copy the block into the staging area*/
+            size_t dims[2] = {ptype_count[ptype], ent->items};
+            ptrdiff_t strides[2];
+            int elsize = dtype_itemsize(ent->dtype);
+            strides[1] = elsize;
+            strides[0] = elsize * ent->items;
+            char * buffer = (char *) allocator_alloc_bot(AsyncSnap.alloc, "IOBUFFER", dims[0] * dims[1] * elsize);
+            big_array_init(&blk->array, buffer, ent->dtype, 2, dims, strides);
+            petaio_fill_buffer(&blk->array, ent, selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager, &conv);
+
+            /* Hash the copy, to store it and to find whether it is unchanged*/
+            int64_t firstrow = 0, j;
+            uint64_t hash[IO_HASH_WORDS] = {0};
+            MPI_Exscan(&ptype_count[ptype], &firstrow, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+            if(ThisTask == 0)
+                firstrow = 0;
+            #pragma omp parallel for reduction(+: hash[:IO_HASH_WORDS])
+            for(j = 0; j < ptype_count[ptype]; j++)
+                petaio_hash_row((unsigned char *) buffer + j * strides[0], strides[0], firstrow + j, hash);
+            MPI_Allreduce(MPI_IN_PLACE, hash, IO_HASH_WORDS, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+
+            size_t size = NTotal[ptype];
+            int NumFiles = petaio_block_files(size, elsize, &BlockWriters);
+            if(petaio_link_block(&AsyncSnap.bf, linkbf, blockname, ent, size, NumFiles, hash)) {
+                if(verbose)
+                    message(0, "Block %s is unchanged: linked to the previous snapshot.\n", blockname);
+                allocator_free(buffer);
+                AsyncSnap.nblocks--;
+                continue;
+            }
+            /* Create the block now, as it is collective*/
+            if(verbose && size > 0)
+                message(0, "Will write %td particles to %d Files for %s in the background.\n", size, NumFiles, blockname);
+            if(0 != big_file_mpi_create_block(&AsyncSnap.bf, &blk->bb, blockname, ent->dtype, ent->items, NumFiles, size, MPI_COMM_WORLD)) {
+                endrun(0, "Failed to create block at %s:%s\n", blockname,
+                        big_file_get_error_message());
+            }
+            if(0 != big_block_set_attr(&blk->bb, "ContentHash", hash, "u8", IO_HASH_WORDS)) {
+                endrun(0, "Failed to set attribute at %s:%s\n", blockname,
+                        big_file_get_error_message());
+            }
+            if(0 != big_block_seek(&blk->bb, &blk->ptr, 0)) {
+                endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
+            }
+        }
+        /* Throttle to the fewest writers any block asks for.*/
+        if(BlockWriters > 0 && BlockWriters < NumWriters)
+            NumWriters = BlockWriters;
+        /* Find where our part goes*/
+        localsize = blk->array.dims[0];
+        MPI_Exscan(&localsize, &offset, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        /* MPI_Exscan leaves the result on the first rank undefined*/
+        if(ThisTask == 0)
+            offset = 0;
+        if(0 != big_block_seek_rel(&blk->bb, &blk->ptr, offset)) {
+            endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
+        }
+    }
+    if(linkbf)
+        big_file_mpi_close(linkbf, MPI_COMM_WORLD);
+    myfree(selection);
+
+    if(CP->MassiveNuLinRespOn) {
+        petaio_save_neutrinos(&AsyncSnap.bf, ThisTask);
+    }
+
+    /* Ranks write in turn within each of NumWriters contiguous groups of ranks.
+     * The first rank of each group starts now, the others when petaio_async_progress
+     * or petaio_async_wait finds the token from the previous rank.*/
+    const int group = (int64_t) ThisTask * NumWriters / NTask;
+    AsyncSnap.prevrank = ThisTask > 0 && (int64_t) (ThisTask - 1) * NumWriters / NTask == group ? ThisTask - 1 : -1;
+    AsyncSnap.nextrank = ThisTask < NTask - 1 && (int64_t) (ThisTask + 1) * NumWriters / NTask == group ? ThisTask + 1 : -1;
+    /* Use our own communicator, so the token cannot match other messages*/
+    MPI_Comm_dup(MPI_COMM_WORLD, &AsyncSnap.comm);
+    AsyncSnap.recvtoken = MPI_REQUEST_NULL;
+    AsyncSnap.sendtoken = MPI_REQUEST_NULL;
+    AsyncSnap.writing = 0;
+    if(AsyncSnap.prevrank >= 0)
+        MPI_Irecv(NULL, 0, MPI_BYTE, AsyncSnap.prevrank, 0, AsyncSnap.comm, &AsyncSnap.recvtoken);
+    else
+        petaio_async_start_writer();
+    AsyncSnap.pending = 1;
+    return 1;
+}
+
+/* Wait for the snapshot being written in the background to complete, and close it.
+ * Collective. Returns 1 if a snapshot was completed, 0 if none was being written.*/
+int
+petaio_async_wait(void)
+{
+    if(!AsyncSnap.pending)
+        return 0;
+
+    /* Complete the writes of the group in order*/
+    if(AsyncSnap.recvtoken != MPI_REQUEST_NULL) {
+        MPI_Wait(&AsyncSnap.recvtoken, MPI_STATUS_IGNORE);
+        petaio_async_start_writer();
+    }
+    if(AsyncSnap.writing)
+        petaio_async_pass_token();
+    MPI_Wait(&AsyncSnap.sendtoken, MPI_STATUS_IGNORE);
+    MPI_Comm_free(&AsyncSnap.comm);
+    AsyncSnap.pending = 0;
+    if(MPIU_Any(AsyncSnap.error, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to write snapshot at %s:%s\n", AsyncSnap.fname,
+                    big_file_get_error_message());
+    }
+
+    int i;
+    /* Closing the blocks combines the checksums from all ranks*/
+    for(i = 0; i < AsyncSnap.nblocks; i++) {
+        if(0 != big_block_mpi_close(&AsyncSnap.blocks[i].bb, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to close block in %s:%s\n", AsyncSnap.fname,
+                    big_file_get_error_message());
+        }
+    }
+    if(0 != big_file_mpi_close(&AsyncSnap.bf, MPI_COMM_WORLD)){
+        endrun(0, "Failed to close snapshot at %s:%s\n", AsyncSnap.fname,
+                    big_file_get_error_message());
+    }
+    /* Free the staged blocks in reverse order*/
+    for(i = AsyncSnap.nblocks - 1; i >= 0; i--) {
+        if(AsyncSnap.blocks[i].compressed)
+            big_chunks_free(&AsyncSnap.blocks[i].chunks);
+        else
+            allocator_free(AsyncSnap.blocks[i].array.data);
+    }
+    allocator_free(AsyncSnap.blocks);
+    allocator_destroy(AsyncSnap.alloc);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    message(0, "Finished saving snapshot into %s\n", AsyncSnap.fname);
+    return 1;
+}
+
 /*
  * register an IO block of name for particle type ptype.
  *
@@ -707,9 +2090,23 @@ void io_register_io_block(const char * name,
     ent->setter = setter;
     ent->items = items;
     ent->required = required;
+    memset(&ent->codec, 0, sizeof(ent->codec));
+    ent->direct = 0;
+    ent->direct_offset = 0;
+    ent->direct_dtype[0] = '\0';
     IOTable->used ++;
 }
 
+void io_register_direct(int where, size_t offset, char kind, size_t size, struct IOTable * IOTable)
+{
+    if(IOTable->used == 0)
+        endrun(1, "No block to read directly\n");
+    IOTableEntry * ent = &IOTable->ent[IOTable->used - 1];
+    ent->direct = where;
+    ent->direct_offset = offset;
+    snprintf(ent->direct_dtype, sizeof(ent->direct_dtype), "%c%zu", kind, size);
+}
+
 static void GTPosition(int i, double * out, void * baseptr, void * smanptr, const struct conversions * params) {
     /* Remove the particle offset before saving*/
     struct particle_data * part = (struct particle_data *) baseptr;
@@ -961,9 +2358,12 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID, int MetalRet
         /* We put Mass first because sometimes there is
          * corruption in the first array and we can recover from Mass corruption*/
         IO_REG(Mass,     "f4", 1, i, IOTable);
+        IO_DIRECT(Mass, 'f', IOTable);
         IO_REG(Position, "f8", 3, i, IOTable);
+        IO_DIRECT(Pos[0], 'f', IOTable);
         IO_REG(Velocity, "f4", 3, i, IOTable);
         IO_REG(ID,       "u8", 1, i, IOTable);
+        IO_DIRECT(ID, 'u', IOTable);
         if(IO.OutputPotential)
             IO_REG_WRONLY(Potential, "f4", 1, i, IOTable);
         if(WriteGroupID)
@@ -979,10 +2379,14 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID, int MetalRet
     IO_REG(Generation,       "u1", 1, 5, IOTable);
     /* Bare Bone SPH*/
     IO_REG(SmoothingLength,  "f4", 1, 0, IOTable);
+    IO_DIRECT(Hsml, 'f', IOTable);
     IO_REG(Density,          "f4", 1, 0, IOTable);
+    IO_DIRECT_PI(Density, 'f', struct sph_particle_data, IOTable);
 
-    if(DensityIndependentSphOn())
+    if(DensityIndependentSphOn()) {
         IO_REG(EgyWtDensity,          "f4", 1, 0, IOTable);
+        IO_DIRECT_PI(EgyWtDensity, 'f', struct sph_particle_data, IOTable);
+    }
 
     /* On reload this sets the Entropy variable, need the densities.
      * Register this after Density and EgyWtDensity will ensure density is read
@@ -991,6 +2395,7 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID, int MetalRet
 
     /* Cooling */
     IO_REG(ElectronAbundance,       "f4", 1, 0, IOTable);
+    IO_DIRECT_PI(Ne, 'f', struct sph_particle_data, IOTable);
     IO_REG_WRONLY(NeutralHydrogenFraction, "f4", 1, 0, IOTable);
 
     if(IO.OutputHeliumFractions) {
@@ -1005,25 +2410,39 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID, int MetalRet
     IO_REG_WRONLY(StarFormationRate, "f4", 1, 0, IOTable);
     /* Another new addition: save the DelayTime for wind particles*/
     IO_REG_NONFATAL(DelayTime,  "f4", 1, 0, IOTable);
+    IO_DIRECT_PI(DelayTime, 'f', struct sph_particle_data, IOTable);
 
     IO_REG_NONFATAL(BirthDensity, "f4", 1, 4, IOTable);
+    IO_DIRECT_PI(BirthDensity, 'f', struct star_particle_data, IOTable);
     IO_REG_TYPE(StarFormationTime, "f4", 1, 4, IOTable);
+    IO_DIRECT_PI(FormationTime, 'f', struct star_particle_data, IOTable);
     IO_REG_TYPE(Metallicity,       "f4", 1, 0, IOTable);
+    IO_DIRECT_PI(Metallicity, 'f', struct sph_particle_data, IOTable);
     IO_REG_TYPE(Metallicity,       "f4", 1, 4, IOTable);
+    IO_DIRECT_PI(Metallicity, 'f', struct star_particle_data, IOTable);
     if(MetalReturnOn) {
         IO_REG_TYPE(Metals,       "f4", NMETALS, 0, IOTable);
+        IO_DIRECT_PI(Metals[0], 'f', struct sph_particle_data, IOTable);
         IO_REG_TYPE(Metals,       "f4", NMETALS, 4, IOTable);
+        IO_DIRECT_PI(Metals[0], 'f', struct star_particle_data, IOTable);
         IO_REG_TYPE(LastEnrichmentMyr, "f4", 1, 4, IOTable);
+        IO_DIRECT_PI(LastEnrichmentMyr, 'f', struct star_particle_data, IOTable);
         IO_REG_TYPE(TotalMassReturned, "f4", 1, 4, IOTable);
+        IO_DIRECT_PI(TotalMassReturned, 'f', struct star_particle_data, IOTable);
         IO_REG_NONFATAL(SmoothingLength,  "f4", 1, 4, IOTable);
+        IO_DIRECT(Hsml, 'f', IOTable);
     }
     /* end SF */
 
     /* Black hole */
     IO_REG_TYPE(StarFormationTime, "f4", 1, 5, IOTable);
+    IO_DIRECT_PI(FormationTime, 'f', struct bh_particle_data, IOTable);
     IO_REG(BlackholeMass,          "f4", 1, 5, IOTable);
+    IO_DIRECT_PI(Mass, 'f', struct bh_particle_data, IOTable);
     IO_REG(BlackholeDensity,          "f4", 1, 5, IOTable);
+    IO_DIRECT_PI(Density, 'f', struct bh_particle_data, IOTable);
     IO_REG(BlackholeAccretionRate, "f4", 1, 5, IOTable);
+    IO_DIRECT_PI(Mdot, 'f', struct bh_particle_data, IOTable);
     IO_REG(BlackholeProgenitors,   "i4", 1, 5, IOTable);
     IO_REG(BlackholeMinPotPos, "f8", 3, 5, IOTable);
     IO_REG(BlackholeJumpToMinPot,   "i4", 1, 5, IOTable);
@@ -1033,6 +2452,7 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID, int MetalRet
 
     /* Smoothing lengths for black hole: this is a new addition*/
     IO_REG_NONFATAL(SmoothingLength,  "f4", 1, 5, IOTable);
+    IO_DIRECT(Hsml, 'f', IOTable);
     /* Marks whether a BH particle has been swallowed*/
     IO_REG_NONFATAL(Swallowed, "u1", 1, 5, IOTable);
     /* ID of the swallowing black hole particle. If == -1, then particle is live*/
@@ -1049,6 +2469,17 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID, int MetalRet
 #endif
     /* end excursion set*/
 
+    /* Compress the particle blocks. Positions may be quantised to 32 bit fractions of the box.*/
+    if(IO.CompressionLevel > 0) {
+        for(i = 0; i < IOTable->used; i++) {
+            IOTableEntry * ent = &IOTable->ent[i];
+            ent->codec.level = IO.CompressionLevel;
+            ent->codec.shuffle = 1;
+            if(IO.QuantisePositions && 0 == strcmp(ent->name, "Position"))
+                ent->codec.quantum = PartManager->BoxSize / 4294967296.;
+        }
+    }
+
     /*Sort IO blocks so similar types are together; then ordered by the sequence they are declared. */
     qsort_openmp(IOTable->ent, IOTable->used, sizeof(struct IOTableEntry), order_by_type);
 }
@@ -55,12 +55,22 @@ typedef struct IOTableEntry {
     int required;
     property_getter getter;
     property_setter setter;
+    /* How to compress the block when writing. Not compressed if codec.level is 0.*/
+    BigCodec codec;
+    /* If the setter is a plain copy of a field, the block is read straight into it.
+     * direct is 1 for a field of struct particle_data, 2 for a field of the slot of ptype and 0 otherwise.
+     * direct_offset is the offset of the field and direct_dtype its type in memory.*/
+    int direct;
+    size_t direct_offset;
+    char direct_dtype[8];
 } IOTableEntry;
 
 struct IOTable {
     IOTableEntry * ent;
     int used;
     int allocated;
+    /* Snapshot to hard link unchanged blocks to, if SnapshotLinkUnchangedBlocks is set. May be NULL.*/
+    char * LinkSnapshot;
 };
 
 #define PTYPE_FOF_GROUP  1024
@@ -83,10 +93,26 @@ void petaio_readout_buffer(BigArray * array, IOTableEntry * ent, struct conversi
 void petaio_destroy_buffer(BigArray * array);
 
 void petaio_save_block(BigFile * bf, const char * blockname, BigArray * array, int verbose);
+/* Save a block, writing the rows of array to the runs of (offset, count) pairs in the block, which may be scattered.*/
+void petaio_save_block_runs(BigFile * bf, const char * blockname, BigArray * array, const ptrdiff_t * runs, const int64_t nruns, int verbose);
+void petaio_save_compressed_block(BigFile * bf, const char * blockname, BigArray * array, const BigCodec * codec, int verbose);
 int petaio_read_block(BigFile * bf, const char * blockname, BigArray * array, int required);
 
 void petaio_save_snapshot(const char * fname, struct IOTable * IOTable, int verbose, const double atime, const Cosmology * CP);
+/* Save a snapshot, writing it in the background if AsyncSnapshotMaxMB allows. Returns 1 if the write is still in progress.*/
+int petaio_save_snapshot_async(const char * fname, struct IOTable * IOTable, int verbose, const double atime, const Cosmology * CP);
+/* Complete a snapshot being written in the background. Returns 1 if there was one.*/
+int petaio_async_wait(void);
+/* Let the next rank of each writer group start writing the background snapshot once the previous one is done.
+ * Not collective; call it often, eg once per timestep. Ranks not reached by then write in petaio_async_wait.*/
+void petaio_async_progress(void);
 void petaio_read_snapshot(int num, const char * OutputDir, Cosmology * CP, struct header_data * header, struct part_manager_type * PartManager, struct slots_manager_type * SlotsManager, MPI_Comm Comm);
+/* Returns 1 if SnapshotReadTypes or SnapshotReadRegion select only some of the particles of a snapshot.
+ * Such subsets are only useful for analysis, not for continuing a simulation.*/
+int petaio_reading_subset(void);
+/* For a subset read, set header->NLocal to the number of particles of each type read onto this rank and return 1.
+ * Returns 0 if the whole snapshot is read. A region can only be selected in snapshots written with SnapshotPeanoIndex.*/
+int petaio_read_subset_counts(int num, const char * OutputDir, struct header_data * header, MPI_Comm Comm);
 /* Returns a header struct. Note that this may also change the cosmology values in CP, if those are different from the ones in the parameter file*/
 struct header_data petaio_read_header(int num, const char * OutputDir, Cosmology * CP);
 
@@ -128,6 +154,14 @@ void io_register_io_block(const char * name,
         struct IOTable * IOTable
         );
 
+/* Mark the last registered block as a plain copy of field, which may then be read without a buffer or the setter.
+ * kind is the dtype kind of the field in memory, 'f', 'i' or 'u'. For arrays field is the first element.*/
+#define IO_DIRECT(field, kind, IOTable) \
+    io_register_direct(1, offsetof(struct particle_data, field), kind, sizeof(((struct particle_data *) 0)->field), IOTable)
+#define IO_DIRECT_PI(field, kind, slottype, IOTable) \
+    io_register_direct(2, offsetof(slottype, field), kind, sizeof(((slottype *) 0)->field), IOTable)
+void io_register_direct(int where, size_t offset, char kind, size_t size, struct IOTable * IOTable);
+
 
 /*
  * define a simple getter function
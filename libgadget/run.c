@@ -353,6 +353,9 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
 
     while(1) /* main loop */
     {
+        /* Pass on the turn to write a snapshot being written in the background*/
+        petaio_async_progress();
+
         /* Find next synchronization point and the timebins active during this timestep.
          *
          * Note that on startup, P[i].TimeBin == 0 for all particles,
@@ -389,6 +392,8 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
             stop = hci_query(HCI_DEFAULT_MANAGER, action);
 
             if(action->type == HCI_TERMINATE) {
+                /* endrun aborts, so a snapshot still being written in the background would be truncated*/
+                finish_checkpoint();
                 endrun(0, "Human triggered termination.\n");
             }
         }
@@ -414,8 +419,10 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
         if(extradomain || is_PM) {
             /* Sync positions of all particles */
             drift_all_particles(Ti_Last, times.Ti_Current, &All.CP, rel_random_shift);
-            /* full decomposition rebuilds the domain, needs keys.*/
-            domain_decompose_full(ddecomp);
+            /* Try to keep or incrementally rebalance the existing domain.
+             * A full decomposition rebuilds the domain, needs keys.*/
+            if(domain_decompose_incremental(ddecomp))
+                domain_decompose_full(ddecomp);
         } else {
             /* If it is not a PM step, do a shorter version
              * of the ddecomp decomp which just exchanges particles.
@@ -425,9 +432,15 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
             drift.CP = &All.CP;
             drift.ti0 = Ti_Last;
             drift.ti1 = times.Ti_Current;
+            /* Inactive particles are not used on this step unless the gravity tree contains all particles,
+             * or the lightcone needs their positions.*/
+            drift.lazy = All.HierarchicalGravity && !All.LightconeOn;
             int needfull = domain_maintain(ddecomp, &drift);
-            if(needfull)
+            if(needfull) {
+                /* The new domain needs the current positions of all particles*/
+                drift_lagging_particles(PartManager, SlotsManager);
                 domain_decompose_full(ddecomp);
+            }
         }
         update_lastactive_drift(&times);
 
@@ -466,8 +479,9 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
 
             /* adds hydrodynamical accelerations and computes du/dt  */
             if(All.HydroOn) {
-                /* Calculate moments to propagate new hmax up the tree. */
-                force_tree_calc_moments(&gasTree, ddecomp);
+                /* density() propagated the new hmax of the active particles up to the local top-level nodes.
+                 * Exchange the changed top-level nodes to finish the update.*/
+                force_exchange_hmax(&gasTree, ddecomp);
                 walltime_measure("/SPH/HmaxUpdate");
                 int64_t totnumparticles;
                 MPI_Reduce(&gasTree.NumParticles, &totnumparticles, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
@@ -677,6 +691,8 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
             WritePlane |= action->write_plane; 
         }
         if(WriteSnapshot || WriteFOF) {
+            /* Outputs should be on PM steps, but make sure every particle is at the current time.*/
+            drift_lagging_particles(PartManager, SlotsManager);
             /* Get a new snapshot*/
             SnapshotFileCount++;
             /* The accel may have created garbage -- collect them before writing a snapshot.
@@ -691,26 +707,18 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
             fof = fof_fof(ddecomp, 1, MPI_COMM_WORLD);
         }
 
+        /* Write the stored lightcone with the checkpoint, so a restart does not lose it*/
+        if(WriteSnapshot && All.LightconeOn)
+            lightcone_flush();
+
         /* WriteFOF just reminds the checkpoint code to save GroupID*/
         if(WriteSnapshot)
             write_checkpoint(SnapshotFileCount, WriteFOF, All.MetalReturnOn, atime, &All.CP, All.OutputDir, All.OutputDebugFields);
 
         /* Save FOF tables after checkpoint so that if there is a FOF save bug we have particle tables available to debug it*/
         if(WriteFOF) {
-            int domain_needed = fof_save_groups(&fof, All.OutputDir, All.FOFFileBase, SnapshotFileCount, &All.CP, atime, header->MassTable, All.MetalReturnOn, MPI_COMM_WORLD);
-            /* In case we need to do a second exchange to get back to a sensible compact mass distribution*/
+            fof_save_groups(&fof, All.OutputDir, All.FOFFileBase, SnapshotFileCount, &All.CP, atime, header->MassTable, All.MetalReturnOn, MPI_COMM_WORLD);
             fof_finish(&fof);
-            if(domain_needed) {
-                /* Because this Peano sorts the particles, it should avoid a
-                 * single iteration of the domain exchange sending more particles
-                 * to one processor than there is room for.*/
-                slots_gc_sorted(PartManager, SlotsManager);
-                /* Do a domain exchange*/
-                if(domain_maintain(ddecomp, NULL))
-                    endrun(0, "Domain exchange after FOF save particle did not complete!\n");
-                /* Not strictly necessary, but a good idea for performance*/
-                slots_gc_sorted(PartManager, SlotsManager);
-            }
         }
 
         /* Write the potential planes*/
@@ -792,6 +800,10 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
         NumCurrentTiStep++;
     }
 
+    if(All.LightconeOn)
+        lightcone_flush();
+    /* The last snapshot may still be being written*/
+    finish_checkpoint();
     close_outputfiles(&fds);
 }
 
@@ -242,10 +242,10 @@ slots_gc_base(struct part_manager_type * pman)
     return 0;
 }
 
-static int slot_cmp_reverse_link(const void * b1in, const void * b2in) {
+static void slot_radix_reverse_link(const void * b1in, void * radix, void * arg) {
     const struct particle_data_ext * b1 = (struct particle_data_ext *) b1in;
-    const struct particle_data_ext * b2 = (struct particle_data_ext *) b2in;
-    return (b1->ReverseLink > b2->ReverseLink) - (b1->ReverseLink < b2->ReverseLink);
+    /* Flip the sign bit so negative links sort first*/
+    *(uint32_t *) radix = ((uint32_t) b1->ReverseLink) ^ (1u << 31);
 }
 
 static int
@@ -402,29 +402,16 @@ slots_get_last_garbage(int nfirst, int nlast, int ptype, const struct part_manag
     return nlast;
 }
 
-struct PeanoOrder
-{
-    peano_t Key;
-    int TypeKey;
-    int Pindex;
-};
-
-static int
-order_by_type_and_key(const void *a, const void *b)
+/* Sort key for particles: type, then peano key.*/
+static void
+radix_by_type_and_key(const void * a, void * radix, void * arg)
 {
-    const struct PeanoOrder * pa  = (const struct PeanoOrder *) a;
-    const struct PeanoOrder * pb  = (const struct PeanoOrder *) b;
-    /* Note garbage types have their values set to something large here*/
-    if(pa->TypeKey < pb->TypeKey)
-        return -1;
-    if(pa->TypeKey > pb->TypeKey)
-        return +1;
-    if(pa->Key < pb->Key)
-        return -1;
-    if(pa->Key > pb->Key)
-        return +1;
-
-    return 0;
+    const struct particle_data * pa = (const struct particle_data *) a;
+    const struct part_manager_type * pman = (const struct part_manager_type *) arg;
+    uint64_t * u = (uint64_t *) radix;
+    u[0] = PEANO(pa->Pos, pman->BoxSize);
+    /* Garbage has a type far beyond the existing types, so it sorts to the end.*/
+    u[1] = pa->IsGarbage ? 255 : pa->Type;
 }
 
 /* Sort the particles and their slots by type and peano order.
@@ -438,48 +425,16 @@ slots_gc_sorted(struct part_manager_type * pman, struct slots_manager_type * sma
     /* Resort the particles such that those of the same type and key are close by.
      * The locality is broken by the exchange. */
     int64_t garbage=0;
-    struct PeanoOrder * peanokeys = mymalloc("Keydata", pman->NumPart * sizeof(struct PeanoOrder));
     #pragma omp parallel for reduction(+: garbage)
     for(i = 0; i < pman->NumPart; i++) {
-        peanokeys[i].Key = PEANO(pman->Base[i].Pos, pman->BoxSize);
-        peanokeys[i].TypeKey = pman->Base[i].Type;
-        if(pman->Base[i].IsGarbage) {
+        if(pman->Base[i].IsGarbage)
             garbage++;
-            /* Set it to a type far beyond the existing types, so it sorts to the end.*/
-            peanokeys[i].TypeKey = 255;
-        }
-        peanokeys[i].Pindex = i;
-    }
-    /* Sort the keys*/
-    qsort_openmp(peanokeys, pman->NumPart, sizeof(struct PeanoOrder), order_by_type_and_key);
-    /* Now sort the base with a cycle leader permutation algorithm, like qsort.*/
-    for(i = 0; i < pman->NumPart; i++) {
-        int k = peanokeys[i].Pindex;
-        /* This element already in the right place*/
-        if(k == i)
-            continue;
-        /* Copy the wrongly placed element to a tmp*/
-        struct particle_data tmp_p = pman->Base[i];
-        int j = i;
-        do {
-            /* Update index so that we know this element is permuted.*/
-            peanokeys[j].Pindex = j;
-            /* Copy the right element in.*/
-            pman->Base[j] = pman->Base[k];
-            /* k is the new j*/
-            j = k;
-            k = peanokeys[j].Pindex;
-        } while(i != k);
-
-        /* We finished when we found the right spot for the first object, the one we copied into tmp*/
-        peanokeys[j].Pindex = j;
-        pman->Base[j] = tmp_p;
     }
+    radix_sort_openmp(pman->Base, pman->NumPart, sizeof(struct particle_data), radix_by_type_and_key, 2 * sizeof(uint64_t), pman);
     // message(1, "garbage %ld\n", garbage);
     /*Remove garbage particles*/
     pman->NumPart -= garbage;
 
-    myfree(peanokeys);
     /*Set up ReverseLink*/
     slots_gc_mark(pman, sman);
 
@@ -488,10 +443,10 @@ slots_gc_sorted(struct part_manager_type * pman, struct slots_manager_type * sma
             continue;
         /* sort the used ones
          * by their location in the P array */
-        qsort_openmp(sman->info[ptype].ptr,
+        radix_sort_openmp(sman->info[ptype].ptr,
                  sman->info[ptype].size,
                  sman->info[ptype].elsize,
-                 slot_cmp_reverse_link);
+                 slot_radix_reverse_link, sizeof(uint32_t), NULL);
 
         /*Reduce slots used*/
         SlotsManager->info[ptype].size = slots_get_last_garbage(0, sman->info[ptype].size-1, ptype, pman, sman);
@@ -303,7 +303,7 @@ static int setup_density(void **state) {
     for(i = 0; i < 6; i++)
         maxpart+=atleast[i];
     const double BoxSize = 8;
-    particle_alloc_memory(PartManager, BoxSize, maxpart);
+    particle_alloc_memory(PartManager, BoxSize, maxpart, maxpart);
     slots_reserve(1, atleast, SlotsManager);
     walltime_init(&CT);
     init_forcetree_params(0.7);
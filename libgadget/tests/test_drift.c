@@ -0,0 +1,137 @@
+/*Tests for the lazy drift of particles skipped on a step*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libgadget/drift.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/walltime.h>
+#include "stub.h"
+
+static struct ClockTable CT;
+
+#define NUMPART 64
+
+/* Drift factor of the step ending at ti*/
+static double
+step_factor(inttime_t ti)
+{
+    return 0.01 * (1 + ti % 3);
+}
+
+/* Particle i is drifted on a step ending at ti if ti is a multiple of 1, 2, 4 or 8, like a timebin.*/
+static int
+is_active(int i, inttime_t ti)
+{
+    return ti % (1 << (i % 4)) == 0;
+}
+
+/* Drift from ti0 to ti1 as domain_maintain does with a lazy drift: only the active particles move,
+ * from their own Ti_drift, and the others are left behind in the history.*/
+static void
+lazy_step(inttime_t ti0, inttime_t ti1)
+{
+    const double zero[3] = {0};
+    int i;
+    assert_int_equal(drift_history_push(ti0, ti1, step_factor(ti1)), 1);
+    for(i = 0; i < PartManager->NumPart; i++) {
+        struct particle_data * pp = &PartManager->Base[i];
+        if(!is_active(i, ti1))
+            continue;
+        real_drift_particle(pp, SlotsManager, drift_history_factor(pp->Ti_drift), PartManager->BoxSize, zero);
+        pp->Ti_drift = ti1;
+    }
+}
+
+/* Drift every particle of the copy by one step*/
+static void
+eager_step(struct particle_data * eager, inttime_t ti1)
+{
+    const double zero[3] = {0};
+    int i;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        real_drift_particle(&eager[i], SlotsManager, step_factor(ti1), PartManager->BoxSize, zero);
+        eager[i].Ti_drift = ti1;
+    }
+}
+
+static void
+check_positions(const struct particle_data * eager, inttime_t ti)
+{
+    int i, j;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        assert_int_equal(PartManager->Base[i].Ti_drift, ti);
+        for(j = 0; j < 3; j++)
+            assert_true(fabs(PartManager->Base[i].Pos[j] - eager[i].Pos[j]) < 1e-9 * PartManager->BoxSize);
+    }
+}
+
+static void
+test_lazy_drift(void ** state)
+{
+    walltime_init(&CT);
+    const double BoxSize = 1000;
+    particle_alloc_memory(PartManager, BoxSize, NUMPART, NUMPART);
+    PartManager->NumPart = NUMPART;
+    int i, j;
+    for(i = 0; i < NUMPART; i++) {
+        struct particle_data * pp = &PartManager->Base[i];
+        pp->ID = i;
+        pp->Type = 1;
+        pp->Mass = 1;
+        for(j = 0; j < 3; j++) {
+            pp->Pos[j] = fmod(37.1 * i + 101.3 * j, BoxSize) + 0.5;
+            /* Fast enough that some particles wrap around the box*/
+            pp->Vel[j] = 2000 * sin(i + 3 * j);
+        }
+    }
+    struct particle_data * eager = (struct particle_data *) mymalloc("Eager", NUMPART * sizeof(struct particle_data));
+    memcpy(eager, PartManager->Base, NUMPART * sizeof(struct particle_data));
+
+    inttime_t ti;
+    drift_history_reset(0);
+    /* Several steps on which some particles are skipped*/
+    for(ti = 1; ti <= 7; ti++) {
+        lazy_step(ti - 1, ti);
+        eager_step(eager, ti);
+    }
+    /* The history gives the drift of the skipped steps*/
+    assert_true(fabs(drift_history_factor(4) - (step_factor(5) + step_factor(6) + step_factor(7))) < 1e-12);
+    assert_true(drift_history_factor(7) == 0);
+    drift_lagging_particles(PartManager, SlotsManager);
+    check_positions(eager, 7);
+
+    /* A new history starts after the catch up*/
+    for(ti = 8; ti <= 13; ti++) {
+        lazy_step(ti - 1, ti);
+        eager_step(eager, ti);
+    }
+    drift_lagging_particles(PartManager, SlotsManager);
+    check_positions(eager, 13);
+
+    /* After an explicit reset, once everything is synchronised, lazy drifts start from the reset time*/
+    drift_history_reset(13);
+    for(ti = 14; ti <= 19; ti++) {
+        lazy_step(ti - 1, ti);
+        eager_step(eager, ti);
+    }
+    drift_lagging_particles(PartManager, SlotsManager);
+    check_positions(eager, 19);
+
+    myfree(eager);
+    myfree(PartManager->Base);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_lazy_drift),
+    };
+    return cmocka_run_group_tests_mpi(tests, NULL, NULL);
+}
@@ -156,6 +156,27 @@ test_exchange_with_garbage(void **state)
     return;
 }
 
+static void
+test_exchange_no_space(void **state)
+{
+    int64_t newSlots[6] = {NUMPART1, NUMPART1, NUMPART1, NUMPART1, NUMPART1, NUMPART1};
+
+    setup_particles(newSlots);
+    /* No room at the end of the particle array for incoming particles,
+     * so the exported particles must be buffered and a gc done before receiving.*/
+    PartManager->MaxPart = PartManager->NumPart;
+
+    int fail = domain_exchange(&test_exchange_layout_func, NULL, NULL, PartManager, SlotsManager, 10000, MPI_COMM_WORLD);
+
+    assert_all_true(!fail);
+#ifdef DEBUG
+    slots_check_id_consistency(PartManager, SlotsManager);
+#endif
+    domain_test_id_uniqueness(PartManager);
+    teardown_particles(state);
+    return;
+}
+
 static int
 test_exchange_layout_func_uneven(int i, const void * userdata)
 {
@@ -215,6 +236,7 @@ int main(void) {
         cmocka_unit_test(test_exchange_with_garbage),
         cmocka_unit_test(test_exchange),
         cmocka_unit_test(test_exchange_zero_slots),
+        cmocka_unit_test(test_exchange_no_space),
         cmocka_unit_test(test_exchange_uneven),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
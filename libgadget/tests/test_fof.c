@@ -33,7 +33,7 @@ setup_particles(int NumPart, double BoxSize)
     gsl_rng * r = gsl_rng_alloc(gsl_rng_mt19937);
     gsl_rng_set(r, 0);
 
-    particle_alloc_memory(PartManager, BoxSize, 1.5 * NumPart);
+    particle_alloc_memory(PartManager, BoxSize, 1.5 * NumPart, NumPart);
     PartManager->NumPart = NumPart;
 
     int i;
@@ -74,6 +74,7 @@ test_fof(void **state)
     dp.DomainUseGlobalSorting = 0;
     dp.TopNodeAllocFactor = 1.;
     dp.SetAsideFactor = 1;
+    dp.DomainUseNodeOrdering = 1;
     set_domain_par(dp);
     init_forcetree_params(0.7);
 
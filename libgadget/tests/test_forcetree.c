@@ -296,7 +296,7 @@ static void test_rebuild_flat(void ** state) {
     /*Set up the particle data*/
     int ncbrt = 128;
     int numpart = ncbrt*ncbrt*ncbrt;
-    particle_alloc_memory(PartManager, 8, numpart);
+    particle_alloc_memory(PartManager, 8, numpart, numpart);
     /* Create a regular grid of particles, 8x8x8, all of type 1,
      * in a box 8 kpc across.*/
     int i;
@@ -332,7 +332,7 @@ static void test_rebuild_close(void ** state) {
     int ncbrt = 128;
     int numpart = ncbrt*ncbrt*ncbrt;
     double close = 5000;
-    particle_alloc_memory(PartManager, 8, numpart);
+    particle_alloc_memory(PartManager, 8, numpart, numpart);
     /* Create particles clustered in one place, all of type 1.*/
     int i;
     #pragma omp parallel for
@@ -389,7 +389,7 @@ static void test_rebuild_random(void ** state) {
     DomainDecomp ddecomp = data->ddecomp;
     gsl_rng * r = (gsl_rng *) data->r;
     int numpart = ncbrt*ncbrt*ncbrt;
-    particle_alloc_memory(PartManager, 8, numpart);
+    particle_alloc_memory(PartManager, 8, numpart, numpart);
     /*Allocate tree*/
     /*Base pointer*/
     ddecomp.TopLeaves[0].treenode = numpart;
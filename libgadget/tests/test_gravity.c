@@ -223,7 +223,7 @@ static void test_force_flat(void ** state) {
     /*Set up the particle data*/
     int numpart = PartManager->NumPart;
     int ncbrt = cbrt(numpart);
-    particle_alloc_memory(PartManager, 8, numpart);
+    particle_alloc_memory(PartManager, 8, numpart, numpart);
     /* Create a regular grid of particles, 8x8x8, all of type 1,
      * in a box 8 kpc across.*/
     int i;
@@ -266,7 +266,7 @@ static void test_force_close(void ** state) {
     int numpart = PartManager->NumPart;
     int ncbrt = cbrt(numpart);
     double close = 5000;
-    particle_alloc_memory(PartManager, 8, numpart);
+    particle_alloc_memory(PartManager, 8, numpart, numpart);
     /* Create particles clustered in one place, all of type 1.*/
     int i;
     #pragma omp parallel for
@@ -309,7 +309,7 @@ static void test_force_random(void ** state) {
     int numpart = PartManager->NumPart;
     struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
     gsl_rng * r = data->r;
-    particle_alloc_memory(PartManager, 8, numpart);
+    particle_alloc_memory(PartManager, 8, numpart, numpart);
     int i;
     for(i=0; i<2; i++) {
         do_random_test(r, numpart);
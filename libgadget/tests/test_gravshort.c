@@ -0,0 +1,200 @@
+/*Test that walking the gravity trees of the other ranks on a node through shared memory
+ * gives the same short-range forces as exporting to them, and that the grouped neighbour search
+ * gives the same pairwise forces as a neighbour search for each particle.*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "stub.h"
+
+#include <libgadget/utils/mymalloc.h>
+#include <libgadget/utils/system.h>
+#include <libgadget/utils/endrun.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/walltime.h>
+#include <libgadget/domain.h>
+#include <libgadget/forcetree.h>
+#include <libgadget/gravity.h>
+#include <libgadget/petapm.h>
+#include <libgadget/treewalk.h>
+#include <libgadget/utils/paramset.h>
+
+static struct ClockTable CT;
+static const double G = 43.0071;
+
+#define NUMPART 4096
+
+/* Set the treewalk parameters: exports are sent at full precision, so that they do not change the forces.*/
+static void
+set_treewalk(const int NgbGroupSize)
+{
+    ParameterSet * ps = parameter_set_new();
+    param_declare_int(ps, "ImportBufferBoost", OPTIONAL, 2, "");
+    param_declare_int(ps, "TreeWalkCompressExports", OPTIONAL, 0, "");
+    param_declare_int(ps, "TreeWalkNgbGroupSize", OPTIONAL, NgbGroupSize, "");
+    char empty[1] = "";
+    param_parse(ps, empty);
+    set_treewalk_params(ps);
+    parameter_set_free(ps);
+}
+
+/* Place the particles of this rank, the same way every time, compute the short-range forces
+ * and store them in accn, indexed by ID. If pairwise is true the forces are summed over the neighbours
+ * within one mesh smoothing length, otherwise they are computed with the tree. Returns the mean acceleration.*/
+static double
+short_forces(double * accn, const int64_t NTot, const int pairwise)
+{
+    int ThisTask, i, d;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    particle_alloc_memory(PartManager, 8, 2 * NUMPART, NUMPART);
+    /* The exchange may reserve slots*/
+    slots_init(0.01 * PartManager->MaxPart, SlotsManager);
+    PartManager->NumPart = NUMPART;
+    for(i = 0; i < NUMPART; i++) {
+        P[i].Type = 1;
+        P[i].Mass = 1;
+        P[i].ID = (int64_t) ThisTask * NUMPART + i;
+        /* Half the particles in a clump, so the ranks' trees differ in depth*/
+        const double scale = i % 2 ? PartManager->BoxSize : PartManager->BoxSize / 8;
+        for(d = 0; d < 3; d++)
+            P[i].Pos[d] = fmod(scale * fabs(sin(P[i].ID * 1.37 + d * 2.11)) + 0.01, PartManager->BoxSize);
+    }
+
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+
+    /* Only the mesh size and smoothing are used by the tree walk*/
+    PetaPM pm = {0};
+    pm.Nmesh = 48;
+    pm.Asmth = 1.5;
+    pm.G = G;
+    gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_EXACT, pm.Asmth);
+
+    ForceTree Tree = {0};
+    force_tree_full(&Tree, &ddecomp, 0, NULL);
+
+    struct gravshort_tree_params treeacc = {0};
+    treeacc.BHOpeningAngle = 0.175;
+    treeacc.TreeUseBH = 1;
+    treeacc.Rcut = 7;
+    treeacc.ErrTolForceAcc = 0.002;
+    treeacc.FractionalGravitySoftening = 1./30.;
+    set_gravshort_treepar(treeacc);
+    gravshort_set_softenings(PartManager->BoxSize / cbrt(NUMPART));
+
+    ActiveParticles act = init_empty_active_particles(PartManager);
+    if(pairwise)
+        grav_short_pair(&act, &pm, &Tree, 1, 0);
+    else
+        grav_short_tree(&act, &pm, &Tree, NULL, 1, 0);
+
+    memset(accn, 0, 3 * NTot * sizeof(double));
+    double meanacc = 0;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        for(d = 0; d < 3; d++) {
+            accn[3 * P[i].ID + d] = P[i].FullTreeGravAccel[d];
+            meanacc += fabs(P[i].FullTreeGravAccel[d]);
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, accn, 3 * NTot, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &meanacc, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+    force_tree_free(&Tree);
+    domain_free(&ddecomp);
+    if(SlotsManager->Base)
+        slots_free(SlotsManager);
+    myfree(P);
+    return meanacc / (3 * NTot);
+}
+
+static void
+test_shared_tree(void ** state)
+{
+    int NTask, i;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    const int64_t NTot = (int64_t) NTask * NUMPART;
+    double * exported = malloc(3 * NTot * sizeof(double));
+    double * shared = malloc(3 * NTot * sizeof(double));
+
+    /* With private memory every other rank is reached by exporting*/
+    const double meanacc = short_forces(exported, NTot, 0);
+
+    /* Move MAIN into a window shared between the ranks on this node*/
+    allocator_destroy(A_TEMP);
+    allocator_destroy(A_MAIN);
+    allocator_init(A_TEMP, "TEMP", 8 * 1024 * 1024, 0, NULL);
+    const double MBPerRank = 256;
+    mymalloc_init(MBPerRank * NTask / cluster_get_num_hosts(), 1, 0);
+    if(NTask > 1)
+        assert_true(mymalloc_node_comm() != MPI_COMM_NULL);
+
+    short_forces(shared, NTot, 0);
+
+    /* The sums are done in a different order, so the forces only agree to rounding*/
+    double maxerr = 0;
+    for(i = 0; i < 3 * NTot; i++) {
+        const double err = fabs(shared[i] - exported[i]) / meanacc;
+        if(err > maxerr)
+            maxerr = err;
+    }
+    message(0, "Max relative difference between shared and exported tree forces: %g\n", maxerr);
+    assert_true(maxerr < 1e-10);
+
+    mymalloc_free_shared();
+    free(shared);
+    free(exported);
+}
+
+static void
+test_grouped_ngb(void ** state)
+{
+    int NTask, i;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    const int64_t NTot = (int64_t) NTask * NUMPART;
+    double * single = malloc(3 * NTot * sizeof(double));
+    double * grouped = malloc(3 * NTot * sizeof(double));
+
+    set_treewalk(1);
+    short_forces(single, NTot, 1);
+    set_treewalk(8);
+    short_forces(grouped, NTot, 1);
+    set_treewalk(1);
+
+    /* The neighbours of each particle are visited in the same order, so the sums are identical*/
+    for(i = 0; i < 3 * NTot; i++)
+        assert_true(grouped[i] == single[i]);
+
+    free(grouped);
+    free(single);
+}
+
+static int
+setup_tree(void **state)
+{
+    walltime_init(&CT);
+    struct DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 2;
+    dp.DomainUseGlobalSorting = 0;
+    dp.TopNodeAllocFactor = 1.;
+    dp.SetAsideFactor = 1;
+    set_domain_par(dp);
+    init_forcetree_params(0.7);
+    set_treewalk(1);
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_grouped_ngb),
+        cmocka_unit_test(test_shared_tree),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_tree, NULL);
+}
@@ -4,6 +4,7 @@
 #include <cmocka.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "stub.h"
 
@@ -107,12 +108,39 @@ test_allocator_malloc(void ** state)
     allocator_destroy(A0);
 }
 
+static void
+test_allocator_region(void ** state)
+{
+    /* An unaligned region, as from an MPI window*/
+    const size_t region = 4096 * 256 + 100;
+    char * buf = malloc(region + 100);
+    char * rawbase = buf + 100;
+    Allocator A0[1];
+    assert_int_equal(allocator_init_region(A0, "Region", rawbase, region, 1), 0);
+    assert_true(A0->base >= rawbase);
+    assert_true(A0->base + A0->size <= rawbase + region);
+
+    char * p1 = allocator_alloc_bot(A0, "M+1", 2048);
+    char * q1 = allocator_alloc_top(A0, "M-1", 2048);
+    assert_true(p1 >= rawbase && p1 + 2048 <= rawbase + region);
+    assert_true(q1 >= rawbase && q1 + 2048 <= rawbase + region);
+    p1[2047] = 1;
+    q1[2047] = 1;
+
+    allocator_free(q1);
+    allocator_free(p1);
+    /* Does not free the region*/
+    allocator_destroy(A0);
+    free(buf);
+}
+
 int main(void)
 {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_allocator),
         cmocka_unit_test(test_allocator_malloc),
         cmocka_unit_test(test_sub_allocator),
+        cmocka_unit_test(test_allocator_region),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
@@ -134,7 +134,7 @@ int compar_int(void * d1, void * d2)
         return 1;
 }
 
-static void
+static double
 do_mpsort_test(int64_t srcsize, int bits, int staggered, int gather)
 {
     int ThisTask;
@@ -169,6 +169,7 @@ do_mpsort_test(int64_t srcsize, int bits, int staggered, int gather)
     generate(src, srcsize, bits, seed);
 
     int64_t srcsum = checksum(src, srcsize, MPI_COMM_WORLD);
+    double elapsed;
 //         if(ThisTask == 0)
 //        mpsort_setup_timers(512);
     {
@@ -193,7 +194,8 @@ do_mpsort_test(int64_t srcsize, int bits, int staggered, int gather)
 
         check_sorted(dest, sizeof(int64_t), destsize, compar_int, MPI_COMM_WORLD);
 
-        message(0, "MPSort total time: %g\n", end - start);
+        elapsed = end - start;
+        message(0, "MPSort total time: %g\n", elapsed);
 //         if(ThisTask == 0) {
 //             mpsort_mpi_report_last_run();
 //                mpsort_free_timers();
@@ -203,6 +205,7 @@ do_mpsort_test(int64_t srcsize, int bits, int staggered, int gather)
     mpsort_mpi_unset_options(MPSORT_REQUIRE_GATHER_SORT + MPSORT_DISABLE_GATHER_SORT);
     myfree(dest);
     myfree(src);
+    return elapsed;
 }
 
 static void fof_radix_Group_TotalCountTaskDiffMinID(const void * a, void * radix, void * arg) {
@@ -334,6 +337,88 @@ test_mpsort_gather(void ** state)
     do_mpsort_test(2000, 32, 0, 0);
 }
 
+static void
+test_mpsort_duplicates(void ** state)
+{
+    /* Only 16 distinct values, so the rank boundaries fall inside runs of equal keys*/
+    do_mpsort_test(2000, 4, 0, 0);
+    do_mpsort_test(2000, 4, 1, 0);
+    /* Only two distinct values*/
+    do_mpsort_test(1999, 1, 0, 0);
+}
+
+static void
+test_mpsort_histogram(void ** state)
+{
+    /* The bisection algorithm is still available*/
+    mpsort_mpi_set_options(MPSORT_USE_HISTOGRAM_SORT);
+    do_mpsort_test(2000, 32, 0, 0);
+    do_mpsort_test(2000, 4, 1, 0);
+    mpsort_mpi_unset_options(MPSORT_USE_HISTOGRAM_SORT);
+}
+
+/* Sort the same data with the sample sort and the histogram bisection sort, and check the results are the same on every rank*/
+static void
+do_mpsort_compare(int64_t srcsize, int bits, int staggered)
+{
+    int ThisTask;
+    int NTask;
+
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    if(staggered && (ThisTask % 2 == 0)) srcsize = 0;
+
+    int64_t csize;
+    MPI_Allreduce(&srcsize, &csize, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    int64_t destsize = csize * (ThisTask + 1) /  NTask - csize * (ThisTask) / NTask;
+
+    int64_t * src = mymalloc("src", srcsize * sizeof(int64_t));
+    int64_t * sample = mymalloc("sample", destsize * sizeof(int64_t));
+    int64_t * hist = mymalloc("hist", destsize * sizeof(int64_t));
+
+    /* Do not use the gather sort, so both parallel algorithms are used*/
+    mpsort_mpi_set_options(MPSORT_DISABLE_GATHER_SORT);
+    generate(src, srcsize, bits, 9999 * ThisTask);
+    mpsort_mpi_newarray(src, srcsize, sample, destsize, sizeof(int64_t), radix_int, sizeof(int64_t), NULL, MPI_COMM_WORLD);
+
+    mpsort_mpi_set_options(MPSORT_USE_HISTOGRAM_SORT);
+    generate(src, srcsize, bits, 9999 * ThisTask);
+    mpsort_mpi_newarray(src, srcsize, hist, destsize, sizeof(int64_t), radix_int, sizeof(int64_t), NULL, MPI_COMM_WORLD);
+    mpsort_mpi_unset_options(MPSORT_USE_HISTOGRAM_SORT + MPSORT_DISABLE_GATHER_SORT);
+
+    assert_memory_equal(sample, hist, destsize * sizeof(int64_t));
+
+    myfree(hist);
+    myfree(sample);
+    myfree(src);
+}
+
+static void
+test_mpsort_compare(void ** state)
+{
+    do_mpsort_compare(2000, 64, 0);
+    /* Many duplicate keys*/
+    do_mpsort_compare(2000, 4, 0);
+    /* Empty ranks and a size that does not divide evenly*/
+    do_mpsort_compare(1999, 32, 1);
+}
+
+/* Compare the speed of the sample sort and the histogram bisection sort at increasing sizes.
+ * This is a benchmark, not a test: it is only run if MPSORT_BENCHMARK is set in the environment.*/
+static void
+test_mpsort_scaling(void ** state)
+{
+    int64_t srcsize;
+    for(srcsize = 1000; srcsize <= 1000000; srcsize *= 10) {
+        double tsample = do_mpsort_test(srcsize, 64, 0, 0);
+        mpsort_mpi_set_options(MPSORT_USE_HISTOGRAM_SORT);
+        double thist = do_mpsort_test(srcsize, 64, 0, 0);
+        mpsort_mpi_unset_options(MPSORT_USE_HISTOGRAM_SORT);
+        message(0, "%ld items per rank: sample sort %g s histogram sort %g s\n", srcsize, tsample, thist);
+    }
+}
+
 int main(void)
 {
     const struct CMUnitTest tests[] = {
@@ -341,6 +426,14 @@ int main(void)
         cmocka_unit_test(test_mpsort_stagger),
         cmocka_unit_test(test_basegroup),
         cmocka_unit_test(test_mpsort_gather),
+        cmocka_unit_test(test_mpsort_duplicates),
+        cmocka_unit_test(test_mpsort_histogram),
+        cmocka_unit_test(test_mpsort_compare),
+    };
+    const struct CMUnitTest benchmarks[] = {
+        cmocka_unit_test(test_mpsort_scaling),
     };
+    if(getenv("MPSORT_BENCHMARK"))
+        return cmocka_run_group_tests_mpi(benchmarks, NULL, NULL);
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
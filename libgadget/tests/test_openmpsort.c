@@ -5,6 +5,10 @@
 #include <stdio.h>
 #include <omp.h>
 #include <stdlib.h>
+#include <stdint.h>
+
+#include "../utils/radixsort.h"
+#include "../utils/mymalloc.h"
 
 #include "stub.h"
 
@@ -99,10 +103,72 @@ static void test_openmpsort(void ** state) {
 
 }
 
+static void radix_int(const void * ptr, void * radix, void * arg) {
+    *(uint32_t *) radix = *(const int *) ptr;
+}
+
+static void radix_data(const void * ptr, void * radix, void * arg) {
+    *(uint32_t *) radix = ((const struct __data *) ptr)->dd[0];
+}
+
+static void test_radixsort(void ** state) {
+    int i;
+    int size = 87763;
+    int *a = (int *) mymalloc("a", size * sizeof(int));
+    int *b = (int *) mymalloc("b", size * sizeof(int));
+
+    srand48(8675309);
+    for(i = 0; i < size; i++)
+        a[i] = b[i] = (int) (size * drand48());
+
+    double start = omp_get_wtime();
+    radix_sort_openmp(a, size, sizeof(int), radix_int, sizeof(uint32_t), NULL);
+    double end = omp_get_wtime();
+    message(1,"radix sort time = %g s %d threads\n",end-start, omp_get_max_threads());
+
+    start = omp_get_wtime();
+    qsort_openmp(b, size, sizeof(int), compare);
+    end = omp_get_wtime();
+    message(1,"parallel sort time = %g s %d threads\n",end-start, omp_get_max_threads());
+
+    for(i=0; i<size; i++)
+        assert_int_equal(a[i], b[i]);
+    myfree(b);
+    myfree(a);
+}
+
+/* Large elements are permuted in place. Also checks the sort is stable.*/
+static void test_radixsort_struct(void ** state) {
+    int i;
+    int size = 187763;
+    struct __data *a = (struct __data *) mymalloc("a", size * sizeof(struct __data));
+
+    srand48(8675309);
+    for(i = 0; i < size; i++) {
+        /* Many duplicates, and keys which differ only in the high bytes*/
+        a[i].dd[0] = ((int) (1000 * drand48())) << 16;
+        a[i].dd[1] = i;
+    }
+
+    double start = omp_get_wtime();
+    radix_sort_openmp(a, size, sizeof(struct __data), radix_data, sizeof(uint32_t), NULL);
+    double end = omp_get_wtime();
+    message(1,"radix sort time = %g s %d threads\n",end-start, omp_get_max_threads());
+
+    for(i=1; i<size; i++) {
+        assert_true(a[i-1].dd[0] <= a[i].dd[0]);
+        if(a[i-1].dd[0] == a[i].dd[0])
+            assert_true(a[i-1].dd[1] < a[i].dd[1]);
+    }
+    myfree(a);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_openmpsort),
         cmocka_unit_test(test_openmpsort_struct),
+        cmocka_unit_test(test_radixsort),
+        cmocka_unit_test(test_radixsort_struct),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
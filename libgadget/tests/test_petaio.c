@@ -0,0 +1,233 @@
+/*Tests for the snapshot IO*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <bigfile-mpi.h>
+
+#include <libgadget/petaio.h>
+#include <libgadget/walltime.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include "stub.h"
+
+static struct ClockTable CT;
+
+static char prefix[1024] = "/tmp/test_petaio_XXXXXX";
+
+static void
+setup_petaio(int CompressionLevel, int QuantisePositions, int NumWriters, int AsyncSnapshotMaxMB)
+{
+    ParameterSet * ps = parameter_set_new();
+    param_declare_int(ps, "BytesPerFile", OPTIONAL, 64 * 1024, "");
+    param_declare_int(ps, "NumWriters", OPTIONAL, NumWriters, "");
+    param_declare_int(ps, "MinNumWriters", OPTIONAL, 1, "");
+    param_declare_int(ps, "WritersPerFile", OPTIONAL, 8, "");
+    param_declare_int(ps, "EnableAggregatedIO", OPTIONAL, 0, "");
+    param_declare_int(ps, "AggregatedIOThreshold", OPTIONAL, 256, "");
+    param_declare_int(ps, "AsyncSnapshotMaxMB", OPTIONAL, AsyncSnapshotMaxMB, "");
+    param_declare_int(ps, "SnapshotCompressionLevel", OPTIONAL, CompressionLevel, "");
+    param_declare_int(ps, "SnapshotQuantisePositions", OPTIONAL, QuantisePositions, "");
+    param_declare_int(ps, "SnapshotLinkUnchangedBlocks", OPTIONAL, 0, "");
+    param_declare_int(ps, "SnapshotReadMmap", OPTIONAL, 0, "");
+    param_declare_int(ps, "SnapshotReadAhead", OPTIONAL, 0, "");
+    param_declare_int(ps, "AdaptiveNumWriters", OPTIONAL, 0, "");
+    param_declare_int(ps, "SnapshotPeanoIndex", OPTIONAL, 0, "");
+    param_declare_int(ps, "SnapshotReadTypes", OPTIONAL, 63, "");
+    param_declare_string(ps, "SnapshotReadRegion", OPTIONAL, "", "");
+    param_declare_int(ps, "OutputPotential", OPTIONAL, 0, "");
+    param_declare_int(ps, "OutputTimebins", OPTIONAL, 0, "");
+    param_declare_int(ps, "OutputHeliumFractions", OPTIONAL, 0, "");
+    param_declare_string(ps, "SnapshotFileBase", OPTIONAL, "PART", "");
+    param_declare_string(ps, "InitCondFile", OPTIONAL, "IC", "");
+    param_declare_int(ps, "ExcursionSetReionOn", OPTIONAL, 0, "");
+    char empty[1] = "";
+    param_parse(ps, empty);
+    set_petaio_params(ps);
+    petaio_init();
+    parameter_set_free(ps);
+}
+
+/* Write an array compressed with codec, read it back and check it is unchanged,
+ * or within half a quantum of the original modulo the box if quantised.*/
+static void
+check_codec_roundtrip(BigFile * bf, const char * blockname, const BigCodec * codec, const double BoxSize)
+{
+    const int n = 100000;
+    double * pos = mymalloc("pos", 3 * n * sizeof(double));
+    double * pos2 = mymalloc("pos2", 3 * n * sizeof(double));
+    int i;
+    for(i = 0; i < 3 * n; i++)
+        pos[i] = fmod(i * 0.37 + sin(i), BoxSize);
+    BigArray array = {0};
+    big_array_init(&array, pos, "f8", 2, (size_t []) {n, 3}, NULL);
+    petaio_save_compressed_block(bf, blockname, &array, codec, 0);
+
+    BigArray array2 = {0};
+    big_array_init(&array2, pos2, "f8", 2, (size_t []) {n, 3}, NULL);
+    assert_int_equal(petaio_read_block(bf, blockname, &array2, 1), 0);
+    for(i = 0; i < 3 * n; i++) {
+        if(codec->quantum > 0) {
+            double diff = fabs(pos2[i] - pos[i]);
+            if(diff > BoxSize / 2)
+                diff = BoxSize - diff;
+            assert_true(diff <= codec->quantum / 2 * (1 + 1e-6));
+        }
+        else
+            assert_true(pos2[i] == pos[i]);
+    }
+    myfree(pos2);
+    myfree(pos);
+}
+
+static void
+test_codec_roundtrip(void **state)
+{
+    walltime_init(&CT);
+    setup_petaio(0, 0, 0, 0);
+
+    const double BoxSize = 1000;
+    BigFile bf = {0};
+    char * fname = fastpm_strdup_printf("%s/codec", prefix);
+    assert_int_equal(big_file_mpi_create(&bf, fname, MPI_COMM_WORLD), 0);
+
+    BigCodec zlib = {6, 0, 0};
+    check_codec_roundtrip(&bf, "zlib", &zlib, BoxSize);
+    BigCodec shuffle = {6, 1, 0};
+    check_codec_roundtrip(&bf, "shuffle", &shuffle, BoxSize);
+    BigCodec quantised = {1, 1, BoxSize / 4294967296.};
+    check_codec_roundtrip(&bf, "quantised", &quantised, BoxSize);
+
+    big_file_mpi_close(&bf, MPI_COMM_WORLD);
+    myfree(fname);
+}
+
+static void
+test_register_codec(void **state)
+{
+    const double BoxSize = 1000;
+    particle_alloc_memory(PartManager, BoxSize, 16, 16);
+
+    struct IOTable IOTable = {0};
+    int i, npos = 0;
+
+    setup_petaio(0, 0, 0, 0);
+    register_io_blocks(&IOTable, 0, 1);
+    for(i = 0; i < IOTable.used; i++)
+        assert_int_equal(IOTable.ent[i].codec.level, 0);
+    destroy_io_blocks(&IOTable);
+
+    setup_petaio(3, 1, 0, 0);
+    register_io_blocks(&IOTable, 0, 1);
+    for(i = 0; i < IOTable.used; i++) {
+        assert_int_equal(IOTable.ent[i].codec.level, 3);
+        assert_int_equal(IOTable.ent[i].codec.shuffle, 1);
+        if(0 == strcmp(IOTable.ent[i].name, "Position")) {
+            assert_true(IOTable.ent[i].codec.quantum == BoxSize / 4294967296.);
+            npos++;
+        }
+        else
+            assert_true(IOTable.ent[i].codec.quantum == 0);
+    }
+    assert_int_equal(npos, 6);
+    destroy_io_blocks(&IOTable);
+    myfree(PartManager->Base);
+}
+
+/* A snapshot written in the background, one rank at a time, should be the same as one written synchronously*/
+static void
+test_async_snapshot(void **state)
+{
+    const double BoxSize = 1000;
+    const int NumPart = 5000;
+    int ThisTask, i, j;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    particle_alloc_memory(PartManager, BoxSize, NumPart, NumPart);
+    PartManager->NumPart = NumPart;
+    for(i = 0; i < NumPart; i++) {
+        P[i].Type = 1;
+        P[i].ID = (MyIDType) ThisTask * NumPart + i;
+        P[i].Mass = 1;
+        for(j = 0; j < 3; j++) {
+            P[i].Pos[j] = fmod(ThisTask * 17.1 + i * 0.37 * (j + 1), BoxSize);
+            P[i].Vel[j] = sin(i + j + ThisTask);
+        }
+    }
+    Cosmology CP = {0};
+    CP.Omega0 = 1;
+    CP.OmegaLambda = 0;
+    CP.HubbleParam = 0.7;
+    CP.Hubble = 0.1;
+
+    /* One writer, so the ranks write in turn*/
+    setup_petaio(0, 0, 1, 1024);
+    struct IOTable IOTable = {0};
+    register_io_blocks(&IOTable, 0, 1);
+    char * syncname = fastpm_strdup_printf("%s/sync", prefix);
+    char * asyncname = fastpm_strdup_printf("%s/async", prefix);
+    petaio_save_snapshot(syncname, &IOTable, 0, 0.5, &CP);
+    assert_int_equal(petaio_save_snapshot_async(asyncname, &IOTable, 0, 0.5, &CP), 1);
+    /* The particles may change while the snapshot is written*/
+    for(i = 0; i < NumPart; i++)
+        P[i].Pos[0] = -1;
+    for(i = 0; i < 3; i++)
+        petaio_async_progress();
+    assert_int_equal(petaio_async_wait(), 1);
+
+    BigFile bfsync = {0}, bfasync = {0};
+    assert_int_equal(big_file_mpi_open(&bfsync, syncname, MPI_COMM_WORLD), 0);
+    assert_int_equal(big_file_mpi_open(&bfasync, asyncname, MPI_COMM_WORLD), 0);
+    int nblocks = 0;
+    for(i = 0; i < IOTable.used; i++) {
+        IOTableEntry * ent = &IOTable.ent[i];
+        if(ent->ptype != 1)
+            continue;
+        char blockname[128];
+        sprintf(blockname, "%d/%s", ent->ptype, ent->name);
+        const size_t bytes = NumPart * dtype_itemsize(ent->dtype) * ent->items;
+        char * sync = mymalloc("sync", bytes);
+        char * async = mymalloc("async", bytes);
+        BigArray array = {0}, array2 = {0};
+        big_array_init(&array, sync, ent->dtype, 2, (size_t []) {NumPart, ent->items}, NULL);
+        big_array_init(&array2, async, ent->dtype, 2, (size_t []) {NumPart, ent->items}, NULL);
+        assert_int_equal(petaio_read_block(&bfsync, blockname, &array, 1), 0);
+        assert_int_equal(petaio_read_block(&bfasync, blockname, &array2, 1), 0);
+        assert_memory_equal(sync, async, bytes);
+        myfree(async);
+        myfree(sync);
+        nblocks++;
+    }
+    assert_true(nblocks > 0);
+    big_file_mpi_close(&bfasync, MPI_COMM_WORLD);
+    big_file_mpi_close(&bfsync, MPI_COMM_WORLD);
+    myfree(asyncname);
+    myfree(syncname);
+    destroy_io_blocks(&IOTable);
+    myfree(PartManager->Base);
+}
+
+static int
+setup_prefix(void **state)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0 && !mkdtemp(prefix))
+        return 1;
+    MPI_Bcast(prefix, sizeof(prefix), MPI_BYTE, 0, MPI_COMM_WORLD);
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_codec_roundtrip),
+        cmocka_unit_test(test_register_codec),
+        cmocka_unit_test(test_async_snapshot),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_prefix, NULL);
+}
@@ -1394,9 +1394,10 @@ build_active_particles(ActiveParticles * act, const DriftKickTimes * const times
                 const int type = PartManager->Base[i].Type;
                 /* For now build active particles with either hydro or gravity active*/
                 const int hydro_particle = type == 0 || type == 5;
-                /* All particles must have been synced in drift. */
+                /* All particles must have been synced in drift, except inactive particles skipped by a lazy drift. */
 #ifdef DEBUG
-                if (PartManager->Base[i].Ti_drift != times->Ti_Current) {
+                if (PartManager->Base[i].Ti_drift != times->Ti_Current &&
+                    (is_timebin_active(bin_gravity, times->Ti_Current) || (type == 0 || type == 5))) {
                     endrun(5, "Particle %d type %d has drift time %lx not ti_current %lx!",i, type, PartManager->Base[i].Ti_drift, times->Ti_Current);
                 }
 #endif
@@ -21,6 +21,56 @@ static int ImportBufferBoost;
 /* 7/9/24: The code segfaults if the send/recv buffer is larger than 4GB in size.
  * Likely a 32-bit variable is overflowing but it is hard to debug. Easier to enforce a maximum buffer size.*/
 static size_t MaxExportBufferBytes = 3584*1024*1024L;
+/* If true, exported queries are sent with a float position relative to the first top-level node in the NodeList,
+ * instead of the full double position. After padding this saves 8 bytes per query. The results are module-defined
+ * structs of MyFloat, which is double by default, and are sent unchanged, so the saving is about 10% of the bytes
+ * exchanged per particle in the short-range gravity walk and about 5% in the SPH walks.
+ * This is lossy, so the results differ slightly from a walk with uncompressed exports, and it is off by default.*/
+static int CompressExports = 0;
+/* Maximum number of particles in a group for the grouped neighbour search in the primary treewalk. 1 disables grouping,
+ * which is the default.*/
+#define MAXNGBGROUPSIZE 64
+static int NgbGroupSize = 1;
+
+/* Compressed header of an exported query. This replaces TreeWalkQueryBase on the wire:
+ * the module-specific part of the query follows it unchanged. The position is relative to the center
+ * of the first node in the NodeList. Top-level nodes are the same on all ranks, so the receiver can reconstruct it.
+ * The offset is the periodic distance to the node, which for the gravity walk may be as large as half the box,
+ * so the position error is up to a single precision rounding of BoxSize/2, about 3e-8 of the box.*/
+typedef struct {
+    float dPos[3];
+    int NodeList[NODELISTLENGTH];
+#ifdef DEBUG
+    MyIDType ID;
+#endif
+} TreeWalkQueryWire;
+
+/* Exports and imports of the last treewalk with each label on this rank.
+ * Used to size the export table and the memory left for the imports before the walk starts,
+ * so that the exports usually fit in a single round.*/
+#define MAXEXPORTHISTORY 64
+static struct ExportHistory {
+    const char * label;
+    /* Exported particles per particle in the WorkSet*/
+    double ExportsPerParticle;
+    /* Imported particles per particle in the WorkSet*/
+    double ImportsPerParticle;
+} ExportHistory[MAXEXPORTHISTORY];
+static int NExportHistory;
+
+/* Find the export history for a treewalk label, optionally creating it. Returns NULL if not found.*/
+static struct ExportHistory *
+treewalk_find_history(const char * label, int create)
+{
+    int i;
+    for(i = 0; i < NExportHistory; i++)
+        if(!strcmp(ExportHistory[i].label, label))
+            return &ExportHistory[i];
+    if(!create || NExportHistory >= MAXEXPORTHISTORY)
+        return NULL;
+    ExportHistory[NExportHistory].label = label;
+    return &ExportHistory[NExportHistory++];
+}
 
 /*Initialise global treewalk parameters*/
 void set_treewalk_params(ParameterSet * ps)
@@ -28,8 +78,76 @@ void set_treewalk_params(ParameterSet * ps)
     int ThisTask;
     MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
     if(ThisTask == 0)
+    {
         ImportBufferBoost = param_get_int(ps, "ImportBufferBoost");
+        CompressExports = param_get_int(ps, "TreeWalkCompressExports");
+        NgbGroupSize = param_get_int(ps, "TreeWalkNgbGroupSize");
+        if(NgbGroupSize < 1)
+            NgbGroupSize = 1;
+        if(NgbGroupSize > MAXNGBGROUPSIZE)
+            NgbGroupSize = MAXNGBGROUPSIZE;
+    }
     MPI_Bcast(&ImportBufferBoost, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&CompressExports, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&NgbGroupSize, 1, MPI_INT, 0, MPI_COMM_WORLD);
+}
+
+/* Size of an exported query as sent over MPI*/
+static size_t
+treewalk_wire_elsize(const TreeWalk * tw)
+{
+    if(!CompressExports)
+        return tw->query_type_elsize;
+    /* Pad to a multiple of 8 so the buffers stay aligned*/
+    size_t size = sizeof(TreeWalkQueryWire) + tw->query_type_elsize - sizeof(TreeWalkQueryBase);
+    return (size + 7) / 8 * 8;
+}
+
+/* Copy a query into the export buffer, compressing the position if enabled.*/
+static void
+treewalk_pack_query(const TreeWalk * tw, char * wire, const TreeWalkQueryBase * query)
+{
+    if(!CompressExports) {
+        memcpy(wire, query, tw->query_type_elsize);
+        return;
+    }
+    TreeWalkQueryWire * hdr = (TreeWalkQueryWire *) wire;
+    const struct NODE * node = &tw->tree->Nodes[query->NodeList[0]];
+    int d;
+    for(d = 0; d < 3; d++)
+        hdr->dPos[d] = NEAREST(query->Pos[d] - node->center[d], tw->tree->BoxSize);
+    memcpy(hdr->NodeList, query->NodeList, sizeof(query->NodeList[0]) * NODELISTLENGTH);
+#ifdef DEBUG
+    hdr->ID = query->ID;
+#endif
+    memcpy(wire + sizeof(TreeWalkQueryWire), (const char *) query + sizeof(TreeWalkQueryBase), tw->query_type_elsize - sizeof(TreeWalkQueryBase));
+}
+
+/* Reconstruct an imported query from the wire format. Returns the query:
+ * if the exports are not compressed this points into the import buffer and buf is unused.*/
+static TreeWalkQueryBase *
+treewalk_unpack_query(const TreeWalk * tw, char * wire, TreeWalkQueryBase * buf)
+{
+    if(!CompressExports)
+        return (TreeWalkQueryBase *) wire;
+    const TreeWalkQueryWire * hdr = (const TreeWalkQueryWire *) wire;
+    const struct NODE * node = &tw->tree->Nodes[hdr->NodeList[0]];
+    const double BoxSize = tw->tree->BoxSize;
+    int d;
+    for(d = 0; d < 3; d++) {
+        double pos = node->center[d] + hdr->dPos[d];
+        while(pos < 0)
+            pos += BoxSize;
+        while(pos >= BoxSize)
+            pos -= BoxSize;
+        buf->Pos[d] = pos;
+    }
+    memcpy(buf->NodeList, hdr->NodeList, sizeof(hdr->NodeList[0]) * NODELISTLENGTH);
+#ifdef DEBUG
+    buf->ID = hdr->ID;
+#endif
+    memcpy((char *) buf + sizeof(TreeWalkQueryBase), wire + sizeof(TreeWalkQueryWire), tw->query_type_elsize - sizeof(TreeWalkQueryBase));
+    return buf;
 }
 
 /* This function is to allow a test which fills up the exchange buffer*/
@@ -47,6 +165,15 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
         int startnode,
         LocalTreeWalk * lv);
 
+static void
+ngbiter_start(TreeWalkQueryBase * I, TreeWalkResultBase * O, TreeWalkNgbIterBase * iter, LocalTreeWalk * lv);
+
+static int
+ngbiter_candidates(TreeWalkQueryBase * I, TreeWalkResultBase * O, TreeWalkNgbIterBase * iter, LocalTreeWalk * lv, const int numcand);
+
+static int64_t
+ev_primary_ngb_group(TreeWalk * tw, LocalTreeWalk * lv, const int64_t start, const int64_t end, char * queries, char * outputs, char * iters, int * targets);
+
 #ifdef DEBUG
 /*
  * for debugging
@@ -67,11 +194,9 @@ ev_init_thread(TreeWalk * const tw, LocalTreeWalk * lv)
     lv->Ninteractions = 0;
     lv->Nexport = 0;
     lv->NThisParticleExport = 0;
-    lv->nodelistindex = 0;
-    if(tw->ExportTable_thread)
-        lv->DataIndexTable = tw->ExportTable_thread[thread_id];
-    else
-        lv->DataIndexTable = NULL;
+    /* Blocks of the export table are claimed on the first export*/
+    lv->DataIndexTable = NULL;
+    lv->ExportBlock = -1;
     if(tw->Ngblist)
         lv->ngblist = tw->Ngblist + thread_id * tw->tree->NumParticles;
 }
@@ -108,23 +233,41 @@ ev_begin(TreeWalk * tw, int * active_set, const size_t size)
     if(tw->result_type_elsize % 8 != 0)
         endrun(0, "Result structure has size %ld, not aligned to 64-bit boundary.\n", tw->result_type_elsize);
 
+    /* Exported and imported queries are stored in the (possibly compressed) wire format*/
+    const size_t wire_elsize = treewalk_wire_elsize(tw);
     /*The amount of memory eventually allocated per tree buffer*/
-    size_t bytesperbuffer = sizeof(struct data_index) + tw->query_type_elsize + tw->result_type_elsize;
-    /*This memory scales like the number of imports. In principle this could be much larger than Nexport
-     * if the tree is very imbalanced and many processors all need to export to this one. In practice I have
-     * not seen this happen, but provide a parameter to boost the memory for Nimport just in case.*/
-    bytesperbuffer += ImportBufferBoost * (tw->query_type_elsize + tw->result_type_elsize);
+    size_t bytesperbuffer = sizeof(struct data_index) + wire_elsize + tw->result_type_elsize;
     /*Use all free bytes for the tree buffer, as in exchange. Leave some free memory for array overhead.*/
     size_t freebytes = mymalloc_freebytes();
-    freebytes -= 4096 * 10 * bytesperbuffer;
+    freebytes -= 4096 * 10 * (bytesperbuffer + ImportBufferBoost * (wire_elsize + tw->result_type_elsize));
 
-    tw->BunchSize = (size_t) floor(((double)freebytes)/ bytesperbuffer);
-    if(tw->BunchSize * tw->query_type_elsize > MaxExportBufferBytes)
-        tw->BunchSize = MaxExportBufferBytes / tw->query_type_elsize;
-    /* Per thread*/
-    tw->BunchSize /= omp_get_max_threads();
+    /*The memory for imports scales like the number of exports. In principle this could be much larger than Nexport
+     * if the tree is very imbalanced and many processors all need to export to this one. In practice I have
+     * not seen this happen, but provide a parameter to boost the memory for Nimport just in case.*/
+    const size_t importbytesperbuffer = ImportBufferBoost * (wire_elsize + tw->result_type_elsize);
+    tw->BunchSize = (size_t) floor(((double)freebytes)/ (bytesperbuffer + importbytesperbuffer));
+
+    /* If we have walked with this label before, predict the exports and imports from the last walk (with some headroom).
+     * Memory is reserved for the larger of the predicted imports and ImportBufferBoost times the predicted exports,
+     * and the rest goes to the export table. This never gives a smaller table than the estimate above,
+     * which needs no history: if the predicted imports do not fit, the walk takes several rounds, as it would without one.*/
+    const struct ExportHistory * hist = treewalk_find_history(tw->ev_label, 0);
+    if(hist) {
+        const double exports = 1.5 * hist->ExportsPerParticle * tw->WorkSetSize;
+        double importbytes = 1.5 * hist->ImportsPerParticle * tw->WorkSetSize * (wire_elsize + tw->result_type_elsize);
+        if(importbytes < exports * importbytesperbuffer)
+            importbytes = exports * importbytesperbuffer;
+        if(importbytes < freebytes) {
+            const size_t HistBunchSize = (size_t) floor((freebytes - importbytes) / bytesperbuffer);
+            if(HistBunchSize > tw->BunchSize)
+                tw->BunchSize = HistBunchSize;
+        }
+    }
+    bytesperbuffer += importbytesperbuffer;
+    if(tw->BunchSize * wire_elsize > MaxExportBufferBytes)
+        tw->BunchSize = MaxExportBufferBytes / wire_elsize;
 
-    if(freebytes <= 4096 * bytesperbuffer || tw->BunchSize < 100) {
+    if(freebytes <= 4096 * bytesperbuffer || tw->BunchSize < 100 * NumThreads) {
         endrun(1231245, "Not enough free memory in %s to export particles: needed %ld bytes have %ld. can export %ld \n", tw->ev_label, bytesperbuffer, freebytes, tw->BunchSize);
     }
 
@@ -252,23 +395,124 @@ treewalk_build_queue(TreeWalk * tw, int * active_set, const size_t size, int may
     tw->WorkSetSize = nqueue;
 }
 
+/* A contiguous range of the WorkSet owned by one thread in ev_primary.
+ * The owner takes chunks from the front of the range, idle threads steal
+ * half of what remains from the back. Padded so that the queues of
+ * different threads do not share a cache line. */
+struct WorkQueue
+{
+    int64_t head;
+    int64_t tail;
+    omp_lock_t lock;
+    char pad[64];
+};
+
+/* Take a chunk of up to chnksz entries from the front of the queue.
+ * Returns the first entry of the chunk and sets end, or returns -1 if the queue is empty.*/
+static int64_t
+workqueue_pop(struct WorkQueue * q, const int64_t chnksz, int64_t * end)
+{
+    int64_t start = -1;
+    omp_set_lock(&q->lock);
+    if(q->head < q->tail) {
+        start = q->head;
+        q->head += chnksz;
+        if(q->head > q->tail)
+            q->head = q->tail;
+        *end = q->head;
+    }
+    omp_unset_lock(&q->lock);
+    return start;
+}
+
+/* Move half of the remaining work of the most loaded queue to the (empty) queue of thread tid.
+ * Returns 0 if there was nothing left to steal.*/
+static int
+workqueue_steal(struct WorkQueue * queues, const int64_t nqueue, const int tid)
+{
+    while(1) {
+        /* Find the victim with the most remaining work. This is racy, but we check again under the lock.*/
+        int64_t i, victim = -1, maxleft = 0;
+        for(i = 0; i < nqueue; i++) {
+            int64_t head, tail;
+            #pragma omp atomic read
+            head = queues[i].head;
+            #pragma omp atomic read
+            tail = queues[i].tail;
+            if(tail - head > maxleft) {
+                maxleft = tail - head;
+                victim = i;
+            }
+        }
+        if(victim < 0)
+            return 0;
+        struct WorkQueue * vq = &queues[victim];
+        omp_set_lock(&vq->lock);
+        const int64_t left = vq->tail - vq->head;
+        /* Someone else got there first: look again.*/
+        if(left <= 0) {
+            omp_unset_lock(&vq->lock);
+            continue;
+        }
+        const int64_t oldtail = vq->tail;
+        const int64_t newtail = vq->tail - (left + 1) / 2;
+        vq->tail = newtail;
+        omp_unset_lock(&vq->lock);
+        /* Other thieves see our queue as empty until this is set, so the stolen range is never evaluated twice.*/
+        omp_set_lock(&queues[tid].lock);
+        queues[tid].head = newtail;
+        queues[tid].tail = oldtail;
+        omp_unset_lock(&queues[tid].lock);
+        return 1;
+    }
+}
+
 /* returns struct containing export counts */
 static void
 ev_primary(TreeWalk * tw)
 {
     int64_t maxNinteractions = 0, minNinteractions = 1L << 45, Ninteractions=0;
-#pragma omp parallel reduction(min:minNinteractions) reduction(max:maxNinteractions) reduction(+: Ninteractions)
+    /* Split the WorkSet into one contiguous range per thread, so each thread walks
+     * particles which are close in Peano order. Particles in halo cores are far more
+     * expensive than particles in voids, so a thread which finishes its range steals
+     * half of the remaining range of the thread with the most work left. This avoids
+     * threads idling at the end of the walk without the contention of a single shared queue.*/
+    struct WorkQueue * queues = ta_malloc("WorkQueues", struct WorkQueue, tw->NThread);
+    /* Time each thread spent working, and the time it would have needed to finish its initial range alone.*/
+    double * busytime = ta_malloc("busytime", double, 2 * tw->NThread);
+    double * statictime = busytime + tw->NThread;
+    int64_t Nsteals = 0;
+    int64_t n;
+    for(n = 0; n < tw->NThread; n++) {
+        queues[n].head = tw->WorkSetSize * n / tw->NThread;
+        queues[n].tail = tw->WorkSetSize * (n + 1) / tw->NThread;
+        omp_init_lock(&queues[n].lock);
+        busytime[n] = 0;
+        statictime[n] = 0;
+    }
+
+#pragma omp parallel reduction(min:minNinteractions) reduction(max:maxNinteractions) reduction(+: Ninteractions, Nsteals)
     {
         LocalTreeWalk lv[1];
         /* Note: exportflag is local to each thread */
         ev_init_thread(tw, lv);
         lv->mode = TREEWALK_PRIMARY;
+        const int tid = omp_get_thread_num();
 
         /* use old index to recover from a buffer overflow*/;
         TreeWalkQueryBase * input = (TreeWalkQueryBase *) alloca(tw->query_type_elsize);
         TreeWalkResultBase * output = (TreeWalkResultBase *) alloca(tw->result_type_elsize);
-        /* We must schedule dynamically so that we have reduced imbalance.
-        * We do not need to worry about the export buffer filling up.*/
+        /* Scratch space for the grouped neighbour search*/
+        const int grouped = NgbGroupSize > 1 && tw->visit == treewalk_visit_ngbiter && lv->ngblist;
+        char * groupqueries = NULL, * groupoutputs = NULL, * groupiters = NULL;
+        int * grouptargets = NULL;
+        if(grouped) {
+            groupqueries = (char *) alloca(NgbGroupSize * tw->query_type_elsize);
+            groupoutputs = (char *) alloca(NgbGroupSize * tw->result_type_elsize);
+            groupiters = (char *) alloca(NgbGroupSize * tw->ngbiter_type_elsize);
+            grouptargets = (int *) alloca(NgbGroupSize * sizeof(int));
+        }
+        /* We do not need to worry about the export buffer filling up.*/
         /* chunk size: 1 and 1000 were slightly (3 percent) slower than 8.
         * FoF treewalk needs a larger chnksz to avoid contention.*/
         int64_t chnksz = tw->WorkSetSize / (4*tw->NThread);
@@ -276,23 +520,67 @@ ev_primary(TreeWalk * tw)
             chnksz = 1;
         if(chnksz > 100)
             chnksz = 100;
-        int k;
-        #pragma omp for schedule(dynamic, chnksz)
-        for(k = 0; k < tw->WorkSetSize; k++) {
-            const int i = tw->WorkSet ? tw->WorkSet[k] : k;
-            /* Primary never uses node list */
-            treewalk_init_query(tw, input, i, NULL);
-            treewalk_init_result(tw, output, input);
-            lv->target = i;
-            tw->visit(input, output, lv);
-            treewalk_reduce_result(tw, output, i, TREEWALK_PRIMARY);
-        }
+        const int64_t ninitial = queues[tid].tail - queues[tid].head;
+        int64_t nown = 0;
+        double ownwork = 0, allwork = 0;
+        int stolen = 0;
+        do {
+            int64_t chnk, end;
+            while((chnk = workqueue_pop(&queues[tid], chnksz, &end)) >= 0) {
+                const double tstart = second();
+                int64_t k;
+                if(grouped) {
+                    for(k = chnk; k < end; )
+                        k += ev_primary_ngb_group(tw, lv, k, end, groupqueries, groupoutputs, groupiters, grouptargets);
+                }
+                else {
+                    for(k = chnk; k < end; k++) {
+                        const int i = tw->WorkSet ? tw->WorkSet[k] : k;
+                        /* Primary never uses node list */
+                        treewalk_init_query(tw, input, i, NULL);
+                        treewalk_init_result(tw, output, input);
+                        lv->target = i;
+                        tw->visit(input, output, lv);
+                        treewalk_reduce_result(tw, output, i, TREEWALK_PRIMARY);
+                    }
+                }
+                const double tchunk = timediff(tstart, second());
+                allwork += tchunk;
+                if(!stolen) {
+                    ownwork += tchunk;
+                    nown += end - chnk;
+                }
+            }
+            /* Our range is done: anything else we do is stolen.*/
+            stolen = 1;
+        } while(workqueue_steal(queues, tw->NThread, tid) && ++Nsteals);
+
+        busytime[tid] = allwork;
+        /* Extrapolate from the part of the initial range we did ourselves to the whole range.*/
+        if(nown > 0)
+            statictime[tid] = ownwork * ninitial / nown;
         if(maxNinteractions < lv->maxNinteractions)
             maxNinteractions = lv->maxNinteractions;
         if(minNinteractions > lv->maxNinteractions)
             minNinteractions = lv->minNinteractions;
         Ninteractions = lv->Ninteractions;
     }
+    double maxbusy = 0, meanbusy = 0, maxstatic = 0;
+    for(n = 0; n < tw->NThread; n++) {
+        omp_destroy_lock(&queues[n].lock);
+        meanbusy += busytime[n] / tw->NThread;
+        if(maxbusy < busytime[n])
+            maxbusy = busytime[n];
+        if(maxstatic < statictime[n])
+            maxstatic = statictime[n];
+    }
+    if(meanbusy > 0) {
+        tw->PrimaryImbalance = maxbusy / meanbusy;
+        tw->PrimaryStaticImbalance = maxstatic / meanbusy;
+    }
+    tw->Nsteals += Nsteals;
+    myfree(busytime);
+    myfree(queues);
     tw->maxNinteractions = maxNinteractions;
     tw->minNinteractions = minNinteractions;
     tw->Ninteractions += Ninteractions;
@@ -317,45 +605,66 @@ int treewalk_export_particle(LocalTreeWalk * lv, int no)
     if(lv->mode != TREEWALK_TOPTREE || no < lv->tw->tree->lastnode) {
         endrun(1, "Called export not from a toptree.\n");
     }
-    if(!lv->DataIndexTable)
-        endrun(1, "DataIndexTable not allocated, treewalk_export_particle called in the wrong way\n");
+    if(!lv->tw->ExportTable)
+        endrun(1, "ExportTable not allocated, treewalk_export_particle called in the wrong way\n");
     if(no - lv->tw->tree->lastnode > lv->tw->tree->NTopLeaves)
         endrun(1, "Bad export leaf: no = %d lastnode %d ntop %d target %d\n", no, lv->tw->tree->lastnode, lv->tw->tree->NTopLeaves, lv->target);
     const int target = lv->target;
     TreeWalk * tw = lv->tw;
     const int task = tw->tree->TopLeaves[no - tw->tree->lastnode].Task;
+    const int treenode = tw->tree->TopLeaves[no - tw->tree->lastnode].treenode;
     /* This index is a unique entry in the global DataIndexTable.*/
     size_t nexp = lv->Nexport;
-    /* If the last export was to this task, we can perhaps just add this export to the existing NodeList. We can
-     * be sure that all exports of this particle are contiguous.*/
-    if(lv->NThisParticleExport >= 1 && lv->DataIndexTable[nexp-1].Task == task) {
+    /* If this particle was already exported to this task, we can perhaps just add this export to the existing NodeList,
+     * so that each particle is sent to each task only once. We can be sure that all exports of this particle are contiguous.
+     * Pseudo-particles of the same task are often not adjacent in the walk, so check all exports of this particle.*/
+    size_t j;
+    for(j = nexp - lv->NThisParticleExport; j < nexp; j++) {
+        data_index * prev = &lv->DataIndexTable[j];
+        if(prev->Task != task)
+            continue;
 #ifdef DEBUG
         /* This is just to be safe: only happens if our indices are off.*/
-        if(lv->DataIndexTable[nexp - 1].Index != target)
-            endrun(1, "Previous of %ld exports is target %d not current %d\n", lv->NThisParticleExport, lv->DataIndexTable[nexp-1].Index, target);
-#endif
-        if(lv->nodelistindex < NODELISTLENGTH) {
-#ifdef DEBUG
-            if(lv->DataIndexTable[nexp-1].NodeList[lv->nodelistindex] != -1)
-                endrun(1, "Current nodelist %ld entry (%d) not empty!\n", lv->nodelistindex, lv->DataIndexTable[nexp-1].NodeList[lv->nodelistindex]);
+        if(prev->Index != target)
+            endrun(1, "Previous of %ld exports is target %d not current %d\n", lv->NThisParticleExport, prev->Index, target);
 #endif
-            lv->DataIndexTable[nexp-1].NodeList[lv->nodelistindex] = tw->tree->TopLeaves[no - tw->tree->lastnode].treenode;
-            lv->nodelistindex++;
-            return 0;
+        int k;
+        for(k = 1; k < NODELISTLENGTH; k++) {
+            if(prev->NodeList[k] == -1) {
+                prev->NodeList[k] = treenode;
+                return 0;
+            }
         }
     }
-    /* out of buffer space. Need to interrupt. */
-    if(lv->Nexport >= tw->BunchSize) {
-        return -1;
+    /* Our block is full (or we do not have one yet): claim a new block from the shared table. */
+    if(lv->ExportBlock < 0 || lv->Nexport >= tw->ExportBlockSize) {
+        /* A single particle needs more than a whole block: we cannot make progress*/
+        if(lv->NThisParticleExport >= tw->ExportBlockSize)
+            return -1;
+        const int64_t newblock = atomic_fetch_and_add_64(&tw->NExportBlocksUsed, 1);
+        /* out of buffer space. Need to interrupt. */
+        if(newblock >= tw->NExportBlocks)
+            return -1;
+        data_index * newtable = tw->ExportTable + newblock * tw->ExportBlockSize;
+        /* Move the exports of the current particle to the new block, so that the exports
+         * of a particle are always contiguous and can be dropped if the buffer fills.*/
+        if(lv->ExportBlock >= 0) {
+            lv->Nexport -= lv->NThisParticleExport;
+            memcpy(newtable, lv->DataIndexTable + lv->Nexport, lv->NThisParticleExport * sizeof(data_index));
+            tw->ExportBlockFill[lv->ExportBlock] = lv->Nexport;
+        }
+        lv->ExportBlock = newblock;
+        lv->DataIndexTable = newtable;
+        lv->Nexport = lv->NThisParticleExport;
+        nexp = lv->Nexport;
     }
     lv->DataIndexTable[nexp].Task = task;
     lv->DataIndexTable[nexp].Index = target;
-    lv->DataIndexTable[nexp].NodeList[0] = tw->tree->TopLeaves[no - tw->tree->lastnode].treenode;
+    lv->DataIndexTable[nexp].NodeList[0] = treenode;
     int i;
     for(i = 1; i < NODELISTLENGTH; i++)
         lv->DataIndexTable[nexp].NodeList[i] = -1;
     lv->Nexport++;
-    lv->nodelistindex = 1;
     lv->NThisParticleExport++;
     return 0;
 }
@@ -363,11 +672,17 @@ int treewalk_export_particle(LocalTreeWalk * lv, int no)
 void
 alloc_export_memory(TreeWalk * tw)
 {
-    tw->Nexport_thread = ta_malloc2("localexports", size_t, tw->NThread);
-    tw->ExportTable_thread = ta_malloc2("localexports", data_index *, tw->NThread);
+    /* Blocks should be small enough that no thread is left without space while
+     * there is room elsewhere, but large enough that claiming them is rare.*/
+    tw->ExportBlockSize = tw->BunchSize / (16 * tw->NThread);
+    if(tw->ExportBlockSize < 4096)
+        tw->ExportBlockSize = 4096;
+    if(tw->ExportBlockSize > tw->BunchSize / tw->NThread)
+        tw->ExportBlockSize = tw->BunchSize / tw->NThread;
+    tw->NExportBlocks = tw->BunchSize / tw->ExportBlockSize;
+    tw->ExportBlockFill = ta_malloc2("ExportBlockFill", size_t, tw->NExportBlocks);
+    tw->ExportTable = mymalloc("DataIndexTable", sizeof(data_index) * tw->NExportBlocks * tw->ExportBlockSize);
     int i;
-    for(i = 0; i < tw->NThread; i++)
-        tw->ExportTable_thread[i] = mymalloc("DataIndexTable", sizeof(data_index) * tw->BunchSize);
     tw->QueueChunkEnd = ta_malloc2("queueend", int64_t, tw->NThread);
     for(i = 0; i < tw->NThread; i++)
         tw->QueueChunkEnd[i] = -1;
@@ -379,11 +694,18 @@ free_export_memory(TreeWalk * tw)
 {
     myfree(tw->QueueChunkRestart);
     myfree(tw->QueueChunkEnd);
-    int i;
-    for(i = tw->NThread - 1; i >= 0; i--)
-        myfree(tw->ExportTable_thread[i]);
-    myfree(tw->ExportTable_thread);
-    myfree(tw->Nexport_thread);
+    myfree(tw->ExportTable);
+    myfree(tw->ExportBlockFill);
+    tw->ExportTable = NULL;
+}
+
+/* Number of blocks of the export table which contain exports*/
+static int64_t
+ev_nexport_blocks(const TreeWalk * tw)
+{
+    if(tw->NExportBlocksUsed > tw->NExportBlocks)
+        return tw->NExportBlocks;
+    return tw->NExportBlocksUsed;
 }
 
 int
@@ -392,6 +714,9 @@ ev_toptree(TreeWalk * tw)
     tw->BufferFullFlag = 0;
     int64_t currentIndex = tw->WorkSetStart;
     int BufferFullFlag = 0;
+    /* Empty the export table*/
+    tw->NExportBlocksUsed = 0;
+    memset(tw->ExportBlockFill, 0, tw->NExportBlocks * sizeof(tw->ExportBlockFill[0]));
 
     if(tw->Nexportfull > 0)
         message(0, "Toptree %s, iter %ld. First particle %ld size %ld.\n", tw->ev_label, tw->Nexportfull, tw->WorkSetStart, tw->WorkSetSize);
@@ -476,17 +801,18 @@ ev_toptree(TreeWalk * tw)
                 }
             }
         } while(chnk < tw->WorkSetSize && BufferFull_thread == 0);
-        tw->Nexport_thread[tid] = lv->Nexport;
+        if(lv->ExportBlock >= 0)
+            tw->ExportBlockFill[lv->ExportBlock] = lv->Nexport;
         BufferFullFlag += BufferFull_thread;
     }
 
     if(BufferFullFlag > 0) {
         size_t Nexport = 0;
-        int i;
-        for(i = 0; i < tw->NThread; i++)
-            Nexport += tw->Nexport_thread[i];
+        int64_t i;
+        for(i = 0; i < ev_nexport_blocks(tw); i++)
+            Nexport += tw->ExportBlockFill[i];
         message(1, "Tree export buffer full on %d of %ld threads with %lu exports (%lu Mbytes). First particle %ld new start: %ld size %ld.\n",
-                        BufferFullFlag, tw->NThread, Nexport, Nexport*tw->query_type_elsize/1024/1024, tw->WorkSetStart, currentIndex, tw->WorkSetSize);
+                        BufferFullFlag, tw->NThread, Nexport, Nexport*treewalk_wire_elsize(tw)/1024/1024, tw->WorkSetStart, currentIndex, tw->WorkSetSize);
         if(currentIndex == tw->WorkSetStart)
             endrun(5, "Not enough export space to make progress! lastsuc %ld Bunchsize: %ld \n", currentIndex, tw->BunchSize);
     }
@@ -599,6 +925,7 @@ static struct CommBuffer ev_secondary(struct CommBuffer * imports, struct ImpExp
     MPI_Datatype type;
     MPI_Type_contiguous(tw->result_type_elsize, MPI_BYTE, &type);
     MPI_Type_commit(&type);
+    const size_t wire_elsize = treewalk_wire_elsize(tw);
     int * complete_array = ta_malloc("completes", int, imports->nrequest_all);
 
     int tot_completed = 0;
@@ -618,7 +945,7 @@ static struct CommBuffer ev_secondary(struct CommBuffer * imports, struct ImpExp
             const int task = imports->rqst_task[i];
             const int64_t nimports_task = counts->Import_count[task];
             // message(1, "starting at %d with %d for iport %d task %d\n", counts->Import_offset[task], counts->Import_count[task], i, task);
-            char * databufstart = imports->databuf + counts->Import_offset[task] * tw->query_type_elsize;
+            char * databufstart = imports->databuf + counts->Import_offset[task] * wire_elsize;
             char * dataresultstart = res_imports.databuf + counts->Import_offset[task] * tw->result_type_elsize;
             /* This sends each set of imports to a parallel for loop. This may lead to suboptimal resource allocation if only a small number of imports come from a processor.
             * If there are a large number of importing ranks each with a small number of imports, a better scheme could be to send each chunk to a separate openmp task.
@@ -628,12 +955,13 @@ static struct CommBuffer ev_secondary(struct CommBuffer * imports, struct ImpExp
                 {
                     int64_t j;
                     LocalTreeWalk lv[1];
+                    TreeWalkQueryBase * unpacked = (TreeWalkQueryBase *) alloca(tw->query_type_elsize);
 
                     ev_init_thread(tw, lv);
                     lv->mode = TREEWALK_GHOSTS;
                     #pragma omp for
                     for(j = 0; j < nimports_task; j++) {
-                        TreeWalkQueryBase * input = (TreeWalkQueryBase *) (databufstart + j * tw->query_type_elsize);
+                        TreeWalkQueryBase * input = treewalk_unpack_query(tw, databufstart + j * wire_elsize, unpacked);
                         TreeWalkResultBase * output = (TreeWalkResultBase *) (dataresultstart + j * tw->result_type_elsize);
                         treewalk_init_result(tw, output, input);
                         lv->target = -1;
@@ -666,23 +994,24 @@ ev_export_import_counts(TreeWalk * tw, MPI_Comm comm)
     memset(counts.Export_count, 0, sizeof(int64_t)*4*NTask);
 
     int64_t i;
-    counts.Nexport=0;
+    size_t Nexport = 0;
     /* Calculate the amount of data to send. */
-    for(i = 0; i < tw->NThread; i++)
+    int64_t * exportcount = counts.Export_count;
+    #pragma omp parallel for reduction(+: exportcount[:NTask]) reduction(+: Nexport)
+    for(i = 0; i < ev_nexport_blocks(tw); i++)
     {
-        int64_t * exportcount = counts.Export_count;
+        const data_index * table = tw->ExportTable + i * tw->ExportBlockSize;
         size_t k;
-        #pragma omp parallel for reduction(+: exportcount[:NTask])
-        for(k = 0; k < tw->Nexport_thread[i]; k++)
-            exportcount[tw->ExportTable_thread[i][k].Task]++;
-        /* This is over all full buffers.*/
-        tw->Nexport_sum += tw->Nexport_thread[i];
-        /* This is the export count*/
-        counts.Nexport += tw->Nexport_thread[i];
+        for(k = 0; k < tw->ExportBlockFill[i]; k++)
+            exportcount[table[k].Task]++;
+        Nexport += tw->ExportBlockFill[i];
     }
+    /* This is the export count*/
+    counts.Nexport = Nexport;
+    /* This is over all full buffers.*/
+    tw->Nexport_sum += Nexport;
     /* Exchange the counts. Note this is synchronous so we need to ensure the toptree walk, which happens before this, is balanced.*/
     MPI_Alltoall(counts.Export_count, 1, MPI_INT64, counts.Import_count, 1, MPI_INT64, counts.comm);
-    // message(1, "Exporting %ld particles. Thread 0 is %ld\n", counts.Nexport, tw->Nexport_thread[0]);
 
     counts.Nimport = counts.Import_count[0];
     tw->NExportTargets = (counts.Export_count[0] > 0);
@@ -693,20 +1022,22 @@ ev_export_import_counts(TreeWalk * tw, MPI_Comm comm)
         counts.Import_offset[i] = counts.Import_offset[i - 1] + counts.Import_count[i - 1];
         tw->NExportTargets += (counts.Export_count[i] > 0);
     }
+    tw->Nimport_sum += counts.Nimport;
     return counts;
 }
 
 /* Builds the list of exported particles and async sends the export queries. */
 static void ev_send_recv_export_import(struct ImpExpCounts * counts, TreeWalk * tw, struct CommBuffer * exports, struct CommBuffer * imports)
 {
+    const size_t wire_elsize = treewalk_wire_elsize(tw);
     alloc_commbuffer(exports, counts->NTask, 0);
-    exports->databuf = (char *) mymalloc("ExportQuery", counts->Nexport * tw->query_type_elsize);
+    exports->databuf = (char *) mymalloc("ExportQuery", counts->Nexport * wire_elsize);
 
     alloc_commbuffer(imports, counts->NTask, 0);
-    imports->databuf = mymalloc("ImportQuery", counts->Nimport * tw->query_type_elsize);
+    imports->databuf = mymalloc("ImportQuery", counts->Nimport * wire_elsize);
 
     MPI_Datatype type;
-    MPI_Type_contiguous(tw->query_type_elsize, MPI_BYTE, &type);
+    MPI_Type_contiguous(wire_elsize, MPI_BYTE, &type);
     MPI_Type_commit(&type);
 
     /* Post recvs before sends. This sometimes allows for a fastpath.*/
@@ -715,17 +1046,19 @@ static void ev_send_recv_export_import(struct ImpExpCounts * counts, TreeWalk *
     /* prepare particle data for export */
     int64_t * real_send_count = ta_malloc("tmp_send_count", int64_t, tw->NTask);
     memset(real_send_count, 0, sizeof(int64_t)*tw->NTask);
+    TreeWalkQueryBase * input = (TreeWalkQueryBase *) alloca(tw->query_type_elsize);
     int64_t i;
-    for(i = 0; i < tw->NThread; i++)
+    for(i = 0; i < ev_nexport_blocks(tw); i++)
     {
+        const data_index * table = tw->ExportTable + i * tw->ExportBlockSize;
         size_t k;
-        for(k = 0; k < tw->Nexport_thread[i]; k++) {
-            const int place = tw->ExportTable_thread[i][k].Index;
-            const int task = tw->ExportTable_thread[i][k].Task;
+        for(k = 0; k < tw->ExportBlockFill[i]; k++) {
+            const int place = table[k].Index;
+            const int task = table[k].Task;
             const int64_t bufpos = real_send_count[task] + counts->Export_offset[task];
-            TreeWalkQueryBase * input = (TreeWalkQueryBase*) (exports->databuf + bufpos * tw->query_type_elsize);
             real_send_count[task]++;
-            treewalk_init_query(tw, input, place, tw->ExportTable_thread[i][k].NodeList);
+            treewalk_init_query(tw, input, place, table[k].NodeList);
+            treewalk_pack_query(tw, exports->databuf + bufpos * wire_elsize, input);
         }
     }
 #ifdef DEBUG
@@ -762,12 +1095,13 @@ static void ev_reduce_export_result(struct CommBuffer * export, struct ImpExpCou
     if(tw->reduce != NULL) {
         int * real_recv_count = ta_malloc("tmp_recv_count", int, tw->NTask);
         memset(real_recv_count, 0, sizeof(int)*tw->NTask);
-        for(i = 0; i < tw->NThread; i++)
+        for(i = 0; i < ev_nexport_blocks(tw); i++)
         {
+            const data_index * table = tw->ExportTable + i * tw->ExportBlockSize;
             size_t k;
-            for(k = 0; k < tw->Nexport_thread[i]; k++) {
-                const int place = tw->ExportTable_thread[i][k].Index;
-                const int task = tw->ExportTable_thread[i][k].Task;
+            for(k = 0; k < tw->ExportBlockFill[i]; k++) {
+                const int place = table[k].Index;
+                const int task = table[k].Task;
                 const int64_t bufpos = real_recv_count[task] + counts->Export_offset[task];
                 real_recv_count[task]++;
                 TreeWalkResultBase * output = (TreeWalkResultBase*) (export->databuf + tw->result_type_elsize * bufpos);
@@ -818,6 +1152,7 @@ treewalk_run(TreeWalk * tw, int * active_set, size_t size)
     if(tw->visit) {
         tw->Nexportfull = 0;
         tw->Nexport_sum = 0;
+        tw->Nimport_sum = 0;
         tw->Ninteractions = 0;
         int Ndone = 0;
         /* Needs to be outside loop because it allocates restart information*/
@@ -874,6 +1209,12 @@ treewalk_run(TreeWalk * tw, int * active_set, size_t size)
             /* Note there is no sync at the end!*/
         } while(Ndone < tw->NTask);
         free_export_memory(tw);
+        /* Remember the export volume for the next treewalk with this label*/
+        struct ExportHistory * hist = treewalk_find_history(tw->ev_label, 1);
+        if(hist && tw->WorkSetSize > 0) {
+            hist->ExportsPerParticle = (double) tw->Nexport_sum / tw->WorkSetSize;
+            hist->ImportsPerParticle = (double) tw->Nimport_sum / tw->WorkSetSize;
+        }
     }
 
     tstart = second();
@@ -924,16 +1265,7 @@ int treewalk_visit_ngbiter(TreeWalkQueryBase * I,
 
     TreeWalkNgbIterBase * iter = (TreeWalkNgbIterBase *) alloca(lv->tw->ngbiter_type_elsize);
 
-    /* Kick-start the iteration with other == -1 */
-    iter->other = -1;
-    lv->tw->ngbiter(I, O, iter, lv);
-    /* Check whether the tree contains the particles we are looking for*/
-    if((lv->tw->tree->mask & iter->mask) != iter->mask)
-        endrun(5, "Treewalk for particles with mask %d but tree mask is only %d overlap %d.\n", iter->mask, lv->tw->tree->mask, lv->tw->tree->mask & iter->mask);
-    /* If symmetric, make sure we did hmax first*/
-    if(iter->symmetric == NGB_TREEFIND_SYMMETRIC && !lv->tw->tree->hmax_computed_flag)
-        endrun(3, "%s tried to do a symmetric treewalk without computing hmax!\n", lv->tw->ev_label);
-    const double BoxSize = lv->tw->tree->BoxSize;
+    ngbiter_start(I, O, iter, lv);
 
     int64_t ninteractions = 0;
     int inode = 0;
@@ -946,54 +1278,81 @@ int treewalk_visit_ngbiter(TreeWalkQueryBase * I,
             return numcand;
 
         /* If we are here, export is successful. Work on this particle -- first
-         * filter out all of the candidates that are actually outside. */
-        int numngb;
+         * filter out all of the candidates that are actually outside.
+         * Only the neighbours count as interactions, so the count is the same with grouping.*/
+        ninteractions += ngbiter_candidates(I, O, iter, lv, numcand);
+    }
 
-        for(numngb = 0; numngb < numcand; numngb ++) {
-            int other = lv->ngblist[numngb];
+    treewalk_add_counters(lv, ninteractions);
 
-            /* Skip garbage*/
-            if(P[other].IsGarbage)
-                continue;
-            /* In case the type of the particle has changed since the tree was built.
-             * Happens for wind treewalk for gas turned into stars on this timestep.*/
-            if(!((1<<P[other].Type) & iter->mask)) {
-                continue;
-            }
+    return 0;
+}
 
-            double dist;
+/* Kick-start the iteration with other == -1, which sets up the search radius and mask in iter,
+ * and check that the tree can answer the query. */
+static void
+ngbiter_start(TreeWalkQueryBase * I, TreeWalkResultBase * O, TreeWalkNgbIterBase * iter, LocalTreeWalk * lv)
+{
+    iter->other = -1;
+    lv->tw->ngbiter(I, O, iter, lv);
+    /* Check whether the tree contains the particles we are looking for*/
+    if((lv->tw->tree->mask & iter->mask) != iter->mask)
+        endrun(5, "Treewalk for particles with mask %d but tree mask is only %d overlap %d.\n", iter->mask, lv->tw->tree->mask, lv->tw->tree->mask & iter->mask);
+    /* If symmetric, make sure we did hmax first*/
+    if(iter->symmetric == NGB_TREEFIND_SYMMETRIC && !lv->tw->tree->hmax_computed_flag)
+        endrun(3, "%s tried to do a symmetric treewalk without computing hmax!\n", lv->tw->ev_label);
+}
 
-            if(iter->symmetric == NGB_TREEFIND_SYMMETRIC) {
-                dist = DMAX(P[other].Hsml, iter->Hsml);
-            } else {
-                dist = iter->Hsml;
-            }
+/* Call the ngbiter function for each of the numcand candidates in the Ngblist
+ * which are actually within the search radius of the query. Returns the number of these neighbours.
+ * This is a scalar loop: the candidates are gathered from the particle table by index
+ * and each neighbour found is passed straight to the ngbiter callback.*/
+static int
+ngbiter_candidates(TreeWalkQueryBase * I, TreeWalkResultBase * O, TreeWalkNgbIterBase * iter, LocalTreeWalk * lv, const int numcand)
+{
+    const double BoxSize = lv->tw->tree->BoxSize;
+    int numngb, nfound = 0;
 
-            double r2 = 0;
-            int d;
-            double h2 = dist * dist;
-            for(d = 0; d < 3; d ++) {
-                /* the distance vector points to 'other' */
-                iter->dist[d] = NEAREST(I->Pos[d] - P[other].Pos[d], BoxSize);
-                r2 += iter->dist[d] * iter->dist[d];
-                if(r2 > h2) break;
-            }
-            if(r2 > h2) continue;
+    for(numngb = 0; numngb < numcand; numngb ++) {
+        int other = lv->ngblist[numngb];
+
+        /* Skip garbage*/
+        if(P[other].IsGarbage)
+            continue;
+        /* In case the type of the particle has changed since the tree was built.
+         * Happens for wind treewalk for gas turned into stars on this timestep.*/
+        if(!((1<<P[other].Type) & iter->mask)) {
+            continue;
+        }
 
-            /* update the iter and call the iteration function*/
-            iter->r2 = r2;
-            iter->r = sqrt(r2);
-            iter->other = other;
+        double dist;
 
-            lv->tw->ngbiter(I, O, iter, lv);
+        if(iter->symmetric == NGB_TREEFIND_SYMMETRIC) {
+            dist = DMAX(P[other].Hsml, iter->Hsml);
+        } else {
+            dist = iter->Hsml;
         }
 
-        ninteractions += numngb;
-    }
+        double r2 = 0;
+        int d;
+        double h2 = dist * dist;
+        for(d = 0; d < 3; d ++) {
+            /* the distance vector points to 'other' */
+            iter->dist[d] = NEAREST(I->Pos[d] - P[other].Pos[d], BoxSize);
+            r2 += iter->dist[d] * iter->dist[d];
+            if(r2 > h2) break;
+        }
+        if(r2 > h2) continue;
 
-    treewalk_add_counters(lv, ninteractions);
+        /* update the iter and call the iteration function*/
+        iter->r2 = r2;
+        iter->r = sqrt(r2);
+        iter->other = other;
 
-    return 0;
+        lv->tw->ngbiter(I, O, iter, lv);
+        nfound++;
+    }
+    return nfound;
 }
 
 /**
@@ -1132,6 +1491,147 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
     return numcand;
 }
 
+/* Cull a node against a group of queries: the group is a box with the given center and half-width,
+ * and every query in it has a search radius of at most hsml. Conservative: returns 1 if the node
+ * may contain neighbours of any query in the group.*/
+static int
+cull_node_group(const double * center, const double * halfwidth, const double hsml, const int symmetric, const struct NODE * const current, const double BoxSize)
+{
+    double dist;
+    if(symmetric) {
+        dist = DMAX(current->mom.hmax, hsml) + 0.5 * current->len;
+    } else {
+        dist = hsml + 0.5 * current->len;
+    }
+
+    /* Squared distance from the node center to the box*/
+    double r2 = 0;
+    int d;
+    for(d = 0; d < 3; d ++) {
+        double dx = fabs(NEAREST(current->center[d] - center[d], BoxSize)) - halfwidth[d];
+        if(dx > dist) return 0;
+        if(dx > 0)
+            r2 += dx * dx;
+    }
+    /* now test against the minimal sphere enclosing everything */
+    dist += FACT1 * current->len;
+
+    if(r2 > dist * dist) {
+        return 0;
+    }
+    return 1;
+}
+
+/* Primary-only version of ngb_treefind_threads for a group of queries. Finds all particles
+ * which may be neighbours of any query in the group, so that the tree is walked only once for the group.
+ * Pseudo particles are skipped: they have already been exported in the toptree walk.*/
+static int
+ngb_treefind_group(const double * center, const double * halfwidth, const double hsml, const int symmetric, LocalTreeWalk * lv)
+{
+    int numcand = 0;
+    const ForceTree * tree = lv->tw->tree;
+    const double BoxSize = tree->BoxSize;
+
+    int no = tree->firstnode;
+
+    while(no >= 0)
+    {
+        struct NODE *current = &tree->Nodes[no];
+
+        /* Cull the node, or move sideways past pseudo particles*/
+        if(current->f.ChildType == PSEUDO_NODE_TYPE ||
+            0 == cull_node_group(center, halfwidth, hsml, symmetric, current, BoxSize)) {
+            no = current->sibling;
+            continue;
+        }
+
+        /* Node contains relevant particles, add them.*/
+        if(current->f.ChildType == PARTICLE_NODE_TYPE) {
+            int i;
+            int * suns = current->s.suns;
+            for (i = 0; i < current->s.noccupied; i++) {
+                lv->ngblist[numcand++] = suns[i];
+            }
+            /* Move sideways*/
+            no = current->sibling;
+            continue;
+        }
+        /* ok, we need to open the node */
+        no = current->s.suns[0];
+    }
+
+    return numcand;
+}
+
+/* Evaluate a group of consecutive particles from the WorkSet, starting at start and ending before end,
+ * in a primary treewalk using treewalk_visit_ngbiter.
+ * Particles which are adjacent in the (Peano-ordered) WorkSet are usually close in space,
+ * so they share almost all their candidate neighbours. The tree is walked once with the bounding box of the group,
+ * and each member filters the shared candidate list. The group stops growing when the next particle would make
+ * the box larger than the search radius. The query, result and iterator scratch space must hold NgbGroupSize elements.
+ * Returns the number of particles evaluated, which is always at least one.*/
+static int64_t
+ev_primary_ngb_group(TreeWalk * tw, LocalTreeWalk * lv, const int64_t start, const int64_t end, char * queries, char * outputs, char * iters, int * targets)
+{
+    const double BoxSize = tw->tree->BoxSize;
+    const TreeWalkQueryBase * first = (TreeWalkQueryBase *) queries;
+    double lo[3] = {0}, hi[3] = {0};
+    double hsml = 0;
+    int symmetric = 0;
+    int n = 0;
+    int64_t k;
+    for(k = start; k < end && n < NgbGroupSize; k++, n++) {
+        const int i = tw->WorkSet ? tw->WorkSet[k] : k;
+        TreeWalkQueryBase * I = (TreeWalkQueryBase *) (queries + n * tw->query_type_elsize);
+        treewalk_init_query(tw, I, i, NULL);
+        if(n > 0) {
+            /* Offset from the first member: the box is stored relative to it, to deal with the periodic wrap.*/
+            double off[3];
+            int d, far = 0;
+            for(d = 0; d < 3; d++) {
+                off[d] = NEAREST(I->Pos[d] - first->Pos[d], BoxSize);
+                if(off[d] - lo[d] > hsml || hi[d] - off[d] > hsml)
+                    far = 1;
+            }
+            /* This particle starts the next group*/
+            if(far)
+                break;
+            for(d = 0; d < 3; d++) {
+                lo[d] = DMIN(lo[d], off[d]);
+                hi[d] = DMAX(hi[d], off[d]);
+            }
+        }
+        TreeWalkResultBase * O = (TreeWalkResultBase *) (outputs + n * tw->result_type_elsize);
+        TreeWalkNgbIterBase * iter = (TreeWalkNgbIterBase *) (iters + n * tw->ngbiter_type_elsize);
+        treewalk_init_result(tw, O, I);
+        lv->target = i;
+        targets[n] = i;
+        ngbiter_start(I, O, iter, lv);
+        hsml = DMAX(hsml, iter->Hsml);
+        if(iter->symmetric == NGB_TREEFIND_SYMMETRIC)
+            symmetric = 1;
+    }
+
+    double center[3], halfwidth[3];
+    int d;
+    for(d = 0; d < 3; d++) {
+        center[d] = first->Pos[d] + 0.5 * (lo[d] + hi[d]);
+        halfwidth[d] = 0.5 * (hi[d] - lo[d]);
+    }
+    const int numcand = ngb_treefind_group(center, halfwidth, hsml, symmetric, lv);
+
+    int m;
+    for(m = 0; m < n; m++) {
+        TreeWalkQueryBase * I = (TreeWalkQueryBase *) (queries + m * tw->query_type_elsize);
+        TreeWalkResultBase * O = (TreeWalkResultBase *) (outputs + m * tw->result_type_elsize);
+        TreeWalkNgbIterBase * iter = (TreeWalkNgbIterBase *) (iters + m * tw->ngbiter_type_elsize);
+        lv->target = targets[m];
+        treewalk_add_counters(lv, ngbiter_candidates(I, O, iter, lv, numcand));
+        treewalk_reduce_result(tw, O, targets[m], TREEWALK_PRIMARY);
+    }
+    return n;
+}
+
 /*****
  * Variant of ngbiter that doesn't use the Ngblist.
  * The ngblist is generally preferred for memory locality reasons.
@@ -1434,4 +1934,11 @@ treewalk_print_stats(const TreeWalk * tw)
     MPI_Reduce(&tw->NExportTargets, &NExportTargets, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
     message(0, "%s Ngblist: min %ld max %ld avg %g average exports: %g avg target ranks: %g\n", tw->ev_label, minNinteractions, maxNinteractions,
             (double) Ninteractions / Nlistprimary, ((double) Nexport)/ tw->NTask, ((double) NExportTargets)/ tw->NTask);
+    double imbalance[2] = {tw->PrimaryImbalance, tw->PrimaryStaticImbalance};
+    double maximbalance[2];
+    int64_t Nsteals;
+    MPI_Reduce(imbalance, maximbalance, 2, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&tw->Nsteals, &Nsteals, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+    message(0, "%s primary thread imbalance (max/mean busy time): %g, without work stealing: %g. Steals: %g per rank.\n", tw->ev_label,
+            maximbalance[0], maximbalance[1], ((double) Nsteals) / tw->NTask);
 }
@@ -68,10 +68,10 @@ typedef struct {
     size_t Nexport;
     /* Number of entries in the export table for this particle*/
     size_t NThisParticleExport;
-    /* Index to use in the current node list*/
-    size_t nodelistindex;
-    /* Pointer to memory for exports*/
+    /* Pointer to the block of the export table this thread is filling*/
     data_index * DataIndexTable;
+    /* Index of that block in the shared export table, -1 if none claimed yet*/
+    int64_t ExportBlock;
 
     int * ngblist;
     int64_t maxNinteractions;
@@ -139,6 +139,8 @@ struct TreeWalk {
     /* Total number of exported particles
      * (Nexport is only the exported particles in the current export buffer). */
     int64_t Nexport_sum;
+    /* Total number of imported particles*/
+    int64_t Nimport_sum;
     /* Number of times we filled up our export buffer*/
     int64_t Nexportfull;
     /* Number of MPI ranks we export to from this rank.*/
@@ -150,18 +152,31 @@ struct TreeWalk {
     int64_t maxNinteractions;
     int64_t minNinteractions;
     int64_t Ninteractions;
+    /* Thread imbalance of the primary treewalk: max / mean of the time each thread spent working.*/
+    double PrimaryImbalance;
+    /* Estimated thread imbalance if each thread had only evaluated its initial range of the WorkSet.*/
+    double PrimaryStaticImbalance;
+    /* Number of times a thread stole work from another thread in the primary treewalk*/
+    int64_t Nsteals;
 
     /* internal flags*/
-    /* Export counters for each thread*/
-    size_t * Nexport_thread;
     /* Information allowing the toptree walk to restart successfully after the export buffer fills up*/
     int * QueueChunkRestart;
     int64_t * QueueChunkEnd;
-    /* Pointer to a particle export table for each thread.*/
-    data_index ** ExportTable_thread;
+    /* Export table shared by all threads. It is divided into fixed-size blocks,
+     * which threads claim as they fill them, so the buffer is only full when every block is used.*/
+    data_index * ExportTable;
+    /* Number of exports stored in each block*/
+    size_t * ExportBlockFill;
+    /* Number of exports which fit into one block*/
+    size_t ExportBlockSize;
+    /* Number of blocks in the export table*/
+    int64_t NExportBlocks;
+    /* Number of blocks claimed in this toptree walk. May exceed NExportBlocks when the table is full.*/
+    int64_t NExportBlocksUsed;
     /* Flags that our export buffer is full*/
     int BufferFullFlag;
-    /* Number of particles we can fit into the export buffer*/
+    /* Number of particles we can fit into the export buffer (summed over all threads)*/
     size_t BunchSize;
     /* List of neighbour candidates.*/
     int *Ngblist;
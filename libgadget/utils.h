@@ -16,6 +16,7 @@
 #include "utils/paramset.h"
 #include "utils/event.h"
 #include "utils/openmpsort.h"
+#include "utils/radixsort.h"
 #include "utils/system.h"
 #include "utils/string.h"
 #include "utils/endrun.h"
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <omp.h>
 #include "memory.h"
 #include "endrun.h"
 
@@ -20,6 +21,23 @@ struct BlockHeader {
     char annotation[];
 } ;
 
+static void
+allocator_setup(Allocator * alloc, const char * name, char * rawbase, const size_t size, const int zero, Allocator * parent)
+{
+    alloc->parent = parent;
+    alloc->rawbase = rawbase;
+    alloc->base = rawbase + ALIGNMENT - ((size_t) rawbase % ALIGNMENT);
+    alloc->size = size;
+    alloc->use_malloc = 0;
+    alloc->external = 0;
+    strncpy(alloc->name, name, 11);
+    alloc->refcount = 1;
+    alloc->top = alloc->size;
+    alloc->bottom = 0;
+
+    allocator_reset(alloc, zero);
+}
+
 int
 allocator_init(Allocator * alloc, const char * name, const size_t request_size, const int zero, Allocator * parent)
 {
@@ -35,18 +53,19 @@ allocator_init(Allocator * alloc, const char * name, const size_t request_size,
         if(posix_memalign((void **) &rawbase, ALIGNMENT, size + ALIGNMENT))
             return ALLOC_ENOMEMORY;
 
-    alloc->parent = parent;
-    alloc->rawbase = rawbase;
-    alloc->base = rawbase + ALIGNMENT - ((size_t) rawbase % ALIGNMENT);
-    alloc->size = size;
-    alloc->use_malloc = 0;
-    strncpy(alloc->name, name, 11);
-    alloc->refcount = 1;
-    alloc->top = alloc->size;
-    alloc->bottom = 0;
-
-    allocator_reset(alloc, zero);
+    allocator_setup(alloc, name, rawbase, size, zero, parent);
+    return 0;
+}
 
+int
+allocator_init_region(Allocator * alloc, const char * name, char * rawbase, const size_t region_size, const int zero)
+{
+    if(region_size < 2 * ALIGNMENT)
+        return ALLOC_ENOMEMORY;
+    /* Leave room to align the base*/
+    size_t size = (region_size / ALIGNMENT - 1) * ALIGNMENT;
+    allocator_setup(alloc, name, rawbase, size, zero, NULL);
+    alloc->external = 1;
     return 0;
 }
 
@@ -68,6 +87,7 @@ allocator_malloc_init(Allocator * alloc, const char * name, const size_t request
 
     alloc->parent = parent;
     alloc->use_malloc = 1;
+    alloc->external = 0;
     alloc->rawbase = rawbase;
     alloc->base = rawbase;
     alloc->size = size;
@@ -97,7 +117,16 @@ allocator_reset(Allocator * alloc, int zero)
     alloc->bottom = 0;
 
     if(zero) {
-        memset(alloc->base, 0, alloc->size);
+        /* Each thread clears a contiguous piece, so on a NUMA machine the pages
+         * are spread over the domains of all threads rather than the master's.*/
+        #pragma omp parallel
+        {
+            const size_t nthr = omp_get_num_threads();
+            const size_t tid = omp_get_thread_num();
+            const size_t start = alloc->size / nthr * tid;
+            const size_t end = (tid == nthr - 1) ? alloc->size : alloc->size / nthr * (tid + 1);
+            memset(alloc->base + start, 0, end - start);
+        }
     }
     return 0;
 }
@@ -181,7 +210,7 @@ allocator_destroy(Allocator * alloc)
     }
     if(alloc->parent)
         allocator_dealloc(alloc->parent, alloc->rawbase);
-    else
+    else if(!alloc->external)
         free(alloc->rawbase);
     return 0;
 }
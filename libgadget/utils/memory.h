@@ -26,6 +26,7 @@ struct Allocator {
 
     int refcount;
     int use_malloc; /* only do the book keeping. delegate to libc malloc/free */
+    int external; /* memory is owned by the caller, eg an MPI window, and not freed by allocator_destroy */
 };
 
 typedef struct AllocatorIter AllocatorIter;
@@ -47,6 +48,10 @@ struct AllocatorIter {
 int
 allocator_init(Allocator * alloc, const char * name, const size_t size, const int zero, Allocator * parent);
 
+/* Initialize an allocator in a memory region owned by the caller, such as an MPI shared memory window.*/
+int
+allocator_init_region(Allocator * alloc, const char * name, char * rawbase, const size_t region_size, const int zero);
+
 int
 allocator_malloc_init(Allocator * alloc, const char * name, const size_t size, const int zero, Allocator * parent);
 
@@ -12,6 +12,7 @@
 #include "system.h"
 #include "mymalloc.h"
 #include "openmpsort.h"
+#include "radixsort.h"
 #include "endrun.h"
 
 typedef int (*_compar_fn_t)(const void * r1, const void * r2, size_t rsize);
@@ -786,6 +787,8 @@ mpsort_mpi_impl (void * mybase, size_t mynmemb, size_t size,
 
 static int
 mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o);
+static int
+mpsort_mpi_sample_sort(struct crstruct d, struct crmpistruct o);
 
 static void
 MPIU_Scatter (MPI_Comm comm, int root, const void * sendbuffer, void * recvbuffer, int nrecv, size_t elsize, int * totalnsend);
@@ -910,7 +913,10 @@ mpsort_mpi_newarray_impl (void * mybase, size_t mynmemb,
 
         _setup_mpsort_mpi(&o, &d, myoutsegmentbase, myoutsegmentnmemb, seggrp->Leaders);
 
-        mpsort_mpi_histogram_sort(d, o);
+        if(mpsort_mpi_has_options(MPSORT_USE_HISTOGRAM_SORT))
+            mpsort_mpi_histogram_sort(d, o);
+        else
+            mpsort_mpi_sample_sort(d, o);
 
         _destroy_mpsort_mpi(&o);
     }
@@ -1018,6 +1024,216 @@ MPIU_Scatter (MPI_Comm comm, int root, const void * sendbuffer, void * recvbuffe
     MPI_Type_free(&dtype);
 }
 
+/* Number of splitter candidates sampled per rank in the sample sort*/
+#define MPSORT_OVERSAMPLE 16
+
+static void
+_radix_copy(const void * ptr, void * radix, void * arg)
+{
+    memcpy(radix, ptr, *(size_t *) arg);
+}
+
+/* Sample sort:
+ * 1. sort the local array with a threaded radix sort.
+ * 2. gather regularly spaced samples of the sorted local keys, in proportion to the local size,
+ *    and histogram the global data on all the samples with a single Allreduce.
+ * 3. for each rank boundary pick the sample edge closest to the boundary.
+ *    Runs of equal keys straddling a boundary are split between ranks in rank order.
+ * 4. exchange the data in one all-to-all and radix sort the received items.
+ * 5. the boundaries are only exact to within one sample bin, so shift the items
+ *    to the requested output layout. Usually only neighbouring ranks exchange items here.
+ * Unlike the bisection in mpsort_mpi_histogram_sort, the number of communication rounds
+ * does not depend on the key distribution. */
+static int
+mpsort_mpi_sample_sort(struct crstruct d, struct crmpistruct o)
+{
+    int i;
+
+    mpsort_increment_timer("START", 0);
+
+    radix_sort_openmp(d.base, d.nmemb, d.size, d.radix, d.rsize, d.arg);
+
+    mpsort_increment_timer("FirstSort", 0);
+
+    /* Desired counts*/
+    ptrdiff_t * C = (ptrdiff_t *) mymalloc("histC", (o.NTask + 1) * sizeof(ptrdiff_t));
+    ptrdiff_t * myC = (ptrdiff_t *) mymalloc("myhistC", (o.NTask + 1) * sizeof(ptrdiff_t));
+    MPI_Allgather(&o.myoutnmemb, 1, MPI_TYPE_PTRDIFF, C + 1, 1, MPI_TYPE_PTRDIFF, o.comm);
+    C[0] = 0;
+    for(i = 0; i < o.NTask; i ++)
+        C[i + 1] += C[i];
+
+    size_t mynsample = 0;
+    if(o.nmemb > 0)
+        mynsample = (d.nmemb * MPSORT_OVERSAMPLE * o.NTask + o.nmemb - 1) / o.nmemb;
+    if(mynsample > d.nmemb)
+        mynsample = d.nmemb;
+
+    int * nsamples = ta_malloc("nsamples", int, o.NTask);
+    int * sampledispl = ta_malloc("sampledispl", int, o.NTask);
+    int mynsample_int = mynsample;
+    MPI_Allgather(&mynsample_int, 1, MPI_INT, nsamples, 1, MPI_INT, o.comm);
+    int nsample = 0;
+    for(i = 0; i < o.NTask; i ++) {
+        sampledispl[i] = nsample;
+        nsample += nsamples[i];
+    }
+    char * P = (char *) mymalloc("samples", (nsample + 1) * d.rsize);
+    char * myP = (char *) mymalloc("mysamples", (mynsample + 1) * d.rsize);
+    for(i = 0; i < mynsample_int; i ++) {
+        const size_t j = (2 * (size_t) i + 1) * d.nmemb / (2 * mynsample);
+        d.radix((char *) d.base + j * d.size, myP + i * d.rsize, d.arg);
+    }
+    MPI_Allgatherv(myP, mynsample_int, o.MPI_TYPE_RADIX, P, nsamples, sampledispl, o.MPI_TYPE_RADIX, o.comm);
+    myfree(myP);
+    radix_sort_openmp(P, nsample, d.rsize, _radix_copy, d.rsize, &d.rsize);
+
+    mpsort_increment_timer("Samples", 0);
+
+    /* counts of less than and less than or equal to each sample. The global counts are reduced together.*/
+    ptrdiff_t * myCLT = (ptrdiff_t *) mymalloc("myhistCLT", (nsample + 2) * sizeof(ptrdiff_t));
+    ptrdiff_t * myCLE = (ptrdiff_t *) mymalloc("myhistCLE", (nsample + 2) * sizeof(ptrdiff_t));
+    ptrdiff_t * CLT = (ptrdiff_t *) mymalloc("histCLT", 2 * (nsample + 2) * sizeof(ptrdiff_t));
+    ptrdiff_t * CLE = CLT + nsample + 2;
+    _histogram(P, nsample, d.base, d.nmemb, myCLT, myCLE, &d);
+    memcpy(CLT, myCLT, (nsample + 2) * sizeof(ptrdiff_t));
+    memcpy(CLE, myCLE, (nsample + 2) * sizeof(ptrdiff_t));
+    MPI_Allreduce(MPI_IN_PLACE, CLT, 2 * (nsample + 2), MPI_TYPE_PTRDIFF, MPI_SUM, o.comm);
+
+    /* Edge k of the histogram is the cut below sample k - 1, at CLT[k], or above it, at CLE[k].
+     * Edges 0 and nsample + 1 are the ends of the data.
+     * myTie is the number of local items equal to the sample when a boundary falls inside a run of them,
+     * TieBefore the number of these items on lower ranks, and TieBase the global count below the run.*/
+    ptrdiff_t * myTie = (ptrdiff_t *) mymalloc("myTie", 3 * (o.NTask + 1) * sizeof(ptrdiff_t));
+    ptrdiff_t * TieBefore = myTie + o.NTask + 1;
+    ptrdiff_t * TieBase = TieBefore + o.NTask + 1;
+    int k = 0;
+    for(i = 0; i <= o.NTask; i ++) {
+        myTie[i] = 0;
+        TieBase[i] = 0;
+        /* Last edge at or below the boundary. Both the edges and C are monotonic.*/
+        while(k < nsample + 1 && CLT[k + 1] <= C[i])
+            k ++;
+        myC[i] = myCLT[k];
+        if(CLT[k] == C[i])
+            continue;
+        /* The boundary is inside the run of items equal to sample k - 1: split the run.*/
+        if(k >= 1 && C[i] <= CLE[k]) {
+            myTie[i] = myCLE[k] - myCLT[k];
+            TieBase[i] = CLT[k];
+            continue;
+        }
+        /* Otherwise the boundary is between two samples: use the closer edge.*/
+        const ptrdiff_t lo = k >= 1 ? CLE[k] : CLT[k];
+        if(C[i] - lo <= CLT[k + 1] - C[i])
+            myC[i] = k >= 1 ? myCLE[k] : myCLT[k];
+        else
+            myC[i] = myCLT[k + 1];
+    }
+
+    MPI_Exscan(myTie, TieBefore, o.NTask + 1, MPI_TYPE_PTRDIFF, MPI_SUM, o.comm);
+    if(o.ThisTask == 0)
+        memset(TieBefore, 0, (o.NTask + 1) * sizeof(ptrdiff_t));
+
+    for(i = 0; i <= o.NTask; i ++) {
+        if(myTie[i] == 0)
+            continue;
+        /* Lower ranks take the first of the equal items below the boundary*/
+        ptrdiff_t take = C[i] - TieBase[i] - TieBefore[i];
+        if(take < 0)
+            take = 0;
+        if(take > myTie[i])
+            take = myTie[i];
+        myC[i] += take;
+    }
+
+    for(i = 0; i < o.NTask; i ++) {
+        if(myC[i + 1] < myC[i])
+            endrun(7, "Splitters are not monotonic: myC[%d] = %td > myC[%d] = %td\n", i, myC[i], i + 1, myC[i + 1]);
+    }
+
+    myfree(myTie);
+    myfree(CLT);
+    myfree(myCLE);
+    myfree(myCLT);
+    myfree(P);
+    ta_free(sampledispl);
+    ta_free(nsamples);
+
+    mpsort_increment_timer("Splitters", 0);
+
+    int * SendCount = ta_malloc("SendCount", int, o.NTask);
+    int * SendDispl = ta_malloc("SendDispl", int, o.NTask);
+    int * RecvCount = ta_malloc("RecvCount", int, o.NTask);
+    int * RecvDispl = ta_malloc("RecvDispl", int, o.NTask);
+
+    for(i = 0; i < o.NTask; i ++) {
+        SendCount[i] = myC[i + 1] - myC[i];
+        SendDispl[i] = myC[i];
+    }
+    MPI_Alltoall(SendCount, 1, MPI_INT, RecvCount, 1, MPI_INT, o.comm);
+    ptrdiff_t totrecv = 0;
+    for(i = 0; i < o.NTask; i ++) {
+        RecvDispl[i] = totrecv;
+        totrecv += RecvCount[i];
+    }
+
+    char * buffer = (char *) mymalloc("buffer", d.size * totrecv);
+
+    MPI_Alltoallv_smart(
+            o.mybase, SendCount, SendDispl, o.MPI_TYPE_DATA,
+            buffer, RecvCount, RecvDispl, o.MPI_TYPE_DATA,
+            o.comm);
+
+    mpsort_increment_timer("Exchange", 0);
+
+    radix_sort_openmp(buffer, totrecv, d.size, d.radix, d.rsize, d.arg);
+
+    mpsort_increment_timer("SecondSort", 0);
+
+    /* This rank now holds the items [myfirst, myfirst + totrecv) of the sorted array.
+     * Send each rank the part of them it should have.*/
+    ptrdiff_t myfirst = 0;
+    MPI_Exscan(&totrecv, &myfirst, 1, MPI_TYPE_PTRDIFF, MPI_SUM, o.comm);
+    if(o.ThisTask == 0)
+        myfirst = 0;
+    for(i = 0; i < o.NTask; i ++) {
+        const ptrdiff_t start = C[i] > myfirst ? C[i] : myfirst;
+        const ptrdiff_t end = C[i + 1] < myfirst + totrecv ? C[i + 1] : myfirst + totrecv;
+        SendCount[i] = end > start ? end - start : 0;
+        SendDispl[i] = end > start ? start - myfirst : 0;
+    }
+    MPI_Alltoall(SendCount, 1, MPI_INT, RecvCount, 1, MPI_INT, o.comm);
+    size_t totout = 0;
+    for(i = 0; i < o.NTask; i ++) {
+        RecvDispl[i] = totout;
+        totout += RecvCount[i];
+    }
+    if(totout != o.myoutnmemb) {
+        endrun(8, "totrecv = %td, mismatch with %td\n", totout, o.myoutnmemb);
+    }
+
+    MPI_Alltoallv_smart(
+            buffer, SendCount, SendDispl, o.MPI_TYPE_DATA,
+            o.myoutbase, RecvCount, RecvDispl, o.MPI_TYPE_DATA,
+            o.comm);
+
+    myfree(buffer);
+    ta_free(RecvDispl);
+    ta_free(RecvCount);
+    ta_free(SendDispl);
+    ta_free(SendCount);
+    myfree(myC);
+    myfree(C);
+
+    MPI_Barrier(o.comm);
+
+    mpsort_increment_timer("Shift", 0);
+    mpsort_increment_timer("End", 0);
+
+    return 0;
+}
+
 static int
 mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o)
 {
@@ -1281,10 +1497,10 @@ mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o)
         myfree(buffer);
     }
 
-    myfree(RecvDispl);
-    myfree(RecvCount);
-    myfree(SendDispl);
-    myfree(SendCount);
+    ta_free(RecvDispl);
+    ta_free(RecvCount);
+    ta_free(SendDispl);
+    ta_free(SendCount);
 
     myfree(myC);
     MPI_Barrier(o.comm);
@@ -1352,8 +1568,8 @@ static void _find_Pmax_Pmin_C(void * mybase, size_t mynmemb,
 
     myfree(eachPmin);
     myfree(eachPmax);
-    myfree(eachoutnmemb);
-    myfree(eachnmemb);
+    ta_free(eachoutnmemb);
+    ta_free(eachnmemb);
 }
 
 static int
@@ -1431,6 +1647,8 @@ static void _mpsort_mpi_parse_env()
         mpsort_mpi_set_options(MPSORT_DISABLE_GATHER_SORT);
     if(getenv("MPSORT_REQUIRE_GATHER_SORT "))
         mpsort_mpi_set_options(MPSORT_REQUIRE_GATHER_SORT );
+    if(getenv("MPSORT_USE_HISTOGRAM_SORT"))
+        mpsort_mpi_set_options(MPSORT_USE_HISTOGRAM_SORT);
 }
 
 void
@@ -4,6 +4,8 @@
 /* MPI support */
 #define MPSORT_DISABLE_GATHER_SORT (1 << 3)
 #define MPSORT_REQUIRE_GATHER_SORT (1 << 4)
+/* Use the iterative histogram bisection instead of the sample sort*/
+#define MPSORT_USE_HISTOGRAM_SORT (1 << 5)
 
 void mpsort_mpi_set_options(int options);
 int mpsort_mpi_has_options(int options);
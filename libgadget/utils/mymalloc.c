@@ -44,8 +44,103 @@ tamalloc_init(void)
     }
 }
 
+/* If the MAIN allocator is in an MPI shared memory window, the window,
+ * the communicator of the ranks on this node and the base of MAIN on each of them.*/
+static struct {
+    MPI_Win win;
+    MPI_Comm comm;
+    char ** Base;
+} NodeShared = {MPI_WIN_NULL, MPI_COMM_NULL, NULL};
+
+/* Allocate the memory for the MAIN allocator in a shared memory window between the ranks on a node,
+ * so that other ranks may read objects in it directly. Returns the allocator_init status.*/
+static int
+mymalloc_init_shared(const size_t n, const int zero)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, ThisTask, MPI_INFO_NULL, &NodeShared.comm);
+
+    /* Each rank mostly touches its own memory, so let MPI place it in local pages*/
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "alloc_shared_noncontig", "true");
+    const MPI_Aint winsize = n + 2 * 4096;
+    char * rawbase;
+    int ret = MPI_Win_allocate_shared(winsize, 1, info, NodeShared.comm, &rawbase, &NodeShared.win);
+    MPI_Info_free(&info);
+    if(ret != MPI_SUCCESS)
+        return ALLOC_ENOMEMORY;
+    /* A passive target epoch for the whole run: synchronisation is done with mymalloc_node_sync*/
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, NodeShared.win);
+
+    int NodeSize, i;
+    MPI_Comm_size(NodeShared.comm, &NodeSize);
+    ret = allocator_init_region(A_MAIN, "MAIN", rawbase, winsize, zero);
+    if(ret != 0)
+        return ret;
+
+    /* This lives for the whole run, at the very top of MAIN*/
+    NodeShared.Base = ma_malloc2("NodeBase", char *, NodeSize);
+    /* The allocator aligns its base, so its offset in the window may differ between ranks*/
+    MPI_Aint myoffset = A_MAIN->base - rawbase;
+    MPI_Aint * offsets = ta_malloc("NodeOffsets", MPI_Aint, NodeSize);
+    MPI_Allgather(&myoffset, 1, MPI_AINT, offsets, 1, MPI_AINT, NodeShared.comm);
+    for(i = 0; i < NodeSize; i++) {
+        MPI_Aint size;
+        int disp_unit;
+        char * base;
+        MPI_Win_shared_query(NodeShared.win, i, &size, &disp_unit, &base);
+        NodeShared.Base[i] = base + offsets[i];
+    }
+    ta_free(offsets);
+    return 0;
+}
+
+void
+mymalloc_free_shared(void)
+{
+    if(NodeShared.win == MPI_WIN_NULL)
+        return;
+    /* No rank may free its memory while the others may still be reading it*/
+    mymalloc_node_sync();
+    /* The window holds MAIN, NodeShared.Base included, so MAIN is gone with it*/
+    NodeShared.Base = NULL;
+    MPI_Win_unlock_all(NodeShared.win);
+    MPI_Win_free(&NodeShared.win);
+    MPI_Comm_free(&NodeShared.comm);
+}
+
+MPI_Comm
+mymalloc_node_comm(void)
+{
+    return NodeShared.comm;
+}
+
+ptrdiff_t
+mymalloc_node_offset(const void * ptr)
+{
+    return (const char *) ptr - A_MAIN->base;
+}
+
+void *
+mymalloc_node_address(const int noderank, const ptrdiff_t offset)
+{
+    return NodeShared.Base[noderank] + offset;
+}
+
 void
-mymalloc_init(double MaxMemSizePerNode)
+mymalloc_node_sync(void)
+{
+    if(NodeShared.win == MPI_WIN_NULL)
+        return;
+    MPI_Win_sync(NodeShared.win);
+    MPI_Barrier(NodeShared.comm);
+    MPI_Win_sync(NodeShared.win);
+}
+
+void
+mymalloc_init(double MaxMemSizePerNode, int SharedMemory, int FirstTouch)
 {
     /* Warning: this uses ta_malloc*/
     size_t Nhost = cluster_get_num_hosts();
@@ -64,7 +159,18 @@ mymalloc_init(double MaxMemSizePerNode)
         endrun(2, "Mem too small! MB/node=%g, nodespercpu = %g NTask = %d\n", MaxMemSizePerNode, nodespercpu, NTask);
 
 
-    if (MPIU_Any(ALLOC_ENOMEMORY == allocator_init(A_MAIN, "MAIN", n, 1, NULL), MPI_COMM_WORLD)) {
+#ifdef VALGRIND
+    SharedMemory = 0;
+#endif
+    if(SharedMemory)
+        message(0, "MAIN memory allocator is shared between the ranks on each node.\n");
+    /* Do not touch the memory now: each page is placed when a thread first writes to it.
+     * Fresh pages from the OS are zero, so this only skips the clearing.*/
+    const int zero = !FirstTouch;
+    if(FirstTouch)
+        message(0, "MAIN memory is placed on NUMA domains by first touch.\n");
+
+    if (MPIU_Any(ALLOC_ENOMEMORY == (SharedMemory ? mymalloc_init_shared(n, zero) : allocator_init(A_MAIN, "MAIN", n, zero, NULL)), MPI_COMM_WORLD)) {
         endrun(0, "Insufficient memory for the MAIN allocator on at least one nodes."
                   "Requestion %td bytes. Try reducing MaxMemSizePerNode. Also check the node health status.\n", n);
     }
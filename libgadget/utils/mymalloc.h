@@ -1,13 +1,29 @@
 #ifndef _MYMALLOC_H_
 #define _MYMALLOC_H_
 
+#include <stddef.h>
+#include <mpi.h>
 #include "memory.h"
 
 extern Allocator A_MAIN[1];
 extern Allocator A_TEMP[1];
 
-/* Initialize the main memory block*/
-void mymalloc_init(double MemoryMB);
+/* Initialize the main memory block. If SharedMemory is true, the block is placed in an
+ * MPI shared memory window so that the other ranks on the node can read it.
+ * If FirstTouch is true the block is not cleared, so that on a NUMA machine each page
+ * is placed near the thread which first writes to it.*/
+void mymalloc_init(double MemoryMB, int SharedMemory, int FirstTouch);
+
+/* Communicator of the ranks on this node whose MAIN memory is shared, or MPI_COMM_NULL if it is not shared.*/
+MPI_Comm mymalloc_node_comm(void);
+/* Offset of ptr, which is in our MAIN allocator, from the base of MAIN*/
+ptrdiff_t mymalloc_node_offset(const void * ptr);
+/* Address in our address space of the object at offset in the MAIN allocator of rank noderank of mymalloc_node_comm()*/
+void * mymalloc_node_address(const int noderank, const ptrdiff_t offset);
+/* Make writes to shared MAIN memory visible to the other ranks on the node. Collective on mymalloc_node_comm().*/
+void mymalloc_node_sync(void);
+/* Free the shared memory window holding MAIN, if there is one. Collective; MAIN may not be used afterwards.*/
+void mymalloc_free_shared(void);
 /* Initialize the small temporary memory block*/
 void tamalloc_init(void);
 void report_detailed_memory_usage(const char *label, const char * fmt, ...);
@@ -0,0 +1,139 @@
+#include <omp.h>
+#include <stdint.h>
+#include <string.h>
+#include "radixsort.h"
+#include "mymalloc.h"
+
+/* Number of bits sorted in each pass*/
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+static int
+_is_big_endian(void)
+{
+    union {
+        uint32_t i;
+        char c[4];
+    } be_detect = {0x01020304};
+    return be_detect.c[0] == 1;
+}
+
+/* The keys are extracted once and sorted, with an index array, one byte per pass,
+ * from least to most significant. Each pass counts the bytes in a per-thread histogram,
+ * and a prefix sum ordered by bucket then thread gives each thread where to scatter its keys.
+ * Passes where every key has the same byte are skipped. Finally the elements are permuted,
+ * through a temporary copy for small elements and by following the permutation cycles for large ones. */
+void
+radix_sort_openmp(void * base, size_t nmemb, size_t size,
+        void (*radix)(const void * ptr, void * radix, void * arg),
+        size_t rsize, void * arg)
+{
+    if(nmemb <= 1)
+        return;
+
+    const int NumThreads = omp_get_max_threads();
+    size_t * hist = (size_t *) mymalloc("radixhist", NumThreads * RADIX_BUCKETS * sizeof(size_t));
+    size_t * idx[2];
+    unsigned char * keys[2];
+    idx[0] = (size_t *) mymalloc("radixidx", nmemb * sizeof(size_t));
+    idx[1] = (size_t *) mymalloc("radixidx", nmemb * sizeof(size_t));
+    keys[0] = (unsigned char *) mymalloc("radixkeys", nmemb * rsize);
+    keys[1] = (unsigned char *) mymalloc("radixkeys", nmemb * rsize);
+
+    size_t i;
+    #pragma omp parallel for
+    for(i = 0; i < nmemb; i++) {
+        radix((char *) base + i * size, keys[0] + i * rsize, arg);
+        idx[0][i] = i;
+    }
+
+    const int bigendian = _is_big_endian();
+    int cur = 0;
+    size_t b;
+    for(b = 0; b < rsize; b++) {
+        /* Least significant byte first*/
+        const size_t byte = bigendian ? rsize - 1 - b : b;
+        const unsigned char * ckeys = keys[cur];
+        int skip = 0;
+        #pragma omp parallel
+        {
+            const int tid = omp_get_thread_num();
+            const int nt = omp_get_num_threads();
+            const size_t start = tid * nmemb / nt;
+            const size_t end = (tid + 1) * nmemb / nt;
+            size_t * myhist = hist + tid * RADIX_BUCKETS;
+            size_t j;
+            memset(myhist, 0, RADIX_BUCKETS * sizeof(size_t));
+            for(j = start; j < end; j++)
+                myhist[ckeys[j * rsize + byte]]++;
+            #pragma omp barrier
+            #pragma omp single
+            {
+                size_t sum = 0;
+                int bk, t;
+                for(bk = 0; bk < RADIX_BUCKETS; bk++) {
+                    const size_t bucketstart = sum;
+                    for(t = 0; t < nt; t++) {
+                        const size_t count = hist[t * RADIX_BUCKETS + bk];
+                        hist[t * RADIX_BUCKETS + bk] = sum;
+                        sum += count;
+                    }
+                    if(sum - bucketstart == nmemb)
+                        skip = 1;
+                }
+            }
+            if(!skip) {
+                unsigned char * nkeys = keys[1 - cur];
+                size_t * nidx = idx[1 - cur];
+                for(j = start; j < end; j++) {
+                    const size_t dest = myhist[ckeys[j * rsize + byte]]++;
+                    memcpy(nkeys + dest * rsize, ckeys + j * rsize, rsize);
+                    nidx[dest] = idx[cur][j];
+                }
+            }
+        }
+        if(!skip)
+            cur = 1 - cur;
+    }
+
+    myfree(keys[1]);
+    myfree(keys[0]);
+
+    size_t * sorted = idx[cur];
+    /* Large elements are permuted in place, to avoid a second copy of the array.
+     * The threshold is the same as for the indirect sort in qsort_openmp.*/
+    if(size > 32) {
+        char * cbase = (char *) base;
+        char tmp_el[size];
+        for(i = 0; i < nmemb; i++) {
+            size_t k = sorted[i];
+            /* This element already in the right place*/
+            if(k == i)
+                continue;
+            /* Follow the cycle starting at i, marking each element as permuted.*/
+            memcpy(tmp_el, cbase + i * size, size);
+            size_t j = i;
+            do {
+                sorted[j] = j;
+                memcpy(cbase + j * size, cbase + k * size, size);
+                j = k;
+                k = sorted[j];
+            } while(k != i);
+            sorted[j] = j;
+            memcpy(cbase + j * size, tmp_el, size);
+        }
+    }
+    else {
+        char * tmp = (char *) mymalloc("radixtmp", nmemb * size);
+        #pragma omp parallel for
+        for(i = 0; i < nmemb; i++)
+            memcpy(tmp + i * size, (char *) base + sorted[i] * size, size);
+        #pragma omp parallel for
+        for(i = 0; i < nmemb; i++)
+            memcpy((char *) base + i * size, tmp + i * size, size);
+        myfree(tmp);
+    }
+    myfree(idx[1]);
+    myfree(idx[0]);
+    myfree(hist);
+}
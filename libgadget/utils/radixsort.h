@@ -0,0 +1,15 @@
+#ifndef RADIXSORT_H
+#define RADIXSORT_H
+
+#include <stddef.h>
+
+/* Parallel LSD radix sort. The radix function extracts a key of rsize bytes from each element,
+ * to be compared as an unsigned integer in machine byte order (the same convention as mpsort_mpi).
+ * The sort is stable. Uses 2 * nmemb * (rsize + sizeof(size_t)) bytes of temporary memory,
+ * and for elements of up to 32 bytes, nmemb * size bytes to permute them.
+ * Prefer this to qsort_openmp when the sort order is given by a few integers. */
+void radix_sort_openmp(void * base, size_t nmemb, size_t size,
+        void (*radix)(const void * ptr, void * radix, void * arg),
+        size_t rsize, void * arg);
+
+#endif
@@ -404,6 +404,46 @@ cluster_get_num_hosts(void)
     return nunique;
 }
 
+/* Fills order (NTask entries) with the ranks of comm arranged so that ranks
+ * on the same shared memory node are contiguous. Nodes are ordered by their lowest rank,
+ * and ranks within a node by rank, so on a block-mapped job this is the identity.
+ * Returns the number of nodes.*/
+int
+cluster_get_node_order(MPI_Comm comm, int * order)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(comm, &NTask);
+    MPI_Comm_rank(comm, &ThisTask);
+
+    MPI_Comm nodecomm;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, ThisTask, MPI_INFO_NULL, &nodecomm);
+    /* Label each node by its lowest rank in comm*/
+    int nodeid;
+    MPI_Allreduce(&ThisTask, &nodeid, 1, MPI_INT, MPI_MIN, nodecomm);
+    MPI_Comm_free(&nodecomm);
+
+    int * NodeId = ta_malloc("NodeId", int, NTask);
+    int * NodeStart = ta_malloc("NodeStart", int, NTask + 1);
+    MPI_Allgather(&nodeid, 1, MPI_INT, NodeId, 1, MPI_INT, comm);
+
+    /* Counting sort by node label, which keeps ranks within a node in order*/
+    int i, nnodes = 0;
+    memset(NodeStart, 0, (NTask + 1) * sizeof(int));
+    for(i = 0; i < NTask; i++) {
+        if(NodeStart[NodeId[i] + 1] == 0)
+            nnodes++;
+        NodeStart[NodeId[i] + 1]++;
+    }
+    for(i = 0; i < NTask; i++)
+        NodeStart[i + 1] += NodeStart[i];
+    for(i = 0; i < NTask; i++)
+        order[NodeStart[NodeId[i]]++] = i;
+
+    ta_free(NodeStart);
+    ta_free(NodeId);
+    return nnodes;
+}
+
 double
 get_physmem_bytes(void)
 {
@@ -23,6 +23,8 @@ typedef struct _Rnd_Table
 } RandTable;
 
 int cluster_get_num_hosts(void);
+/* Fills order with the ranks of comm sorted so that ranks sharing a node are contiguous. Returns the number of nodes.*/
+int cluster_get_node_order(MPI_Comm comm, int * order);
 double get_physmem_bytes(void);
 
 /* Gets a random number in the range [0, 1) from the table. The id is used modulo the size of the table,